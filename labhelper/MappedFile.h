@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace labhelper
+{
+///////////////////////////////////////////////////////////////////////////
+// A read-only memory mapping of a whole file. The mapping is released
+// when the object is destroyed.
+///////////////////////////////////////////////////////////////////////////
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// Returns false if the file does not exist or can not be mapped.
+	// Empty files are opened successfully, with data() == nullptr.
+	bool open(const std::string& filename);
+	void close();
+
+	const uint8_t* data() const
+	{
+		return m_data;
+	}
+	size_t size() const
+	{
+		return m_size;
+	}
+
+private:
+	const uint8_t* m_data = nullptr;
+	size_t m_size = 0;
+#ifdef _WIN32
+	void* m_file = nullptr;
+	void* m_mapping = nullptr;
+#else
+	int m_fd = -1;
+#endif
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Size and modification time of a file, false if it does not exist
+///////////////////////////////////////////////////////////////////////////
+bool fileInfo(const std::string& filename, uint64_t& size, int64_t& modification_time);
+
+///////////////////////////////////////////////////////////////////////////
+// 64-bit FNV-1a hash of a block of memory
+///////////////////////////////////////////////////////////////////////////
+uint64_t hashBytes(const void* data, size_t size);
+} // namespace labhelper
@@ -1,10 +1,14 @@
 #include "Model.h"
 
 #include <iostream>
-#define TINYOBJLOADER_IMPLEMENTATION // define this in only *one* .cc
-#include <tiny_obj_loader.h>
+#include "ObjParser.h"
 //#include <experimental/tinyobj_loader_opt.h>
 #include <algorithm>
+#include <unordered_map>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include "MappedFile.h"
 #include <sstream>
 #include <iomanip>
 #include <glad/glad.h>
@@ -19,11 +23,6 @@ namespace labhelper
 {
 void Texture::free()
 {
-	if(data)
-	{
-		stbi_image_free(data);
-		data = nullptr;
-	}
 	if(gl_id_internal)
 	{
 		glDeleteTextures(1, &gl_id_internal);
@@ -31,24 +30,39 @@ void Texture::free()
 	}
 }
 
-bool Texture::load(const std::string& _directory, const std::string& _filename, int _components)
+bool Texture::load(const std::string& _directory, const std::string& _filename, int _components, bool upload_to_gpu)
 {
 	filename = file::normalise(_filename);
 	directory = file::normalise(_directory);
 	valid = true;
 	int components;
-	data = stbi_load((directory + filename).c_str(), &width, &height, &components, _components);
-	if(data == nullptr)
+	uint8_t* data = nullptr;
+	bool found;
+	if(upload_to_gpu)
+	{
+		data = stbi_load(path().c_str(), &width, &height, &components, _components);
+		found = data != nullptr;
+	}
+	else
+	{
+		// Only check the file. Whoever samples the texture on the CPU decodes it.
+		found = stbi_info(path().c_str(), &width, &height, &components) != 0;
+	}
+	if(!found)
 	{
 		std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << " in " << directory
 		          << "\n";
 		exit(1);
 	}
+	n_components = _components;
+	if(!upload_to_gpu)
+	{
+		return true;
+	}
 	glGenTextures(1, &gl_id_internal);
 	gl_id = gl_id_internal;
 	glBindTexture(GL_TEXTURE_2D, gl_id_internal);
 	GLenum format, internal_format;
-	n_components = _components;
 	if(_components == 1)
 	{
 		format = GL_R8;
@@ -78,28 +92,10 @@ bool Texture::load(const std::string& _directory, const std::string& _filename,
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
 
 	glBindTexture(GL_TEXTURE_2D, 0);
+	stbi_image_free(data);
 	return true;
 }
 
-glm::vec4 Texture::sample(glm::vec2 uv) const
-{
-	int x = int(uv.x * width + 0.5) % width;
-	int y = int(uv.y * height + 0.5) % height;
-	if(n_components == 4)
-	{
-		return glm::vec4(data[(y * width + x) * 4 + 0], data[(y * width + x) * 4 + 1],
-		                 data[(y * width + x) * 4 + 2], data[(y * width + x) * 4 + 3])
-		       / 255.f;
-	}
-	else
-	{
-		// Just return one channel
-		return glm::vec4(data[(y * width + x) * n_components + 0], data[(y * width + x) * n_components + 0],
-		                 data[(y * width + x) * n_components + 0], data[(y * width + x) * n_components + 0])
-		       / 255.f;
-	}
-}
-
 ///////////////////////////////////////////////////////////////////////////
 // Destructor
 ///////////////////////////////////////////////////////////////////////////
@@ -118,38 +114,394 @@ Model::~Model()
 		if(material.m_emission_texture.valid)
 			material.m_emission_texture.free();
 	}
-	glDeleteBuffers(1, &m_positions_bo);
-	glDeleteBuffers(1, &m_normals_bo);
-	glDeleteBuffers(1, &m_texture_coordinates_bo);
+	if(m_vaob)
+	{
+		glDeleteBuffers(1, &m_positions_bo);
+		glDeleteBuffers(1, &m_normals_bo);
+		glDeleteBuffers(1, &m_texture_coordinates_bo);
+		if(m_indices_bo)
+			glDeleteBuffers(1, &m_indices_bo);
+		glDeleteVertexArrays(1, &m_vaob);
+	}
 }
 
 
-Model* loadModelFromOBJ(std::string path)
+///////////////////////////////////////////////////////////////////////////
+// The attributes that make up one vertex, used to find duplicates when
+// building indexed models. Many OBJ exporters write the same position or
+// normal several times, so we compare values rather than OBJ indices.
+///////////////////////////////////////////////////////////////////////////
+struct VertexKey
 {
-	std::string filename, extension, directory;
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec2 uv;
+	bool operator==(const VertexKey& o) const
+	{
+		return position == o.position && normal == o.normal && uv == o.uv;
+	}
+};
 
-	filename = file::normalise(path);
-	directory = file::parent_path(path);
-	filename = file::file_stem(path);
-	extension = file::file_extension(path);
+struct VertexKeyHash
+{
+	size_t operator()(const VertexKey& k) const
+	{
+		const float values[8] = { k.position.x, k.position.y, k.position.z, k.normal.x,
+			                      k.normal.y,   k.normal.z,   k.uv.x,       k.uv.y };
+		size_t h = 0;
+		for(float value : values)
+		{
+			// Make 0.0 and -0.0, which compare equal, hash equal
+			h ^= std::hash<float>()(value == 0.0f ? 0.0f : value) + 0x9e3779b9 + (h << 6) + (h >> 2);
+		}
+		return h;
+	}
+};
 
-	if(extension != ".obj")
+///////////////////////////////////////////////////////////////////////////
+// Binary model cache. The first time an OBJ file is loaded, the final
+// buffers, meshes and materials are written to <name>.modelcache next to
+// it. Later loads map that file and copy the buffers straight into the
+// Model, as long as the OBJ (size, mtime and content hash) and MTL (size
+// and mtime) are unchanged and the cache has the same version and
+// indexing mode.
+///////////////////////////////////////////////////////////////////////////
+static bool model_cache_enabled = true;
+
+void setModelCacheEnabled(bool enabled)
+{
+	model_cache_enabled = enabled;
+}
+
+static const char model_cache_magic[8] = { 'L', 'H', 'M', 'O', 'D', 'E', 'L', 0 };
+static const uint32_t model_cache_version = 1;
+
+struct ModelSource
+{
+	uint64_t obj_size = 0;
+	int64_t obj_mtime = 0;
+	uint64_t obj_hash = 0;
+	uint64_t mtl_size = 0;
+	int64_t mtl_mtime = 0;
+	bool valid = false;
+};
+
+struct ModelCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t indexed;
+	ModelSource source;
+};
+
+static ModelSource getModelSource(const std::string& obj_path, const std::string& mtl_path)
+{
+	ModelSource source{};
+	if(!fileInfo(obj_path, source.obj_size, source.obj_mtime))
 	{
-		std::cout << "Fatal: loadModelFromOBJ(): Expecting filename ending in '.obj'\n";
-		exit(1);
+		return source;
+	}
+	MappedFile obj;
+	if(!obj.open(obj_path))
+	{
+		return source;
+	}
+	source.obj_hash = hashBytes(obj.data(), obj.size());
+	// The MTL file is optional
+	fileInfo(mtl_path, source.mtl_size, source.mtl_mtime);
+	source.valid = true;
+	return source;
+}
+
+static bool sameSource(const ModelSource& a, const ModelSource& b)
+{
+	return a.valid && b.valid && a.obj_size == b.obj_size && a.obj_mtime == b.obj_mtime
+	       && a.obj_hash == b.obj_hash && a.mtl_size == b.mtl_size && a.mtl_mtime == b.mtl_mtime;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Bounds-checked reading from the mapped cache file
+///////////////////////////////////////////////////////////////////////////
+struct CacheReader
+{
+	const uint8_t* current;
+	const uint8_t* end;
+
+	bool read(void* dst, size_t size)
+	{
+		if(size_t(end - current) < size)
+			return false;
+		memcpy(dst, current, size);
+		current += size;
+		return true;
+	}
+	template <typename T>
+	bool read(T& value)
+	{
+		return read(&value, sizeof(T));
+	}
+	template <typename T>
+	bool read(std::vector<T>& values)
+	{
+		uint64_t count;
+		if(!read(count) || count > uint64_t(end - current) / sizeof(T))
+			return false;
+		values.resize(size_t(count));
+		return count == 0 || read(values.data(), size_t(count) * sizeof(T));
+	}
+	bool read(std::string& str)
+	{
+		uint32_t length;
+		if(!read(length) || length > uint64_t(end - current))
+			return false;
+		str.assign((const char*)current, length);
+		current += length;
+		return true;
+	}
+};
+
+struct CacheWriter
+{
+	std::ofstream& out;
+
+	template <typename T>
+	void write(const T& value)
+	{
+		out.write((const char*)&value, sizeof(T));
+	}
+	template <typename T>
+	void write(const std::vector<T>& values)
+	{
+		write(uint64_t(values.size()));
+		if(!values.empty())
+			out.write((const char*)values.data(), values.size() * sizeof(T));
+	}
+	void write(const std::string& str)
+	{
+		write(uint32_t(str.size()));
+		out.write(str.data(), str.size());
+	}
+};
+
+static void saveModelCache(const std::string& cache_path, const ModelSource& source, const Model* model,
+                           bool indexed)
+{
+	if(!source.valid)
+	{
+		return;
+	}
+	// Written next to the cache and renamed over it once complete, so that
+	// a crash or another instance never leaves a partial cache behind
+	const std::string tmp_path = cache_path + ".tmp";
+	std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+	if(!out.is_open())
+	{
+		// Not fatal, e.g. a read-only scene directory
+		std::cout << "(could not write " << cache_path << ") " << std::flush;
+		return;
+	}
+	CacheWriter writer = { out };
+	ModelCacheHeader header;
+	memcpy(header.magic, model_cache_magic, sizeof(header.magic));
+	header.version = model_cache_version;
+	header.indexed = indexed ? 1 : 0;
+	header.source = source;
+	writer.write(header);
+
+	writer.write(model->m_positions);
+	writer.write(model->m_normals);
+	writer.write(model->m_texture_coordinates);
+	writer.write(model->m_indices);
+
+	writer.write(uint32_t(model->m_meshes.size()));
+	for(const Mesh& mesh : model->m_meshes)
+	{
+		writer.write(mesh.m_name);
+		writer.write(mesh.m_material_idx);
+		writer.write(mesh.m_start_index);
+		writer.write(mesh.m_number_of_vertices);
+		writer.write(mesh.m_first_vertex);
+		writer.write(mesh.m_vertex_count);
+	}
+
+	writer.write(uint32_t(model->m_materials.size()));
+	for(const Material& m : model->m_materials)
+	{
+		writer.write(m.m_name);
+		writer.write(m.m_color);
+		writer.write(m.m_shininess);
+		writer.write(m.m_metalness);
+		writer.write(m.m_fresnel);
+		writer.write(m.m_emission);
+		writer.write(m.m_transparency);
+		writer.write(m.m_ior);
+		for(const Texture* t : { &m.m_color_texture, &m.m_shininess_texture, &m.m_metalness_texture,
+		                         &m.m_fresnel_texture, &m.m_emission_texture })
+		{
+			writer.write(t->valid ? t->filename : std::string());
+		}
+	}
+	out.close();
+	if(out.fail())
+	{
+		remove(tmp_path.c_str());
+		return;
+	}
+	// rename() does not replace existing files on Windows
+	remove(cache_path.c_str());
+	if(rename(tmp_path.c_str(), cache_path.c_str()) != 0)
+	{
+		remove(tmp_path.c_str());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Check that every mesh range, index and material id of a model read from
+// a cache lies inside its buffers, so that a truncated or stale cache is
+// reparsed rather than read out of bounds
+///////////////////////////////////////////////////////////////////////////
+static bool validModelCache(const Model* model, bool indexed)
+{
+	const uint64_t number_of_positions = model->m_positions.size();
+	if(model->m_normals.size() != number_of_positions || model->m_texture_coordinates.size() != number_of_positions)
+	{
+		return false;
+	}
+	// Non-indexed models have no index buffer, and indexed ones need one
+	// unless they are empty
+	if(indexed ? (model->m_indices.empty() && number_of_positions != 0) : !model->m_indices.empty())
+	{
+		return false;
+	}
+	for(uint32_t index : model->m_indices)
+	{
+		if(index >= number_of_positions)
+		{
+			return false;
+		}
+	}
+	const uint64_t number_of_corners = indexed ? model->m_indices.size() : number_of_positions;
+	for(const Mesh& mesh : model->m_meshes)
+	{
+		if(mesh.m_material_idx >= model->m_materials.size() || mesh.m_number_of_vertices % 3 != 0
+		   || uint64_t(mesh.m_start_index) + mesh.m_number_of_vertices > number_of_corners
+		   || uint64_t(mesh.m_first_vertex) + mesh.m_vertex_count > number_of_positions)
+		{
+			return false;
+		}
+		if(!indexed)
+		{
+			if(mesh.m_first_vertex != mesh.m_start_index || mesh.m_vertex_count != mesh.m_number_of_vertices)
+			{
+				return false;
+			}
+			continue;
+		}
+		// Consumers such as the OBJ writer rebase indices to the mesh's range
+		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+		{
+			if(model->m_indices[i] < mesh.m_first_vertex
+			   || model->m_indices[i] - mesh.m_first_vertex >= mesh.m_vertex_count)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static Model* loadModelCache(const std::string& cache_path, const ModelSource& source, const std::string& path,
+                             const std::string& filename, const std::string& directory, bool upload_to_gpu,
+                             bool indexed)
+{
+	MappedFile file;
+	if(!source.valid || !file.open(cache_path))
+	{
+		return nullptr;
+	}
+	CacheReader reader = { file.data(), file.data() + file.size() };
+	ModelCacheHeader header;
+	if(!reader.read(header) || memcmp(header.magic, model_cache_magic, sizeof(header.magic)) != 0
+	   || header.version != model_cache_version || header.indexed != (indexed ? 1u : 0u)
+	   || !sameSource(header.source, source))
+	{
+		return nullptr;
+	}
+
+	std::unique_ptr<Model> model(new Model);
+	model->m_name = filename;
+	model->m_filename = path;
+	bool ok = reader.read(model->m_positions) && reader.read(model->m_normals)
+	          && reader.read(model->m_texture_coordinates) && reader.read(model->m_indices);
+
+	uint32_t number_of_meshes = 0;
+	ok = ok && reader.read(number_of_meshes);
+	for(uint32_t i = 0; ok && i < number_of_meshes; i++)
+	{
+		Mesh mesh;
+		ok = reader.read(mesh.m_name) && reader.read(mesh.m_material_idx) && reader.read(mesh.m_start_index)
+		     && reader.read(mesh.m_number_of_vertices) && reader.read(mesh.m_first_vertex)
+		     && reader.read(mesh.m_vertex_count);
+		model->m_meshes.push_back(mesh);
+	}
+
+	uint32_t number_of_materials = 0;
+	std::vector<std::string> texture_names[5];
+	ok = ok && reader.read(number_of_materials);
+	for(uint32_t i = 0; ok && i < number_of_materials; i++)
+	{
+		Material m;
+		ok = reader.read(m.m_name) && reader.read(m.m_color) && reader.read(m.m_shininess)
+		     && reader.read(m.m_metalness) && reader.read(m.m_fresnel) && reader.read(m.m_emission)
+		     && reader.read(m.m_transparency) && reader.read(m.m_ior);
+		for(int t = 0; ok && t < 5; t++)
+		{
+			texture_names[t].emplace_back();
+			ok = reader.read(texture_names[t].back());
+		}
+		model->m_materials.push_back(m);
+	}
+	if(!ok || !validModelCache(model.get(), indexed))
+	{
+		return nullptr;
 	}
 
 	///////////////////////////////////////////////////////////////////////
-	// Parse the OBJ file using tinyobj
+	// Textures are not cached, they are loaded by name
+	///////////////////////////////////////////////////////////////////////
+	for(uint32_t i = 0; i < number_of_materials; i++)
+	{
+		Material& m = model->m_materials[i];
+		Texture* textures[5] = { &m.m_color_texture, &m.m_shininess_texture, &m.m_metalness_texture,
+			                     &m.m_fresnel_texture, &m.m_emission_texture };
+		const int components[5] = { 4, 1, 1, 1, 4 };
+		for(int t = 0; t < 5; t++)
+		{
+			if(!texture_names[t][i].empty())
+			{
+				textures[t]->load(directory, texture_names[t][i], components[t], upload_to_gpu);
+			}
+		}
+	}
+	return model.release();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Parse an OBJ file (and its MTL file) into a Model on the CPU
+///////////////////////////////////////////////////////////////////////////
+static Model* parseOBJ(const std::string& path, const std::string& directory, const std::string& filename,
+                       const std::string& extension, bool upload_to_gpu, bool indexed)
+{
+	///////////////////////////////////////////////////////////////////////
+	// Parse the OBJ file on all cores. Produces the same result as
+	// tinyobj::LoadObj(), with triangulated meshes and the '.mtl' file
+	// expected in the same directory.
 	///////////////////////////////////////////////////////////////////////
-	std::cout << "Loading " << path << "..." << std::flush;
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
 	std::vector<tinyobj::material_t> materials;
 	std::string err;
-	// Expect '.mtl' file in the same directory and triangulate meshes
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err,
-	                            (directory + filename + extension).c_str(), directory.c_str(), true);
+	bool ret = loadObjParallel(&attrib, &shapes, &materials, &err, directory + filename + extension, directory);
 	if(!err.empty())
 	{ // `err` may contain warning message.
 		std::cerr << err << std::endl;
@@ -172,27 +524,27 @@ Model* loadModelFromOBJ(std::string path)
 		material.m_color = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
 		if(m.diffuse_texname != "")
 		{
-			material.m_color_texture.load(directory, m.diffuse_texname, 4);
+			material.m_color_texture.load(directory, m.diffuse_texname, 4, upload_to_gpu);
 		}
 		material.m_metalness = m.metallic;
 		if(m.metallic_texname != "")
 		{
-			material.m_metalness_texture.load(directory, m.metallic_texname, 1);
+			material.m_metalness_texture.load(directory, m.metallic_texname, 1, upload_to_gpu);
 		}
 		material.m_fresnel = m.specular[0];
 		if(m.specular_texname != "")
 		{
-			material.m_fresnel_texture.load(directory, m.specular_texname, 1);
+			material.m_fresnel_texture.load(directory, m.specular_texname, 1, upload_to_gpu);
 		}
 		material.m_shininess = m.roughness;
 		if(m.roughness_texname != "")
 		{
-			material.m_shininess_texture.load(directory, m.roughness_texname, 1);
+			material.m_shininess_texture.load(directory, m.roughness_texname, 1, upload_to_gpu);
 		}
 		material.m_emission = glm::vec3(m.emission[0], m.emission[1], m.emission[2]);
 		if(m.emissive_texname != "")
 		{
-			material.m_emission_texture.load(directory, m.emissive_texname, 4);
+			material.m_emission_texture.load(directory, m.emissive_texname, 4, upload_to_gpu);
 		}
 		material.m_transparency = m.transmittance[0];
 		material.m_ior = m.ior;
@@ -201,17 +553,29 @@ Model* loadModelFromOBJ(std::string path)
 
 	///////////////////////////////////////////////////////////////////////
 	// A vertex in the OBJ file may have different indices for position,
-	// normal and texture coordinate. We will not even attempt to use
-	// indexed lookups, but will store a simple vertex stream per mesh.
+	// normal and texture coordinate. Unless we are asked for an indexed
+	// model, we will store a simple vertex stream per mesh. Otherwise
+	// each unique combination of indices becomes one vertex and the
+	// triangles are stored as an index buffer.
 	///////////////////////////////////////////////////////////////////////
 	uint64_t number_of_vertices = 0;
 	for(const auto& shape : shapes)
 	{
 		number_of_vertices += shape.mesh.indices.size();
 	}
-	model->m_positions.resize(number_of_vertices);
-	model->m_normals.resize(number_of_vertices);
-	model->m_texture_coordinates.resize(number_of_vertices);
+	if(indexed)
+	{
+		model->m_indices.resize(number_of_vertices);
+		model->m_positions.reserve(attrib.vertices.size() / 3);
+		model->m_normals.reserve(attrib.vertices.size() / 3);
+		model->m_texture_coordinates.reserve(attrib.vertices.size() / 3);
+	}
+	else
+	{
+		model->m_positions.resize(number_of_vertices);
+		model->m_normals.resize(number_of_vertices);
+		model->m_texture_coordinates.resize(number_of_vertices);
+	}
 
 	///////////////////////////////////////////////////////////////////////
 	// For each vertex _position_ auto generate a normal that will be used
@@ -250,6 +614,32 @@ Model* loadModelFromOBJ(std::string path)
 	// Now we will turn all shapes into Meshes. A shape that has several
 	// materials will be split into several meshes with unique names
 	///////////////////////////////////////////////////////////////////////
+	auto getVertex = [&](const tinyobj::index_t& idx, glm::vec3& position, glm::vec3& normal, glm::vec2& uv) {
+		position = glm::vec3(attrib.vertices[idx.vertex_index * 3 + 0], attrib.vertices[idx.vertex_index * 3 + 1],
+		                     attrib.vertices[idx.vertex_index * 3 + 2]);
+		if(idx.normal_index == -1)
+		{
+			// No normal, use the autogenerated
+			normal = glm::vec3(auto_normals[idx.vertex_index]);
+		}
+		else
+		{
+			normal = glm::vec3(attrib.normals[idx.normal_index * 3 + 0], attrib.normals[idx.normal_index * 3 + 1],
+			                   attrib.normals[idx.normal_index * 3 + 2]);
+		}
+		if(idx.texcoord_index == -1)
+		{
+			// No UV coordinates. Use null.
+			uv = glm::vec2(0.0f);
+		}
+		else
+		{
+			uv = glm::vec2(attrib.texcoords[idx.texcoord_index * 2 + 0],
+			               attrib.texcoords[idx.texcoord_index * 2 + 1]);
+		}
+	};
+	std::unordered_map<VertexKey, uint32_t, VertexKeyHash> mesh_vertices;
+
 	int vertices_so_far = 0;
 	for(int s = 0; s < shapes.size(); ++s)
 	{
@@ -273,6 +663,8 @@ Model* loadModelFromOBJ(std::string path)
 			mesh.m_name = shape.name + "_" + materials[current_material_index].name;
 			mesh.m_material_idx = current_material_index;
 			mesh.m_start_index = vertices_so_far;
+			mesh.m_first_vertex = indexed ? uint32_t(model->m_positions.size()) : vertices_so_far;
+			mesh_vertices.clear();
 			number_of_materials_in_shape += 1;
 
 			uint64_t number_of_faces = shape.mesh.indices.size() / 3;
@@ -293,39 +685,32 @@ Model* loadModelFromOBJ(std::string path)
 				else
 				{
 					///////////////////////////////////////////////////////
-					// Now we generate the vertices
+					// Now we generate the vertices. An indexed model only
+					// creates a vertex the first time a (position, normal,
+					// uv) combination is seen in this mesh.
 					///////////////////////////////////////////////////////
 					for(int j = 0; j < 3; j++)
 					{
-						int v = shape.mesh.indices[i * 3 + j].vertex_index;
-						model->m_positions[vertices_so_far + j] =
-						    glm::vec3(attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 0],
-						              attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 1],
-						              attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 2]);
-						if(shape.mesh.indices[i * 3 + j].normal_index == -1)
-						{
-							// No normal, use the autogenerated
-							model->m_normals[vertices_so_far + j] = glm::vec3(
-							    auto_normals[shape.mesh.indices[i * 3 + j].vertex_index]);
-						}
-						else
-						{
-							model->m_normals[vertices_so_far + j] =
-							    glm::vec3(attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 0],
-							              attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 1],
-							              attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 2]);
-						}
-						if(shape.mesh.indices[i * 3 + j].texcoord_index == -1)
+						const tinyobj::index_t& idx = shape.mesh.indices[i * 3 + j];
+						if(!indexed)
 						{
-							// No UV coordinates. Use null.
-							model->m_texture_coordinates[vertices_so_far + j] = glm::vec2(0.0f);
+							getVertex(idx, model->m_positions[vertices_so_far + j],
+							          model->m_normals[vertices_so_far + j],
+							          model->m_texture_coordinates[vertices_so_far + j]);
+							continue;
 						}
-						else
+						VertexKey key;
+						getVertex(idx, key.position, key.normal, key.uv);
+						auto it = mesh_vertices.find(key);
+						if(it == mesh_vertices.end())
 						{
-							model->m_texture_coordinates[vertices_so_far + j] = glm::vec2(
-							    attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 0],
-							    attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 1]);
+							uint32_t vertex = uint32_t(model->m_positions.size());
+							model->m_positions.push_back(key.position);
+							model->m_normals.push_back(key.normal);
+							model->m_texture_coordinates.push_back(key.uv);
+							it = mesh_vertices.insert(std::make_pair(key, vertex)).first;
 						}
+						model->m_indices[vertices_so_far + j] = it->second;
 					}
 					vertices_so_far += 3;
 				}
@@ -334,6 +719,8 @@ Model* loadModelFromOBJ(std::string path)
 			// Finalize and push this mesh to the list
 			///////////////////////////////////////////////////////////////
 			mesh.m_number_of_vertices = vertices_so_far - mesh.m_start_index;
+			mesh.m_vertex_count = indexed ? uint32_t(model->m_positions.size()) - mesh.m_first_vertex :
+			                                mesh.m_number_of_vertices;
 			model->m_meshes.push_back(mesh);
 			finished_materials[current_material_index] = true;
 		}
@@ -347,9 +734,15 @@ Model* loadModelFromOBJ(std::string path)
 	std::sort(model->m_meshes.begin(), model->m_meshes.end(),
 	          [](const Mesh& a, const Mesh& b) { return a.m_name < b.m_name; });
 
-	///////////////////////////////////////////////////////////////////////
-	// Upload to GPU
-	///////////////////////////////////////////////////////////////////////
+	return model;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Upload the CPU buffers of a model to the GPU
+///////////////////////////////////////////////////////////////////////////
+static void uploadModelToGPU(Model* model)
+{
+	const bool indexed = !model->m_indices.empty();
 	glGenVertexArrays(1, &model->m_vaob);
 	glBindVertexArray(model->m_vaob);
 	glGenBuffers(1, &model->m_positions_bo);
@@ -370,9 +763,62 @@ Model* loadModelFromOBJ(std::string path)
 	             &model->m_texture_coordinates[0].x, GL_STATIC_DRAW);
 	glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
 	glEnableVertexAttribArray(2);
+	if(indexed)
+	{
+		// The element buffer binding is part of the VAO state
+		glGenBuffers(1, &model->m_indices_bo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->m_indices_bo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, model->m_indices.size() * sizeof(uint32_t), model->m_indices.data(),
+		             GL_STATIC_DRAW);
+	}
 
 	glBindVertexArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+Model* loadModelFromOBJ(std::string path, bool upload_to_gpu, bool indexed)
+{
+	std::string filename, extension, directory;
+
+	filename = file::normalise(path);
+	directory = file::parent_path(path);
+	filename = file::file_stem(path);
+	extension = file::file_extension(path);
+
+	if(extension != ".obj")
+	{
+		std::cout << "Fatal: loadModelFromOBJ(): Expecting filename ending in '.obj'\n";
+		exit(1);
+	}
+
+	std::cout << "Loading " << path << "..." << std::flush;
+	const std::string cache_path = directory + filename + ".modelcache";
+	// Hashing the source costs a pass over the file, so it is only done
+	// for the cache
+	ModelSource source{};
+	Model* model = nullptr;
+	if(model_cache_enabled)
+	{
+		source = getModelSource(directory + filename + extension, directory + filename + ".mtl");
+		model = loadModelCache(cache_path, source, path, filename, directory, upload_to_gpu, indexed);
+		if(model != nullptr)
+		{
+			std::cout << "(cached) ";
+		}
+	}
+	if(model == nullptr)
+	{
+		model = parseOBJ(path, directory, filename, extension, upload_to_gpu, indexed);
+		if(model_cache_enabled)
+		{
+			saveModelCache(cache_path, source, model, indexed);
+		}
+	}
+
+	if(upload_to_gpu)
+	{
+		uploadModelToGPU(model);
+	}
 
 	std::cout << "done.\n";
 	return model;
@@ -448,17 +894,17 @@ void saveModelToOBJ(Model* model, std::string filename)
 		obj_file << "o " << mesh.m_name << "\n";
 		obj_file << "g " << mesh.m_name << "\n";
 		obj_file << "usemtl " << model->m_materials[mesh.m_material_idx].m_name << "\n";
-		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+		for(uint32_t i = mesh.m_first_vertex; i < mesh.m_first_vertex + mesh.m_vertex_count; i++)
 		{
 			obj_file << "v " << model->m_positions[i].x << " " << model->m_positions[i].y << " "
 			         << model->m_positions[i].z << "\n";
 		}
-		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+		for(uint32_t i = mesh.m_first_vertex; i < mesh.m_first_vertex + mesh.m_vertex_count; i++)
 		{
 			obj_file << "vn " << model->m_normals[i].x << " " << model->m_normals[i].y << " "
 			         << model->m_normals[i].z << "\n";
 		}
-		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+		for(uint32_t i = mesh.m_first_vertex; i < mesh.m_first_vertex + mesh.m_vertex_count; i++)
 		{
 			obj_file << "vt " << model->m_texture_coordinates[i].x << " " << model->m_texture_coordinates[i].y
 			         << "\n";
@@ -466,11 +912,15 @@ void saveModelToOBJ(Model* model, std::string filename)
 		int number_of_faces = mesh.m_number_of_vertices / 3;
 		for(int i = 0; i < number_of_faces; i++)
 		{
-			obj_file << "f " << vertex_counter << "/" << vertex_counter << "/" << vertex_counter << " "
-			         << vertex_counter + 1 << "/" << vertex_counter + 1 << "/" << vertex_counter + 1 << " "
-			         << vertex_counter + 2 << "/" << vertex_counter + 2 << "/" << vertex_counter + 2 << "\n";
-			vertex_counter += 3;
+			obj_file << "f";
+			for(int j = 0; j < 3; j++)
+			{
+				int v = vertex_counter + model->vertexIndex(mesh.m_start_index + i * 3 + j) - mesh.m_first_vertex;
+				obj_file << " " << v << "/" << v << "/" << v;
+			}
+			obj_file << "\n";
 		}
+		vertex_counter += mesh.m_vertex_count;
 	}
 }
 
@@ -549,7 +999,15 @@ void render(const Model* model, const bool submitMaterials)
 			setUniformSlow( current_program, "has_shininess_texture", has_shininess_texture );
 			*/
 		}
-		glDrawArrays(GL_TRIANGLES, mesh.m_start_index, (GLsizei)mesh.m_number_of_vertices);
+		if(model->m_indices_bo)
+		{
+			glDrawElements(GL_TRIANGLES, (GLsizei)mesh.m_number_of_vertices, GL_UNSIGNED_INT,
+			               (const void*)(uintptr_t(mesh.m_start_index) * sizeof(uint32_t)));
+		}
+		else
+		{
+			glDrawArrays(GL_TRIANGLES, mesh.m_start_index, (GLsizei)mesh.m_number_of_vertices);
+		}
 	}
 	glBindVertexArray(0);
 }
@@ -2,7 +2,6 @@
 #include <string>
 #include <vector>
 #include <memory>
-#include <memory>
 #include <glm/glm.hpp>
 
 namespace labhelper
@@ -15,11 +14,17 @@ struct Texture
 	std::string filename;
 	std::string directory;
 	int width, height;
-	uint8_t* data;
 	uint8_t n_components = 4;
 
-	bool load(const std::string& directory, const std::string& filename, int nof_components);
-	glm::vec4 sample(glm::vec2 uv) const;
+	// No copy of the texels is kept on the CPU. With `upload_to_gpu` false
+	// no GL calls are made, which allows loading textures in processes that
+	// have no GL context, and the image is only checked, not decoded.
+	bool load(const std::string& directory, const std::string& filename, int nof_components,
+	          bool upload_to_gpu = true);
+	std::string path() const
+	{
+		return directory + filename;
+	}
 	void free();
 };
 //////////////////////////////////////////////////////////////////////////////
@@ -51,9 +56,14 @@ struct Mesh
 {
 	std::string m_name;
 	uint32_t m_material_idx;
-	// Where this Mesh's vertices start
+	// Where this Mesh's vertices start (in m_indices for indexed models)
 	uint32_t m_start_index;
+	// Number of triangle corners, i.e., three times the number of triangles
 	uint32_t m_number_of_vertices;
+	// The range of vertices used by this Mesh. For non-indexed models this
+	// is the same as [m_start_index, m_start_index + m_number_of_vertices).
+	uint32_t m_first_vertex;
+	uint32_t m_vertex_count;
 };
 
 class Model
@@ -72,15 +82,30 @@ public:
 	std::vector<glm::vec3> m_positions;
 	std::vector<glm::vec3> m_normals;
 	std::vector<glm::vec2> m_texture_coordinates;
-	// Buffers on GPU
-	uint32_t m_positions_bo;
-	uint32_t m_normals_bo;
-	uint32_t m_texture_coordinates_bo;
+	// Triangle corners of indexed models (empty if the model is not indexed)
+	std::vector<uint32_t> m_indices;
+	// Index of the vertex used by triangle corner `i`
+	uint32_t vertexIndex(uint32_t i) const
+	{
+		return m_indices.empty() ? i : m_indices[i];
+	}
+	// Buffers on GPU (0 if the model was loaded without a GL context)
+	uint32_t m_positions_bo = 0;
+	uint32_t m_normals_bo = 0;
+	uint32_t m_texture_coordinates_bo = 0;
+	uint32_t m_indices_bo = 0;
 	// Vertex Array Object
-	uint32_t m_vaob;
+	uint32_t m_vaob = 0;
 };
 
-Model* loadModelFromOBJ(std::string filename);
+// Load a model. With `upload_to_gpu` false only the CPU buffers are filled
+// and no GL calls are made (e.g., for headless rendering). With `indexed`
+// duplicate vertices are merged, the triangles are stored in m_indices and
+// render() draws with glDrawElements. The labs use the expanded vertices.
+Model* loadModelFromOBJ(std::string filename, bool upload_to_gpu = true, bool indexed = false);
+// Loaded models are cached in a binary file next to the OBJ (<name>.modelcache),
+// which is used instead of parsing the OBJ as long as it is up to date.
+void setModelCacheEnabled(bool enabled);
 void saveModelToOBJ(Model* model, std::string filename);
 void saveModelMaterialsToMTL(Model* model, std::string filename);
 void freeModel(Model* model);
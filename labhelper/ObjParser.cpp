@@ -0,0 +1,642 @@
+// Must come before the tinyobj implementation, which has no include guard
+#include "ObjParser.h"
+// tinyobj is compiled here, with the parser that uses it to read MTL files
+#define TINYOBJLOADER_IMPLEMENTATION
+#include <tiny_obj_loader.h>
+#include "MappedFile.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <thread>
+
+namespace labhelper
+{
+namespace
+{
+// Files smaller than this per thread are not worth splitting
+const size_t min_chunk_size = 1 << 20;
+
+///////////////////////////////////////////////////////////////////////////
+// A statement that affects how faces are grouped into shapes. They are
+// replayed in file order once all chunks have been parsed.
+///////////////////////////////////////////////////////////////////////////
+struct Statement
+{
+	enum Type
+	{
+		USEMTL,
+		GROUP,
+		OBJECT,
+		MTLLIB
+	};
+	Type type;
+	std::string argument;
+	// Number of triangle corners and faces that precede the statement
+	// within its chunk
+	size_t index_offset;
+	size_t face_offset;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Everything parsed from one chunk of the file
+///////////////////////////////////////////////////////////////////////////
+struct Chunk
+{
+	const char* begin;
+	const char* end;
+	std::vector<tinyobj::real_t> vertices, normals, texcoords;
+	// Fan-triangulated faces, three corners per triangle
+	std::vector<tinyobj::index_t> indices;
+	size_t num_faces = 0;
+	std::vector<Statement> statements;
+	// Negative (relative) indices can only be resolved against the
+	// attributes of this chunk. These are the corners that still need the
+	// attribute counts of all preceding chunks added.
+	std::vector<size_t> relative_vertex, relative_normal, relative_texcoord;
+	// Number of corners and faces in all preceding chunks
+	size_t first_index = 0, first_face = 0;
+};
+
+inline bool isSpace(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+inline bool isNewLine(char c)
+{
+	return c == '\r' || c == '\n';
+}
+
+inline const char* skipSpace(const char* p, const char* end)
+{
+	while(p < end && isSpace(*p))
+	{
+		p++;
+	}
+	return p;
+}
+
+inline const char* skipToken(const char* p, const char* end)
+{
+	while(p < end && !isSpace(*p))
+	{
+		p++;
+	}
+	return p;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Parse a number in [s, s_end). This does exactly the same arithmetic as
+// tinyobj's tryParseDouble(), so that we get bit-identical vertices, but
+// works on a bounded range of the mapped file instead of a line copy.
+///////////////////////////////////////////////////////////////////////////
+bool parseDouble(const char* s, const char* s_end, double* result)
+{
+	if(s >= s_end)
+	{
+		return false;
+	}
+	static const double pow_lut[] = { 1.0, 0.1, 0.01, 0.001, 0.0001, 0.00001, 0.000001, 0.0000001 };
+	const int lut_entries = sizeof pow_lut / sizeof pow_lut[0];
+
+	double mantissa = 0.0;
+	int exponent = 0;
+	bool negative = false;
+	const char* curr = s;
+
+	if(*curr == '+' || *curr == '-')
+	{
+		negative = *curr == '-';
+		curr++;
+	}
+	else if(!(*curr >= '0' && *curr <= '9'))
+	{
+		return false;
+	}
+
+	// Integer part
+	int read = 0;
+	while(curr < s_end && *curr >= '0' && *curr <= '9')
+	{
+		mantissa *= 10;
+		mantissa += static_cast<int>(*curr - '0');
+		curr++;
+		read++;
+	}
+	if(read == 0)
+	{
+		return false;
+	}
+
+	// Decimal part
+	if(curr < s_end && *curr == '.')
+	{
+		curr++;
+		read = 1;
+		while(curr < s_end && *curr >= '0' && *curr <= '9')
+		{
+			mantissa += static_cast<int>(*curr - '0') * (read < lut_entries ? pow_lut[read] : std::pow(10.0, -read));
+			read++;
+			curr++;
+		}
+	}
+
+	// Exponent part
+	if(curr < s_end && (*curr == 'e' || *curr == 'E'))
+	{
+		curr++;
+		bool negative_exponent = false;
+		if(curr < s_end && (*curr == '+' || *curr == '-'))
+		{
+			negative_exponent = *curr == '-';
+			curr++;
+		}
+		else if(!(curr < s_end && *curr >= '0' && *curr <= '9'))
+		{
+			return false;
+		}
+		read = 0;
+		while(curr < s_end && *curr >= '0' && *curr <= '9')
+		{
+			exponent *= 10;
+			exponent += static_cast<int>(*curr - '0');
+			curr++;
+			read++;
+		}
+		if(read == 0)
+		{
+			return false;
+		}
+		exponent *= negative_exponent ? -1 : 1;
+	}
+
+	*result = (negative ? -1 : 1)
+	          * (exponent ? std::ldexp(mantissa * std::pow(5.0, exponent), exponent) : mantissa);
+	return true;
+}
+
+inline tinyobj::real_t parseReal(const char*& p, const char* end)
+{
+	p = skipSpace(p, end);
+	const char* token_end = skipToken(p, end);
+	double value = 0.0;
+	parseDouble(p, token_end, &value);
+	p = token_end;
+	return static_cast<tinyobj::real_t>(value);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Same as atoi() on an index, but stops at the end of the line
+///////////////////////////////////////////////////////////////////////////
+inline int parseIndex(const char*& p, const char* end)
+{
+	bool negative = false;
+	if(p < end && (*p == '+' || *p == '-'))
+	{
+		negative = *p == '-';
+		p++;
+	}
+	int value = 0;
+	while(p < end && *p >= '0' && *p <= '9')
+	{
+		value = value * 10 + (*p - '0');
+		p++;
+	}
+	// Skip whatever is left of the number, like tinyobj does
+	while(p < end && *p != '/' && !isSpace(*p))
+	{
+		p++;
+	}
+	return negative ? -value : value;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Make an index zero-based. Relative indices are resolved against the
+// number of attributes seen so far in the chunk, and `relative` is set.
+///////////////////////////////////////////////////////////////////////////
+inline int fixIndex(int index, size_t count, bool& relative)
+{
+	relative = index < 0;
+	if(index > 0)
+	{
+		return index - 1;
+	}
+	if(index == 0)
+	{
+		return 0;
+	}
+	return int(count) + index;
+}
+
+struct FaceCorner
+{
+	tinyobj::index_t index;
+	bool relative_vertex, relative_normal, relative_texcoord;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Parse i, i/j, i//k or i/j/k
+///////////////////////////////////////////////////////////////////////////
+FaceCorner parseCorner(const char*& p, const char* end, const Chunk& chunk)
+{
+	FaceCorner c;
+	c.index.vertex_index = c.index.normal_index = c.index.texcoord_index = -1;
+	c.relative_normal = c.relative_texcoord = false;
+
+	c.index.vertex_index = fixIndex(parseIndex(p, end), chunk.vertices.size() / 3, c.relative_vertex);
+	if(p >= end || *p != '/')
+	{
+		return c;
+	}
+	p++;
+	if(p < end && *p == '/')
+	{
+		p++;
+		c.index.normal_index = fixIndex(parseIndex(p, end), chunk.normals.size() / 3, c.relative_normal);
+		return c;
+	}
+	c.index.texcoord_index = fixIndex(parseIndex(p, end), chunk.texcoords.size() / 2, c.relative_texcoord);
+	if(p >= end || *p != '/')
+	{
+		return c;
+	}
+	p++;
+	c.index.normal_index = fixIndex(parseIndex(p, end), chunk.normals.size() / 3, c.relative_normal);
+	return c;
+}
+
+void pushCorner(Chunk& chunk, const FaceCorner& c)
+{
+	size_t i = chunk.indices.size();
+	chunk.indices.push_back(c.index);
+	if(c.relative_vertex)
+	{
+		chunk.relative_vertex.push_back(i);
+	}
+	if(c.relative_normal)
+	{
+		chunk.relative_normal.push_back(i);
+	}
+	if(c.relative_texcoord)
+	{
+		chunk.relative_texcoord.push_back(i);
+	}
+}
+
+inline bool startsWith(const char* p, const char* end, const char* keyword, size_t length)
+{
+	return size_t(end - p) > length && strncmp(p, keyword, length) == 0 && isSpace(p[length]);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Parse all lines of a chunk
+///////////////////////////////////////////////////////////////////////////
+void parseChunk(Chunk& chunk)
+{
+	std::vector<FaceCorner> face;
+	const char* p = chunk.begin;
+	while(p < chunk.end)
+	{
+		const char* line_end = p;
+		while(line_end < chunk.end && !isNewLine(*line_end))
+		{
+			line_end++;
+		}
+		const char* token = skipSpace(p, line_end);
+		p = line_end + 1;
+
+		if(token == line_end || *token == '#')
+		{
+			continue;
+		}
+		if(startsWith(token, line_end, "v", 1))
+		{
+			token += 2;
+			chunk.vertices.push_back(parseReal(token, line_end));
+			chunk.vertices.push_back(parseReal(token, line_end));
+			chunk.vertices.push_back(parseReal(token, line_end));
+		}
+		else if(startsWith(token, line_end, "vn", 2))
+		{
+			token += 3;
+			chunk.normals.push_back(parseReal(token, line_end));
+			chunk.normals.push_back(parseReal(token, line_end));
+			chunk.normals.push_back(parseReal(token, line_end));
+		}
+		else if(startsWith(token, line_end, "vt", 2))
+		{
+			token += 3;
+			chunk.texcoords.push_back(parseReal(token, line_end));
+			chunk.texcoords.push_back(parseReal(token, line_end));
+		}
+		else if(startsWith(token, line_end, "f", 1))
+		{
+			token = skipSpace(token + 2, line_end);
+			face.clear();
+			while(token < line_end)
+			{
+				face.push_back(parseCorner(token, line_end, chunk));
+				token = skipSpace(token, line_end);
+			}
+			// Polygon -> triangle fan
+			for(size_t k = 2; k < face.size(); k++)
+			{
+				pushCorner(chunk, face[0]);
+				pushCorner(chunk, face[k - 1]);
+				pushCorner(chunk, face[k]);
+			}
+			chunk.num_faces++;
+		}
+		else
+		{
+			Statement s;
+			s.index_offset = chunk.indices.size();
+			s.face_offset = chunk.num_faces;
+			if(startsWith(token, line_end, "usemtl", 6))
+			{
+				s.type = Statement::USEMTL;
+				const char* name = skipSpace(token + 7, line_end);
+				s.argument.assign(name, skipToken(name, line_end));
+			}
+			else if(startsWith(token, line_end, "mtllib", 6))
+			{
+				s.type = Statement::MTLLIB;
+				s.argument.assign(token + 7, line_end);
+			}
+			else if(*token == 'g' || *token == 'o')
+			{
+				if(line_end - token < 2 || !isSpace(token[1]))
+				{
+					continue;
+				}
+				s.type = *token == 'g' ? Statement::GROUP : Statement::OBJECT;
+				const char* name = skipSpace(token + 2, line_end);
+				s.argument.assign(name, skipToken(name, line_end));
+			}
+			else
+			{
+				// Unknown statements (and tags) are ignored
+				continue;
+			}
+			chunk.statements.push_back(s);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Split [data, data + size) into about `count` pieces, at line boundaries
+///////////////////////////////////////////////////////////////////////////
+std::vector<Chunk> splitIntoChunks(const char* data, size_t size, int count)
+{
+	std::vector<Chunk> chunks;
+	const char* end = data + size;
+	const char* begin = data;
+	for(int i = 1; i <= count && begin < end; i++)
+	{
+		const char* split = data + size_t((uint64_t(size) * i) / count);
+		split = std::max(split, begin);
+		while(split < end && !isNewLine(*split))
+		{
+			split++;
+		}
+		if(split < end)
+		{
+			split++;
+		}
+		Chunk chunk;
+		chunk.begin = begin;
+		chunk.end = split;
+		chunks.push_back(std::move(chunk));
+		begin = split;
+	}
+	return chunks;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The shape building of tinyobj::LoadObj(), replayed over the statements
+// of all chunks. The current face group is a range of the merged corners.
+///////////////////////////////////////////////////////////////////////////
+struct ShapeBuilder
+{
+	const std::vector<tinyobj::index_t>& indices;
+	tinyobj::shape_t shape;
+	std::string name;
+	int material = -1;
+	size_t group_begin = 0, group_end = 0;
+	size_t group_first_face = 0, group_end_face = 0;
+
+	explicit ShapeBuilder(const std::vector<tinyobj::index_t>& _indices) : indices(_indices)
+	{
+	}
+
+	// All faces before corner `index` (and face `face`) join the group
+	void advance(size_t index, size_t face)
+	{
+		group_end = index;
+		group_end_face = face;
+	}
+
+	void clearGroup()
+	{
+		group_begin = group_end;
+		group_first_face = group_end_face;
+	}
+
+	// tinyobj's exportFaceGroupToShape()
+	bool exportGroup()
+	{
+		if(group_end_face == group_first_face)
+		{
+			return false;
+		}
+		shape.mesh.indices.insert(shape.mesh.indices.end(), indices.begin() + group_begin,
+		                          indices.begin() + group_end);
+		size_t num_triangles = (group_end - group_begin) / 3;
+		shape.mesh.num_face_vertices.insert(shape.mesh.num_face_vertices.end(), num_triangles, 3);
+		shape.mesh.material_ids.insert(shape.mesh.material_ids.end(), num_triangles, material);
+		shape.name = name;
+		return true;
+	}
+};
+} // namespace
+
+bool loadObjParallel(tinyobj::attrib_t* attrib, std::vector<tinyobj::shape_t>* shapes,
+                     std::vector<tinyobj::material_t>* materials, std::string* err,
+                     const std::string& filename, const std::string& mtl_basedir, int num_threads)
+{
+	attrib->vertices.clear();
+	attrib->normals.clear();
+	attrib->texcoords.clear();
+	shapes->clear();
+
+	MappedFile file;
+	if(!file.open(filename))
+	{
+		if(err)
+		{
+			(*err) = "Cannot open file [" + filename + "]\n";
+		}
+		return false;
+	}
+	const char* data = reinterpret_cast<const char*>(file.data());
+	const size_t size = file.size();
+
+	///////////////////////////////////////////////////////////////////////
+	// Parse the chunks in parallel
+	///////////////////////////////////////////////////////////////////////
+	if(num_threads <= 0)
+	{
+		num_threads = std::max(1, int(std::thread::hardware_concurrency()));
+	}
+	int num_chunks = int(std::min<size_t>(num_threads, size / min_chunk_size + 1));
+	std::vector<Chunk> chunks = splitIntoChunks(data, size, num_chunks);
+
+	std::vector<std::thread> workers;
+	for(size_t i = 1; i < chunks.size(); i++)
+	{
+		workers.emplace_back(parseChunk, std::ref(chunks[i]));
+	}
+	if(!chunks.empty())
+	{
+		parseChunk(chunks[0]);
+	}
+	for(auto& w : workers)
+	{
+		w.join();
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Merge the attributes and corners in file order, resolving the
+	// relative indices against the attributes of the preceding chunks
+	///////////////////////////////////////////////////////////////////////
+	size_t num_vertices = 0, num_normals = 0, num_texcoords = 0, num_indices = 0;
+	for(const Chunk& c : chunks)
+	{
+		num_vertices += c.vertices.size();
+		num_normals += c.normals.size();
+		num_texcoords += c.texcoords.size();
+		num_indices += c.indices.size();
+	}
+	attrib->vertices.reserve(num_vertices);
+	attrib->normals.reserve(num_normals);
+	attrib->texcoords.reserve(num_texcoords);
+	std::vector<tinyobj::index_t> indices;
+	indices.reserve(num_indices);
+
+	size_t num_faces = 0;
+	for(Chunk& c : chunks)
+	{
+		c.first_index = indices.size();
+		c.first_face = num_faces;
+		num_faces += c.num_faces;
+		const int vertex_base = int(attrib->vertices.size() / 3);
+		const int normal_base = int(attrib->normals.size() / 3);
+		const int texcoord_base = int(attrib->texcoords.size() / 2);
+		for(size_t i : c.relative_vertex)
+		{
+			c.indices[i].vertex_index += vertex_base;
+		}
+		for(size_t i : c.relative_normal)
+		{
+			c.indices[i].normal_index += normal_base;
+		}
+		for(size_t i : c.relative_texcoord)
+		{
+			c.indices[i].texcoord_index += texcoord_base;
+		}
+		attrib->vertices.insert(attrib->vertices.end(), c.vertices.begin(), c.vertices.end());
+		attrib->normals.insert(attrib->normals.end(), c.normals.begin(), c.normals.end());
+		attrib->texcoords.insert(attrib->texcoords.end(), c.texcoords.begin(), c.texcoords.end());
+		indices.insert(indices.end(), c.indices.begin(), c.indices.end());
+		std::vector<tinyobj::real_t>().swap(c.vertices);
+		std::vector<tinyobj::real_t>().swap(c.normals);
+		std::vector<tinyobj::real_t>().swap(c.texcoords);
+		std::vector<tinyobj::index_t>().swap(c.indices);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Replay the statements to group the faces into shapes, exactly as
+	// tinyobj does it
+	///////////////////////////////////////////////////////////////////////
+	std::map<std::string, int> material_map;
+	tinyobj::MaterialFileReader material_reader(mtl_basedir);
+	ShapeBuilder builder(indices);
+	for(const Chunk& c : chunks)
+	{
+		for(const Statement& s : c.statements)
+		{
+			builder.advance(c.first_index + s.index_offset, c.first_face + s.face_offset);
+			switch(s.type)
+			{
+			case Statement::USEMTL:
+			{
+				auto it = material_map.find(s.argument);
+				int new_material = it != material_map.end() ? it->second : -1;
+				if(new_material != builder.material)
+				{
+					builder.exportGroup();
+					builder.clearGroup();
+					builder.material = new_material;
+				}
+				break;
+			}
+			case Statement::MTLLIB:
+			{
+				std::vector<std::string> mtl_filenames;
+				std::stringstream ss(s.argument);
+				std::string item;
+				while(std::getline(ss, item, ' '))
+				{
+					mtl_filenames.push_back(item);
+				}
+				if(mtl_filenames.empty())
+				{
+					if(err)
+					{
+						(*err) += "WARN: Looks like empty filename for mtllib. Use default material. \n";
+					}
+					break;
+				}
+				bool found = false;
+				for(const std::string& mtl_filename : mtl_filenames)
+				{
+					std::string err_mtl;
+					found = material_reader(mtl_filename, materials, &material_map, &err_mtl);
+					if(err && !err_mtl.empty())
+					{
+						(*err) += err_mtl;
+					}
+					if(found)
+					{
+						break;
+					}
+				}
+				if(!found && err)
+				{
+					(*err) += "WARN: Failed to load material file(s). Use default material.\n";
+				}
+				break;
+			}
+			case Statement::GROUP:
+			case Statement::OBJECT:
+				if(builder.exportGroup())
+				{
+					shapes->push_back(builder.shape);
+				}
+				builder.shape = tinyobj::shape_t();
+				builder.clearGroup();
+				builder.name = s.argument;
+				break;
+			}
+		}
+	}
+	builder.advance(indices.size(), chunks.empty() ? 0 : chunks.back().first_face + chunks.back().num_faces);
+	if(builder.exportGroup() || !builder.shape.mesh.indices.empty())
+	{
+		shapes->push_back(builder.shape);
+	}
+	return true;
+}
+} // namespace labhelper
@@ -0,0 +1,21 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <tiny_obj_loader.h>
+
+namespace labhelper
+{
+///////////////////////////////////////////////////////////////////////////
+// Parse an OBJ file on several threads. The file is memory mapped, split
+// into chunks at line boundaries and every chunk is parsed on its own
+// thread. The chunks are then stitched together in file order.
+//
+// The result is identical to that of
+//   tinyobj::LoadObj(attrib, shapes, materials, err, filename, mtl_basedir, true)
+// except that tags ('t' lines) are ignored. MTL files are still read with
+// tinyobj. `num_threads` <= 0 uses all hardware threads.
+///////////////////////////////////////////////////////////////////////////
+bool loadObjParallel(tinyobj::attrib_t* attrib, std::vector<tinyobj::shape_t>* shapes,
+                     std::vector<tinyobj::material_t>* materials, std::string* err,
+                     const std::string& filename, const std::string& mtl_basedir, int num_threads = 0);
+} // namespace labhelper
@@ -0,0 +1,201 @@
+#include "PackedFloat.h"
+#include <algorithm>
+
+namespace labhelper
+{
+namespace
+{
+// (511 / 512) * 2^16, the largest value that RGB9E5 holds
+const float RGB9E5_MAX = 65408.0f;
+// 2^-16, below which the exponent stays at its minimum
+const float RGB9E5_MIN_EXPONENT_VALUE = 1.0f / 65536.0f;
+
+inline uint32_t floatBits(float f)
+{
+	uint32_t u;
+	memcpy(&u, &f, sizeof(u));
+	return u;
+}
+inline float bitsFloat(uint32_t u)
+{
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+#if PACKED_FLOAT_SSE2
+///////////////////////////////////////////////////////////////////////////
+// packRGB9E5() for four texels, with their channels in separate registers
+///////////////////////////////////////////////////////////////////////////
+inline __m128i packRGB9E5x4(__m128 r, __m128 g, __m128 b)
+{
+	// _mm_max_ps returns its second operand for NaNs, so they become 0
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 max_value = _mm_set1_ps(RGB9E5_MAX);
+	r = _mm_min_ps(_mm_max_ps(r, zero), max_value);
+	g = _mm_min_ps(_mm_max_ps(g, zero), max_value);
+	b = _mm_min_ps(_mm_max_ps(b, zero), max_value);
+	const __m128 max_c = _mm_max_ps(_mm_max_ps(r, g), _mm_max_ps(b, _mm_set1_ps(RGB9E5_MIN_EXPONENT_VALUE)));
+
+	// The shared exponent is floor(log2(max_c)) + 16, straight from the
+	// float's exponent bits, and each channel is scaled by 2^(24 - it)
+	const __m128i biased = _mm_srli_epi32(_mm_castps_si128(max_c), 23);
+	__m128i exponent = _mm_sub_epi32(biased, _mm_set1_epi32(127 - 16));
+	__m128i scale = _mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(262), biased), 23);
+
+	// Rounding the largest mantissa up to 512 takes the next exponent
+	const __m128 rounding = _mm_set1_ps(0.5f);
+	const __m128i max_m = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(max_c, _mm_castsi128_ps(scale)), rounding));
+	const __m128i overflow = _mm_cmpeq_epi32(max_m, _mm_set1_epi32(512));
+	exponent = _mm_sub_epi32(exponent, overflow);
+	scale = _mm_sub_epi32(scale, _mm_and_si128(overflow, _mm_set1_epi32(1 << 23)));
+
+	const __m128 s = _mm_castsi128_ps(scale);
+	const __m128i rm = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(r, s), rounding));
+	const __m128i gm = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(g, s), rounding));
+	const __m128i bm = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(b, s), rounding));
+	return _mm_or_si128(_mm_or_si128(rm, _mm_slli_epi32(gm, 9)),
+	                    _mm_or_si128(_mm_slli_epi32(bm, 18), _mm_slli_epi32(exponent, 27)));
+}
+#endif
+} // namespace
+
+const char* getHdrFormatName(HdrFormat format)
+{
+	switch(format)
+	{
+	case HDR_FLOAT16:
+		return "RGB16F";
+	case HDR_RGB9E5:
+		return "RGB9E5";
+	default:
+		return "RGB32F";
+	}
+}
+
+uint32_t packRGB9E5(const glm::vec3& rgb)
+{
+	// Written as !(x > 0) so that NaNs become 0 too
+	float c[3];
+	for(int i = 0; i < 3; i++)
+	{
+		c[i] = !(rgb[i] > 0.0f) ? 0.0f : std::min(rgb[i], RGB9E5_MAX);
+	}
+	const float max_c = std::max(std::max(c[0], c[1]), std::max(c[2], RGB9E5_MIN_EXPONENT_VALUE));
+	const uint32_t biased = floatBits(max_c) >> 23;
+	uint32_t exponent = biased - (127 - 16);
+	float scale = bitsFloat((262u - biased) << 23);
+	if(uint32_t(max_c * scale + 0.5f) == 512u)
+	{
+		exponent++;
+		scale *= 0.5f;
+	}
+	uint32_t bits = exponent << 27;
+	for(int i = 0; i < 3; i++)
+	{
+		bits |= uint32_t(c[i] * scale + 0.5f) << (9 * i);
+	}
+	return bits;
+}
+
+void floatToHalf(const float* in, size_t count, uint16_t* out)
+{
+	size_t i = 0;
+#if PACKED_FLOAT_SSE2
+	for(; i + 4 <= count; i += 4)
+	{
+		storeHalf4(out + i, _mm_loadu_ps(in + i));
+	}
+#endif
+	for(; i < count; i++)
+	{
+		out[i] = floatToHalf(in[i]);
+	}
+}
+
+void halfToFloat(const uint16_t* in, size_t count, float* out)
+{
+	size_t i = 0;
+#if PACKED_FLOAT_SSE2
+	for(; i + 4 <= count; i += 4)
+	{
+		_mm_storeu_ps(out + i, loadHalf4(in + i));
+	}
+#endif
+	for(; i < count; i++)
+	{
+		out[i] = halfToFloat(in[i]);
+	}
+}
+
+void packRGB9E5(const float* in, int components, size_t count, uint32_t* out)
+{
+	size_t i = 0;
+#if PACKED_FLOAT_SSE2
+	if(components == 4)
+	{
+		for(; i + 4 <= count; i += 4)
+		{
+			__m128 r = _mm_loadu_ps(in + 4 * i);
+			__m128 g = _mm_loadu_ps(in + 4 * i + 4);
+			__m128 b = _mm_loadu_ps(in + 4 * i + 8);
+			__m128 a = _mm_loadu_ps(in + 4 * i + 12);
+			_MM_TRANSPOSE4_PS(r, g, b, a);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packRGB9E5x4(r, g, b));
+		}
+	}
+	else
+	{
+		for(; i + 4 <= count; i += 4)
+		{
+			const float* t = in + 3 * i;
+			const __m128 r = _mm_setr_ps(t[0], t[3], t[6], t[9]);
+			const __m128 g = _mm_setr_ps(t[1], t[4], t[7], t[10]);
+			const __m128 b = _mm_setr_ps(t[2], t[5], t[8], t[11]);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packRGB9E5x4(r, g, b));
+		}
+	}
+#endif
+	for(; i < count; i++)
+	{
+		const float* t = in + components * i;
+		out[i] = packRGB9E5(glm::vec3(t[0], t[1], t[2]));
+	}
+}
+
+void unpackRGB9E5(const uint32_t* in, size_t count, int components, float* out)
+{
+	size_t i = 0;
+#if PACKED_FLOAT_SSE2
+	if(components == 4)
+	{
+		const __m128i mask = _mm_set1_epi32(511);
+		for(; i + 4 <= count; i += 4)
+		{
+			const __m128i bits = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+			const __m128 scale =
+			    _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_srli_epi32(bits, 27), _mm_set1_epi32(127 - 24)), 23));
+			__m128 r = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(bits, mask)), scale);
+			__m128 g = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(bits, 9), mask)), scale);
+			__m128 b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(bits, 18), mask)), scale);
+			__m128 a = _mm_set1_ps(1.0f);
+			_MM_TRANSPOSE4_PS(r, g, b, a);
+			_mm_storeu_ps(out + 4 * i, r);
+			_mm_storeu_ps(out + 4 * i + 4, g);
+			_mm_storeu_ps(out + 4 * i + 8, b);
+			_mm_storeu_ps(out + 4 * i + 12, a);
+		}
+	}
+#endif
+	for(; i < count; i++)
+	{
+		const glm::vec3 rgb = unpackRGB9E5(in[i]);
+		float* t = out + components * i;
+		t[0] = rgb.r;
+		t[1] = rgb.g;
+		t[2] = rgb.b;
+		if(components == 4)
+			t[3] = 1.0f;
+	}
+}
+} // namespace labhelper
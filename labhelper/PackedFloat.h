@@ -0,0 +1,230 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// SSE2 is part of x86-64, so it needs no compiler flags. F16C comes with
+// every AVX2 CPU, and compilers enable it along with AVX2 (/arch:AVX2 or
+// -mavx2), or on its own with -mf16c.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PACKED_FLOAT_SSE2 1
+#include <emmintrin.h>
+#if defined(__F16C__) || defined(__AVX2__)
+#define PACKED_FLOAT_F16C 1
+#include <immintrin.h>
+#endif
+#endif
+
+namespace labhelper
+{
+///////////////////////////////////////////////////////////////////////////
+// Storage formats for HDR images. The smaller ones halve or quarter the
+// memory and bandwidth of float RGB(A) texels, at 11 or 9 significant
+// bits, which is well below what is visible after tone mapping.
+///////////////////////////////////////////////////////////////////////////
+enum HdrFormat
+{
+	// 32-bit floats
+	HDR_FLOAT32 = 0,
+	// IEEE half floats (GL_RGB16F): 16 bits per channel, 11 significant
+	// bits, up to 65504
+	HDR_FLOAT16 = 1,
+	// 9-bit mantissas with a shared 5-bit exponent (GL_RGB9_E5), 32 bits
+	// per RGB texel, up to 65408. Channels that are much darker than the
+	// brightest one keep fewer bits, so saturated colors lose the most.
+	HDR_RGB9E5 = 2,
+};
+const char* getHdrFormatName(HdrFormat format);
+
+// Texel types of the compact formats. They are just the bits; use the
+// functions below to convert.
+struct half
+{
+	uint16_t bits;
+};
+struct rgb9e5
+{
+	uint32_t bits;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Round a float to the nearest half float. Fabian Giesen's branch-light
+// conversion (float_to_half_fast3_rtne), which is several times faster
+// than glm::packHalf1x16.
+///////////////////////////////////////////////////////////////////////////
+inline uint16_t floatToHalf(float f)
+{
+	const uint32_t f32_infinity = 255u << 23;
+	const uint32_t f16_max = (127u + 16u) << 23;
+	const uint32_t denorm_magic_bits = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+	uint32_t u;
+	memcpy(&u, &f, sizeof(u));
+	const uint32_t sign = u & 0x80000000u;
+	u ^= sign;
+	uint16_t h;
+	if(u >= f16_max)
+	{
+		// Inf or NaN
+		h = u > f32_infinity ? 0x7e00 : 0x7c00;
+	}
+	else if(u < (113u << 23))
+	{
+		// Denormal: let the FPU round the mantissa into place
+		float denorm_magic, v;
+		memcpy(&denorm_magic, &denorm_magic_bits, sizeof(float));
+		memcpy(&v, &u, sizeof(float));
+		v += denorm_magic;
+		memcpy(&u, &v, sizeof(float));
+		h = uint16_t(u - denorm_magic_bits);
+	}
+	else
+	{
+		// Rebias the exponent and round to nearest even
+		const uint32_t mantissa_odd = (u >> 13) & 1u;
+		u += (uint32_t(15 - 127) << 23) + 0xfffu;
+		u += mantissa_odd;
+		h = uint16_t(u >> 13);
+	}
+	return uint16_t(h | (sign >> 16));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Exact. Denormals are scaled into place by a multiplication rather than
+// normalized with a loop (Giesen's half_to_float_fast5).
+///////////////////////////////////////////////////////////////////////////
+inline float halfToFloat(uint16_t h)
+{
+	const uint32_t shifted_exp = 0x7c00u << 13;
+	uint32_t u = (h & 0x7fffu) << 13;
+	const uint32_t exp = shifted_exp & u;
+	u += uint32_t(127 - 15) << 23;
+	if(exp == shifted_exp)
+	{
+		// Inf or NaN
+		u += uint32_t(128 - 16) << 23;
+	}
+	else if(exp == 0)
+	{
+		// Zero or denormal
+		const uint32_t magic_bits = 113u << 23;
+		float magic, f;
+		memcpy(&magic, &magic_bits, sizeof(float));
+		u += 1u << 23;
+		memcpy(&f, &u, sizeof(float));
+		f -= magic;
+		memcpy(&u, &f, sizeof(float));
+	}
+	u |= uint32_t(h & 0x8000u) << 16;
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Shared-exponent RGB as in EXT_texture_shared_exponent: the exponent
+// fits the brightest channel, and each mantissa is rounded to nearest.
+// Negative values and NaNs become 0, and values above 65408 are clamped.
+///////////////////////////////////////////////////////////////////////////
+uint32_t packRGB9E5(const glm::vec3& rgb);
+inline glm::vec3 unpackRGB9E5(uint32_t bits)
+{
+	// 2^(exponent - 15 - 9), built from its bits
+	const uint32_t scale_bits = ((bits >> 27) + 127u - 24u) << 23;
+	float scale;
+	memcpy(&scale, &scale_bits, sizeof(scale));
+	return glm::vec3(float(bits & 511u), float((bits >> 9) & 511u), float((bits >> 18) & 511u)) * scale;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Whole arrays, several values per instruction with SSE2, or with F16C
+// where the compiler targets it.
+///////////////////////////////////////////////////////////////////////////
+// `count` values
+void floatToHalf(const float* in, size_t count, uint16_t* out);
+void halfToFloat(const uint16_t* in, size_t count, float* out);
+// `count` texels of `components` (3 or 4) floats. Alpha is dropped when
+// packing and set to 1 when unpacking.
+void packRGB9E5(const float* in, int components, size_t count, uint32_t* out);
+void unpackRGB9E5(const uint32_t* in, size_t count, int components, float* out);
+
+#if PACKED_FLOAT_SSE2
+///////////////////////////////////////////////////////////////////////////
+// Four values at a time, for the loops above and for texture filtering
+///////////////////////////////////////////////////////////////////////////
+#if !PACKED_FLOAT_F16C
+// floatToHalf() without branches: all three cases are computed, and the
+// right one picked with masks. The halves are in the low 16 bits of each
+// lane, sign extended, so that a signed saturating pack keeps them exact.
+inline __m128i floatToHalf4(__m128 f)
+{
+	const __m128i sign_mask = _mm_set1_epi32(int(0x80000000u));
+	const __m128i f16_max = _mm_set1_epi32((127 + 16) << 23);
+	const __m128i min_normal = _mm_set1_epi32((127 - 14) << 23);
+	const __m128i denorm_magic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+	const __m128i normal_bias = _mm_set1_epi32(0xfff - ((127 - 15) << 23));
+
+	const __m128 sign = _mm_and_ps(f, _mm_castsi128_ps(sign_mask));
+	const __m128 abs_f = _mm_xor_ps(f, sign);
+	const __m128i u = _mm_castps_si128(abs_f);
+	const __m128i is_nan = _mm_castps_si128(_mm_cmpunord_ps(abs_f, abs_f));
+	const __m128i is_finite = _mm_cmpgt_epi32(f16_max, u);
+	const __m128i is_denormal = _mm_cmpgt_epi32(min_normal, u);
+	const __m128i inf_or_nan = _mm_or_si128(_mm_and_si128(is_nan, _mm_set1_epi32(0x200)), _mm_set1_epi32(0x7c00));
+
+	const __m128i denormal =
+	    _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(abs_f, _mm_castsi128_ps(denorm_magic))), denorm_magic);
+	const __m128i mantissa_odd = _mm_srai_epi32(_mm_slli_epi32(u, 31 - 13), 31);
+	const __m128i normal = _mm_srli_epi32(_mm_sub_epi32(_mm_add_epi32(u, normal_bias), mantissa_odd), 13);
+
+	__m128i h = _mm_or_si128(_mm_and_si128(is_denormal, denormal), _mm_andnot_si128(is_denormal, normal));
+	h = _mm_or_si128(_mm_and_si128(is_finite, h), _mm_andnot_si128(is_finite, inf_or_nan));
+	return _mm_or_si128(h, _mm_srai_epi32(_mm_castps_si128(sign), 16));
+}
+
+// halfToFloat() without branches, for halves in the low 16 bits of each
+// lane. Multiplying by 2^112 rebiases the exponent and scales denormals
+// into place at once.
+inline __m128 halfToFloat4(__m128i h)
+{
+	const __m128i abs_h = _mm_and_si128(h, _mm_set1_epi32(0x7fff));
+	const __m128i sign = _mm_slli_epi32(_mm_xor_si128(_mm_and_si128(h, _mm_set1_epi32(0xffff)), abs_h), 16);
+	const __m128 scaled =
+	    _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(abs_h, 13)), _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23)));
+	const __m128i was_inf_or_nan = _mm_cmpgt_epi32(abs_h, _mm_set1_epi32(0x7bff));
+	const __m128i inf_exponent = _mm_and_si128(was_inf_or_nan, _mm_set1_epi32(255 << 23));
+	return _mm_or_ps(scaled, _mm_castsi128_ps(_mm_or_si128(sign, inf_exponent)));
+}
+#endif
+
+// Four consecutive halves
+inline __m128 loadHalf4(const uint16_t* p)
+{
+	const __m128i h = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+#if PACKED_FLOAT_F16C
+	return _mm_cvtph_ps(h);
+#else
+	return halfToFloat4(_mm_unpacklo_epi16(h, _mm_setzero_si128()));
+#endif
+}
+inline void storeHalf4(uint16_t* p, __m128 f)
+{
+#if PACKED_FLOAT_F16C
+	const __m128i h = _mm_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+	__m128i h = floatToHalf4(f);
+	h = _mm_packs_epi32(h, h);
+#endif
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(p), h);
+}
+
+// One RGB9E5 texel as (r, g, b, 1)
+inline __m128 loadRGB9E5(uint32_t bits)
+{
+	const uint32_t scale_bits = ((bits >> 27) + 127u - 24u) << 23;
+	const __m128i m = _mm_set_epi32(0, int((bits >> 18) & 511u), int((bits >> 9) & 511u), int(bits & 511u));
+	const __m128 scaled = _mm_mul_ps(_mm_cvtepi32_ps(m), _mm_castsi128_ps(_mm_set1_epi32(int(scale_bits))));
+	return _mm_or_ps(scaled, _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f));
+}
+#endif
+} // namespace labhelper
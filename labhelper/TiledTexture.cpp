@@ -0,0 +1,655 @@
+#include "TiledTexture.h"
+#include "PackedFloat.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// SSE2 is part of x86-64, so it needs no compiler flags (see
+// PackedFloat.h). Elsewhere the filter falls back to glm.
+#if PACKED_FLOAT_SSE2
+#define TILED_TEXTURE_SSE2 1
+#endif
+
+namespace labhelper
+{
+namespace
+{
+const int TILE_TEXELS = TiledTexture<float>::TILE_SIZE * TiledTexture<float>::TILE_SIZE;
+
+// Bits of a 3-bit coordinate spread to the even bits (Morton order)
+const uint8_t morton_spread[8] = { 0, 1, 4, 5, 16, 17, 20, 21 };
+
+// Values stored per texel: RGBA, or a single RGB9E5 word
+template <typename T>
+int texelValues()
+{
+	return 4;
+}
+template <>
+int texelValues<rgb9e5>()
+{
+	return 1;
+}
+
+// 8-bit texels are stored as is, and scaled after filtering
+template <typename T>
+float texelScale()
+{
+	return 1.0f;
+}
+template <>
+float texelScale<uint8_t>()
+{
+	return 1.0f / 255.0f;
+}
+
+// The alpha of texels built from three components
+template <typename T>
+T texelOne()
+{
+	return T(1);
+}
+template <>
+uint8_t texelOne<uint8_t>()
+{
+	return 255;
+}
+template <>
+half texelOne<half>()
+{
+	return half{ 0x3c00 };
+}
+template <>
+rgb9e5 texelOne<rgb9e5>()
+{
+	return rgb9e5{ 0 };
+}
+
+uint8_t averageTexels(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+	return uint8_t((int(a) + int(b) + int(c) + int(d) + 2) / 4);
+}
+float averageTexels(float a, float b, float c, float d)
+{
+	return 0.25f * (a + b + c + d);
+}
+half averageTexels(half a, half b, half c, half d)
+{
+	const float sum = halfToFloat(a.bits) + halfToFloat(b.bits) + halfToFloat(c.bits) + halfToFloat(d.bits);
+	return half{ floatToHalf(0.25f * sum) };
+}
+rgb9e5 averageTexels(rgb9e5 a, rgb9e5 b, rgb9e5 c, rgb9e5 d)
+{
+	const glm::vec3 sum = unpackRGB9E5(a.bits) + unpackRGB9E5(b.bits) + unpackRGB9E5(c.bits) + unpackRGB9E5(d.bits);
+	return rgb9e5{ packRGB9E5(0.25f * sum) };
+}
+
+// One texel as floats, before texelScale()
+template <typename T>
+glm::vec4 decodeTexel(const T* t)
+{
+	return glm::vec4(float(t[0]), float(t[1]), float(t[2]), float(t[3]));
+}
+template <>
+glm::vec4 decodeTexel<half>(const half* t)
+{
+	return glm::vec4(halfToFloat(t[0].bits), halfToFloat(t[1].bits), halfToFloat(t[2].bits), halfToFloat(t[3].bits));
+}
+template <>
+glm::vec4 decodeTexel<rgb9e5>(const rgb9e5* t)
+{
+	return glm::vec4(unpackRGB9E5(t->bits), 1.0f);
+}
+
+// Texture coordinate in [0, 1]. NaNs (e.g. from degenerate uvs) map to 0.
+inline float wrapCoordinate(float u, TextureWrap wrap)
+{
+	u = wrap == WRAP_REPEAT ? u - std::floor(u) : std::min(std::max(u, 0.0f), 1.0f);
+	return (u >= 0.0f && u <= 1.0f) ? u : 0.0f;
+}
+
+// The two texels around `x` (in texels, from texel centers) along an axis
+// of `size` texels, and the weight of the second
+inline void wrapTexels(float x, int size, TextureWrap wrap, int& x0, int& x1, float& f)
+{
+	const float fx0 = std::floor(x);
+	f = x - fx0;
+	x0 = int(fx0);
+	x1 = x0 + 1;
+	if(wrap == WRAP_REPEAT)
+	{
+		if(x0 < 0)
+			x0 += size;
+		if(x1 >= size)
+			x1 -= size;
+	}
+	else
+	{
+		x0 = std::max(x0, 0);
+		x1 = std::min(x1, size - 1);
+	}
+}
+
+#if TILED_TEXTURE_SSE2
+// floor() for |x| < 2^31
+inline __m128 floor4(__m128 x)
+{
+	const __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+	return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, x), _mm_set1_ps(1.0f)));
+}
+
+// wrapCoordinate() and wrapTexels() for four points, along an axis of
+// `size` texels in each lane
+inline void wrapTexels4(__m128 u, __m128i size, TextureWrap wrap, __m128i& x0, __m128i& x1, __m128& f)
+{
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	if(wrap == WRAP_REPEAT)
+		u = _mm_sub_ps(u, floor4(u));
+	else
+		u = _mm_min_ps(_mm_max_ps(u, zero), one);
+	u = _mm_and_ps(u, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+	const __m128 x = _mm_sub_ps(_mm_mul_ps(u, _mm_cvtepi32_ps(size)), _mm_set1_ps(0.5f));
+	const __m128 fx0 = floor4(x);
+	f = _mm_sub_ps(x, fx0);
+	x0 = _mm_cvttps_epi32(fx0);
+	x1 = _mm_add_epi32(x0, _mm_set1_epi32(1));
+	// x0 is at least -1 and x1 at most size, so one step wraps them
+	const __m128i below = _mm_cmplt_epi32(x0, _mm_setzero_si128());
+	const __m128i above = _mm_cmpeq_epi32(x1, size);
+	if(wrap == WRAP_REPEAT)
+	{
+		x0 = _mm_add_epi32(x0, _mm_and_si128(below, size));
+		x1 = _mm_sub_epi32(x1, _mm_and_si128(above, size));
+	}
+	else
+	{
+		x0 = _mm_andnot_si128(below, x0);
+		x1 = _mm_add_epi32(x1, above);
+	}
+}
+
+// The low 32 bits of the products of four pairs of unsigned integers
+inline __m128i mullo4(__m128i a, __m128i b)
+{
+	const __m128i even = _mm_mul_epu32(a, b);
+	const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+	                          _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// morton_spread[] of four 3-bit coordinates
+inline __m128i mortonSpread4(__m128i x)
+{
+	const __m128i bit0 = _mm_and_si128(x, _mm_set1_epi32(1));
+	const __m128i bit1 = _mm_slli_epi32(_mm_and_si128(x, _mm_set1_epi32(2)), 1);
+	const __m128i bit2 = _mm_slli_epi32(_mm_and_si128(x, _mm_set1_epi32(4)), 2);
+	return _mm_or_si128(bit0, _mm_or_si128(bit1, bit2));
+}
+
+inline __m128 loadTexel(const float* p)
+{
+	return _mm_loadu_ps(p);
+}
+
+inline __m128 loadTexel(const uint8_t* p)
+{
+	int bits;
+	memcpy(&bits, p, sizeof(bits));
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v = _mm_cvtsi32_si128(bits);
+	v = _mm_unpacklo_epi8(v, zero);
+	v = _mm_unpacklo_epi16(v, zero);
+	return _mm_cvtepi32_ps(v);
+}
+
+inline __m128 loadTexel(const half* p)
+{
+	return loadHalf4(&p->bits);
+}
+
+inline __m128 loadTexel(const rgb9e5* p)
+{
+	return loadRGB9E5(p->bits);
+}
+#endif
+} // namespace
+
+template <typename T>
+TiledTexture<T>::~TiledTexture()
+{
+	clear();
+}
+
+template <typename T>
+void TiledTexture<T>::clear()
+{
+	for(int p = 0; p < getNumPages(); p++)
+	{
+		evictPage(p);
+	}
+	levels.clear();
+	pages.reset();
+	page_sizes.clear();
+	page_use.reset();
+}
+
+template <typename T>
+int TiledTexture<T>::pageIndex(const Level& level, int x, int y) const
+{
+	return level.first_page + (y / PAGE_SIZE) * level.pages_x + x / PAGE_SIZE;
+}
+
+template <typename T>
+size_t TiledTexture<T>::offsetInPage(const Level& level, int x, int y) const
+{
+	const int tile = ((y % PAGE_SIZE) / TILE_SIZE) * level.page_tiles_x + (x % PAGE_SIZE) / TILE_SIZE;
+	const int within = morton_spread[x % TILE_SIZE] | (morton_spread[y % TILE_SIZE] << 1);
+	return (size_t(tile) * TILE_TEXELS + within) * texelValues<T>();
+}
+
+template <typename T>
+T* TiledTexture<T>::texelAddress(const Level& level, int x, int y) const
+{
+	return pages[pageIndex(level, x, y)].load(std::memory_order_relaxed) + offsetInPage(level, x, y);
+}
+
+template <typename T>
+const T* TiledTexture<T>::usePage(int page) const
+{
+	const T* texels = pages[page].load(std::memory_order_acquire);
+	if(texels != nullptr && page_use[page].load(std::memory_order_relaxed) != use_stamp)
+	{
+		page_use[page].store(use_stamp, std::memory_order_relaxed);
+	}
+	return texels;
+}
+
+template <typename T>
+void TiledTexture<T>::evictPage(int page)
+{
+	T* texels = pages[page].exchange(nullptr);
+	if(texels != nullptr)
+	{
+		delete[] texels;
+		resident_bytes -= getPageBytes(page);
+	}
+}
+
+template <typename T>
+void TiledTexture<T>::restorePages(TiledTexture& source)
+{
+	if(source.getNumPages() != getNumPages())
+	{
+		return;
+	}
+	for(int p = 0; p < getNumPages(); p++)
+	{
+		if(pages[p].load(std::memory_order_relaxed) != nullptr)
+		{
+			continue;
+		}
+		T* texels = source.pages[p].exchange(nullptr);
+		if(texels != nullptr)
+		{
+			source.resident_bytes -= getPageBytes(p);
+			page_use[p].store(use_stamp, std::memory_order_relaxed);
+			pages[p].store(texels, std::memory_order_release);
+			resident_bytes += getPageBytes(p);
+		}
+	}
+}
+
+template <typename T>
+void TiledTexture<T>::build(const T* source, int width, int height, int components, bool mipmaps,
+                            TextureWrap wrap_u_, TextureWrap wrap_v_)
+{
+	clear();
+	wrap_u = wrap_u_;
+	wrap_v = wrap_v_;
+	if(source == nullptr || width <= 0 || height <= 0)
+	{
+		return;
+	}
+
+	// Lay out the levels and their pages. Pages at the right and top edges
+	// are padded to whole pages, small levels only to whole tiles.
+	const int page_tiles = PAGE_SIZE / TILE_SIZE;
+	for(int w = width, h = height;; w = std::max(1, w / 2), h = std::max(1, h / 2))
+	{
+		Level level;
+		level.width = w;
+		level.height = h;
+		level.tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+		const int tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+		level.page_tiles_x = std::min(level.tiles_x, page_tiles);
+		level.page_tiles_y = std::min(tiles_y, page_tiles);
+		level.pages_x = (w + PAGE_SIZE - 1) / PAGE_SIZE;
+		level.first_page = int(page_sizes.size());
+		const int pages_y = (h + PAGE_SIZE - 1) / PAGE_SIZE;
+		const size_t page_size = size_t(level.page_tiles_x) * level.page_tiles_y * TILE_TEXELS * texelValues<T>();
+		page_sizes.insert(page_sizes.end(), size_t(level.pages_x) * pages_y, page_size);
+		levels.push_back(level);
+		if(!mipmaps || (w == 1 && h == 1))
+			break;
+	}
+	pages.reset(new std::atomic<T*>[page_sizes.size()]);
+	page_use.reset(new std::atomic<uint32_t>[page_sizes.size()]);
+	for(int p = 0; p < getNumPages(); p++)
+	{
+		pages[p].store(new T[page_sizes[p]](), std::memory_order_relaxed);
+		page_use[p].store(use_stamp, std::memory_order_relaxed);
+		resident_bytes += getPageBytes(p);
+	}
+
+	const T one = texelOne<T>();
+	const int values = texelValues<T>();
+	const Level& base = levels[0];
+	for(int y = 0; y < height; y++)
+	{
+		for(int x = 0; x < width; x++)
+		{
+			const T* s = source + (size_t(y) * width + x) * components;
+			T* d = texelAddress(base, x, y);
+			for(int c = 0; c < values; c++)
+			{
+				if(components == 1)
+					d[c] = s[0];
+				else if(c < components)
+					d[c] = s[c];
+				else
+					d[c] = one;
+			}
+		}
+	}
+	for(int l = 1; l < int(levels.size()); l++)
+	{
+		buildMipLevel(l);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Each texel is the mean of the 2x2 texels above it (fewer at the last
+// row or column of odd-sized levels)
+///////////////////////////////////////////////////////////////////////////
+template <typename T>
+void TiledTexture<T>::buildMipLevel(int l)
+{
+	const Level& src = levels[l - 1];
+	const Level& dst = levels[l];
+	for(int y = 0; y < dst.height; y++)
+	{
+		const int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+		for(int x = 0; x < dst.width; x++)
+		{
+			const int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+			const T* a = texelAddress(src, x0, y0);
+			const T* b = texelAddress(src, x1, y0);
+			const T* c = texelAddress(src, x0, y1);
+			const T* d = texelAddress(src, x1, y1);
+			T* out = texelAddress(dst, x, y);
+			for(int i = 0; i < texelValues<T>(); i++)
+			{
+				out[i] = averageTexels(a[i], b[i], c[i], d[i]);
+			}
+		}
+	}
+}
+
+template <typename T>
+glm::vec4 TiledTexture<T>::fetch(int x, int y, int level) const
+{
+	const Level& l = levels[level];
+	const T* page = usePage(pageIndex(l, x, y));
+	if(page == nullptr)
+	{
+		return glm::vec4(0.0f);
+	}
+	return decodeTexel(page + offsetInPage(l, x, y)) * texelScale<T>();
+}
+
+template <typename T>
+float TiledTexture<T>::lodForFootprint(float uv_width) const
+{
+	if(levels.empty() || !(uv_width > 0.0f))
+	{
+		return 0.0f;
+	}
+	const float texels_across = uv_width * float(std::max(levels[0].width, levels[0].height));
+	return std::max(0.0f, std::log2(texels_across));
+}
+
+template <typename T>
+bool TiledTexture<T>::footprint(const glm::vec2& uv, int l, Bilinear& b) const
+{
+	const Level& level = levels[l];
+	int x[2], y[2];
+	wrapTexels(wrapCoordinate(uv.x, wrap_u) * level.width - 0.5f, level.width, wrap_u, x[0], x[1], b.fx);
+	wrapTexels(wrapCoordinate(uv.y, wrap_v) * level.height - 0.5f, level.height, wrap_v, y[0], y[1], b.fy);
+	return texelAddresses(level, x, y, b);
+}
+
+template <typename T>
+bool TiledTexture<T>::texelAddresses(const Level& level, const int x[2], const int y[2], Bilinear& b) const
+{
+	for(int i = 0; i < 4; i++)
+	{
+		const int tx = x[i & 1], ty = y[i >> 1];
+		const T* page = usePage(pageIndex(level, tx, ty));
+		if(page == nullptr)
+		{
+			return false;
+		}
+		b.texel[i] = page + offsetInPage(level, tx, ty);
+	}
+	return true;
+}
+
+#if TILED_TEXTURE_SSE2
+///////////////////////////////////////////////////////////////////////////
+// footprint() for four points, in mip levels `level`. The coordinates,
+// weights and texel offsets of all four are computed at once, one point
+// per lane, and only the page lookups are done one by one.
+///////////////////////////////////////////////////////////////////////////
+template <typename T>
+void TiledTexture<T>::footprint4(const glm::vec2* uv, const int* level, Bilinear* b, bool* resident) const
+{
+	const Level* l[4] = { &levels[level[0]], &levels[level[1]], &levels[level[2]], &levels[level[3]] };
+	const __m128i width = _mm_setr_epi32(l[0]->width, l[1]->width, l[2]->width, l[3]->width);
+	const __m128i height = _mm_setr_epi32(l[0]->height, l[1]->height, l[2]->height, l[3]->height);
+	const __m128 u = _mm_setr_ps(uv[0].x, uv[1].x, uv[2].x, uv[3].x);
+	const __m128 v = _mm_setr_ps(uv[0].y, uv[1].y, uv[2].y, uv[3].y);
+	__m128i x[2], y[2];
+	__m128 fx, fy;
+	wrapTexels4(u, width, wrap_u, x[0], x[1], fx);
+	wrapTexels4(v, height, wrap_v, y[0], y[1], fy);
+
+	// pageIndex() and offsetInPage() of the four corners
+	static_assert(PAGE_SIZE == 64 && TILE_SIZE == 8, "The shifts below assume 64x64 pages of 8x8 tiles");
+	const __m128i first_page = _mm_setr_epi32(l[0]->first_page, l[1]->first_page, l[2]->first_page, l[3]->first_page);
+	const __m128i pages_x = _mm_setr_epi32(l[0]->pages_x, l[1]->pages_x, l[2]->pages_x, l[3]->pages_x);
+	const __m128i page_tiles_x =
+	    _mm_setr_epi32(l[0]->page_tiles_x, l[1]->page_tiles_x, l[2]->page_tiles_x, l[3]->page_tiles_x);
+	__m128i page_x[2], row_page[2], tile_x[2], tile_y[2], within_x[2], within_y[2];
+	for(int i = 0; i < 2; i++)
+	{
+		page_x[i] = _mm_srli_epi32(x[i], 6);
+		row_page[i] = _mm_add_epi32(first_page, mullo4(_mm_srli_epi32(y[i], 6), pages_x));
+		tile_x[i] = _mm_srli_epi32(_mm_and_si128(x[i], _mm_set1_epi32(PAGE_SIZE - 1)), 3);
+		tile_y[i] = mullo4(_mm_srli_epi32(_mm_and_si128(y[i], _mm_set1_epi32(PAGE_SIZE - 1)), 3), page_tiles_x);
+		within_x[i] = mortonSpread4(_mm_and_si128(x[i], _mm_set1_epi32(TILE_SIZE - 1)));
+		within_y[i] = _mm_slli_epi32(mortonSpread4(_mm_and_si128(y[i], _mm_set1_epi32(TILE_SIZE - 1))), 1);
+	}
+	int page[4][4], offset[4][4];
+	for(int c = 0; c < 4; c++)
+	{
+		const int cx = c & 1, cy = c >> 1;
+		const __m128i tile = _mm_add_epi32(tile_y[cy], tile_x[cx]);
+		const __m128i texel = _mm_or_si128(_mm_slli_epi32(tile, 6), _mm_or_si128(within_x[cx], within_y[cy]));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(page[c]), _mm_add_epi32(row_page[cy], page_x[cx]));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(offset[c]), texel);
+	}
+
+	float fxs[4], fys[4];
+	_mm_storeu_ps(fxs, fx);
+	_mm_storeu_ps(fys, fy);
+	for(int i = 0; i < 4; i++)
+	{
+		b[i].fx = fxs[i];
+		b[i].fy = fys[i];
+		resident[i] = true;
+		for(int c = 0; c < 4; c++)
+		{
+			const T* texels = usePage(page[c][i]);
+			if(texels == nullptr)
+			{
+				resident[i] = false;
+				break;
+			}
+			b[i].texel[c] = texels + size_t(offset[c][i]) * texelValues<T>();
+		}
+	}
+}
+#endif
+
+template <typename T>
+glm::vec4 TiledTexture<T>::filter(const Bilinear& b) const
+{
+	glm::vec4 result;
+#if TILED_TEXTURE_SSE2
+	// One texel per register, all four channels at once
+	const __m128 a = loadTexel(b.texel[0]);
+	const __m128 c = loadTexel(b.texel[2]);
+	const __m128 fx = _mm_set1_ps(b.fx);
+	const __m128 bottom = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(loadTexel(b.texel[1]), a), fx));
+	const __m128 top = _mm_add_ps(c, _mm_mul_ps(_mm_sub_ps(loadTexel(b.texel[3]), c), fx));
+	__m128 r = _mm_add_ps(bottom, _mm_mul_ps(_mm_sub_ps(top, bottom), _mm_set1_ps(b.fy)));
+	r = _mm_mul_ps(r, _mm_set1_ps(texelScale<T>()));
+	_mm_storeu_ps(&result.x, r);
+#else
+	glm::vec4 texel[4];
+	for(int i = 0; i < 4; i++)
+	{
+		texel[i] = decodeTexel(b.texel[i]);
+	}
+	const glm::vec4 bottom = glm::mix(texel[0], texel[1], b.fx);
+	const glm::vec4 top = glm::mix(texel[2], texel[3], b.fx);
+	result = glm::mix(bottom, top, b.fy) * texelScale<T>();
+#endif
+	return result;
+}
+
+template <typename T>
+bool TiledTexture<T>::sample(const glm::vec2& uv, float lod, glm::vec4& result) const
+{
+	if(levels.empty())
+	{
+		return false;
+	}
+	const float l = std::min(std::max(lod, 0.0f), float(levels.size() - 1));
+	const int level = int(l);
+	const float t = l - float(level);
+	Bilinear b;
+	if(!footprint(uv, level, b))
+	{
+		return false;
+	}
+	result = filter(b);
+	if(t > 0.0f)
+	{
+		if(!footprint(uv, level + 1, b))
+		{
+			return false;
+		}
+		result = glm::mix(result, filter(b), t);
+	}
+	return true;
+}
+
+template <typename T>
+glm::vec4 TiledTexture<T>::sample(const glm::vec2& uv, float lod) const
+{
+	glm::vec4 result;
+	return sample(uv, lod, result) ? result : glm::vec4(0.0f);
+}
+
+template <typename T>
+bool TiledTexture<T>::sample(const glm::vec2* uv, const float* lod, int count, glm::vec4* out) const
+{
+	if(levels.empty())
+	{
+		std::fill(out, out + count, glm::vec4(0.0f));
+		return false;
+	}
+	const int BATCH = 8;
+	const float max_level = float(levels.size() - 1);
+	int level[BATCH], coarse_level[BATCH];
+	float t[BATCH];
+	Bilinear fine[BATCH], coarse[BATCH];
+	bool resident[BATCH], coarse_resident[BATCH];
+	bool all_resident = true;
+	for(int start = 0; start < count; start += BATCH)
+	{
+		const int n = std::min(BATCH, count - start);
+		bool trilinear = false;
+		for(int i = 0; i < n; i++)
+		{
+			const float l = lod != nullptr ? std::min(std::max(lod[start + i], 0.0f), max_level) : 0.0f;
+			level[i] = int(l);
+			t[i] = l - float(level[i]);
+			coarse_level[i] = std::min(level[i] + 1, int(max_level));
+			trilinear = trilinear || t[i] > 0.0f;
+		}
+		int i = 0;
+#if TILED_TEXTURE_SSE2
+		for(; i + 4 <= n; i += 4)
+		{
+			footprint4(uv + start + i, level + i, fine + i, resident + i);
+			if(trilinear)
+				footprint4(uv + start + i, coarse_level + i, coarse + i, coarse_resident + i);
+		}
+#endif
+		for(; i < n; i++)
+		{
+			resident[i] = footprint(uv[start + i], level[i], fine[i]);
+			if(trilinear)
+				coarse_resident[i] = footprint(uv[start + i], coarse_level[i], coarse[i]);
+		}
+		for(i = 0; i < n; i++)
+		{
+			if(t[i] > 0.0f)
+				resident[i] = resident[i] && coarse_resident[i];
+#if TILED_TEXTURE_SSE2
+			// Start fetching the texels of the whole batch before filtering
+			// any, so that the cache misses overlap rather than wait behind
+			// the filtering (and, for the packed formats, the decoding)
+			if(resident[i])
+			{
+				for(int j = 0; j < 4; j++)
+				{
+					_mm_prefetch(reinterpret_cast<const char*>(fine[i].texel[j]), _MM_HINT_T0);
+				}
+			}
+#endif
+		}
+		for(i = 0; i < n; i++)
+		{
+			if(!resident[i])
+			{
+				out[start + i] = glm::vec4(0.0f);
+				all_resident = false;
+				continue;
+			}
+			out[start + i] = filter(fine[i]);
+			if(t[i] > 0.0f)
+				out[start + i] = glm::mix(out[start + i], filter(coarse[i]), t[i]);
+		}
+	}
+	return all_resident;
+}
+
+template class TiledTexture<uint8_t>;
+template class TiledTexture<float>;
+template class TiledTexture<half>;
+template class TiledTexture<rgb9e5>;
+} // namespace labhelper
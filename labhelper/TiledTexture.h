@@ -0,0 +1,164 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "PackedFloat.h"
+
+namespace labhelper
+{
+enum TextureWrap
+{
+	WRAP_REPEAT = 0,
+	WRAP_CLAMP = 1,
+};
+
+///////////////////////////////////////////////////////////////////////////
+// A texture for filtered lookups on the CPU. Texels are stored as RGBA,
+// either 8-bit unorm (T = uint8_t), float or half float, or as packed
+// RGB9E5 (T = rgb9e5, see PackedFloat.h), in 8x8 tiles with the texels
+// of a tile in Morton order. The four texels of a bilinear lookup then
+// usually share one or two cache lines, whatever the lookup direction.
+// Optionally with a box-filtered mip chain.
+//
+// The tiles are grouped into pages of 64x64 texels, which are allocated
+// separately, so that a cache can evict the pages it has not used lately
+// (see evictPage()) and restore them when they are needed again.
+//
+// Row 0 is v = 0, and texel (x, y) covers [x, x + 1] / width in u.
+///////////////////////////////////////////////////////////////////////////
+template <typename T>
+class TiledTexture
+{
+public:
+	static const int TILE_SIZE = 8;
+	static const int PAGE_SIZE = 64;
+
+	TiledTexture() = default;
+	~TiledTexture();
+	TiledTexture(const TiledTexture&) = delete;
+	TiledTexture& operator=(const TiledTexture&) = delete;
+
+	// `texels` holds `components` (1, 3 or 4) values per texel, row by
+	// row. A single component is replicated to all channels, and three
+	// components get an alpha of 1. RGB9E5 texels are one component, and
+	// have an alpha of 1.
+	void build(const T* texels, int width, int height, int components, bool mipmaps,
+	           TextureWrap wrap_u = WRAP_REPEAT, TextureWrap wrap_v = WRAP_REPEAT);
+	void clear();
+
+	bool empty() const
+	{
+		return levels.empty();
+	}
+	int getNumLevels() const
+	{
+		return int(levels.size());
+	}
+	int getWidth(int level = 0) const
+	{
+		return levels[level].width;
+	}
+	int getHeight(int level = 0) const
+	{
+		return levels[level].height;
+	}
+	// Of the resident pages
+	size_t getMemoryUsage() const
+	{
+		return resident_bytes.load(std::memory_order_relaxed);
+	}
+
+	// One texel, as floats (8-bit texels are divided by 255)
+	glm::vec4 fetch(int x, int y, int level = 0) const;
+	// Bilinear filtering within mip level `lod`, or between the two mip
+	// levels around it (trilinear filtering). False, without a result, if
+	// a page it needs has been evicted.
+	bool sample(const glm::vec2& uv, float lod, glm::vec4& result) const;
+	// The same, with black for evicted pages
+	glm::vec4 sample(const glm::vec2& uv, float lod = 0.0f) const;
+	// The same for `count` points. They are processed in batches: first
+	// the texel addresses and weights of a whole batch, four points at a
+	// time with SSE2, then the filtering. `lod` may be nullptr for mip
+	// level 0. False if a page it needs has been evicted, with black for
+	// the points that need it.
+	bool sample(const glm::vec2* uv, const float* lod, int count, glm::vec4* out) const;
+
+	// The level of detail at which a footprint `uv_width` wide (in uv)
+	// covers one texel, for lookups at the size of a ray's footprint
+	float lodForFootprint(float uv_width) const;
+
+	///////////////////////////////////////////////////////////////////////
+	// Paging. Lookups stamp the pages they read with the current use
+	// stamp. Pages may only be evicted while no lookups run, but they may
+	// be restored at any time.
+	///////////////////////////////////////////////////////////////////////
+	int getNumPages() const
+	{
+		return int(page_sizes.size());
+	}
+	bool isPageResident(int page) const
+	{
+		return pages[page].load(std::memory_order_acquire) != nullptr;
+	}
+	size_t getPageBytes(int page) const
+	{
+		return page_sizes[page] * sizeof(T);
+	}
+	uint32_t getPageUse(int page) const
+	{
+		return page_use[page].load(std::memory_order_relaxed);
+	}
+	void setUseStamp(uint32_t stamp)
+	{
+		use_stamp = stamp;
+	}
+	void evictPage(int page);
+	// Move the pages that are evicted here over from `source`, a texture
+	// built from the same image with the same settings
+	void restorePages(TiledTexture& source);
+
+private:
+	struct Level
+	{
+		int width, height;
+		int tiles_x;
+		int pages_x;
+		int first_page;
+		// Of a page, in tiles (less than a page for small levels)
+		int page_tiles_x, page_tiles_y;
+	};
+	// The four texels of a bilinear lookup and the weights between them
+	struct Bilinear
+	{
+		const T* texel[4];
+		float fx, fy;
+	};
+
+	std::vector<Level> levels;
+	// Texels of each page, or nullptr for evicted pages
+	std::unique_ptr<std::atomic<T*>[]> pages;
+	std::vector<size_t> page_sizes;
+	mutable std::unique_ptr<std::atomic<uint32_t>[]> page_use;
+	uint32_t use_stamp = 0;
+	std::atomic<size_t> resident_bytes = { 0 };
+	TextureWrap wrap_u = WRAP_REPEAT, wrap_v = WRAP_REPEAT;
+
+	int pageIndex(const Level& level, int x, int y) const;
+	size_t offsetInPage(const Level& level, int x, int y) const;
+	T* texelAddress(const Level& level, int x, int y) const;
+	const T* usePage(int page) const;
+	bool footprint(const glm::vec2& uv, int level, Bilinear& b) const;
+	bool texelAddresses(const Level& level, const int x[2], const int y[2], Bilinear& b) const;
+	void footprint4(const glm::vec2* uv, const int* level, Bilinear* b, bool* resident) const;
+	glm::vec4 filter(const Bilinear& b) const;
+	void buildMipLevel(int level);
+};
+
+extern template class TiledTexture<uint8_t>;
+extern template class TiledTexture<float>;
+extern template class TiledTexture<half>;
+extern template class TiledTexture<rgb9e5>;
+} // namespace labhelper
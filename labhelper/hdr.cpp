@@ -27,7 +27,38 @@ struct HDRImage
 	};
 };
 
-GLuint loadHdrTexture(const std::string& filename)
+///////////////////////////////////////////////////////////////////////////
+// Upload `image` to mip level `level` of the bound texture, as `format`
+///////////////////////////////////////////////////////////////////////////
+void uploadHdrLevel(const HDRImage& image, int level, HdrFormat format)
+{
+	const size_t num_texels = size_t(image.width) * image.height;
+	if(format == HDR_FLOAT16)
+	{
+		// Rows of half float RGB are only 2-byte aligned
+		GLint alignment;
+		glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+		std::vector<uint16_t> texels(num_texels * 3);
+		floatToHalf(image.data, texels.size(), texels.data());
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGB16F, image.width, image.height, 0, GL_RGB, GL_HALF_FLOAT,
+		             texels.data());
+		glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+	}
+	else if(format == HDR_RGB9E5)
+	{
+		std::vector<uint32_t> texels(num_texels);
+		packRGB9E5(image.data, 3, num_texels, texels.data());
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGB9_E5, image.width, image.height, 0, GL_RGB,
+		             GL_UNSIGNED_INT_5_9_9_9_REV, texels.data());
+	}
+	else
+	{
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
+	}
+}
+
+GLuint loadHdrTexture(const std::string& filename, HdrFormat format)
 {
 	GLuint texId;
 	glGenTextures(1, &texId);
@@ -39,12 +70,12 @@ GLuint loadHdrTexture(const std::string& filename)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 
 	HDRImage image(filename);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
+	uploadHdrLevel(image, 0, format);
 
 	return texId;
 }
 
-GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames)
+GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames, HdrFormat format)
 {
 	GLuint texId;
 	glGenTextures(1, &texId);
@@ -54,19 +85,16 @@ GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 
-	HDRImage image(filenames[0]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
-	glGenerateMipmap(GL_TEXTURE_2D);
-
-	// We call this again because AMD drivers have some weird issue in the GenerateMipmap function that
-	// breaks the first level of the image.
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
-
+	// Every level that is sampled comes from a file, so the texture is
+	// complete without generating the smaller levels (which would only be
+	// computed to be thrown away, at the cost of a float copy of each)
 	const int roughnesses = 8;
-	for(int i = 1; i < roughnesses; i++)
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, roughnesses - 1);
+	for(int i = 0; i < roughnesses; i++)
 	{
 		HDRImage image(filenames[i]);
-		glTexImage2D(GL_TEXTURE_2D, i, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
+		uploadHdrLevel(image, i, format);
 	}
 
 	return texId;
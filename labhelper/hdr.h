@@ -1,10 +1,15 @@
 #include <vector>
 #include <string>
 #include <GL/glew.h>
+#include "PackedFloat.h"
 
 namespace labhelper {
-	GLuint loadHdrTexture(const std::string &filename);
-	GLuint loadHdrMipmapTexture(const std::vector<std::string> &filenames);
+	// The texels are converted to `format` on the CPU, so that only the
+	// packed texels are uploaded. Half floats keep all the detail of the
+	// .hdr files (which have 8-bit mantissas) in half the memory of floats.
+	GLuint loadHdrTexture(const std::string &filename, HdrFormat format = HDR_FLOAT16);
+	// One file per mip level, each half the size of the one before
+	GLuint loadHdrMipmapTexture(const std::vector<std::string> &filenames, HdrFormat format = HDR_FLOAT16);
 
 	void saveHdrTexture(const std::string &filename, GLuint texture);
-}
\ No newline at end of file
+}
@@ -1,23 +1,183 @@
 #include "HDRImage.h"
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <glm/gtc/constants.hpp>
 
 using namespace std;
 using namespace glm;
 
-void HDRImage::load(const string& filename)
+void HDRImage::load(const string& filename, labhelper::HdrFormat format_)
 {
 	stbi_set_flip_vertically_on_load(true);
-	data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
+	float* data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
 	if(data == NULL)
 	{
 		std::cout << "Failed to load image: " << filename << ".\n";
 		exit(1);
 	}
+	format = format_;
+	buildSamplingTables(data);
+	texture.clear();
+	texture_half.clear();
+	texture_rgb9e5.clear();
+	const size_t num_texels = size_t(width) * height;
+	if(format == labhelper::HDR_FLOAT16)
+	{
+		vector<labhelper::half> texels(num_texels * 3);
+		labhelper::floatToHalf(data, num_texels * 3, &texels[0].bits);
+		texture_half.build(texels.data(), width, height, 3, true, labhelper::WRAP_REPEAT, labhelper::WRAP_CLAMP);
+	}
+	else if(format == labhelper::HDR_RGB9E5)
+	{
+		vector<labhelper::rgb9e5> texels(num_texels);
+		labhelper::packRGB9E5(data, 3, num_texels, &texels[0].bits);
+		texture_rgb9e5.build(texels.data(), width, height, 1, true, labhelper::WRAP_REPEAT, labhelper::WRAP_CLAMP);
+	}
+	else
+	{
+		texture.build(data, width, height, 3, true, labhelper::WRAP_REPEAT, labhelper::WRAP_CLAMP);
+	}
+	stbi_image_free(data);
 };
 
-vec3 HDRImage::sample(float u, float v)
+vec3 HDRImage::sample(float u, float v, float lod) const
+{
+	if(format == labhelper::HDR_FLOAT16)
+		return vec3(texture_half.sample(vec2(u, v), lod));
+	if(format == labhelper::HDR_RGB9E5)
+		return vec3(texture_rgb9e5.sample(vec2(u, v), lod));
+	return vec3(texture.sample(vec2(u, v), lod));
+}
+
+void HDRImage::sample(const vec2* uv, const float* lod, int count, vec4* out) const
+{
+	if(format == labhelper::HDR_FLOAT16)
+		texture_half.sample(uv, lod, count, out);
+	else if(format == labhelper::HDR_RGB9E5)
+		texture_rgb9e5.sample(uv, lod, count, out);
+	else
+		texture.sample(uv, lod, count, out);
+}
+
+float HDRImage::lodForSpread(float angle) const
+{
+	// A texel spans 2 pi / width radians in longitude, and as much in
+	// latitude in a 2:1 map
+	const float texels_across = angle * float(width) / (2.0f * pi<float>());
+	return texels_across > 1.0f ? std::log2(texels_across) : 0.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build an alias table (Vose's method) for picking one of `n` entries with
+// probability proportional to `weights`. If all weights are zero, the
+// entries are equally likely.
+///////////////////////////////////////////////////////////////////////////
+template<typename AliasEntry>
+static void buildAliasTable(const double* weights, int n, AliasEntry* table)
+{
+	double total = 0.0;
+	for(int i = 0; i < n; i++)
+	{
+		total += weights[i];
+	}
+
+	// Entries with less than the mean probability are topped up with a
+	// part of one with more
+	vector<double> scaled(n);
+	vector<int> small, large;
+	for(int i = 0; i < n; i++)
+	{
+		scaled[i] = total > 0.0 ? weights[i] / total * n : 1.0;
+		table[i].pdf = float(scaled[i]);
+		(scaled[i] < 1.0 ? small : large).push_back(i);
+	}
+	while(!small.empty() && !large.empty())
+	{
+		const int s = small.back(), l = large.back();
+		small.pop_back();
+		table[s].probability = float(scaled[s]);
+		table[s].alias = l;
+		scaled[l] -= 1.0 - scaled[s];
+		if(scaled[l] < 1.0)
+		{
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// What is left is 1 up to rounding
+	for(int i : small)
+	{
+		table[i].probability = 1.0f;
+		table[i].alias = i;
+	}
+	for(int i : large)
+	{
+		table[i].probability = 1.0f;
+		table[i].alias = i;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Pick an entry of an alias table with `rnd`, and return what is left of
+// `rnd` as a new number in [0, 1) in `remapped`
+///////////////////////////////////////////////////////////////////////////
+template<typename AliasEntry>
+static int sampleAlias(const AliasEntry* table, int n, float rnd, float& remapped)
+{
+	const float scaled = rnd * n;
+	const int i = std::min(int(scaled), n - 1);
+	const float f = std::min(scaled - i, 1.0f);
+	const float p = table[i].probability;
+	if(f < p)
+	{
+		remapped = std::min(f / p, 0.99999994f);
+		return i;
+	}
+	remapped = std::min((f - p) / (1.0f - p), 0.99999994f);
+	return table[i].alias;
+}
+
+void HDRImage::buildSamplingTables(const float* data)
+{
+	marginal.resize(height);
+	conditional.resize(height * width);
+
+	vector<double> row_weights(height);
+	vector<double> weights(width);
+	for(int y = 0; y < height; y++)
+	{
+		// Row y is at theta = pi * (1 - (y + 0.5) / height)
+		const double sin_theta = sin(pi<double>() * (y + 0.5) / height);
+		double row_weight = 0.0;
+		for(int x = 0; x < width; x++)
+		{
+			const float* texel = &data[(y * width + x) * 3];
+			const double luminance = 0.2126 * texel[0] + 0.7152 * texel[1] + 0.0722 * texel[2];
+			weights[x] = std::max(luminance, 0.0) * sin_theta;
+			row_weight += weights[x];
+		}
+		row_weights[y] = row_weight;
+		buildAliasTable(weights.data(), width, &conditional[y * width]);
+	}
+	buildAliasTable(row_weights.data(), height, marginal.data());
+}
+
+vec2 HDRImage::sampleUV(const vec2& rnd, float& pdf) const
+{
+	float fy, fx;
+	const int y = sampleAlias(marginal.data(), height, rnd.y, fy);
+	const int x = sampleAlias(&conditional[y * width], width, rnd.x, fx);
+	const vec2 uv = vec2((x + fx) / width, (y + fy) / height);
+	// Rounding can put uv in the next texel, so look up the texel again
+	pdf = pdfUV(uv.x, uv.y);
+	return uv;
+}
+
+float HDRImage::pdfUV(float u, float v) const
 {
-	int x = int(u * width) % width;
-	int y = int(v * height) % height;
-	return vec3(data[(y * width + x) * 3 + 0], data[(y * width + x) * 3 + 1], data[(y * width + x) * 3 + 2]);
+	// The texel that (u, v) is in
+	const int x = int(u * width) % width;
+	const int y = int(v * height) % height;
+	return marginal[y].pdf * conditional[y * width + x].pdf;
 }
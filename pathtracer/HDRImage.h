@@ -1,21 +1,72 @@
 #pragma once
 #include <stb_image.h>
 #include <string>
+#include <vector>
 #include <glm/glm.hpp>
+#include <TiledTexture.h>
 
 ///////////////////////////////////////////////////////////////////////////
-// Simple helper class for loading HDR images with STB image
+// Simple helper class for loading HDR images with STB image. The texels
+// are kept in a mipmapped TiledTexture, which repeats in u and clamps in
+// v, as a latitude-longitude map should.
+//
+// By default the texels are stored as half floats, in half the memory of
+// floats, and lookups read half as many bytes. The importance sampling
+// tables are built from the full-precision image either way.
 ///////////////////////////////////////////////////////////////////////////
 struct HDRImage
 {
-	int width, height, components;
-	float* data = nullptr;
+	int width = 0, height = 0, components = 0;
+	// Only the texture of this format is built
+	labhelper::HdrFormat format = labhelper::HDR_FLOAT16;
+	labhelper::TiledTexture<float> texture;
+	labhelper::TiledTexture<labhelper::half> texture_half;
+	labhelper::TiledTexture<labhelper::rgb9e5> texture_rgb9e5;
 	HDRImage(){};
-	~HDRImage()
+	void load(const std::string& filename, labhelper::HdrFormat format = labhelper::HDR_FLOAT16);
+	bool valid() const
 	{
-		if(data != nullptr)
-			stbi_image_free(data);
+		return !texture.empty() || !texture_half.empty() || !texture_rgb9e5.empty();
+	}
+	// Of the texels, not counting the sampling tables
+	size_t getMemoryUsage() const
+	{
+		return texture.getMemoryUsage() + texture_half.getMemoryUsage() + texture_rgb9e5.getMemoryUsage();
+	}
+	// Bilinearly filtered at mip level 0, trilinearly above it
+	glm::vec3 sample(float u, float v, float lod = 0.0f) const;
+	// The same for `count` points, in batches. `lod` may be nullptr for
+	// mip level 0.
+	void sample(const glm::vec2* uv, const float* lod, int count, glm::vec4* out) const;
+	// The level of detail at which a cone of directions `angle` radians
+	// wide covers one texel
+	float lodForSpread(float angle) const;
+
+	///////////////////////////////////////////////////////////////////////
+	// Importance sampling of the image as a latitude-longitude environment
+	// map. Texels are picked with probability proportional to their
+	// luminance times sin(theta), the solid angle they cover, so that
+	// bright texels near the poles are not oversampled.
+	///////////////////////////////////////////////////////////////////////
+	// Pick a point (u, v) in the image, with two numbers in [0, 1). `pdf`
+	// is the density of the point with respect to (u, v).
+	glm::vec2 sampleUV(const glm::vec2& rnd, float& pdf) const;
+	// The density with which sampleUV() picks (u, v)
+	float pdfUV(float u, float v) const;
+
+private:
+	// Built by load(). Rows are picked from the marginal distribution and
+	// texels within the row from its conditional distribution, both with
+	// alias tables, in constant time.
+	struct AliasEntry
+	{
+		// Probability of keeping the entry rather than taking its alias
+		float probability;
+		int alias;
+		// The entry's probability times the number of entries
+		float pdf;
 	};
-	void load(const std::string& filename);
-	glm::vec3 sample(float u, float v);
-};
\ No newline at end of file
+	std::vector<AliasEntry> marginal;    // height
+	std::vector<AliasEntry> conditional; // height rows of width
+	void buildSamplingTables(const float* data);
+};
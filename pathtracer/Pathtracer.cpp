@@ -3,10 +3,16 @@
 #include <iostream>
 #include <map>
 #include <algorithm>
+#include <atomic>
 #include "material.h"
 #include "embree.h"
 #include "sampling.h"
+#include "sampler.h"
+#include "integrator.h"
+#include "texturecache.h"
+#include "denoiser.h"
 #include "labhelper.h"
+#include <stb_image_write.h>
 
 using namespace std;
 using namespace glm;
@@ -22,6 +28,35 @@ Environment environment;
 Image rendered_image;
 PointLight point_light;
 std::vector<DiscLight> disc_lights;
+TileScheduler tile_scheduler;
+PathStats path_stats;
+// Path and ray statistics of the current pass, one per thread, so that
+// counting takes no atomics. They are summed when the pass ends.
+struct PathCounters
+{
+	std::vector<uint64_t> depth_histogram;
+	uint64_t ended[NUM_PATH_ENDS];
+	uint64_t rays[NUM_RAY_TYPES];
+	double trace_seconds;
+	// Time spent on tiles
+	double busy_seconds;
+	// Keeps the counters of different threads off each other's cache
+	// lines
+	char padding[64];
+
+	void clear(int max_bounces)
+	{
+		depth_histogram.assign(max_bounces + 1, 0);
+		std::fill(ended, ended + NUM_PATH_ENDS, 0);
+		std::fill(rays, rays + NUM_RAY_TYPES, 0);
+		trace_seconds = 0.0;
+		busy_seconds = 0.0;
+	}
+};
+std::vector<std::unique_ptr<PathCounters>> path_counters;
+// Set by abortPass(), and whether the last pass stopped because of it
+std::atomic<bool> abort_requested(false);
+bool last_pass_aborted = false;
 
 ///////////////////////////////////////////////////////////////////////////
 // Restart rendering of image
@@ -37,6 +72,54 @@ int getSampleCount()
 	return std::max(rendered_image.number_of_samples - 1, 0);
 }
 
+float getConvergedFraction()
+{
+	const size_t num_pixels = rendered_image.pass_samples.size();
+	return num_pixels > 0 ? float(rendered_image.num_converged) / float(num_pixels) : 0.0f;
+}
+
+const TileStats& getTileStats()
+{
+	return tile_scheduler.getStats();
+}
+
+const PathStats& getPathStats()
+{
+	return path_stats;
+}
+
+void recordPathEnd(int depth, PathEnd reason)
+{
+	PathCounters& counters = *path_counters[omp_get_thread_num()];
+	counters.depth_histogram[std::min(depth, int(counters.depth_histogram.size()) - 1)]++;
+	counters.ended[reason]++;
+}
+
+void recordRays(RayType type, size_t count, double start)
+{
+	PathCounters& counters = *path_counters[omp_get_thread_num()];
+	counters.rays[type] += count;
+	counters.trace_seconds += omp_get_wtime() - start;
+}
+
+bool russianRoulette(vec3& path_throughput, int bounce)
+{
+	if(!settings.russian_roulette || bounce + 1 < settings.roulette_min_depth)
+	{
+		return true;
+	}
+	// Never below 5%, so that the survivors' weights stay bounded
+	const float survival = std::min(1.0f, std::max(0.05f, luminance(path_throughput)));
+	Sampler& sampler = getSampler();
+	sampler.setDimension(bounceDimension(bounce) + ROULETTE_DIMENSION);
+	if(sampler.get1D() >= survival)
+	{
+		return false;
+	}
+	path_throughput /= survival;
+	return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // On window resize, window size is passed in, actual size of pathtraced
 // image may be smaller (if we're subsampling for speed)
@@ -45,7 +128,6 @@ void resize(int w, int h)
 {
 	rendered_image.width = w / settings.subsampling;
 	rendered_image.height = h / settings.subsampling;
-	rendered_image.data.resize(rendered_image.width * rendered_image.height);
 	restart();
 }
 
@@ -53,40 +135,229 @@ void resize(int w, int h)
 /// Return the radiance from a certain direction wi from the environment
 /// map.
 ///////////////////////////////////////////////////////////////////////////
-vec3 Lenvironment(const vec3& wi)
+static vec2 environmentLookup(const vec3& wi)
 {
 	const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
 	float phi = atan(wi.z, wi.x);
 	if(phi < 0.0f)
 		phi = phi + 2.0f * M_PI;
-	vec2 lookup = vec2(phi / (2.0 * M_PI), 1 - theta / M_PI);
-	return environment.multiplier * environment.map.sample(lookup.x, lookup.y);
+	return vec2(phi / (2.0 * M_PI), 1 - theta / M_PI);
+}
+
+vec3 Lenvironment(const vec3& wi, float spread_angle)
+{
+	vec2 lookup = environmentLookup(wi);
+	const float lod = environment.map.lodForSpread(spread_angle);
+	return environment.multiplier * environment.map.sample(lookup.x, lookup.y, lod);
+}
+
+void Lenvironment(const vec3* wi, int count, float spread_angle, vec3* L)
+{
+	static thread_local vector<vec2> lookups;
+	static thread_local vector<float> lods;
+	static thread_local vector<vec4> texels;
+	lookups.resize(count);
+	lods.assign(count, environment.map.lodForSpread(spread_angle));
+	texels.resize(count);
+	for(int i = 0; i < count; i++)
+	{
+		lookups[i] = environmentLookup(wi[i]);
+	}
+	environment.map.sample(lookups.data(), lods.data(), count, texels.data());
+	for(int i = 0; i < count; i++)
+	{
+		L[i] = environment.multiplier * vec3(texels[i]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// A ray from a hit point in direction wi, offset to the side of the
+/// surface that wi points to
+///////////////////////////////////////////////////////////////////////////
+static Ray offsetRay(const Intersection& hit, const vec3& wi, float tfar = FLT_MAX)
+{
+	Ray ray(hit.position, wi, 0.0f, tfar);
+	if(dot(wi, hit.geometry_normal) < 0)
+		ray.o -= EPSILON * hit.geometry_normal;
+	else
+		ray.o += EPSILON * hit.geometry_normal;
+	return ray;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The environment map is sampled in its (u, v) parameterization, where
+/// u = phi / 2pi and v = 1 - theta / pi. A texel then covers a solid angle
+/// of 2pi^2 sin(theta) times its area in (u, v).
+///////////////////////////////////////////////////////////////////////////
+static bool environmentSampled()
+{
+	return settings.sample_environment && environment.multiplier > 0.0f && environment.map.valid();
+}
+
+float environmentPdf(const vec3& wi)
+{
+	if(!environmentSampled())
+	{
+		return 0.0f;
+	}
+	const float sin_theta = sqrt(std::max(0.0f, 1.0f - wi.y * wi.y));
+	if(sin_theta <= 0.0f)
+	{
+		return 0.0f;
+	}
+	const vec2 lookup = environmentLookup(wi);
+	return environment.map.pdfUV(lookup.x, lookup.y) / (2.0f * M_PI * M_PI * sin_theta);
+}
+
+bool sampleEnvironment(const Intersection& hit, const ShadingMaterial& mat, const vec2& u, Ray& shadow_ray,
+                       vec3& contribution)
+{
+	if(!environmentSampled())
+	{
+		return false;
+	}
+	float uv_pdf;
+	const vec2 uv = environment.map.sampleUV(u, uv_pdf);
+	const float theta = M_PI * (1.0f - uv.y);
+	const float phi = 2.0f * M_PI * uv.x;
+	const float sin_theta = sin(theta);
+	if(uv_pdf <= 0.0f || sin_theta <= 0.0f)
+	{
+		return false;
+	}
+	const vec3 wi = vec3(sin_theta * cos(phi), cos(theta), sin_theta * sin(phi));
+	const vec3 f = mat.f(wi, hit.wo, hit.shading_normal);
+	if(f == vec3(0.0f))
+	{
+		return false;
+	}
+	const float env_pdf = uv_pdf / (2.0f * M_PI * M_PI * sin_theta);
+	const float bsdf_pdf = mat.pdf(wi, hit.wo, hit.shading_normal);
+	contribution = f * Lenvironment(wi) * abs(dot(wi, hit.shading_normal)) / env_pdf
+	               * powerHeuristic(env_pdf, bsdf_pdf);
+	shadow_ray = offsetRay(hit, wi);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The shadow ray from a hit point towards the point light
+///////////////////////////////////////////////////////////////////////////
+Ray pointLightShadowRay(const Intersection& hit)
+{
+	Ray hit2lightray;
+	hit2lightray.o = hit.position + EPSILON * hit.shading_normal;
+	hit2lightray.d = normalize(point_light.position - hit.position);
+	return hit2lightray;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Disc lights emit the same radiance everywhere on their front side (the
+/// side `direction` points to). intensity_multiplier * color is the power
+/// they emit per steradian along `direction`.
+///////////////////////////////////////////////////////////////////////////
+static float discArea(const DiscLight& light)
+{
+	return M_PI * light.radius * light.radius;
+}
+
+static vec3 discRadiance(const DiscLight& light)
+{
+	return light.intensity_multiplier * light.color / discArea(light);
+}
+
+bool sampleDiscLight(const DiscLight& light, const Intersection& hit, const ShadingMaterial& mat,
+                     const vec2& u, Ray& shadow_ray, vec3& contribution)
+{
+	if(light.radius <= 0.0f)
+	{
+		return false;
+	}
+	const mat3 tbn = tangentSpace(light.direction);
+	const vec2 disc = light.radius * concentricSampleDisk(u);
+	const vec3 to_light = light.position + disc.x * tbn[0] + disc.y * tbn[1] - hit.position;
+	const float distance2 = dot(to_light, to_light);
+	const float distance = sqrt(distance2);
+	const vec3 wi = to_light / distance;
+	const float cos_light = -dot(wi, light.direction);
+	if(cos_light <= 0.0f || distance < EPSILON)
+	{
+		return false;
+	}
+	const vec3 f = mat.f(wi, hit.wo, hit.shading_normal);
+	if(f == vec3(0.0f))
+	{
+		return false;
+	}
+	// The pdf of choosing wi, converted from area to solid angle
+	const float light_pdf = distance2 / (cos_light * discArea(light));
+	const float bsdf_pdf = mat.pdf(wi, hit.wo, hit.shading_normal);
+	contribution = f * discRadiance(light) * abs(dot(wi, hit.shading_normal)) / light_pdf
+	               * powerHeuristic(light_pdf, bsdf_pdf);
+
+	shadow_ray = offsetRay(hit, wi, distance * (1.0f - EPSILON));
+	return true;
+}
+
+vec3 discLightsAlongRay(const Ray& ray, float bsdf_pdf)
+{
+	vec3 L = vec3(0.0f);
+	for(const DiscLight& light : disc_lights)
+	{
+		// Only the front side emits
+		const float cos_light = -dot(ray.d, light.direction);
+		if(cos_light <= 0.0f || light.radius <= 0.0f)
+		{
+			continue;
+		}
+		const float t = dot(ray.o - light.position, light.direction) / cos_light;
+		if(t <= ray.tnear || t >= ray.tfar)
+		{
+			continue;
+		}
+		const vec3 p = ray.o + t * ray.d - light.position;
+		if(dot(p, p) > light.radius * light.radius)
+		{
+			continue;
+		}
+		const float light_pdf = t * t / (cos_light * discArea(light));
+		L += discRadiance(light) * bsdfSampleWeight(bsdf_pdf, light_pdf);
+	}
+	return L;
 }
 
 ///////////////////////////////////////////////////////////////////////////
 /// Calculate the radiance going from one point (r.hitPosition()) in one
-/// direction (-r.d), through path tracing.
+/// direction (-r.d), through path tracing. The intersection of the primary
+/// ray and the visibility of the point light from it are passed in, so
+/// that they can be computed for a whole packet of primary rays at once.
+/// The pixel sample must have been started in the thread's sampler. The
+/// primary hit's features are stored in `features`. Textures are filtered
+/// over a ray cone of `spread_angle` (see PrimaryRayGenerator).
 ///////////////////////////////////////////////////////////////////////////
-vec3 Li(Ray& primary_ray)
+vec3 Li(Ray& primary_ray, const Intersection& primary_hit, bool primary_hit_in_shadow, float spread_angle,
+        Features& features)
 {
 	vec3 L = vec3(0.0f);
 	vec3 path_throughput = vec3(1.0);
 	Ray current_ray = primary_ray;
+	// Of the ray cone where the path hits
+	float cone_width = spread_angle * primary_ray.tfar;
+	Sampler& sampler = getSampler();
+	// Shadow rays of one vertex, and what they bring if unoccluded
+	static thread_local std::vector<Ray> shadow_rays;
+	static thread_local std::vector<vec3> shadow_contributions;
 
 	for (int bounes = 0; bounes < settings.max_bounces; bounes++) {
 		// Get the intersection information from the ray
-		Intersection hit = getIntersection(current_ray);
+		Intersection hit = bounes == 0 ? primary_hit : getIntersection(current_ray);
 
-		// create a material tree
-		
-		
-		Diffuse diffuse(hit.material->m_color);
-		MicrofacetBRDF microfacet(hit.material->m_shininess);
-		DielectricBSDF dielectric(&microfacet, &diffuse, hit.material->m_fresnel);
-		MetalBSDF metal(&microfacet, hit.material->m_color, hit.material->m_fresnel);
-		BSDFLinearBlend metal_blend(hit.material->m_metalness, &metal, &dielectric);
-		BSDF& mat = metal_blend;
-		
+		ShadingMaterial textured_mat;
+		const ShadingMaterial& mat =
+		    shadingMaterialAt(hit.material_id, hit.uv, uvFootprint(hit, cone_width), textured_mat);
+		if(bounes == 0)
+		{
+			features = Features(mat.color, hit.shading_normal, primary_ray.tfar);
+		}
 
 		/*
 		GlassBTDF glass(hit.material->m_ior);
@@ -98,26 +369,68 @@ vec3 Li(Ray& primary_ray)
 		
 		
 		
-		Ray hit2lightray;
-		hit2lightray.o = hit.position + EPSILON * hit.shading_normal;
-		hit2lightray.d = normalize(point_light.position - hit.position);
-		bool inshadow = occluded(hit2lightray);
-		if (!inshadow)
+		///////////////////////////////////////////////////////////////
+		// Direct illumination. The shadow rays towards all lights are
+		// traced together.
+		///////////////////////////////////////////////////////////////
+		shadow_rays.clear();
+		shadow_contributions.clear();
+
+		const float distance_to_light = length(point_light.position - hit.position);
+		const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
+		vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
+		vec3 wi = normalize(point_light.position - hit.position);
+		vec3 direct = mat.f(wi, hit.wo, hit.shading_normal) * Li * std::max(0.0f, dot(wi, hit.shading_normal));
+		if(bounes == 0)
 		{
-			//Direct illumination
-			const float distance_to_light = length(point_light.position - hit.position);
-			const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
-			vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
-			vec3 wi = normalize(point_light.position - hit.position);
-			L += path_throughput * mat.f(wi, hit.wo, hit.shading_normal) * Li * std::max(0.0f, dot(wi, hit.shading_normal));
+			// The primary shadow ray has already been traced
+			if(!primary_hit_in_shadow)
+				L += path_throughput * direct;
+		}
+		else if(direct != vec3(0.0f))
+		{
+			shadow_rays.push_back(pointLightShadowRay(hit));
+			shadow_contributions.push_back(direct);
+		}
+
+		Ray env_ray;
+		vec3 env_contribution;
+		sampler.setDimension(bounceDimension(bounes) + ENVIRONMENT_DIMENSION);
+		if(sampleEnvironment(hit, mat, sampler.get2D(), env_ray, env_contribution))
+		{
+			shadow_rays.push_back(env_ray);
+			shadow_contributions.push_back(env_contribution);
+		}
+
+		for(int i = 0; i < int(disc_lights.size()); i++)
+		{
+			sampler.setDimension(lightDimension(bounes, i));
+			Ray shadow_ray;
+			vec3 contribution;
+			if(sampleDiscLight(disc_lights[i], hit, mat, sampler.get2D(), shadow_ray, contribution))
+			{
+				shadow_rays.push_back(shadow_ray);
+				shadow_contributions.push_back(contribution);
+			}
+		}
+
+		const double shadow_start = omp_get_wtime();
+		occluded(shadow_rays.data(), shadow_rays.size());
+		recordRays(SHADOW_RAYS, shadow_rays.size(), shadow_start);
+		for(size_t i = 0; i < shadow_rays.size(); i++)
+		{
+			if(shadow_rays[i].geomID == RTC_INVALID_GEOMETRY_ID)
+				L += path_throughput * shadow_contributions[i];
 		}
 
 		
-		L += path_throughput * hit.material->m_emission;
+		L += path_throughput * mat.emission;
 
+		sampler.setDimension(bounceDimension(bounes));
 		WiSample r = mat.sample_wi(hit.wo, hit.shading_normal);
 
 		if (r.pdf < EPSILON) {
+			recordPathEnd(bounes + 1, PATH_ABSORBED);
 			return L;
 		}
 
@@ -126,9 +439,19 @@ vec3 Li(Ray& primary_ray)
 		path_throughput = path_throughput * (r.f * cosineterm) / r.pdf;
 
 		if (path_throughput == vec3(0.0f, 0.0f, 0.0f)) {
+			recordPathEnd(bounes + 1, PATH_ABSORBED);
 			return L;
 		}
 
+		if(!russianRoulette(path_throughput, bounes))
+		{
+			recordPathEnd(bounes + 1, PATH_ROULETTE);
+			return L;
+		}
+
+		// The pdf of the whole BSDF, which MIS needs if the ray hits a light
+		float bsdf_pdf = mat.pdf(r.wi, hit.wo, hit.shading_normal);
+
 		Ray newray;
 	
 		current_ray = newray;
@@ -142,83 +465,378 @@ vec3 Li(Ray& primary_ray)
 			current_ray.o += EPSILON * hit.geometry_normal;
 		
 
+		const double extension_start = omp_get_wtime();
 		bool newhit = intersect(current_ray);
+		recordRays(EXTENSION_RAYS, 1, extension_start);
+		L += path_throughput * discLightsAlongRay(current_ray, bsdf_pdf);
 		if (!newhit){
-			return L + path_throughput * Lenvironment(current_ray.d);
+			recordPathEnd(bounes + 1, PATH_ESCAPED);
+			return L + path_throughput * Lenvironment(current_ray.d, spread_angle)
+			               * bsdfSampleWeight(bsdf_pdf, environmentPdf(current_ray.d));
 		}
+		cone_width += spread_angle * current_ray.tfar;
 
 	}
+	recordPathEnd(settings.max_bounces, PATH_MAX_DEPTH);
 	// Return the final outgoing radiance for the primary ray
 	return L;
 }
 
+vec3 Li(Ray& primary_ray, float spread_angle, Features& features)
+{
+	Intersection hit = getIntersection(primary_ray);
+	Ray hit2lightray = pointLightShadowRay(hit);
+	const double shadow_start = omp_get_wtime();
+	const bool in_shadow = occluded(hit2lightray);
+	recordRays(SHADOW_RAYS, 1, shadow_start);
+	return Li(primary_ray, hit, in_shadow, spread_angle, features);
+}
+
 ///////////////////////////////////////////////////////////////////////////
-/// Used to homogenize points transformed with projection matrices
+/// Trace one path for each pixel of a tile that is active in `round`,
+/// one ray at a time
 ///////////////////////////////////////////////////////////////////////////
-inline static glm::vec3 homogenize(const glm::vec4& p)
+static void traceTile(const Tile& tile, const PrimaryRayGenerator& camera, int round)
 {
-	return glm::vec3(p * (1.f / p.w));
+	for(int y = tile.y0; y < tile.y1; y++)
+	{
+		for(int x = tile.x0; x < tile.x1; x++)
+		{
+			if(!pixelActive(x, y, round))
+				continue;
+			vec3 color;
+			Features features;
+			Ray primaryRay = camera.generate(x, y);
+			// Intersect ray with scene
+			const double primary_start = omp_get_wtime();
+			const bool hit = intersect(primaryRay);
+			recordRays(PRIMARY_RAYS, 1, primary_start);
+			if(hit)
+			{
+				// If it hit something, evaluate the radiance from that point
+				color = Li(primaryRay, camera.spread_angle, features);
+			}
+			else
+			{
+				// Otherwise evaluate environment
+				color = Lenvironment(primaryRay.d, camera.spread_angle);
+				recordPathEnd(0, PATH_ESCAPED);
+			}
+			accumulate(x, y, color, features);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Trace one path for each pixel of a tile that is active in `round`. The
+/// primary rays of a 4xN/4 block of pixels are coherent, so they are
+/// intersected as one packet, and so are the shadow rays from their hit
+/// points. The rest of each path is traced one ray at a time.
+///////////////////////////////////////////////////////////////////////////
+template <int N>
+static void traceTilePackets(const Tile& tile, const PrimaryRayGenerator& camera, int round)
+{
+	const int block_w = 4, block_h = N / 4;
+	RayPacket<N> primary, shadow;
+	RTCORE_ALIGN(64) int valid[N];
+	RTCORE_ALIGN(64) int shadow_valid[N];
+	Intersection hits[N];
+
+	for(int by = tile.y0; by < tile.y1; by += block_h)
+	{
+		for(int bx = tile.x0; bx < tile.x1; bx += block_w)
+		{
+			///////////////////////////////////////////////////////////////
+			// Primary rays
+			///////////////////////////////////////////////////////////////
+			int num_valid = 0;
+			for(int i = 0; i < N; i++)
+			{
+				int x = bx + i % block_w, y = by + i / block_w;
+				valid[i] = (x < tile.x1 && y < tile.y1 && pixelActive(x, y, round)) ? -1 : 0;
+				if(valid[i])
+				{
+					primary.set(i, camera.generate(x, y));
+					num_valid++;
+				}
+			}
+			if(num_valid == 0)
+				continue;
+			const double primary_start = omp_get_wtime();
+			intersect(primary, valid);
+			recordRays(PRIMARY_RAYS, num_valid, primary_start);
+
+			///////////////////////////////////////////////////////////////
+			// Shadow rays towards the point light from the first hits
+			///////////////////////////////////////////////////////////////
+			int num_shadow = 0;
+			for(int i = 0; i < N; i++)
+			{
+				shadow_valid[i] = (valid[i] && primary.geomID[i] != RTC_INVALID_GEOMETRY_ID) ? -1 : 0;
+				if(shadow_valid[i])
+				{
+					hits[i] = getIntersection(primary, i);
+					shadow.set(i, pointLightShadowRay(hits[i]));
+					num_shadow++;
+				}
+			}
+			const double shadow_start = omp_get_wtime();
+			occluded(shadow, shadow_valid);
+			recordRays(SHADOW_RAYS, num_shadow, shadow_start);
+
+			///////////////////////////////////////////////////////////////
+			// Continue each path on its own
+			///////////////////////////////////////////////////////////////
+			for(int i = 0; i < N; i++)
+			{
+				if(!valid[i])
+					continue;
+				vec3 color;
+				Features features;
+				Ray primaryRay = primary.get(i);
+				if(shadow_valid[i])
+				{
+					const int x = bx + i % block_w, y = by + i / block_w;
+					getSampler().startPixelSample(x, y, pixelSampleIndex(x, y));
+					bool in_shadow = shadow.geomID[i] != RTC_INVALID_GEOMETRY_ID;
+					color = Li(primaryRay, hits[i], in_shadow, camera.spread_angle, features);
+				}
+				else
+				{
+					color = Lenvironment(primaryRay.d, camera.spread_angle);
+					recordPathEnd(0, PATH_ESCAPED);
+				}
+				accumulate(bx + i % block_w, by + i / block_w, color, features);
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Decide how many samples every pixel takes in this pass, and return the
+/// most that any pixel takes. Starts over if the image was restarted.
+///////////////////////////////////////////////////////////////////////////
+static int planPass()
+{
+	Image& image = rendered_image;
+	const int num_pixels = image.width * image.height;
+	if(image.number_of_samples == 0 || int(image.sample_count.size()) != num_pixels)
+	{
+		image.sum.assign(num_pixels, vec3(0.0f));
+		image.sample_count.assign(num_pixels, 0);
+		image.luminance_m2.assign(num_pixels, 0.0f);
+		image.pass_samples.assign(num_pixels, 1);
+		image.albedo_sum.assign(num_pixels, vec3(0.0f));
+		image.normal_sum.assign(num_pixels, vec3(0.0f));
+		image.depth_sum.assign(num_pixels, 0.0f);
+		image.denoised_pass = 0;
+		image.changed_pass = 0;
+		image.num_converged = 0;
+		image.num_active = num_pixels;
+	}
+	const bool adaptive = settings.adaptive_sampling && image.number_of_samples > 0;
+	const uint32_t min_samples = uint32_t(std::max(2, settings.adaptive_min_samples));
+	const int max_per_pass = adaptive ? std::max(1, std::min(255, settings.adaptive_max_samples_per_pass)) : 1;
+	const int64_t max_samples = settings.max_paths_per_pixel != 0 ? settings.max_paths_per_pixel : INT64_MAX;
+
+	int num_converged = 0, num_active = 0;
+#pragma omp parallel for reduction(+ : num_converged, num_active)
+	for(int i = 0; i < num_pixels; i++)
+	{
+		const uint32_t n = image.sample_count[i];
+		int samples = 1;
+		if(adaptive && n >= min_samples)
+		{
+			// Standard error of the mean luminance, relative to the mean
+			const float variance = image.luminance_m2[i] / float(n - 1);
+			const float mean = std::max(luminance(image.mean(i)), 0.01f);
+			const float error = sqrt(variance / float(n)) / mean;
+			if(error < settings.adaptive_threshold)
+			{
+				samples = 0;
+				num_converged++;
+			}
+			else
+			{
+				samples = std::min(max_per_pass, int(error / settings.adaptive_threshold));
+			}
+		}
+		image.pass_samples[i] = uint8_t(std::max<int64_t>(0, std::min<int64_t>(samples, max_samples - n)));
+		if(image.pass_samples[i] > 0)
+			num_active++;
+	}
+	image.num_converged = num_converged;
+	image.num_active = num_active;
+	return max_per_pass;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-/// Trace one path per pixel and accumulate the result in an image
+/// Trace up to settings.adaptive_max_samples_per_pass paths per pixel and
+/// accumulate the result in an image
 ///////////////////////////////////////////////////////////////////////////
-void tracePaths(const glm::mat4& V, const glm::mat4& P)
+bool tracePaths(const glm::mat4& V, const glm::mat4& P)
 {
 	// Stop here if we have as many samples as we want
 	if((int(rendered_image.number_of_samples) > settings.max_paths_per_pixel)
 	   && (settings.max_paths_per_pixel != 0))
 	{
-		return;
+		return false;
 	}
-	vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
-	// Trace one path per pixel (the omp parallel stuf magically distributes the
-	// pathtracing on all cores of your CPU).
-	int num_rays = 0;
-	vector<vec4> local_image(rendered_image.width * rendered_image.height, vec4(0.0f));
-
-#pragma omp parallel for
-	for(int y = 0; y < rendered_image.height; y++)
+	PrimaryRayGenerator camera;
+	camera.camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
+	camera.inv_PV = inverse(P * V);
+	// P[1][1] is 1 / tan(fov / 2), and the rows span 2 * tan(fov / 2)
+	camera.spread_angle = 2.0f / (P[1][1] * float(rendered_image.height));
+	const int rounds = planPass();
+	const int packet_size = settings.packet_tracing && !settings.row_scheduling ? getMaxPacketSize() : 1;
+	// Trace the paths of the pass. The image is cut into tiles which are
+	// handed out to the threads, and threads that run out of tiles steal
+	// from the others so that no core idles at the end of a pass.
+	tile_scheduler.setup(rendered_image.width, rendered_image.height, settings.tile_size, settings.row_scheduling);
+	tile_scheduler.beginPass(omp_get_max_threads());
+	path_counters.resize(omp_get_max_threads());
+	for(std::unique_ptr<PathCounters>& counters : path_counters)
 	{
-		for(int x = 0; x < rendered_image.width; x++)
-		{
-			//Jittered Sampling
-			float r1 = randf();
-			float r2 = randf();
+		if(!counters)
+			counters.reset(new PathCounters);
+		counters->clear(settings.max_bounces);
+	}
 
-			float r3 = randf();
-			float r4 = randf();
+	// The first pass of an image always completes, so that there is
+	// something to show
+	const bool abortable = rendered_image.number_of_samples > 0;
 
-			vec3 color;
-			Ray primaryRay;
-			primaryRay.o = camera_pos;
-			// Create a ray that starts in the camera position and points toward
-			// the current pixel on a virtual screen.
-			vec2 screenCoord = vec2(float(x + r1 - r2) / float(rendered_image.width),
-			                        float(y + r3 - r4) / float(rendered_image.height));
-			// Calculate direction
-			vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
-
-			vec3 p = homogenize(inverse(P * V) * viewCoord);
-			primaryRay.d = normalize(p - camera_pos);
-			// Intersect ray with scene
-			if(intersect(primaryRay))
+	const double pass_start = omp_get_wtime();
+#pragma omp parallel
+	{
+		const int thread = omp_get_thread_num();
+		Tile tile;
+		while(!(abortable && abort_requested.load(std::memory_order_relaxed)) && tile_scheduler.next(thread, tile))
+		{
+			double tile_start = omp_get_wtime();
+			for(int round = 0; round < rounds; round++)
 			{
-				// If it hit something, evaluate the radiance from that point
-				color = Li(primaryRay);
+				if(settings.integrator == INTEGRATOR_WAVEFRONT)
+					traceTileWavefront(tile, camera, round);
+				else if(packet_size == 16)
+					traceTilePackets<16>(tile, camera, round);
+				else if(packet_size == 8)
+					traceTilePackets<8>(tile, camera, round);
+				else
+					traceTile(tile, camera, round);
 			}
-			else
+			const double tile_seconds = omp_get_wtime() - tile_start;
+			tile_scheduler.finishTile(thread, tile, tile_seconds);
+			path_counters[thread]->busy_seconds += tile_seconds;
+		}
+	}
+	const double pass_seconds = omp_get_wtime() - pass_start;
+	tile_scheduler.endPass();
+	trimTextureCache(size_t(std::max(settings.texture_cache_mb, 0)) << 20);
+	last_pass_aborted = abortable && abort_requested.load();
+	rendered_image.number_of_samples += 1;
+
+	path_stats = PathStats();
+	path_stats.depth_histogram.assign(settings.max_bounces + 1, 0);
+	double depth_sum = 0.0, trace_seconds = 0.0, busy_seconds = 0.0;
+	for(const std::unique_ptr<PathCounters>& counters : path_counters)
+	{
+		for(size_t d = 0; d < counters->depth_histogram.size(); d++)
+		{
+			path_stats.depth_histogram[d] += counters->depth_histogram[d];
+			path_stats.num_paths += counters->depth_histogram[d];
+			depth_sum += double(d) * counters->depth_histogram[d];
+		}
+		for(int e = 0; e < NUM_PATH_ENDS; e++)
+		{
+			path_stats.ended[e] += counters->ended[e];
+		}
+		path_stats.primary_rays += counters->rays[PRIMARY_RAYS];
+		path_stats.extension_rays += counters->rays[EXTENSION_RAYS];
+		path_stats.shadow_rays += counters->rays[SHADOW_RAYS];
+		trace_seconds += counters->trace_seconds;
+		busy_seconds += counters->busy_seconds;
+	}
+	path_stats.mean_depth = path_stats.num_paths > 0 ? float(depth_sum / path_stats.num_paths) : 0.0f;
+	path_stats.trace_ms = trace_seconds * 1000.0;
+	path_stats.shading_ms = std::max(busy_seconds - trace_seconds, 0.0) * 1000.0;
+	path_stats.pass_ms = pass_seconds * 1000.0;
+	const uint64_t num_rays = path_stats.primary_rays + path_stats.extension_rays + path_stats.shadow_rays;
+	path_stats.mrays_per_second = pass_seconds > 0.0 ? double(num_rays) / pass_seconds * 1e-6 : 0.0;
+
+	// Denoise every denoise_interval passes, and once the image is done:
+	// when adaptive sampling has nothing left to refine, or in the last
+	// pass that max_paths_per_pixel allows
+	if(rendered_image.num_active > 0)
+		rendered_image.changed_pass = rendered_image.number_of_samples;
+	const bool done = rendered_image.num_active == 0
+	                  || (settings.max_paths_per_pixel != 0
+	                      && rendered_image.number_of_samples > settings.max_paths_per_pixel);
+	const bool due = done || rendered_image.number_of_samples % std::max(settings.denoise_interval, 1) == 0;
+	if(settings.denoise && due && !last_pass_aborted && rendered_image.changed_pass > rendered_image.denoised_pass)
+	{
+		denoise();
+	}
+	return true;
+}
+
+void abortPass()
+{
+	abort_requested = true;
+}
+
+void clearAbort()
+{
+	abort_requested = false;
+}
+
+bool passAborted()
+{
+	return last_pass_aborted;
+}
+
+void denoise()
+{
+	const double start = omp_get_wtime();
+	denoiseImage(rendered_image, rendered_image.denoised);
+	rendered_image.denoised_pass = rendered_image.number_of_samples;
+	rendered_image.denoise_ms = (omp_get_wtime() - start) * 1000.0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Write the rendered image to disk. Row 0 of the image is the bottom
+/// row (as for GL textures), so the rows are flipped on the way out.
+///////////////////////////////////////////////////////////////////////////
+bool saveImage(const std::string& basename, bool denoised)
+{
+	const int w = rendered_image.width, h = rendered_image.height;
+	if(denoised
+	   && (rendered_image.denoised_pass != rendered_image.number_of_samples
+	       || rendered_image.denoised.size() != size_t(w) * h))
+	{
+		denoise();
+	}
+	std::vector<float> hdr(w * h * 3);
+	std::vector<uint8_t> png(w * h * 3);
+	for(int y = 0; y < h; y++)
+	{
+		for(int x = 0; x < w; x++)
+		{
+			const int i = (h - 1 - y) * w + x;
+			const vec3 c = denoised ? rendered_image.denoised[i] : rendered_image.mean(i);
+			for(int channel = 0; channel < 3; channel++)
 			{
-				// Otherwise evaluate environment
-				color = Lenvironment(primaryRay.d);
+				hdr[(y * w + x) * 3 + channel] = c[channel];
+				png[(y * w + x) * 3 + channel] = uint8_t(255.0f * clamp(c[channel], 0.0f, 1.0f) + 0.5f);
 			}
-			// Accumulate the obtained radiance to the pixels color
-			float n = float(rendered_image.number_of_samples);
-			rendered_image.data[y * rendered_image.width + x] =
-			    rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f))
-			    + (1.0f / (n + 1.0f)) * color;
 		}
 	}
-	rendered_image.number_of_samples += 1;
+	bool ok = stbi_write_hdr((basename + ".hdr").c_str(), w, h, 3, hdr.data()) != 0;
+	ok = stbi_write_png((basename + ".png").c_str(), w, h, 3, png.data(), 0) != 0 && ok;
+	if(!ok)
+	{
+		cout << "Failed to write " << basename << ".hdr/.png\n";
+	}
+	return ok;
 }
 }; // namespace pathtracer
@@ -1,9 +1,11 @@
 #pragma once
 #include <glm/glm.hpp>
 #include <vector>
+#include <string>
 #include <Model.h>
 #include <omp.h>
 #include "HDRImage.h"
+#include "tiles.h"
 
 #ifdef M_PI
 #undef M_PI
@@ -21,18 +23,89 @@ namespace pathtracer
 ///////////////////////////////////////////////////////////////////////////////
 // Path Tracer settings
 ///////////////////////////////////////////////////////////////////////////////
-extern struct Settings
+enum Integrator
+{
+	// Follow each path to the end before starting the next (Li())
+	INTEGRATOR_RECURSIVE = 0,
+	// Advance all paths of a tile together, stage by stage
+	INTEGRATOR_WAVEFRONT = 1,
+};
+
+enum SamplerType
+{
+	// White noise
+	SAMPLER_INDEPENDENT = 0,
+	// Jittered strata per pixel
+	SAMPLER_STRATIFIED = 1,
+	// Owen-scrambled Sobol points
+	SAMPLER_SOBOL = 2,
+	// Sobol points shifted by a blue-noise mask
+	SAMPLER_BLUE_NOISE = 3,
+};
+
+struct Settings
 {
 	int subsampling;
 	int max_bounces;
 	int max_paths_per_pixel;
+	// Width and height (in pixels) of the tiles handed out to threads
+	int tile_size = 16;
+	// Hand out the rows of the image instead, a contiguous run per thread
+	// and no stealing, as the "#pragma omp parallel for" over the rows that
+	// the tiles replaced did. Only there to compare against (see
+	// pathtracer_bench). Packet tracing is off with it, as the packets span
+	// more than one row.
+	bool row_scheduling = false;
+	// Trace primary and first shadow rays in 8/16-wide packets (if the
+	// CPU supports it)
+	bool packet_tracing = true;
+	// One of Integrator
+	int integrator = INTEGRATOR_RECURSIVE;
+	// One of SamplerType
+	int sampler = SAMPLER_SOBOL;
+	// Sample the environment map at every path vertex, with MIS against
+	// the BSDF. Otherwise it is only found by paths that escape.
+	bool sample_environment = true;
+	// Russian roulette: paths that have shaded `roulette_min_depth` points
+	// survive each further bounce with a probability that follows the
+	// luminance of their throughput, and are reweighted if they do
+	bool russian_roulette = true;
+	int roulette_min_depth = 3;
+	// Adaptive sampling: once a pixel has `adaptive_min_samples` samples,
+	// it stops when the standard error of its mean luminance, relative to
+	// that mean, drops below `adaptive_threshold`. Until then it takes
+	// samples in proportion to its error, up to
+	// `adaptive_max_samples_per_pass` per pass.
+	bool adaptive_sampling = false;
+	float adaptive_threshold = 0.01f;
+	int adaptive_min_samples = 16;
+	int adaptive_max_samples_per_pass = 4;
+	// Look up the materials' textures at hit points. The textures are
+	// decoded when first hit, and kept within `texture_cache_mb`.
+	bool material_textures = true;
+	int texture_cache_mb = 512;
+	// Mixed into the sample vectors of every pixel (with the blue noise
+	// sampler, which uses the same points everywhere, into those points).
+	// The same seed and settings give the same image.
+	uint32_t seed = 0;
+	// Denoise the image every `denoise_interval` passes, and once more when
+	// it is done, and show the result instead (see denoiser.h). The
+	// filter runs `denoise_iterations` times, at most 5; the sigmas say how
+	// much the luminance (in standard deviations of its noise), normals and
+	// depths of two pixels may differ before they are kept apart.
+	bool denoise = false;
+	int denoise_interval = 8;
+	int denoise_iterations = 5;
+	float denoise_color_sigma = 4.0f;
+	float denoise_normal_sigma = 128.0f;
+	float denoise_depth_sigma = 1.0f;
 };
 extern Settings settings;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Environment
 ///////////////////////////////////////////////////////////////////////////////
-extern struct Environment
+struct Environment
 {
 	float multiplier;
 	HDRImage map;
@@ -42,13 +115,40 @@ extern Environment environment;
 ///////////////////////////////////////////////////////////////////////////
 // The rendered image
 ///////////////////////////////////////////////////////////////////////////
-extern struct Image
+struct Image
 {
+	// number_of_samples counts passes. Pixels can take more or fewer
+	// samples than that with adaptive sampling.
 	int width, height, number_of_samples = 0;
-	std::vector<glm::vec3> data;
-	float* getPtr()
+	// The sum of the samples of each pixel. Divide by sample_count for
+	// the pixel's value.
+	std::vector<glm::vec3> sum;
+	// Per pixel: the number of samples taken, and the sum of squared
+	// deviations of their luminance from the mean (Welford's M2)
+	std::vector<uint32_t> sample_count;
+	std::vector<float> luminance_m2;
+	// Per pixel: the number of samples to take in this pass. 0 once it
+	// has converged.
+	std::vector<uint8_t> pass_samples;
+	// Per pixel: sums over the samples of the albedo and shading normal
+	// where the camera ray first hit something, and of its distance (all
+	// zero for rays that hit nothing). The denoiser is guided by them.
+	std::vector<glm::vec3> albedo_sum, normal_sum;
+	std::vector<float> depth_sum;
+	// The denoised image, as of pass `denoised_pass` (0 if there is none),
+	// and how long denoising it took. changed_pass is the last pass that
+	// took any samples.
+	std::vector<glm::vec3> denoised;
+	int denoised_pass = 0;
+	double denoise_ms = 0.0;
+	int changed_pass = 0;
+	// Pixels that met the adaptive sampling threshold, and pixels that
+	// take samples in this pass
+	int num_converged = 0;
+	int num_active = 0;
+	glm::vec3 mean(int i) const
 	{
-		return &data[0].x;
+		return sample_count[i] > 0 ? sum[i] / float(sample_count[i]) : glm::vec3(0.0f);
 	}
 };
 extern Image rendered_image;
@@ -84,6 +184,54 @@ void restart();
 ///////////////////////////////////////////////////////////////////////////
 int getSampleCount();
 
+///////////////////////////////////////////////////////////////////////////
+/// Get the fraction of pixels that adaptive sampling considers converged
+///////////////////////////////////////////////////////////////////////////
+float getConvergedFraction();
+
+///////////////////////////////////////////////////////////////////////////
+/// Get per-tile and per-thread timings of the last pass
+///////////////////////////////////////////////////////////////////////////
+const TileStats& getTileStats();
+
+///////////////////////////////////////////////////////////////////////////
+/// Why a path ended
+///////////////////////////////////////////////////////////////////////////
+enum PathEnd
+{
+	// Left the scene (including camera rays that hit nothing)
+	PATH_ESCAPED = 0,
+	// The BSDF sample had no weight
+	PATH_ABSORBED = 1,
+	PATH_ROULETTE = 2,
+	// Shaded settings.max_bounces points
+	PATH_MAX_DEPTH = 3,
+	NUM_PATH_ENDS = 4,
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// What the paths of the last pass did, and the rays they traced
+///////////////////////////////////////////////////////////////////////////
+struct PathStats
+{
+	// depth_histogram[d] is the number of paths that shaded d surface
+	// points (0 for camera rays that hit nothing)
+	std::vector<uint64_t> depth_histogram;
+	uint64_t num_paths = 0;
+	// The number of paths that ended for each PathEnd
+	uint64_t ended[NUM_PATH_ENDS] = {};
+	float mean_depth = 0.0f;
+	// Camera rays, rays that continue paths, and shadow rays
+	uint64_t primary_rays = 0, extension_rays = 0, shadow_rays = 0;
+	// Time the threads spent in BVH traversal, and on everything else
+	// (mostly shading), summed over the threads
+	double trace_ms = 0.0, shading_ms = 0.0;
+	// Wall clock time of the pass, and rays traced per second in it
+	double pass_ms = 0.0;
+	double mrays_per_second = 0.0;
+};
+const PathStats& getPathStats();
+
 ///////////////////////////////////////////////////////////////////////////
 /// On window resize, window size is passed in, actual size of pathtraced
 /// image may be smaller (if we're subsampling for speed)
@@ -91,7 +239,31 @@ int getSampleCount();
 void resize(int w, int h);
 
 ///////////////////////////////////////////////////////////////////////////
-/// Trace one path per pixel
+/// Trace one path per pixel. Returns false, and does nothing, if the
+/// image already has max_paths_per_pixel passes.
+///////////////////////////////////////////////////////////////////////////
+bool tracePaths(const mat4& V, const mat4& P);
+
+///////////////////////////////////////////////////////////////////////////
+/// Make a running tracePaths() skip the tiles it has not started, if it
+/// refines an image (rather than starting one). The image is then not
+/// worth showing, so only use this when it is about to be restarted.
+/// Safe to call from any thread; the request holds until clearAbort().
+///////////////////////////////////////////////////////////////////////////
+void abortPass();
+void clearAbort();
+bool passAborted();
+
+///////////////////////////////////////////////////////////////////////////
+/// Denoise the rendered image into rendered_image.denoised. tracePaths()
+/// calls this by itself when settings.denoise is set.
+///////////////////////////////////////////////////////////////////////////
+void denoise();
+
+///////////////////////////////////////////////////////////////////////////
+/// Write the rendered image, or the denoised one, to `<basename>.hdr`
+/// (linear radiance) and `<basename>.png` (clamped, as shown in the
+/// viewer)
 ///////////////////////////////////////////////////////////////////////////
-void tracePaths(const mat4& V, const mat4& P);
+bool saveImage(const std::string& basename, bool denoised = false);
 }; // namespace pathtracer
@@ -0,0 +1,464 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <omp.h>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "material.h"
+#include "sampler.h"
+#include "scenes.h"
+#include "textureupload.h"
+
+using namespace glm;
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// Renders every scene with both integrators, fixed settings and a fixed
+// seed, and writes the ray throughput and timings as JSON, so that runs
+// before and after a change can be compared. Adaptive sampling is off, so
+// every run does the same work. Like the viewer, it is run from bin/.
+//
+// Then it renders the scenes again with the row loop that the tile
+// scheduler replaced, and with the tiles, to compare the two.
+//
+// It also times packing snapshots for display (packSnapshot()) on the CPU
+// at 1080p and 4K, on one thread and on all of them. Only the CPU pack is
+// timed: the bench has no GL context, so the upload of the packed texels
+// is not. The viewer shows that (GPU copy) in its GUI.
+///////////////////////////////////////////////////////////////////////////////
+struct bench_options_t
+{
+	int width = 640, height = 360;
+	int samples = 16;
+	int bounces = 8;
+	uint32_t seed = 1;
+	int bvh = pathtracer::BUILD_HIGH_QUALITY;
+	labhelper::HdrFormat environment_format = labhelper::HDR_FLOAT16;
+	std::string output = "pathtracer_bench.json";
+	bool pack_only = false;
+};
+
+struct bench_result_t
+{
+	std::string scene;
+	std::string integrator;
+	// "tiles", or "rows" for the row loop (Settings::row_scheduling)
+	std::string scheduler;
+	pathtracer::BVHStats bvh;
+	double render_s = 0.0;
+	double samples_per_second = 0.0;
+	// Summed over all passes
+	pathtracer::PathStats paths;
+	double depth_sum = 0.0;
+	// Mean over the passes of the busiest thread's time over the mean
+	// thread's, and the tiles stolen
+	double thread_imbalance = 0.0;
+	int steals = 0;
+	// The mean of the image, to tell whether a change altered the result
+	vec3 mean_radiance;
+};
+
+struct pack_result_t
+{
+	int width = 0, height = 0;
+	// How the snapshot stores the image, and the texture format
+	std::string snapshot, format;
+	int threads = 0;
+	// The median over the runs
+	double cpu_pack_ms = 0.0;
+};
+
+void printUsage(const char* program)
+{
+	cout << "Usage: " << program << " [options]\n"
+	     << "  --width W --height H  Resolution in pixels (default 640x360)\n"
+	     << "  --spp N               Samples per pixel (default 16)\n"
+	     << "  --bounces N           Max bounces per path (default 8)\n"
+	     << "  --seed N              Seed of the samplers (default 1)\n"
+	     << "  --bvh NAME            BVH build: quality, fast or compact (default quality)\n"
+	     << "  --envmap-format NAME  Environment map texels: float, half or rgb9e5 (default half)\n"
+	     << "  --output FILE         JSON results (default pathtracer_bench.json)\n"
+	     << "  --pack-only           Only time the CPU pack of snapshots for display\n";
+}
+
+// Returns false on malformed arguments
+bool parseArguments(int argc, char* argv[], bench_options_t& options)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if(arg == "--width" && has_value)
+		{
+			options.width = atoi(argv[++i]);
+		}
+		else if(arg == "--height" && has_value)
+		{
+			options.height = atoi(argv[++i]);
+		}
+		else if(arg == "--spp" && has_value)
+		{
+			options.samples = atoi(argv[++i]);
+		}
+		else if(arg == "--bounces" && has_value)
+		{
+			options.bounces = atoi(argv[++i]);
+		}
+		else if(arg == "--seed" && has_value)
+		{
+			options.seed = uint32_t(strtoul(argv[++i], nullptr, 10));
+		}
+		else if(arg == "--bvh" && has_value)
+		{
+			std::string name = argv[++i];
+			if(name == "quality")
+				options.bvh = pathtracer::BUILD_HIGH_QUALITY;
+			else if(name == "fast")
+				options.bvh = pathtracer::BUILD_FAST;
+			else if(name == "compact")
+				options.bvh = pathtracer::BUILD_COMPACT;
+			else
+				return false;
+		}
+		else if(arg == "--envmap-format" && has_value)
+		{
+			std::string name = argv[++i];
+			if(name == "float")
+				options.environment_format = labhelper::HDR_FLOAT32;
+			else if(name == "half")
+				options.environment_format = labhelper::HDR_FLOAT16;
+			else if(name == "rgb9e5")
+				options.environment_format = labhelper::HDR_RGB9E5;
+			else
+				return false;
+		}
+		else if(arg == "--output" && has_value)
+		{
+			options.output = argv[++i];
+		}
+		else if(arg == "--pack-only")
+		{
+			options.pack_only = true;
+		}
+		else
+		{
+			cout << "Unknown or incomplete argument: " << arg << "\n";
+			return false;
+		}
+	}
+	return options.width > 0 && options.height > 0 && options.samples > 0 && options.bounces >= 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Render `scene` to completion and sum the statistics of its passes
+///////////////////////////////////////////////////////////////////////////////
+bench_result_t renderScene(const std::string& name, int integrator, const bench_options_t& options)
+{
+	bench_result_t result;
+	result.scene = name;
+	result.integrator = integrator == pathtracer::INTEGRATOR_WAVEFRONT ? "wavefront" : "recursive";
+	result.scheduler = pathtracer::settings.row_scheduling ? "rows" : "tiles";
+
+	const scene_t& scene = scenes[name];
+	buildScene(scene);
+	result.bvh = pathtracer::getBVHStats();
+
+	pathtracer::settings.subsampling = 1;
+	pathtracer::settings.max_bounces = options.bounces;
+	pathtracer::settings.max_paths_per_pixel = options.samples;
+	pathtracer::settings.integrator = integrator;
+	pathtracer::settings.sampler = pathtracer::SAMPLER_SOBOL;
+	pathtracer::settings.adaptive_sampling = false;
+	pathtracer::settings.seed = options.seed;
+	pathtracer::resize(options.width, options.height);
+	pathtracer::updateShadingMaterials();
+	const mat4 view = getViewMatrix(scene.camera);
+	const mat4 projection = getProjectionMatrix(float(options.width) / float(options.height));
+
+	pathtracer::PathStats& totals = result.paths;
+	const double start = omp_get_wtime();
+	for(int i = 0; i < options.samples; i++)
+	{
+		pathtracer::tracePaths(view, projection);
+		const pathtracer::PathStats& pass = pathtracer::getPathStats();
+		totals.num_paths += pass.num_paths;
+		for(int e = 0; e < pathtracer::NUM_PATH_ENDS; e++)
+		{
+			totals.ended[e] += pass.ended[e];
+		}
+		totals.primary_rays += pass.primary_rays;
+		totals.extension_rays += pass.extension_rays;
+		totals.shadow_rays += pass.shadow_rays;
+		totals.trace_ms += pass.trace_ms;
+		totals.shading_ms += pass.shading_ms;
+		totals.pass_ms += pass.pass_ms;
+		result.depth_sum += double(pass.mean_depth) * double(pass.num_paths);
+		const pathtracer::TileStats& tiles = pathtracer::getTileStats();
+		result.thread_imbalance += tiles.thread_imbalance / options.samples;
+		result.steals += tiles.num_steals;
+	}
+	result.render_s = omp_get_wtime() - start;
+
+	const uint64_t num_rays = totals.primary_rays + totals.extension_rays + totals.shadow_rays;
+	totals.mrays_per_second = totals.pass_ms > 0.0 ? double(num_rays) / totals.pass_ms * 1e-3 : 0.0;
+	totals.mean_depth = totals.num_paths > 0 ? float(result.depth_sum / double(totals.num_paths)) : 0.0f;
+	double num_samples = 0.0;
+	dvec3 sum(0.0);
+	const pathtracer::Image& image = pathtracer::rendered_image;
+	for(size_t i = 0; i < image.sample_count.size(); i++)
+	{
+		num_samples += image.sample_count[i];
+		sum += dvec3(image.mean(int(i)));
+	}
+	result.samples_per_second = num_samples / result.render_s;
+	result.mean_radiance = vec3(sum / double(std::max<size_t>(image.sample_count.size(), 1)));
+
+	cout << "  " << name << " (" << result.integrator << ", " << result.scheduler << "): " << result.render_s
+	     << " s, " << result.samples_per_second * 1e-6 << " Msamples/s, " << totals.mrays_per_second << " Mrays/s\n";
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Render every scene with the row loop and with the tiles. Both use the
+// recursive integrator without packets, so that only the scheduling
+// differs.
+///////////////////////////////////////////////////////////////////////////////
+std::vector<bench_result_t> compareSchedulers(const bench_options_t& options)
+{
+	std::vector<bench_result_t> results;
+	const char* scene_names[] = { "Sphere", "Ship", "Refractions" };
+	pathtracer::settings.packet_tracing = false;
+	for(const char* name : scene_names)
+	{
+		pathtracer::settings.row_scheduling = true;
+		const bench_result_t rows = renderScene(name, pathtracer::INTEGRATOR_RECURSIVE, options);
+		pathtracer::settings.row_scheduling = false;
+		const bench_result_t tiles = renderScene(name, pathtracer::INTEGRATOR_RECURSIVE, options);
+		cout << "  " << name << ": tiles take " << tiles.render_s / rows.render_s
+		     << "x the time of rows, thread imbalance " << tiles.thread_imbalance << " vs "
+		     << rows.thread_imbalance << "\n";
+		results.push_back(rows);
+		results.push_back(tiles);
+	}
+	pathtracer::settings.packet_tracing = true;
+	return results;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Time packSnapshot() on the CPU for every snapshot and texture format. The rows with
+// format RGB32F time the float resolve, on one thread, that the viewer did
+// before it packed snapshots, and which left the conversion to the driver.
+///////////////////////////////////////////////////////////////////////////////
+double medianMs(const std::function<void()>& run)
+{
+	const int RUNS = 15;
+	std::vector<double> ms(RUNS);
+	run();
+	for(int i = 0; i < RUNS; i++)
+	{
+		const double start = omp_get_wtime();
+		run();
+		ms[i] = (omp_get_wtime() - start) * 1000.0;
+	}
+	std::nth_element(ms.begin(), ms.begin() + RUNS / 2, ms.end());
+	return ms[RUNS / 2];
+}
+
+std::vector<pack_result_t> benchmarkCpuPack()
+{
+	std::vector<pack_result_t> results;
+	const int max_threads = omp_get_max_threads();
+	const int sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+	for(const auto& size : sizes)
+	{
+		// Sums of up to 64 samples of colors up to 2, as after a few passes
+		pathtracer::ImageSnapshot snapshots[3];
+		pathtracer::ImageSnapshot& float_snapshot = snapshots[0];
+		const int num_pixels = size[0] * size[1];
+		float_snapshot.width = size[0];
+		float_snapshot.height = size[1];
+		float_snapshot.pixels.resize(num_pixels);
+		std::vector<float> colors(size_t(num_pixels) * 4);
+		for(int i = 0; i < num_pixels; i++)
+		{
+			const uint32_t h = pathtracer::hashUint(uint32_t(i));
+			const vec3 color = 2.0f * vec3(h & 0xff, (h >> 8) & 0xff, (h >> 16) & 0xff) / 255.0f;
+			const float count = float(1 + (h >> 26));
+			float_snapshot.pixels[i] = vec4(color * count, count);
+			colors[4 * i + 0] = color.x;
+			colors[4 * i + 1] = color.y;
+			colors[4 * i + 2] = color.z;
+			colors[4 * i + 3] = 1.0f;
+		}
+		snapshots[1] = snapshots[2] = float_snapshot;
+		snapshots[1].format = labhelper::HDR_FLOAT16;
+		snapshots[1].half_pixels.resize(colors.size());
+		labhelper::floatToHalf(colors.data(), colors.size(), snapshots[1].half_pixels.data());
+		snapshots[2].format = labhelper::HDR_RGB9E5;
+		snapshots[2].rgb9e5_pixels.resize(num_pixels);
+		labhelper::packRGB9E5(colors.data(), 4, num_pixels, snapshots[2].rgb9e5_pixels.data());
+
+		pack_result_t result;
+		result.width = size[0];
+		result.height = size[1];
+
+		std::vector<vec3> rgb(num_pixels);
+		result.snapshot = labhelper::getHdrFormatName(labhelper::HDR_FLOAT32);
+		result.format = "RGB32F";
+		result.threads = 1;
+		result.cpu_pack_ms = medianMs([&]() {
+			for(int i = 0; i < num_pixels; i++)
+			{
+				const vec4& p = float_snapshot.pixels[i];
+				rgb[i] = p.w > 0.0f ? vec3(p) / p.w : vec3(0.0f);
+			}
+		});
+		results.push_back(result);
+
+		std::vector<uint8_t> texels(size_t(num_pixels) * 8);
+		const pathtracer::UploadFormat formats[] = { pathtracer::UPLOAD_RGBA8, pathtracer::UPLOAD_RGBA16F,
+			                                         pathtracer::UPLOAD_RGB9E5 };
+		const char* format_names[] = { "RGBA8", "RGBA16F", "RGB9E5" };
+		for(int threads : { 1, max_threads })
+		{
+			omp_set_num_threads(threads);
+			result.threads = threads;
+			for(const pathtracer::ImageSnapshot& snapshot : snapshots)
+			{
+				result.snapshot = labhelper::getHdrFormatName(snapshot.format);
+				for(int f = 0; f < 3; f++)
+				{
+					result.format = format_names[f];
+					result.cpu_pack_ms = medianMs([&]() { pathtracer::packSnapshot(snapshot, formats[f], texels.data()); });
+					results.push_back(result);
+				}
+			}
+			if(max_threads == 1)
+			{
+				break;
+			}
+		}
+		omp_set_num_threads(max_threads);
+	}
+	for(const pack_result_t& r : results)
+	{
+		cout << "  CPU pack " << r.width << "x" << r.height << " " << r.snapshot << " to " << r.format << " on "
+		     << r.threads << " thread(s): " << r.cpu_pack_ms << " ms\n";
+	}
+	return results;
+}
+
+bool writeJson(const std::string& path, const bench_options_t& options, const std::vector<bench_result_t>& results,
+               const std::vector<bench_result_t>& schedulers, const std::vector<pack_result_t>& packs)
+{
+	std::ofstream out(path);
+	if(!out)
+	{
+		cout << "Failed to write " << path << "\n";
+		return false;
+	}
+	const char* bvh_names[] = { "quality", "fast", "compact" };
+	out.precision(9);
+	out << "{\n"
+	    << "  \"width\": " << options.width << ",\n"
+	    << "  \"height\": " << options.height << ",\n"
+	    << "  \"spp\": " << options.samples << ",\n"
+	    << "  \"bounces\": " << options.bounces << ",\n"
+	    << "  \"seed\": " << options.seed << ",\n"
+	    << "  \"bvh\": \"" << bvh_names[options.bvh] << "\",\n"
+	    << "  \"envmap_format\": \"" << labhelper::getHdrFormatName(options.environment_format) << "\",\n"
+	    << "  \"envmap_bytes\": " << pathtracer::environment.map.getMemoryUsage() << ",\n"
+	    << "  \"threads\": " << omp_get_max_threads() << ",\n"
+	    << "  \"runs\": [\n";
+	for(size_t i = 0; i < results.size(); i++)
+	{
+		const bench_result_t& r = results[i];
+		const pathtracer::PathStats& p = r.paths;
+		out << "    {\n"
+		    << "      \"scene\": \"" << r.scene << "\",\n"
+		    << "      \"integrator\": \"" << r.integrator << "\",\n"
+		    << "      \"bvh_build_ms\": " << r.bvh.build_ms << ",\n"
+		    << "      \"bvh_bytes\": " << r.bvh.bytes << ",\n"
+		    << "      \"triangles\": " << r.bvh.num_triangles << ",\n"
+		    << "      \"render_s\": " << r.render_s << ",\n"
+		    << "      \"msamples_per_s\": " << r.samples_per_second * 1e-6 << ",\n"
+		    << "      \"mrays_per_s\": " << p.mrays_per_second << ",\n"
+		    << "      \"primary_rays\": " << p.primary_rays << ",\n"
+		    << "      \"extension_rays\": " << p.extension_rays << ",\n"
+		    << "      \"shadow_rays\": " << p.shadow_rays << ",\n"
+		    << "      \"trace_ms\": " << p.trace_ms << ",\n"
+		    << "      \"shading_ms\": " << p.shading_ms << ",\n"
+		    << "      \"paths\": " << p.num_paths << ",\n"
+		    << "      \"mean_depth\": " << p.mean_depth << ",\n"
+		    << "      \"ended\": { \"escaped\": " << p.ended[pathtracer::PATH_ESCAPED]
+		    << ", \"absorbed\": " << p.ended[pathtracer::PATH_ABSORBED]
+		    << ", \"roulette\": " << p.ended[pathtracer::PATH_ROULETTE]
+		    << ", \"max_depth\": " << p.ended[pathtracer::PATH_MAX_DEPTH] << " },\n"
+		    << "      \"mean_radiance\": [" << r.mean_radiance.x << ", " << r.mean_radiance.y << ", "
+		    << r.mean_radiance.z << "]\n"
+		    << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ],\n"
+	    << "  \"schedulers\": [\n";
+	for(size_t i = 0; i < schedulers.size(); i++)
+	{
+		const bench_result_t& r = schedulers[i];
+		out << "    { \"scene\": \"" << r.scene << "\", \"scheduler\": \"" << r.scheduler
+		    << "\", \"render_s\": " << r.render_s << ", \"msamples_per_s\": " << r.samples_per_second * 1e-6
+		    << ", \"thread_imbalance\": " << r.thread_imbalance << ", \"steals\": " << r.steals << " }"
+		    << (i + 1 < schedulers.size() ? "," : "") << "\n";
+	}
+	out << "  ],\n"
+	    << "  \"cpu_pack\": [\n";
+	for(size_t i = 0; i < packs.size(); i++)
+	{
+		const pack_result_t& u = packs[i];
+		out << "    { \"width\": " << u.width << ", \"height\": " << u.height << ", \"snapshot\": \"" << u.snapshot
+		    << "\", \"format\": \"" << u.format << "\", \"threads\": " << u.threads << ", \"cpu_pack_ms\": " << u.cpu_pack_ms
+		    << " }" << (i + 1 < packs.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n"
+	    << "}\n";
+	return bool(out);
+}
+
+int main(int argc, char* argv[])
+{
+	bench_options_t options;
+	if(!parseArguments(argc, argv, options))
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	initializePathtracer(false, options.environment_format);
+	pathtracer::setBuildProfile(pathtracer::BuildProfile(options.bvh));
+
+	cout << "Benchmarking at " << options.width << "x" << options.height << ", " << options.samples << " spp, seed "
+	     << options.seed << "...\n";
+	std::vector<bench_result_t> results;
+	const char* scene_names[] = { "Sphere", "Ship", "Refractions" };
+	for(const char* name : scene_names)
+	{
+		if(options.pack_only)
+			break;
+		results.push_back(renderScene(name, pathtracer::INTEGRATOR_RECURSIVE, options));
+		results.push_back(renderScene(name, pathtracer::INTEGRATOR_WAVEFRONT, options));
+	}
+	std::vector<bench_result_t> schedulers;
+	if(!options.pack_only)
+	{
+		cout << "Comparing the row loop with the tiles...\n";
+		schedulers = compareSchedulers(options);
+	}
+	std::vector<pack_result_t> packs = benchmarkCpuPack();
+
+	bool ok = writeJson(options.output, options, results, schedulers, packs);
+	cleanupScenes();
+	return ok ? 0 : 1;
+}
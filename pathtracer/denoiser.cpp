@@ -0,0 +1,346 @@
+#include "denoiser.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <omp.h>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace
+{
+const int MAX_ITERATIONS = 5;
+// Wide enough for the outer taps of the last iteration, two steps of 16
+// pixels from the center
+const int PAD = 2 << (MAX_ITERATIONS - 1);
+// Added to the albedo before dividing by it, so that black surfaces and
+// the background (albedo 0) keep their illumination
+const float ALBEDO_EPSILON = 0.01f;
+// The B3 spline
+const float KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+///////////////////////////////////////////////////////////////////////////
+// The filter's images, one float plane each, with PAD pixels of border
+// around them that repeat the edge pixels so that taps never need a bounds
+// check. The illumination and its variance are read from one set of
+// planes and written to the other.
+///////////////////////////////////////////////////////////////////////////
+struct Planes
+{
+	int width = 0, height = 0, stride = 0;
+	vector<float> r[2], g[2], b[2], variance[2];
+	vector<float> luminance, nx, ny, nz, depth;
+	// Without borders: per pixel, the inverse of the luminance difference
+	// and of the depth difference (per pixel of distance) that count as one
+	vector<float> inv_luminance_scale, inv_depth_scale;
+
+	void resize(int w, int h)
+	{
+		width = w;
+		height = h;
+		stride = w + 2 * PAD;
+		const size_t padded = size_t(stride) * size_t(h + 2 * PAD);
+		for(int i = 0; i < 2; i++)
+		{
+			r[i].resize(padded);
+			g[i].resize(padded);
+			b[i].resize(padded);
+			variance[i].resize(padded);
+		}
+		luminance.resize(padded);
+		nx.resize(padded);
+		ny.resize(padded);
+		nz.resize(padded);
+		depth.resize(padded);
+		inv_luminance_scale.resize(size_t(w) * h);
+		inv_depth_scale.resize(size_t(w) * h);
+	}
+	int index(int x, int y) const
+	{
+		return (y + PAD) * stride + x + PAD;
+	}
+	// Fill the border of `plane` from its edge pixels
+	void padBorders(vector<float>& plane) const
+	{
+#pragma omp parallel for
+		for(int y = 0; y < height; y++)
+		{
+			float* row = &plane[index(0, y)];
+			std::fill(row - PAD, row, row[0]);
+			std::fill(row + width, row + width + PAD, row[width - 1]);
+		}
+		for(int y = 1; y <= PAD; y++)
+		{
+			memcpy(&plane[index(-PAD, -y)], &plane[index(-PAD, 0)], stride * sizeof(float));
+			memcpy(&plane[index(-PAD, height - 1 + y)], &plane[index(-PAD, height - 1)], stride * sizeof(float));
+		}
+	}
+};
+Planes planes;
+
+///////////////////////////////////////////////////////////////////////////
+// e^x for x <= 0, within 0.001%, and 0 below about -27 (2^-40): the
+// squares of smaller weights would be denormals, which are slow. It has no
+// branches, calls or float to int conversions, so that the filter loop
+// vectorizes with it.
+///////////////////////////////////////////////////////////////////////////
+inline float fastExp(float x)
+{
+	// e^x = 2^t = 2^i * 2^f, with i the integer nearest to t and f in
+	// [-0.5, 0.5]. t is clamped to -126 with abs() rather than a compare,
+	// and adding 1.5 * 2^23 leaves i in the low bits of the mantissa.
+	const float shifted_t = x * 1.44269504f + 126.0f;
+	const float t = 0.5f * (shifted_t + std::abs(shifted_t)) - 126.0f;
+	const float rounded = t + 12582912.0f;
+	int32_t i;
+	memcpy(&i, &rounded, sizeof(i));
+	i -= 0x4B400000;
+	const float f = t - (rounded - 12582912.0f);
+	const float p = 0.999999191f + f * (0.693121968f + f * (0.240249811f + f * (0.0559170392f + f * 0.00956051021f)));
+	const int32_t exponent = i + 127;
+	const int32_t bits = (exponent << 23) & ~((exponent - 87) >> 31);
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return p * scale;
+}
+
+inline float luminance(float r, float g, float b)
+{
+	return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add the taps `offset` values away from `count` pixels, which start at
+// `center` in the planes, to the pixels' sums of weights, weighted colors
+// and squared-weighted variances. A function of its own so that the
+// compiler can see that the sums alias nothing, and vectorize the loop.
+///////////////////////////////////////////////////////////////////////////
+void addTap(const Planes& p, int src, int center, int offset, int count, float kernel, float inv_distance,
+            const float* inv_luminance_scale, const float* inv_depth_scale, float* __restrict sum_w,
+            float* __restrict sum_r, float* __restrict sum_g, float* __restrict sum_b, float* __restrict sum_v)
+{
+	const float normal_sigma = settings.denoise_normal_sigma;
+	const float* lum = &p.luminance[center];
+	const float* nx = &p.nx[center];
+	const float* ny = &p.ny[center];
+	const float* nz = &p.nz[center];
+	const float* depth = &p.depth[center];
+	const float* r = &p.r[src][center + offset];
+	const float* g = &p.g[src][center + offset];
+	const float* b = &p.b[src][center + offset];
+	const float* variance = &p.variance[src][center + offset];
+	for(int x = 0; x < count; x++)
+	{
+		const int tap = x + offset;
+		const float normal_distance = 1.0f - (nx[x] * nx[tap] + ny[x] * ny[tap] + nz[x] * nz[tap]);
+		const float distance = std::abs(lum[x] - lum[tap]) * inv_luminance_scale[x]
+		                       + std::abs(depth[x] - depth[tap]) * inv_depth_scale[x] * inv_distance
+		                       + normal_sigma * normal_distance;
+		const float weight = kernel * fastExp(-distance);
+		sum_w[x] += weight;
+		sum_r[x] += weight * r[x];
+		sum_g[x] += weight * g[x];
+		sum_b[x] += weight * b[x];
+		sum_v[x] += weight * weight * variance[x];
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// One pass of the filter, with taps `step` pixels apart, from planes
+// `src` to planes 1 - `src`
+///////////////////////////////////////////////////////////////////////////
+void filterPass(int src, int step)
+{
+	Planes& p = planes;
+	const int w = p.width, h = p.height, dst = 1 - src;
+
+	// The noise of the center pixels, from their variance blurred over 3x3
+	// pixels (a single pixel's estimate is too noisy itself)
+	const float* variance = p.variance[src].data();
+#pragma omp parallel for
+	for(int y = 0; y < h; y++)
+	{
+		for(int x = 0; x < w; x++)
+		{
+			const int i = p.index(x, y);
+			float blurred = 0.0f;
+			for(int dy = -1; dy <= 1; dy++)
+			{
+				for(int dx = -1; dx <= 1; dx++)
+				{
+					const float weight = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+					blurred += weight * variance[i + dy * p.stride + dx];
+				}
+			}
+			p.inv_luminance_scale[y * w + x] =
+			    1.0f / (settings.denoise_color_sigma * sqrt(std::max(blurred, 0.0f)) + 1e-6f);
+		}
+	}
+	const float* r = p.r[src].data();
+	const float* g = p.g[src].data();
+	const float* b = p.b[src].data();
+	float* lum = p.luminance.data();
+	const int num_values = int(p.luminance.size());
+#pragma omp parallel for
+	for(int i = 0; i < num_values; i++)
+	{
+		lum[i] = luminance(r[i], g[i], b[i]);
+	}
+
+#pragma omp parallel
+	{
+		// The sums of one row
+		vector<float> sums(5 * w);
+		float* sum_w = sums.data();
+		float* sum_r = sum_w + w;
+		float* sum_g = sum_r + w;
+		float* sum_b = sum_g + w;
+		float* sum_v = sum_b + w;
+#pragma omp for schedule(dynamic, 4)
+		for(int y = 0; y < h; y++)
+		{
+			const int row = p.index(0, y);
+			const float center = KERNEL[2] * KERNEL[2];
+			for(int x = 0; x < w; x++)
+			{
+				const int i = row + x;
+				sum_w[x] = center;
+				sum_r[x] = center * r[i];
+				sum_g[x] = center * g[i];
+				sum_b[x] = center * b[i];
+				sum_v[x] = center * center * variance[i];
+			}
+			for(int ky = 0; ky < 5; ky++)
+			{
+				for(int kx = 0; kx < 5; kx++)
+				{
+					if(kx == 2 && ky == 2)
+						continue;
+					const int offset = ((ky - 2) * p.stride + (kx - 2)) * step;
+					const float inv_distance =
+					    1.0f / (float(step) * sqrt(float((kx - 2) * (kx - 2) + (ky - 2) * (ky - 2))));
+					addTap(p, src, row, offset, w, KERNEL[ky] * KERNEL[kx], inv_distance,
+					       &p.inv_luminance_scale[y * w], &p.inv_depth_scale[y * w], sum_w, sum_r, sum_g, sum_b,
+					       sum_v);
+				}
+			}
+			float* out_r = &p.r[dst][row];
+			float* out_g = &p.g[dst][row];
+			float* out_b = &p.b[dst][row];
+			float* out_v = &p.variance[dst][row];
+			for(int x = 0; x < w; x++)
+			{
+				const float inv_w = 1.0f / sum_w[x];
+				out_r[x] = sum_r[x] * inv_w;
+				out_g[x] = sum_g[x] * inv_w;
+				out_b[x] = sum_b[x] * inv_w;
+				out_v[x] = sum_v[x] * inv_w * inv_w;
+			}
+		}
+	}
+	p.padBorders(p.r[dst]);
+	p.padBorders(p.g[dst]);
+	p.padBorders(p.b[dst]);
+	p.padBorders(p.variance[dst]);
+}
+} // namespace
+
+void denoiseImage(const Image& image, std::vector<vec3>& denoised)
+{
+	Planes& p = planes;
+	const int w = image.width, h = image.height;
+	p.resize(w, h);
+
+	///////////////////////////////////////////////////////////////////////
+	// Split the pixels' means into albedo and illumination, and estimate
+	// the noise of the illumination
+	///////////////////////////////////////////////////////////////////////
+#pragma omp parallel for
+	for(int y = 0; y < h; y++)
+	{
+		for(int x = 0; x < w; x++)
+		{
+			const int pixel = y * w + x, i = p.index(x, y);
+			const uint32_t n = image.sample_count[pixel];
+			const float inv_n = n > 0 ? 1.0f / float(n) : 0.0f;
+			const vec3 albedo = image.albedo_sum[pixel] * inv_n + vec3(ALBEDO_EPSILON);
+			const vec3 illumination = image.sum[pixel] * inv_n / albedo;
+			p.r[0][i] = illumination.r;
+			p.g[0][i] = illumination.g;
+			p.b[0][i] = illumination.b;
+			// The variance of the mean luminance, scaled like the
+			// illumination. With too few samples to tell, the noise is
+			// taken to be as large as the value.
+			const float albedo_luminance = luminance(albedo.r, albedo.g, albedo.b);
+			const float illumination_luminance = luminance(illumination.r, illumination.g, illumination.b);
+			p.variance[0][i] = n >= 2 ? image.luminance_m2[pixel] / (float(n - 1) * float(n))
+			                                / (albedo_luminance * albedo_luminance)
+			                          : illumination_luminance * illumination_luminance;
+			// Pixels on an edge average the normals on both sides
+			const vec3 normal_sum = image.normal_sum[pixel];
+			const float length_sum = length(normal_sum);
+			const vec3 normal = length_sum > 0.0f ? normal_sum / length_sum : vec3(0.0f);
+			p.nx[i] = normal.x;
+			p.ny[i] = normal.y;
+			p.nz[i] = normal.z;
+			p.depth[i] = image.depth_sum[pixel] * inv_n;
+		}
+	}
+	p.padBorders(p.r[0]);
+	p.padBorders(p.g[0]);
+	p.padBorders(p.b[0]);
+	p.padBorders(p.variance[0]);
+	p.padBorders(p.nx);
+	p.padBorders(p.ny);
+	p.padBorders(p.nz);
+	p.padBorders(p.depth);
+
+	///////////////////////////////////////////////////////////////////////
+	// How fast the depth changes around each pixel. Of the differences to
+	// the neighbors on either side, the smaller is taken, so that pixels
+	// next to an edge are not misled by it.
+	///////////////////////////////////////////////////////////////////////
+	const float* depth = p.depth.data();
+#pragma omp parallel for
+	for(int y = 0; y < h; y++)
+	{
+		for(int x = 0; x < w; x++)
+		{
+			const int i = p.index(x, y);
+			const float dx = std::min(std::abs(depth[i + 1] - depth[i]), std::abs(depth[i] - depth[i - 1]));
+			const float dy =
+			    std::min(std::abs(depth[i + p.stride] - depth[i]), std::abs(depth[i] - depth[i - p.stride]));
+			p.inv_depth_scale[y * w + x] =
+			    1.0f / (settings.denoise_depth_sigma * std::max(dx, dy) + 1e-3f * depth[i] + 1e-6f);
+		}
+	}
+
+	const int iterations = std::max(1, std::min(settings.denoise_iterations, MAX_ITERATIONS));
+	int src = 0;
+	for(int iteration = 0; iteration < iterations; iteration++)
+	{
+		filterPass(src, 1 << iteration);
+		src = 1 - src;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Put the albedo back
+	///////////////////////////////////////////////////////////////////////
+	denoised.resize(size_t(w) * h);
+#pragma omp parallel for
+	for(int y = 0; y < h; y++)
+	{
+		for(int x = 0; x < w; x++)
+		{
+			const int pixel = y * w + x, i = p.index(x, y);
+			const uint32_t n = image.sample_count[pixel];
+			const float inv_n = n > 0 ? 1.0f / float(n) : 0.0f;
+			const vec3 albedo = image.albedo_sum[pixel] * inv_n + vec3(ALBEDO_EPSILON);
+			denoised[pixel] = vec3(p.r[src][i], p.g[src][i], p.b[src][i]) * albedo;
+		}
+	}
+}
+} // namespace pathtracer
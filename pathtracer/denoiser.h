@@ -0,0 +1,26 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+/// Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010), steered by
+/// the noise of each pixel as in SVGF (Schied et al. 2017).
+///
+/// The illumination (the image divided by the first-hit albedo) is
+/// smoothed by settings.denoise_iterations passes of a 5x5 B3-spline
+/// kernel whose taps are 1, 2, 4, 8 and 16 pixels apart. Each tap is
+/// weighted down as its luminance (relative to the standard deviation of
+/// the center's), normal or depth (relative to the local depth gradient)
+/// differs from the center's, and the variance is filtered along to steer
+/// the next pass. Multiplying by the albedo again restores the texture
+/// detail that the filter would otherwise blur.
+///
+/// Writes image.width * image.height colors to `denoised`. Runs on all
+/// OpenMP threads, and needs about 14 floats per pixel of scratch memory,
+/// which is kept for the next call.
+///////////////////////////////////////////////////////////////////////////
+void denoiseImage(const Image& image, std::vector<glm::vec3>& denoised);
+} // namespace pathtracer
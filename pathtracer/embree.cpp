@@ -1,6 +1,12 @@
 #include "embree.h"
 #include <iostream>
+#include <vector>
+#include <atomic>
 #include <map>
+#include <cmath>
+#include <omp.h>
+#include <memory>
+#include "material.h"
 
 
 using namespace std;
@@ -13,15 +19,48 @@ namespace pathtracer
 ///////////////////////////////////////////////////////////////////////////
 RTCDevice embree_device = nullptr;
 RTCScene embree_scene = nullptr;
+BuildProfile build_profile = BUILD_HIGH_QUALITY;
+BVHStats bvh_stats;
+// Whether embree_scene has been committed since it was created
+bool scene_committed = false;
+// Bytes that embree has allocated, as reported to the memory monitor
+std::atomic<int64_t> embree_bytes(0);
+
+void setBuildProfile(BuildProfile profile)
+{
+	build_profile = profile;
+}
+
+BuildProfile getBuildProfile()
+{
+	return build_profile;
+}
+
+const BVHStats& getBVHStats()
+{
+	return bvh_stats;
+}
+
+static const char* profileName(BuildProfile profile)
+{
+	switch(profile)
+	{
+	case BUILD_FAST:
+		return "fast";
+	case BUILD_COMPACT:
+		return "compact";
+	default:
+		return "high quality";
+	}
+}
 
 ///////////////////////////////////////////////////////////////////////////
-// Build an acceleration structure for the scene
+// Keeps track of embree's allocations
 ///////////////////////////////////////////////////////////////////////////
-void buildBVH()
+static bool embreeMemoryMonitor(void*, const ssize_t bytes, const bool)
 {
-	cout << "Embree building BVH..." << flush;
-	rtcCommit(embree_scene);
-	cout << "done.\n";
+	embree_bytes += int64_t(bytes);
+	return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -34,10 +73,133 @@ void embreeErrorHandler(void* userval, const RTCError code, const char* str)
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Used to map an Embree geometry ID to our scene Meshes and Materials
+// Shading attributes of one triangle, packed so that a hit touches a
+// single cache line instead of six scattered vertex attributes. Stored in
+// a CacheLineVector so that each one starts a cache line.
+///////////////////////////////////////////////////////////////////////////
+struct alignas(64) TriangleAttributes
+{
+	vec3 n0, n1, n2;
+	vec2 uv0, uv1, uv2;
+	// sqrt(uv area / object space area), how far uv moves per unit
+	float uv_scale;
+};
+static_assert(sizeof(TriangleAttributes) == 64, "TriangleAttributes should fill one cache line");
+
+///////////////////////////////////////////////////////////////////////////
+// std::vector only honours alignas() up to 16 bytes before C++17, so this
+// allocator aligns its blocks to 64 bytes itself. The pointer that
+// operator new returned is kept just before the aligned block.
+///////////////////////////////////////////////////////////////////////////
+template <typename T>
+struct CacheLineAllocator
+{
+	static const size_t ALIGNMENT = 64;
+	static_assert(alignof(T) <= ALIGNMENT, "CacheLineAllocator aligns to 64 bytes at most");
+
+	typedef T value_type;
+	template <typename U>
+	struct rebind
+	{
+		typedef CacheLineAllocator<U> other;
+	};
+	CacheLineAllocator() = default;
+	template <typename U>
+	CacheLineAllocator(const CacheLineAllocator<U>&)
+	{
+	}
+	T* allocate(size_t n)
+	{
+		const size_t bytes = n * sizeof(T);
+		size_t space = bytes + ALIGNMENT;
+		void* raw = ::operator new(space + sizeof(void*));
+		void* p = static_cast<char*>(raw) + sizeof(void*);
+		std::align(ALIGNMENT, bytes, p, space);
+		static_cast<void**>(p)[-1] = raw;
+		return static_cast<T*>(p);
+	}
+	void deallocate(T* p, size_t)
+	{
+		::operator delete(static_cast<void**>(static_cast<void*>(p))[-1]);
+	}
+};
+template <typename T, typename U>
+bool operator==(const CacheLineAllocator<T>&, const CacheLineAllocator<U>&)
+{
+	return true;
+}
+template <typename T, typename U>
+bool operator!=(const CacheLineAllocator<T>&, const CacheLineAllocator<U>&)
+{
+	return false;
+}
+template <typename T>
+using CacheLineVector = vector<T, CacheLineAllocator<T>>;
+
+///////////////////////////////////////////////////////////////////////////
+// Everything getIntersection() needs to know about an embree geometry,
+// stored in a flat table indexed by geomID.
 ///////////////////////////////////////////////////////////////////////////
-map<uint32_t, const labhelper::Model*> map_geom_ID_to_model;
-map<uint32_t, const labhelper::Mesh*> map_geom_ID_to_mesh;
+struct GeometryRecord
+{
+	const labhelper::Material* material = nullptr;
+	uint32_t material_id = 0;
+	const TriangleAttributes* triangles = nullptr;
+	const labhelper::Model* model = nullptr;
+	const labhelper::Mesh* mesh = nullptr;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// A model's meshes in object space, built once into an embree scene of
+// their own. Every time the model is added to the scene, that scene is
+// instanced with the model matrix, so repeated models share their
+// vertices and BVH.
+///////////////////////////////////////////////////////////////////////////
+struct ModelScene
+{
+	const labhelper::Model* model = nullptr;
+	RTCScene scene = nullptr;
+	bool committed = false;
+	// Indexed by the geomID of a mesh within `scene`
+	vector<GeometryRecord> geometries;
+	// Owns the memory that GeometryRecord::triangles points into
+	vector<CacheLineVector<TriangleAttributes>> triangle_attributes;
+};
+vector<ModelScene> model_scenes;
+map<const labhelper::Model*, int> model_scene_index;
+
+///////////////////////////////////////////////////////////////////////////
+// The models in the scene, in the order they were added, and the
+// instances they became
+///////////////////////////////////////////////////////////////////////////
+struct SceneModel
+{
+	int model_scene;
+	mat4 model_matrix;
+	uint32_t inst_ID;
+};
+vector<SceneModel> scene_models;
+
+///////////////////////////////////////////////////////////////////////////
+// What getIntersection() needs to know about an instance, indexed by
+// instID
+///////////////////////////////////////////////////////////////////////////
+struct InstanceRecord
+{
+	const GeometryRecord* geometries = nullptr;
+	// Takes object space normals to world space
+	mat3 normal_matrix;
+	// Object space units per world space unit, for TriangleAttributes::
+	// uv_scale (exact for uniform scaling)
+	float inverse_scale = 1.0f;
+};
+vector<InstanceRecord> instances;
+vector<const labhelper::Material*> scene_materials;
+
+const vector<const labhelper::Material*>& getSceneMaterials()
+{
+	return scene_materials;
+}
 
 void initEmbree()
 {
@@ -51,10 +213,30 @@ void initEmbree()
 		embree_is_initialized = true;
 		embree_device = rtcNewDevice();
 		rtcDeviceSetErrorFunction2(embree_device, embreeErrorHandler, nullptr);
+		rtcDeviceSetMemoryMonitorFunction2(embree_device, embreeMemoryMonitor, nullptr);
 		cout << "done.\n";
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////
+// A new embree scene. Instanced scenes are traversed with the entry
+// points of the top level scene, so all scenes enable the packet entry
+// points that this machine supports.
+///////////////////////////////////////////////////////////////////////////
+static RTCScene newScene(int scene_flags)
+{
+	int algorithm_flags = RTC_INTERSECT1;
+	if(getMaxPacketSize() >= 8)
+		algorithm_flags |= RTC_INTERSECT8;
+	if(getMaxPacketSize() >= 16)
+		algorithm_flags |= RTC_INTERSECT16;
+	if(rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT_STREAM))
+		algorithm_flags |= RTC_INTERSECT_STREAM;
+	if(build_profile == BUILD_COMPACT)
+		scene_flags |= RTC_SCENE_ROBUST;
+	return rtcDeviceNewScene(embree_device, RTCSceneFlags(scene_flags), RTCAlgorithmFlags(algorithm_flags));
+}
+
 void reinitScene()
 {
 	initEmbree();
@@ -63,75 +245,230 @@ void reinitScene()
 	{
 		rtcDeleteScene(embree_scene);
 	}
+	for(ModelScene& model_scene : model_scenes)
+	{
+		rtcDeleteScene(model_scene.scene);
+	}
+	model_scenes.clear();
+	model_scene_index.clear();
+	instances.clear();
+	scene_materials.clear();
+	scene_models.clear();
+	scene_committed = false;
+	bvh_stats.num_triangles = 0;
+	bvh_stats.num_instances = 0;
 
-	embree_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+	///////////////////////////////////////////////////////////////////////
+	// The top level scene only holds instances, and is cheap to build,
+	// so it is dynamic whatever the profile: moving a model updates its
+	// transform, without touching the model's own BVH.
+	///////////////////////////////////////////////////////////////////////
+	embree_scene = newScene(RTC_SCENE_DYNAMIC | RTC_SCENE_INCOHERENT);
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Add a model to the embree scene
+// Widest packet that embree supports on this machine (depends on ISA)
 ///////////////////////////////////////////////////////////////////////////
-void addModel(const labhelper::Model* model, const mat4& model_matrix)
+int getMaxPacketSize()
 {
-	///////////////////////////////////////////////////////////////////////
-	// Lazy initialize embree on first use
-	///////////////////////////////////////////////////////////////////////
-	if(!embree_scene)
+	initEmbree();
+	static int max_packet_size = 0;
+	if(max_packet_size == 0)
 	{
-		reinitScene();
+		max_packet_size = 1;
+		if(rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT8))
+			max_packet_size = 8;
+		if(rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT16))
+			max_packet_size = 16;
+	}
+	return max_packet_size;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build the embree scene of a model, the first time it is added, with a
+// geometry per mesh and mappings so that we can connect an embree geomID
+// to a Material. Returns its index in model_scenes.
+///////////////////////////////////////////////////////////////////////////
+static int findModelScene(const labhelper::Model* model)
+{
+	auto it = model_scene_index.find(model);
+	if(it != model_scene_index.end())
+	{
+		return it->second;
 	}
 
-	///////////////////////////////////////////////////////////////////////
-	// Transform and add each mesh in the model as a geometry in embree,
-	// and create mappings so that we can connect an embree geom_ID to a
-	// Material.
-	///////////////////////////////////////////////////////////////////////
 	cout << "Adding " << model->m_name << " to embree scene..." << flush;
+	// Model scenes are never refit (moving a model only updates its
+	// instance), so they are static in every profile
+	int scene_flags = RTC_SCENE_STATIC | RTC_SCENE_INCOHERENT;
+	if(build_profile == BUILD_HIGH_QUALITY)
+		scene_flags |= RTC_SCENE_HIGH_QUALITY;
+	else if(build_profile == BUILD_COMPACT)
+		scene_flags |= RTC_SCENE_COMPACT;
+	model_scenes.emplace_back();
+	ModelScene& model_scene = model_scenes.back();
+	model_scene.model = model;
+	model_scene.scene = newScene(scene_flags);
+
+	const uint32_t first_material = uint32_t(scene_materials.size());
+	for(const labhelper::Material& material : model->m_materials)
+	{
+		scene_materials.push_back(&material);
+		registerMaterialTextures(material);
+	}
 	for(auto& mesh : model->m_meshes)
 	{
-		uint32_t geom_ID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC,
-		                                      mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices);
-		map_geom_ID_to_mesh[geom_ID] = &mesh;
-		map_geom_ID_to_model[geom_ID] = model;
-		// Transform and commit vertices
-		vec4* embree_vertices = (vec4*)rtcMapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+		// Indexed models share vertices between triangles, so embree only
+		// needs the mesh's own vertex range.
+		uint32_t geom_ID = rtcNewTriangleMesh(model_scene.scene, RTC_GEOMETRY_STATIC, mesh.m_number_of_vertices / 3,
+		                                      mesh.m_vertex_count);
+		bvh_stats.num_triangles += mesh.m_number_of_vertices / 3;
+		// Pack the shading attributes of each triangle
+		CacheLineVector<TriangleAttributes> triangles(mesh.m_number_of_vertices / 3);
+		for(size_t t = 0; t < triangles.size(); t++)
 		{
-			embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
+			const uint32_t corner = mesh.m_start_index + uint32_t(t) * 3;
+			const uint32_t v0 = model->vertexIndex(corner + 0);
+			const uint32_t v1 = model->vertexIndex(corner + 1);
+			const uint32_t v2 = model->vertexIndex(corner + 2);
+			triangles[t].n0 = model->m_normals[v0];
+			triangles[t].n1 = model->m_normals[v1];
+			triangles[t].n2 = model->m_normals[v2];
+			triangles[t].uv0 = model->m_texture_coordinates[v0];
+			triangles[t].uv1 = model->m_texture_coordinates[v1];
+			triangles[t].uv2 = model->m_texture_coordinates[v2];
+			const vec3 p0 = model->m_positions[v0];
+			const float area = length(cross(model->m_positions[v1] - p0, model->m_positions[v2] - p0));
+			const vec2 duv1 = triangles[t].uv1 - triangles[t].uv0, duv2 = triangles[t].uv2 - triangles[t].uv0;
+			const float uv_area = std::abs(duv1.x * duv2.y - duv1.y * duv2.x);
+			triangles[t].uv_scale = area > 0.0f ? std::sqrt(uv_area / area) : 0.0f;
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		// Commit triangle indices
-		int* embree_tri_idxs = (int*)rtcMapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
+		if(model_scene.geometries.size() <= geom_ID)
+		{
+			model_scene.geometries.resize(geom_ID + 1);
+		}
+		GeometryRecord& record = model_scene.geometries[geom_ID];
+		record.material = &model->m_materials[mesh.m_material_idx];
+		record.material_id = first_material + mesh.m_material_idx;
+		record.model = model;
+		record.mesh = &mesh;
+		model_scene.triangle_attributes.push_back(std::move(triangles));
+		record.triangles = model_scene.triangle_attributes.back().data();
+		// Commit vertices, in object space
+		vec4* embree_vertices = (vec4*)rtcMapBuffer(model_scene.scene, geom_ID, RTC_VERTEX_BUFFER);
+		for(uint32_t i = 0; i < mesh.m_vertex_count; i++)
+		{
+			embree_vertices[i] = vec4(model->m_positions[mesh.m_first_vertex + i], 1.0f);
+		}
+		rtcUnmapBuffer(model_scene.scene, geom_ID, RTC_VERTEX_BUFFER);
+		// Commit triangle indices, relative to the mesh's first vertex
+		int* embree_tri_idxs = (int*)rtcMapBuffer(model_scene.scene, geom_ID, RTC_INDEX_BUFFER);
 		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
 		{
-			embree_tri_idxs[i] = i;
+			embree_tri_idxs[i] = int(model->vertexIndex(mesh.m_start_index + i) - mesh.m_first_vertex);
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
+		rtcUnmapBuffer(model_scene.scene, geom_ID, RTC_INDEX_BUFFER);
 	}
 	cout << "done.\n";
+	const int index = int(model_scenes.size()) - 1;
+	model_scene_index[model] = index;
+	return index;
+}
+
+static void setInstanceTransform(const SceneModel& scene_model)
+{
+	rtcSetTransform2(embree_scene, scene_model.inst_ID, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16,
+	                 &scene_model.model_matrix[0][0]);
+	InstanceRecord& instance = instances[scene_model.inst_ID];
+	instance.normal_matrix = transpose(inverse(mat3(scene_model.model_matrix)));
+	const float volume_scale = std::abs(determinant(mat3(scene_model.model_matrix)));
+	instance.inverse_scale = volume_scale > 0.0f ? 1.0f / std::cbrt(volume_scale) : 0.0f;
+}
+
+int addModel(const labhelper::Model* model, const mat4& model_matrix)
+{
+	///////////////////////////////////////////////////////////////////////
+	// Lazy initialize embree on first use
+	///////////////////////////////////////////////////////////////////////
+	if(!embree_scene)
+	{
+		reinitScene();
+	}
+
+	SceneModel scene_model;
+	scene_model.model_scene = findModelScene(model);
+	scene_model.model_matrix = model_matrix;
+	scene_model.inst_ID = rtcNewInstance2(embree_scene, model_scenes[scene_model.model_scene].scene);
+	if(instances.size() <= scene_model.inst_ID)
+	{
+		instances.resize(scene_model.inst_ID + 1);
+	}
+	instances[scene_model.inst_ID].geometries = model_scenes[scene_model.model_scene].geometries.data();
+	setInstanceTransform(scene_model);
+	bvh_stats.num_instances++;
+	scene_models.push_back(scene_model);
+	return int(scene_models.size()) - 1;
+}
+
+void setModelTransform(int model_index, const mat4& model_matrix)
+{
+	SceneModel& scene_model = scene_models[model_index];
+	scene_model.model_matrix = model_matrix;
+	setInstanceTransform(scene_model);
+	rtcUpdate(embree_scene, scene_model.inst_ID);
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Extract an intersection from an embree ray.
+// Build an acceleration structure for the scene: a BVH per model, with
+// the flags of the build profile, the first time, and the top level BVH
+// over the instances. Once that has been built, only the top level BVH
+// is updated to the models that moved.
+///////////////////////////////////////////////////////////////////////////
+void buildBVH()
+{
+	const bool refit = scene_committed;
+	cout << "Embree " << (refit ? "refitting" : "building") << " BVH (" << profileName(build_profile) << ")..."
+	     << flush;
+	const double start = omp_get_wtime();
+	// Instanced scenes have to be committed before the scene that
+	// instances them
+	for(ModelScene& model_scene : model_scenes)
+	{
+		if(!model_scene.committed)
+		{
+			rtcCommit(model_scene.scene);
+			model_scene.committed = true;
+		}
+	}
+	rtcCommit(embree_scene);
+	scene_committed = true;
+	bvh_stats.profile = build_profile;
+	bvh_stats.refit = refit;
+	bvh_stats.build_ms = (omp_get_wtime() - start) * 1000.0;
+	bvh_stats.bytes = size_t(std::max<int64_t>(embree_bytes.load(), 0));
+	cout << "done (" << bvh_stats.build_ms << " ms, " << double(bvh_stats.bytes) / (1024.0 * 1024.0) << " MB).\n";
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Extract an intersection from an embree ray. The hit data of an instance
+// is in the object space of its model, except for the distance along the
+// ray, so the normals are transformed to world space.
 ///////////////////////////////////////////////////////////////////////////
 Intersection getIntersection(const Ray& r)
 {
-	const labhelper::Model* model = map_geom_ID_to_model[r.geomID];
-	const labhelper::Mesh* mesh = map_geom_ID_to_mesh[r.geomID];
+	const InstanceRecord& instance = instances[r.instID];
+	const GeometryRecord& record = instance.geometries[r.geomID];
+	const TriangleAttributes& tri = record.triangles[r.primID];
 	Intersection i;
-	i.material = &(model->m_materials[mesh->m_material_idx]);
-	vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-	vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-	vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+	i.material = record.material;
+	i.material_id = record.material_id;
 	float w = 1.0f - (r.u + r.v);
-	i.shading_normal = normalize(w * n0 + r.u * n1 + r.v * n2);
-	i.geometry_normal = -normalize(r.n);
+	i.shading_normal = normalize(instance.normal_matrix * (w * tri.n0 + r.u * tri.n1 + r.v * tri.n2));
+	i.geometry_normal = -normalize(instance.normal_matrix * r.n);
 	i.position = r.o + r.tfar * r.d;
 	i.wo = normalize(-r.d);
-
-	vec2 uv0 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-	vec2 uv1 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-	vec2 uv2 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
-	i.uv = w * uv0 + r.u * uv1 + r.v * uv2;
+	i.uv = w * tri.uv0 + r.u * tri.uv1 + r.v * tri.uv2;
+	i.uv_scale = tri.uv_scale * instance.inverse_scale;
 	return i;
 }
 
@@ -153,4 +490,70 @@ bool occluded(Ray& r)
 	rtcOccluded(embree_scene, *((RTCRay*)&r));
 	return r.geomID != RTC_INVALID_GEOMETRY_ID;
 }
-} // namespace pathtracer
\ No newline at end of file
+
+///////////////////////////////////////////////////////////////////////////
+// Ray packet versions of intersect() and occluded()
+///////////////////////////////////////////////////////////////////////////
+void intersect(RayPacket8& p, const int* valid)
+{
+	rtcIntersect8(valid, embree_scene, *((RTCRay8*)&p));
+}
+
+void intersect(RayPacket16& p, const int* valid)
+{
+	rtcIntersect16(valid, embree_scene, *((RTCRay16*)&p));
+}
+
+void occluded(RayPacket8& p, const int* valid)
+{
+	rtcOccluded8(valid, embree_scene, *((RTCRay8*)&p));
+}
+
+void occluded(RayPacket16& p, const int* valid)
+{
+	rtcOccluded16(valid, embree_scene, *((RTCRay16*)&p));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Ray stream versions of intersect() and occluded(). Falls back to one
+// ray at a time if embree was built without stream support.
+///////////////////////////////////////////////////////////////////////////
+static bool streamSupported()
+{
+	static int supported = -1;
+	if(supported < 0)
+	{
+		initEmbree();
+		supported = rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT_STREAM) ? 1 : 0;
+	}
+	return supported == 1;
+}
+
+void intersect(Ray* rays, size_t count, bool coherent)
+{
+	if(!streamSupported())
+	{
+		for(size_t i = 0; i < count; i++)
+			intersect(rays[i]);
+		return;
+	}
+	RTCIntersectContext context;
+	context.flags = coherent ? RTC_INTERSECT_COHERENT : RTC_INTERSECT_INCOHERENT;
+	context.userRayExt = nullptr;
+	rtcIntersect1M(embree_scene, &context, (RTCRay*)rays, count, sizeof(Ray));
+}
+
+void occluded(Ray* rays, size_t count)
+{
+	if(!streamSupported())
+	{
+		for(size_t i = 0; i < count; i++)
+			occluded(rays[i]);
+		return;
+	}
+	RTCIntersectContext context;
+	context.flags = RTC_INTERSECT_INCOHERENT;
+	context.userRayExt = nullptr;
+	rtcOccluded1M(embree_scene, &context, (RTCRay*)rays, count, sizeof(Ray));
+}
+} // namespace pathtracer
@@ -28,8 +28,15 @@ struct Intersection
 	// Interpolated UV coordinates between the 3 vertices of the triangle
 	glm::vec2 uv;
 
+	// How far uv moves per unit of world space across the triangle, to
+	// turn a ray's footprint into a texture level of detail
+	float uv_scale;
+
 	// Material information of the hit triangle
 	const labhelper::Material* material;
+
+	// Index of the material in getSceneMaterials()
+	uint32_t material_id;
 };
 
 ///////////////////////////////////////////////////////////////////////////
@@ -82,16 +89,113 @@ struct RTCORE_ALIGN(16) Ray
 	uint32_t instID = RTC_INVALID_GEOMETRY_ID;
 };
 
+///////////////////////////////////////////////////////////////////////////
+// A packet of N rays in structure-of-arrays layout. The memory layout is
+// the same as embree's RTCRay8 / RTCRay16, so a packet can be handed to
+// rtcIntersect8/16 directly, just like a Ray is handed to rtcIntersect.
+///////////////////////////////////////////////////////////////////////////
+template <int N>
+struct RTCORE_ALIGN(64) RayPacket
+{
+	static const int size = N;
+
+	// Ray data
+	float ox[N], oy[N], oz[N];
+	float dx[N], dy[N], dz[N];
+	float tnear[N], tfar[N];
+	float time[N];
+	uint32_t mask[N];
+
+	// Hit data (do not modify)
+	float nx[N], ny[N], nz[N];
+	float u[N], v[N];
+	uint32_t geomID[N], primID[N], instID[N];
+
+	// Store a ray in lane i (and clear the hit data of that lane)
+	void set(int i, const Ray& r)
+	{
+		ox[i] = r.o.x, oy[i] = r.o.y, oz[i] = r.o.z;
+		dx[i] = r.d.x, dy[i] = r.d.y, dz[i] = r.d.z;
+		tnear[i] = r.tnear, tfar[i] = r.tfar;
+		time[i] = r.time;
+		mask[i] = r.mask;
+		geomID[i] = primID[i] = instID[i] = RTC_INVALID_GEOMETRY_ID;
+	}
+
+	// Extract the ray (and hit data) of lane i
+	Ray get(int i) const
+	{
+		Ray r(glm::vec3(ox[i], oy[i], oz[i]), glm::vec3(dx[i], dy[i], dz[i]), tnear[i], tfar[i]);
+		r.time = time[i];
+		r.mask = mask[i];
+		r.n = glm::vec3(nx[i], ny[i], nz[i]);
+		r.u = u[i];
+		r.v = v[i];
+		r.geomID = geomID[i];
+		r.primID = primID[i];
+		r.instID = instID[i];
+		return r;
+	}
+};
+typedef RayPacket<8> RayPacket8;
+typedef RayPacket<16> RayPacket16;
+
 ///////////////////////////////////////////////////////////////////////////
 // Scene functions
 ///////////////////////////////////////////////////////////////////////////
 
-// Add a model to the embree scene
-void addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
+///////////////////////////////////////////////////////////////////////////
+// How embree builds the BVHs of the models in the scene. Takes effect at
+// the next reinitScene().
+///////////////////////////////////////////////////////////////////////////
+enum BuildProfile
+{
+	// SAH with spatial splits: slowest to build, fastest to trace. For
+	// final renders.
+	BUILD_HIGH_QUALITY = 0,
+	// Embree's standard SAH build, without spatial splits: quicker to
+	// build, a little slower to trace. For interactive editing.
+	BUILD_FAST = 1,
+	// Memory conservative BVH and robust traversal. For machines that are
+	// short on memory.
+	BUILD_COMPACT = 2,
+};
+void setBuildProfile(BuildProfile profile);
+BuildProfile getBuildProfile();
 
-// Build an acceleration structure for the scene
+///////////////////////////////////////////////////////////////////////////
+// What the last buildBVH() did
+///////////////////////////////////////////////////////////////////////////
+struct BVHStats
+{
+	BuildProfile profile = BUILD_HIGH_QUALITY;
+	// Whether only the instances were updated, rather than a full build
+	bool refit = false;
+	double build_ms = 0.0;
+	// Memory that embree holds for the scene: the BVH and the vertex and
+	// index buffers
+	size_t bytes = 0;
+	// Triangles of the distinct models, and the instances of them
+	size_t num_triangles = 0;
+	size_t num_instances = 0;
+};
+const BVHStats& getBVHStats();
+
+// Add an instance of a model to the embree scene. The model's geometry is
+// only built the first time it is added. Returns the index of the
+// instance, for setModelTransform().
+int addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
+
+// Move a model that has been added. Takes effect at the next buildBVH(),
+// which only updates the top level BVH.
+void setModelTransform(int model_index, const glm::mat4& model_matrix);
+
+// Build (or update) the acceleration structure for the scene
 void buildBVH();
 
+// The materials of all models in the scene, in the order they were added
+const std::vector<const labhelper::Material*>& getSceneMaterials();
+
 ///////////////////////////////////////////////////////////////////////////
 // Reinitialize the scene
 ///////////////////////////////////////////////////////////////////////////
@@ -114,4 +218,40 @@ Intersection getIntersection(const Ray& r);
 // (does not return an intersection, as it doesn't find the closest one)
 bool occluded(Ray& r);
 
+///////////////////////////////////////////////////////////////////////////
+// Ray packet functions. `valid` has one int per lane: -1 for lanes that
+// should be traced, 0 for lanes that should be ignored.
+///////////////////////////////////////////////////////////////////////////
+
+// Widest packet (1, 8 or 16) that embree supports on this machine
+int getMaxPacketSize();
+
+// Find the closest intersection of every active lane
+void intersect(RayPacket8& p, const int* valid);
+void intersect(RayPacket16& p, const int* valid);
+
+// Set geomID of every active lane that is occluded to something other
+// than RTC_INVALID_GEOMETRY_ID
+void occluded(RayPacket8& p, const int* valid);
+void occluded(RayPacket16& p, const int* valid);
+
+///////////////////////////////////////////////////////////////////////////
+// Ray stream functions. Trace `count` independent rays stored
+// contiguously, letting embree reorder them internally.
+///////////////////////////////////////////////////////////////////////////
+
+// Find the closest intersection of every ray in the stream
+void intersect(Ray* rays, size_t count, bool coherent);
+
+// Set geomID of every occluded ray to something other than
+// RTC_INVALID_GEOMETRY_ID
+void occluded(Ray* rays, size_t count);
+
+// Intersection information for lane i of a packet
+template <int N>
+Intersection getIntersection(const RayPacket<N>& p, int i)
+{
+	return getIntersection(p.get(i));
+}
+
 } // namespace pathtracer
@@ -0,0 +1,340 @@
+#include <stb_image.h>
+#include <stb_image_write.h>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace glm;
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// Compares a render with a reference image, for instance two headless
+// renders of the same scene and seed before and after an optimization:
+//
+//   pathtracer --headless --scene Ship --seed 1 --adaptive 0 --output ref
+//   (change something)
+//   pathtracer --headless --scene Ship --seed 1 --adaptive 0 --output test
+//   imagediff ref.hdr test.hdr
+//
+// It prints the RMSE, the relative MSE and a FLIP-like perceptual error,
+// and fails (exit code 2) if one of them is over its threshold. Identical
+// images give 0 for all three.
+///////////////////////////////////////////////////////////////////////////////
+struct diff_options_t
+{
+	std::string reference, test;
+	// Negative thresholds are not checked
+	float max_rmse = -1.0f, max_relmse = -1.0f, max_flip = -1.0f;
+	// Where to write the FLIP-like error map, if anywhere
+	std::string heatmap;
+};
+
+struct image_t
+{
+	int width = 0, height = 0;
+	std::vector<vec3> pixels;
+};
+
+// .hdr images are read as they are, 8-bit images are converted to linear
+bool loadImage(const std::string& path, image_t& image)
+{
+	int components;
+	float* data = stbi_loadf(path.c_str(), &image.width, &image.height, &components, 3);
+	if(data == nullptr)
+	{
+		cout << "Failed to load image: " << path << "\n";
+		return false;
+	}
+	image.pixels.resize(size_t(image.width) * image.height);
+	for(size_t i = 0; i < image.pixels.size(); i++)
+	{
+		image.pixels[i] = vec3(data[i * 3 + 0], data[i * 3 + 1], data[i * 3 + 2]);
+	}
+	stbi_image_free(data);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A simplified FLIP (Andersson et al., "FLIP: A Difference Evaluator for
+// Alternating Images"). Both images are tone mapped, converted to
+// CIELAB and low-pass filtered, roughly as the eye sees them from a
+// monitor, and the color difference (HyAB) is then amplified where the
+// edges of the two images differ. Per pixel errors are in [0, 1].
+///////////////////////////////////////////////////////////////////////////////
+namespace flip
+{
+const float GAUSSIAN_SIGMA = 1.0f;
+
+vec3 toneMap(const vec3& c)
+{
+	// Reinhard. CIELAB takes linear values, so there is no sRGB encoding.
+	return clamp(c / (vec3(1.0f) + c), vec3(0.0f), vec3(1.0f));
+}
+
+float labF(float t)
+{
+	const float delta = 6.0f / 29.0f;
+	return t > delta * delta * delta ? std::cbrt(t) : t / (3.0f * delta * delta) + 4.0f / 29.0f;
+}
+
+// Linear sRGB to CIELAB (D65)
+vec3 toLab(const vec3& rgb)
+{
+	const float x = 0.4124f * rgb.r + 0.3576f * rgb.g + 0.1805f * rgb.b;
+	const float y = 0.2126f * rgb.r + 0.7152f * rgb.g + 0.0722f * rgb.b;
+	const float z = 0.0193f * rgb.r + 0.1192f * rgb.g + 0.9505f * rgb.b;
+	const float fx = labF(x / 0.9505f), fy = labF(y), fz = labF(z / 1.089f);
+	return vec3(116.0f * fy - 16.0f, 500.0f * (fx - fy), 200.0f * (fy - fz));
+}
+
+// Separable Gaussian blur with clamped edges
+std::vector<vec3> blur(const std::vector<vec3>& in, int w, int h, float sigma)
+{
+	const int radius = int(std::ceil(3.0f * sigma));
+	std::vector<float> kernel(2 * radius + 1);
+	float sum = 0.0f;
+	for(int i = -radius; i <= radius; i++)
+	{
+		kernel[i + radius] = std::exp(-float(i * i) / (2.0f * sigma * sigma));
+		sum += kernel[i + radius];
+	}
+	for(float& k : kernel)
+	{
+		k /= sum;
+	}
+	std::vector<vec3> tmp(in.size()), out(in.size());
+	for(int y = 0; y < h; y++)
+	{
+		for(int x = 0; x < w; x++)
+		{
+			vec3 v(0.0f);
+			for(int i = -radius; i <= radius; i++)
+			{
+				v += kernel[i + radius] * in[y * w + std::min(std::max(x + i, 0), w - 1)];
+			}
+			tmp[y * w + x] = v;
+		}
+	}
+	for(int y = 0; y < h; y++)
+	{
+		for(int x = 0; x < w; x++)
+		{
+			vec3 v(0.0f);
+			for(int i = -radius; i <= radius; i++)
+			{
+				v += kernel[i + radius] * tmp[std::min(std::max(y + i, 0), h - 1) * w + x];
+			}
+			out[y * w + x] = v;
+		}
+	}
+	return out;
+}
+
+// Sobel gradient magnitude of L*, scaled to about [0, 1]
+std::vector<float> edges(const std::vector<vec3>& lab, int w, int h)
+{
+	std::vector<float> out(lab.size());
+	auto L = [&](int x, int y) {
+		return lab[std::min(std::max(y, 0), h - 1) * w + std::min(std::max(x, 0), w - 1)].x / 100.0f;
+	};
+	for(int y = 0; y < h; y++)
+	{
+		for(int x = 0; x < w; x++)
+		{
+			const float gx = (L(x + 1, y - 1) + 2.0f * L(x + 1, y) + L(x + 1, y + 1))
+			                 - (L(x - 1, y - 1) + 2.0f * L(x - 1, y) + L(x - 1, y + 1));
+			const float gy = (L(x - 1, y + 1) + 2.0f * L(x, y + 1) + L(x + 1, y + 1))
+			                 - (L(x - 1, y - 1) + 2.0f * L(x, y - 1) + L(x + 1, y - 1));
+			out[y * w + x] = std::min(1.0f, std::sqrt(gx * gx + gy * gy) / 4.0f);
+		}
+	}
+	return out;
+}
+
+std::vector<float> errorMap(const image_t& reference, const image_t& test)
+{
+	const int w = reference.width, h = reference.height;
+	std::vector<vec3> lab_ref(reference.pixels.size()), lab_test(test.pixels.size());
+	for(size_t i = 0; i < lab_ref.size(); i++)
+	{
+		lab_ref[i] = toLab(toneMap(reference.pixels[i]));
+		lab_test[i] = toLab(toneMap(test.pixels[i]));
+	}
+	const std::vector<float> edges_ref = edges(lab_ref, w, h), edges_test = edges(lab_test, w, h);
+	lab_ref = blur(lab_ref, w, h, GAUSSIAN_SIGMA);
+	lab_test = blur(lab_test, w, h, GAUSSIAN_SIGMA);
+
+	// HyAB distance between black and white, so color errors land in [0, 1]
+	const float max_distance = 100.0f + std::sqrt(2.0f) * 128.0f;
+	std::vector<float> error(lab_ref.size());
+	for(size_t i = 0; i < error.size(); i++)
+	{
+		const vec3 d = lab_ref[i] - lab_test[i];
+		const float hyab = std::abs(d.x) + std::sqrt(d.y * d.y + d.z * d.z);
+		// Small differences are amplified, as in FLIP
+		const float color_error = std::pow(std::min(1.0f, hyab / max_distance), 0.7f);
+		const float feature_error = std::abs(edges_ref[i] - edges_test[i]);
+		error[i] = color_error > 0.0f ? std::pow(color_error, 1.0f - feature_error) : 0.0f;
+	}
+	return error;
+}
+} // namespace flip
+
+bool writeHeatmap(const std::string& path, const std::vector<float>& error, int w, int h)
+{
+	std::vector<uint8_t> rgb(error.size() * 3);
+	for(int y = 0; y < h; y++)
+	{
+		for(int x = 0; x < w; x++)
+		{
+			const float e = error[y * w + x];
+			const vec3 c = mix(vec3(0.0f, 0.0f, 0.2f), vec3(1.0f, 1.0f, 0.0f), e);
+			for(int i = 0; i < 3; i++)
+			{
+				rgb[(y * w + x) * 3 + i] = uint8_t(255.0f * c[i] + 0.5f);
+			}
+		}
+	}
+	if(!stbi_write_png(path.c_str(), w, h, 3, rgb.data(), 0))
+	{
+		cout << "Failed to write " << path << "\n";
+		return false;
+	}
+	return true;
+}
+
+void printUsage(const char* program)
+{
+	cout << "Usage: " << program << " REFERENCE TEST [options]\n"
+	     << "  --max-rmse X          Fail if the RMSE is over X\n"
+	     << "  --max-relmse X        Fail if the relative MSE is over X\n"
+	     << "  --max-flip X          Fail if the mean FLIP-like error is over X\n"
+	     << "  --heatmap FILE        Write the FLIP-like error per pixel to FILE (.png)\n"
+	     << "Exits with 0 if the images match, 2 if a threshold is exceeded and 1 on errors.\n";
+}
+
+// Returns false on malformed arguments
+bool parseArguments(int argc, char* argv[], diff_options_t& options)
+{
+	std::vector<std::string> files;
+	for(int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if(arg == "--max-rmse" && has_value)
+		{
+			options.max_rmse = float(atof(argv[++i]));
+		}
+		else if(arg == "--max-relmse" && has_value)
+		{
+			options.max_relmse = float(atof(argv[++i]));
+		}
+		else if(arg == "--max-flip" && has_value)
+		{
+			options.max_flip = float(atof(argv[++i]));
+		}
+		else if(arg == "--heatmap" && has_value)
+		{
+			options.heatmap = argv[++i];
+		}
+		else if(arg.compare(0, 2, "--") != 0)
+		{
+			files.push_back(arg);
+		}
+		else
+		{
+			cout << "Unknown or incomplete argument: " << arg << "\n";
+			return false;
+		}
+	}
+	if(files.size() != 2)
+	{
+		return false;
+	}
+	options.reference = files[0];
+	options.test = files[1];
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	diff_options_t options;
+	if(!parseArguments(argc, argv, options))
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+	image_t reference, test;
+	if(!loadImage(options.reference, reference) || !loadImage(options.test, test))
+	{
+		return 1;
+	}
+	if(reference.width != test.width || reference.height != test.height)
+	{
+		cout << "Image sizes differ: " << reference.width << "x" << reference.height << " and " << test.width << "x"
+		     << test.height << "\n";
+		return 1;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// RMSE and relative MSE (which does not let bright pixels dominate),
+	// over all channels
+	///////////////////////////////////////////////////////////////////////////
+	double squared_error = 0.0, relative_squared_error = 0.0;
+	size_t differing_pixels = 0;
+	for(size_t i = 0; i < reference.pixels.size(); i++)
+	{
+		const vec3 d = test.pixels[i] - reference.pixels[i];
+		const vec3 r = reference.pixels[i];
+		squared_error += double(dot(d, d));
+		relative_squared_error += double(dot(d * d, vec3(1.0f) / (r * r + vec3(0.01f))));
+		if(d != vec3(0.0f))
+			differing_pixels++;
+	}
+	const double num_values = 3.0 * double(std::max<size_t>(reference.pixels.size(), 1));
+	const double rmse = std::sqrt(squared_error / num_values);
+	const double relmse = relative_squared_error / num_values;
+
+	const std::vector<float> error = flip::errorMap(reference, test);
+	double flip_sum = 0.0;
+	float flip_max = 0.0f;
+	for(float e : error)
+	{
+		flip_sum += e;
+		flip_max = std::max(flip_max, e);
+	}
+	const double flip_mean = flip_sum / double(std::max<size_t>(error.size(), 1));
+
+	cout << "Pixels that differ: " << differing_pixels << " of " << reference.pixels.size() << "\n"
+	     << "RMSE:      " << rmse << "\n"
+	     << "relMSE:    " << relmse << "\n"
+	     << "FLIP-like: " << flip_mean << " mean, " << flip_max << " max\n";
+
+	if(!options.heatmap.empty() && !writeHeatmap(options.heatmap, error, reference.width, reference.height))
+	{
+		return 1;
+	}
+
+	bool ok = true;
+	if(options.max_rmse >= 0.0f && rmse > options.max_rmse)
+	{
+		cout << "RMSE is over " << options.max_rmse << "\n";
+		ok = false;
+	}
+	if(options.max_relmse >= 0.0f && relmse > options.max_relmse)
+	{
+		cout << "relMSE is over " << options.max_relmse << "\n";
+		ok = false;
+	}
+	if(options.max_flip >= 0.0f && flip_mean > options.max_flip)
+	{
+		cout << "FLIP-like error is over " << options.max_flip << "\n";
+		ok = false;
+	}
+	return ok ? 0 : 2;
+}
@@ -0,0 +1,238 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "sampling.h"
+#include "sampler.h"
+#include "tiles.h"
+
+///////////////////////////////////////////////////////////////////////////
+// Building blocks shared by the integrators in Pathtracer.cpp and
+// wavefront.cpp. Not part of the public pathtracer interface.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+struct ShadingMaterial;
+
+///////////////////////////////////////////////////////////////////////////
+/// Return the radiance from a certain direction wi from the environment
+/// map, filtered over a cone of directions `spread_angle` radians wide
+/// (see PrimaryRayGenerator::spread_angle).
+///////////////////////////////////////////////////////////////////////////
+vec3 Lenvironment(const vec3& wi, float spread_angle = 0.0f);
+// The same for `count` directions at once
+void Lenvironment(const vec3* wi, int count, float spread_angle, vec3* L);
+
+///////////////////////////////////////////////////////////////////////////
+/// The width in uv of a ray cone that is `cone_width` wide where it hits
+/// (Akenine-Möller et al. 2019, "Texture Level of Detail Strategies for
+/// Real-Time Ray Tracing"). The footprint is stretched by the angle of
+/// incidence, up to 10 times at grazing angles, where a single level of
+/// detail would blur far more across than along the ray.
+///////////////////////////////////////////////////////////////////////////
+inline float uvFootprint(const Intersection& hit, float cone_width)
+{
+	return cone_width * hit.uv_scale / std::max(std::abs(dot(hit.wo, hit.geometry_normal)), 0.1f);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The shadow ray from a hit point towards the point light
+///////////////////////////////////////////////////////////////////////////
+Ray pointLightShadowRay(const Intersection& hit);
+
+///////////////////////////////////////////////////////////////////////////
+/// Multiple importance sampling weight for a sample taken with pdf `a`,
+/// when another strategy could have taken it with pdf `b` (the power
+/// heuristic)
+///////////////////////////////////////////////////////////////////////////
+inline float powerHeuristic(float a, float b)
+{
+	const float a2 = a * a, b2 = b * b;
+	return a2 + b2 > 0.0f ? a2 / (a2 + b2) : 0.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The MIS weight of a light found by a ray that was sampled with
+/// `bsdf_pdf`, where sampling the light would have had `light_pdf`. A
+/// `bsdf_pdf` of 0 marks rays that light sampling can not produce (camera
+/// rays and specular bounces), which count in full.
+///////////////////////////////////////////////////////////////////////////
+inline float bsdfSampleWeight(float bsdf_pdf, float light_pdf)
+{
+	return bsdf_pdf > 0.0f ? powerHeuristic(bsdf_pdf, light_pdf) : 1.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The solid angle pdf with which sampleEnvironment() picks `wi`. 0 if
+/// the environment is not sampled.
+///////////////////////////////////////////////////////////////////////////
+float environmentPdf(const vec3& wi);
+
+///////////////////////////////////////////////////////////////////////////
+/// Next-event estimation for the environment map: pick a direction with
+/// `u`, proportional to the map's luminance, and compute the radiance it
+/// sends through `mat` towards hit.wo, MIS weighted against sampling
+/// `mat`. Returns false if there is nothing to add, otherwise
+/// `contribution` counts if `shadow_ray` is unoccluded.
+///////////////////////////////////////////////////////////////////////////
+bool sampleEnvironment(const Intersection& hit, const ShadingMaterial& mat, const glm::vec2& u, Ray& shadow_ray,
+                       vec3& contribution);
+
+///////////////////////////////////////////////////////////////////////////
+/// Next-event estimation for a disc light: pick a point on the disc with
+/// `u` and compute the radiance it sends through `mat` towards hit.wo,
+/// MIS weighted against sampling `mat`. Returns false if there is nothing
+/// to add, otherwise `contribution` counts if `shadow_ray` is unoccluded.
+///////////////////////////////////////////////////////////////////////////
+bool sampleDiscLight(const DiscLight& light, const Intersection& hit, const ShadingMaterial& mat,
+                     const glm::vec2& u, Ray& shadow_ray, vec3& contribution);
+
+///////////////////////////////////////////////////////////////////////////
+/// The radiance of the disc lights that a BSDF-sampled ray passes through
+/// before it hits something (at ray.tfar), MIS weighted against sampling
+/// the lights. `bsdf_pdf` is the pdf with which ray.d was chosen (see
+/// bsdfSampleWeight()).
+///////////////////////////////////////////////////////////////////////////
+vec3 discLightsAlongRay(const Ray& ray, float bsdf_pdf);
+
+///////////////////////////////////////////////////////////////////////////
+/// Russian roulette before tracing the ray that leaves the shaded point
+/// `bounce` (0 for the primary hit). Returns false if the path should
+/// end, otherwise divides `path_throughput` by the survival probability.
+///////////////////////////////////////////////////////////////////////////
+bool russianRoulette(vec3& path_throughput, int bounce);
+
+///////////////////////////////////////////////////////////////////////////
+/// Count a finished path in the PathStats of the pass. `depth` is the
+/// number of surface points it shaded.
+///////////////////////////////////////////////////////////////////////////
+void recordPathEnd(int depth, PathEnd reason);
+
+enum RayType
+{
+	PRIMARY_RAYS = 0,
+	EXTENSION_RAYS = 1,
+	SHADOW_RAYS = 2,
+	NUM_RAY_TYPES = 3,
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// Count `count` rays that were traced in one call, which started at
+/// omp_get_wtime() `start`, in the PathStats of the pass
+///////////////////////////////////////////////////////////////////////////
+void recordRays(RayType type, size_t count, double start);
+
+///////////////////////////////////////////////////////////////////////////
+/// Used to homogenize points transformed with projection matrices
+///////////////////////////////////////////////////////////////////////////
+inline glm::vec3 homogenize(const glm::vec4& p)
+{
+	return glm::vec3(p * (1.f / p.w));
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Relative luminance of a linear RGB color
+///////////////////////////////////////////////////////////////////////////
+inline float luminance(const vec3& c)
+{
+	return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The index of the next sample of pixel (x, y)
+///////////////////////////////////////////////////////////////////////////
+inline uint32_t pixelSampleIndex(int x, int y)
+{
+	return rendered_image.sample_count[y * rendered_image.width + x];
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Whether pixel (x, y) takes a sample in round `round` of this pass.
+/// A pass runs as many rounds as any pixel takes samples.
+///////////////////////////////////////////////////////////////////////////
+inline bool pixelActive(int x, int y, int round)
+{
+	return rendered_image.pass_samples[y * rendered_image.width + x] > round;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// The camera for one pass
+///////////////////////////////////////////////////////////////////////////
+struct PrimaryRayGenerator
+{
+	vec3 camera_pos;
+	mat4 inv_PV;
+	// The angle between the rays through neighbouring pixels. Paths carry
+	// a cone of this spread, whose width where it hits picks the mip level
+	// of texture lookups. The spread is kept at every bounce, which is
+	// exact for mirrors and sharper than needed for rough surfaces.
+	float spread_angle;
+
+	// Create a ray that starts in the camera position and points toward
+	// a jittered position in pixel (x, y) on a virtual screen. Starts the
+	// pixel's next sample in the calling thread's sampler.
+	Ray generate(int x, int y) const
+	{
+		//Jittered Sampling
+		Sampler& sampler = getSampler();
+		sampler.startPixelSample(x, y, pixelSampleIndex(x, y));
+		vec2 u1 = sampler.get2D();
+		vec2 u2 = sampler.get2D();
+		float r1 = u1.x;
+		float r2 = u2.x;
+
+		float r3 = u1.y;
+		float r4 = u2.y;
+
+		Ray primaryRay;
+		primaryRay.o = camera_pos;
+		vec2 screenCoord = vec2(float(x + r1 - r2) / float(rendered_image.width),
+		                        float(y + r3 - r4) / float(rendered_image.height));
+		// Calculate direction
+		vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
+
+		vec3 p = homogenize(inv_PV * viewCoord);
+		primaryRay.d = normalize(p - camera_pos);
+		return primaryRay;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// What a camera ray found first, for the denoiser: the albedo and shading
+/// normal at the hit, and its distance. All zero if the ray hit nothing.
+///////////////////////////////////////////////////////////////////////////
+struct Features
+{
+	vec3 albedo;
+	vec3 normal;
+	float depth;
+	Features() : albedo(0.0f), normal(0.0f), depth(0.0f) {}
+	Features(const vec3& albedo, const vec3& normal, float depth) : albedo(albedo), normal(normal), depth(depth) {}
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// Accumulate the obtained radiance, and the features of the sample, to
+/// the pixels color
+///////////////////////////////////////////////////////////////////////////
+inline void accumulate(int x, int y, const vec3& color, const Features& features)
+{
+	const int i = y * rendered_image.width + x;
+	const float old_mean_luminance = luminance(rendered_image.mean(i));
+	rendered_image.sum[i] += color;
+	rendered_image.sample_count[i]++;
+	// Welford's update of the luminance variance
+	const float l = luminance(color);
+	rendered_image.luminance_m2[i] += (l - old_mean_luminance) * (l - luminance(rendered_image.mean(i)));
+	rendered_image.albedo_sum[i] += features.albedo;
+	rendered_image.normal_sum[i] += features.normal;
+	rendered_image.depth_sum[i] += features.depth;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Trace one path for each pixel of a tile that is active in `round`,
+/// with the wavefront integrator
+///////////////////////////////////////////////////////////////////////////
+void traceTileWavefront(const Tile& tile, const PrimaryRayGenerator& camera, int round);
+} // namespace pathtracer
@@ -10,9 +10,14 @@
 #include <glm/gtx/transform.hpp>
 #include <Model.h>
 #include <string>
+#include <cstdio>
+#include <cstdlib>
 #include "Pathtracer.h"
 #include "embree.h"
 #include "sampling.h"
+#include "renderthread.h"
+#include "textureupload.h"
+#include "scenes.h"
 
 
 using namespace glm;
@@ -44,32 +49,22 @@ GLuint simpleShaderProgram;
 ///////////////////////////////////////////////////////////////////////////////
 // GL texture to put pathtracing result into
 ///////////////////////////////////////////////////////////////////////////////
-uint32_t pathtracer_result_txt_id;
+pathtracer::TextureUploader pathtracer_result;
+int upload_format = pathtracer::UPLOAD_RGBA8;
+// The snapshot in the texture, and its statistics
+uint64_t displayed_snapshot_id = 0;
+pathtracer::RenderStats displayed_stats;
+size_t displayed_snapshot_bytes = 0;
 
 ///////////////////////////////////////////////////////////////////////////////
-// Scene
+// The pathtracer renders on its own thread. The UI edits these copies of
+// its settings and lights, and hands them over once per frame.
 ///////////////////////////////////////////////////////////////////////////////
-vec3 worldUp(0.0f, 1.0f, 0.0f);
+pathtracer::FrameState ui_state;
 
-struct camera_t
-{
-	vec3 position;
-	vec3 direction;
-};
-
-struct scene_t
-{
-	struct scene_object_t
-	{
-		labhelper::Model* model;
-		mat4 modelMat;
-	};
-	std::vector<scene_object_t> models;
-
-	camera_t camera;
-};
-
-std::map<std::string, scene_t> scenes;
+///////////////////////////////////////////////////////////////////////////////
+// Scene (see scenes.h)
+///////////////////////////////////////////////////////////////////////////////
 std::string currentScene;
 camera_t camera;
 
@@ -78,42 +73,6 @@ int selected_mesh_index = 0;
 int selected_material_index = 0;
 
 
-void loadScenes()
-{
-	scenes["Sphere"] = { {
-		                     // Models
-		                     { labhelper::loadModelFromOBJ("../scenes/sphere.obj"), mat4(1.f) },
-		                 },
-		                 {
-		                     // Camera
-		                     vec3(-15, 0, 15),
-		                     normalize(-vec3(-15, 0, 15)),
-		                 } };
-	scenes["Ship"] = { {
-		                   // Models
-		                   { labhelper::loadModelFromOBJ("../scenes/space-ship.obj"),
-		                     translate(vec3(0.f, 8.f, 0.f)) },
-		                   { labhelper::loadModelFromOBJ("../scenes/landingpad.obj"), mat4(1.f) },
-		               },
-		               {
-		                   // Camera
-		                   vec3(-30, 15, 30),
-		                   normalize(-vec3(-30, 8, 30)),
-		               } };
-	// Modify the landingpad screen's color
-	scenes["Ship"].models[1].model->m_materials[8].m_color = glm::vec3(0.380392, 0.588235, 0.266667);
-
-	scenes["Refractions"] = { {
-		                          // Models
-		                          { labhelper::loadModelFromOBJ("../scenes/refractions.obj"), mat4(1.f) },
-		                      },
-		                      {
-		                          // Camera
-		                          vec3(7.3, 3.2, 7.2),
-		                          normalize(vec3(-0.43, -0.27, -0.85)),
-		                      } };
-}
-
 void changeScene(std::string sceneName)
 {
 	currentScene = sceneName;
@@ -124,29 +83,73 @@ void changeScene(std::string sceneName)
 	selected_material_index = scenes[currentScene].models[0].model->m_meshes[0].m_material_idx;
 
 
-	pathtracer::reinitScene();
-
-	// Add models to pathtracer scene
-	for(auto& o : scenes[currentScene].models)
-	{
-		pathtracer::addModel(o.model, o.modelMat);
-	}
-	pathtracer::buildBVH();
+	buildScene(scenes[currentScene]);
+	pathtracer::reloadMaterials();
+	ui_state.material_patches.clear();
 
 	pathtracer::restart();
 }
 
-void cleanupScenes()
+///////////////////////////////////////////////////////////////////////////////
+// View matrix for the current camera
+///////////////////////////////////////////////////////////////////////////////
+mat4 getViewMatrix()
+{
+	return getViewMatrix(camera);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start the image over once the render thread gets the next frame state
+///////////////////////////////////////////////////////////////////////////////
+void requestRestart()
 {
-	for(auto& it : scenes)
+	ui_state.restart = true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Hand the camera, settings, lights and material edits of this frame to
+// the render thread
+///////////////////////////////////////////////////////////////////////////////
+void updateFrameState()
+{
+	ui_state.view = getViewMatrix();
+	ui_state.projection = getProjectionMatrix(float(windowWidth) / float(std::max(windowHeight, 1)));
+	ui_state.window_width = windowWidth;
+	ui_state.window_height = windowHeight;
+}
+
+void sendFrameState()
+{
+	updateFrameState();
+	pathtracer::setFrameState(ui_state);
+	ui_state.restart = false;
+	ui_state.material_patches.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Scene edits. Each costs the render thread only what it changes (see
+// FrameState): an edited material is repacked on its own, and a moved
+// model refits the top level BVH. Light edits just call requestRestart().
+///////////////////////////////////////////////////////////////////////////////
+void editMaterial(const labhelper::Material& material)
+{
+	pathtracer::MaterialPatch patch;
+	if(pathtracer::packMaterialPatch(material, patch))
 	{
-		for(auto m : it.second.models)
-		{
-			labhelper::freeModel(m.model);
-		}
+		ui_state.material_patches.push_back(patch);
 	}
+	requestRestart();
 }
 
+void moveModel(int model_index, const mat4& model_matrix)
+{
+	pathtracer::pauseRenderThread();
+	pathtracer::setModelTransform(model_index, model_matrix);
+	pathtracer::buildBVH();
+	requestRestart();
+	sendFrameState();
+	pathtracer::resumeRenderThread();
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 // Load shaders, environment maps, models and so on
@@ -164,66 +167,26 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	// Generate result texture
 	///////////////////////////////////////////////////////////////////////////
-	glGenTextures(1, &pathtracer_result_txt_id);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-	///////////////////////////////////////////////////////////////////////////
-	// Initial path-tracer settings
-	///////////////////////////////////////////////////////////////////////////
-	pathtracer::settings.max_bounces = 8;
-	pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
-#ifdef _DEBUG
-	pathtracer::settings.subsampling = 16;
-#else
-	pathtracer::settings.subsampling = 4;
-#endif
-
-	///////////////////////////////////////////////////////////////////////////
-	// Set up light sources
-	///////////////////////////////////////////////////////////////////////////
-	pathtracer::point_light.intensity_multiplier = 2500.0f;
-	pathtracer::point_light.color = vec3(1.f, 1.f, 1.f);
-	pathtracer::point_light.position = vec3(10.0f, 25.0f, 20.0f);
-
-	// float intensity_multiplier;
-	// vec3 color;
-	// vec3 position;
-	// vec3 direction;
-	// float radius;
-	
-	pathtracer::disc_lights.push_back( pathtracer::DiscLight{
-									   1000,
-									   {1, 0.8, 0},
-									   {-8, 10, 8},
-									   glm::normalize(glm::vec3(10, -2, 10)),
-									   8.0 } );
-	pathtracer::disc_lights.push_back( pathtracer::DiscLight{
-									   1000,
-									   {0.1, 0.3, 1},
-									   {-10, 20, -5},
-									   glm::normalize(-glm::vec3(-10, 20, -5)),
-									   10.0 } );
-	
+	pathtracer_result.init();
 
-	///////////////////////////////////////////////////////////////////////////
-	// Load environment map
-	///////////////////////////////////////////////////////////////////////////
-	pathtracer::environment.map.load("../scenes/envmaps/001.hdr");
-	pathtracer::environment.multiplier = 1.0f;
-
-	///////////////////////////////////////////////////////////////////////////
-	// Load .obj models to scene
-	///////////////////////////////////////////////////////////////////////////
-	loadScenes();
+	initializePathtracer(true);
+	// Interactive editing refits the BVH rather than rebuilding it
+	pathtracer::setBuildProfile(pathtracer::BUILD_FAST);
 	changeScene("Ship");
 	//changeScene("Sphere");
 	//changeScene("Refractions");
 
+	///////////////////////////////////////////////////////////////////////////
+	// Start rendering
+	///////////////////////////////////////////////////////////////////////////
+	ui_state.settings = pathtracer::settings;
+	ui_state.point_light = pathtracer::point_light;
+	ui_state.disc_lights = pathtracer::disc_lights;
+	ui_state.environment_multiplier = pathtracer::environment.multiplier;
+	SDL_GetWindowSize(g_window, &windowWidth, &windowHeight);
+	updateFrameState();
+	pathtracer::startRenderThread(ui_state);
+
 
 	///////////////////////////////////////////////////////////////////////////
 	// This is INCORRECT! But an easy way to get us a brighter image that
@@ -235,38 +198,37 @@ void initialize()
 void display(void)
 {
 	{ ///////////////////////////////////////////////////////////////////////
-		// If first frame, or window resized, or subsampling changes,
-		// inform the pathtracer
+		// If window resized, or subsampling changes, the image starts over
+		// (the render thread resizes it when it gets the new size)
 		///////////////////////////////////////////////////////////////////////
 		int w, h;
 		SDL_GetWindowSize(g_window, &w, &h);
-		static int old_subsampling;
-		if(windowWidth != w || windowHeight != h || old_subsampling != pathtracer::settings.subsampling)
+		static int old_subsampling = ui_state.settings.subsampling;
+		if(windowWidth != w || windowHeight != h || old_subsampling != ui_state.settings.subsampling)
 		{
-			pathtracer::resize(w, h);
+			requestRestart();
 			windowWidth = w;
-			windowWidth = h;
-			old_subsampling = pathtracer::settings.subsampling;
+			windowHeight = h;
+			old_subsampling = ui_state.settings.subsampling;
 		}
 	}
 
-	///////////////////////////////////////////////////////////////////////////
-	// Trace one path per pixel
-	///////////////////////////////////////////////////////////////////////////
-	mat4 viewMatrix = lookAt(camera.position, camera.position + camera.direction, worldUp);
-	mat4 projMatrix = perspective(radians(45.0f),
-	                              float(pathtracer::rendered_image.width)
-	                                  / float(pathtracer::rendered_image.height),
-	                              0.1f, 100.0f);
-	pathtracer::tracePaths(viewMatrix, projMatrix);
+	mat4 viewMatrix = getViewMatrix();
+	mat4 projMatrix = getProjectionMatrix(float(windowWidth) / float(std::max(windowHeight, 1)));
 
 	///////////////////////////////////////////////////////////////////////////
-	// Copy pathtraced image to texture for display
+	// Stream the latest pathtraced image to the texture for display, if the
+	// render thread has finished a pass since the last one
 	///////////////////////////////////////////////////////////////////////////
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pathtracer::rendered_image.width,
-	             pathtracer::rendered_image.height, 0, GL_RGB, GL_FLOAT, pathtracer::rendered_image.getPtr());
+	const pathtracer::ImageSnapshot* snapshot = pathtracer::acquireSnapshot();
+	if(snapshot != nullptr && snapshot->id != displayed_snapshot_id)
+	{
+		pathtracer_result.upload(*snapshot, pathtracer::UploadFormat(upload_format));
+		displayed_snapshot_id = snapshot->id;
+		displayed_stats = snapshot->stats;
+		displayed_snapshot_bytes = snapshot->getMemoryUsage();
+	}
+	pathtracer::releaseSnapshot();
 
 	///////////////////////////////////////////////////////////////////////////
 	// Render a fullscreen quad, textured with our pathtraced image.
@@ -278,36 +240,38 @@ void display(void)
 	glEnable(GL_CULL_FACE);
 	SDL_GetWindowSize(g_window, &windowWidth, &windowHeight);
 	glUseProgram(shaderProgram);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, pathtracer_result.getTexture());
 	labhelper::drawFullScreenQuad();
 
 	if(showLightSources)
 	{
 		glUseProgram(simpleShaderProgram);
 
-		mat4 modelMatrix = glm::translate(pathtracer::point_light.position);
+		mat4 modelMatrix = glm::translate(ui_state.point_light.position);
 		glUseProgram(simpleShaderProgram);
 		labhelper::setUniformSlow(simpleShaderProgram, "modelViewProjectionMatrix",
 		                          projMatrix * viewMatrix * modelMatrix);
-		labhelper::setUniformSlow(simpleShaderProgram, "material_color", pathtracer::point_light.color);
+		labhelper::setUniformSlow(simpleShaderProgram, "material_color", ui_state.point_light.color);
 
 		labhelper::debugDrawSphere();
 
-		for(int i = 0; i < pathtracer::disc_lights.size(); ++i)
+		for(int i = 0; i < ui_state.disc_lights.size(); ++i)
 		{
-			mat3 tbn = labhelper::tangentSpace(pathtracer::disc_lights[i].direction);
+			mat3 tbn = labhelper::tangentSpace(ui_state.disc_lights[i].direction);
 			tbn = mat3(tbn[0], tbn[2], tbn[1]);
-			mat4 modelMatrix = glm::translate(pathtracer::disc_lights[i].position) * mat4(tbn)
-			                   * glm::scale(vec3(pathtracer::disc_lights[i].radius));
+			mat4 modelMatrix = glm::translate(ui_state.disc_lights[i].position) * mat4(tbn)
+			                   * glm::scale(vec3(ui_state.disc_lights[i].radius));
 			glUseProgram(simpleShaderProgram);
 			labhelper::setUniformSlow(simpleShaderProgram, "modelViewProjectionMatrix",
 			                          projMatrix * viewMatrix * modelMatrix);
-			labhelper::setUniformSlow(simpleShaderProgram, "material_color", pathtracer::disc_lights[i].color);
+			labhelper::setUniformSlow(simpleShaderProgram, "material_color", ui_state.disc_lights[i].color);
 
 			labhelper::debugDrawDisc();
 
-			labhelper::debugDrawArrow(viewMatrix, projMatrix, pathtracer::disc_lights[i].position,
-			                          pathtracer::disc_lights[i].position
-			                              + 2.f * pathtracer::disc_lights[i].direction);
+			labhelper::debugDrawArrow(viewMatrix, projMatrix, ui_state.disc_lights[i].position,
+			                          ui_state.disc_lights[i].position
+			                              + 2.f * ui_state.disc_lights[i].direction);
 		}
 	}
 }
@@ -365,7 +329,7 @@ bool handleEvents(void)
 			camera.direction = vec3(pitch * yaw * vec4(camera.direction, 0.0f));
 			g_prevMouseCoords.x = event.motion.x;
 			g_prevMouseCoords.y = event.motion.y;
-			pathtracer::restart();
+			requestRestart();
 		}
 	}
 
@@ -378,32 +342,32 @@ bool handleEvents(void)
 		if(state[SDL_SCANCODE_W])
 		{
 			camera.position += deltaTime * speed * camera.direction;
-			pathtracer::restart();
+			requestRestart();
 		}
 		if(state[SDL_SCANCODE_S])
 		{
 			camera.position -= deltaTime * speed * camera.direction;
-			pathtracer::restart();
+			requestRestart();
 		}
 		if(state[SDL_SCANCODE_A])
 		{
 			camera.position -= deltaTime * speed * cameraRight;
-			pathtracer::restart();
+			requestRestart();
 		}
 		if(state[SDL_SCANCODE_D])
 		{
 			camera.position += deltaTime * speed * cameraRight;
-			pathtracer::restart();
+			requestRestart();
 		}
 		if(state[SDL_SCANCODE_Q])
 		{
 			camera.position -= deltaTime * speed * worldUp;
-			pathtracer::restart();
+			requestRestart();
 		}
 		if(state[SDL_SCANCODE_E])
 		{
 			camera.position += deltaTime * speed * worldUp;
-			pathtracer::restart();
+			requestRestart();
 		}
 	}
 
@@ -420,7 +384,11 @@ void gui()
 			{
 				if(ImGui::MenuItem(it.first.c_str(), nullptr, it.first == currentScene))
 				{
+					pathtracer::pauseRenderThread();
 					changeScene(it.first);
+					requestRestart();
+					sendFrameState();
+					pathtracer::resumeRenderThread();
 				}
 			}
 			ImGui::EndMenu();
@@ -473,14 +441,170 @@ void gui()
 	///////////////////////////////////////////////////////////////////////////
 	if(ImGui::CollapsingHeader("Pathtracer", "pathtracer_ch", true, true))
 	{
-		ImGui::SliderInt("Subsampling", &pathtracer::settings.subsampling, 1, 16);
-		ImGui::SliderInt("Max Bounces", &pathtracer::settings.max_bounces, 0, 16);
-		ImGui::SliderInt("Max Paths Per Pixel", &pathtracer::settings.max_paths_per_pixel, 0, 1024);
+		ImGui::SliderInt("Subsampling", &ui_state.settings.subsampling, 1, 16);
+		ImGui::SliderInt("Max Bounces", &ui_state.settings.max_bounces, 0, 16);
+		ImGui::SliderInt("Max Paths Per Pixel", &ui_state.settings.max_paths_per_pixel, 0, 1024);
 		if(ImGui::Button("Restart Pathtracing"))
 		{
-			pathtracer::restart();
+			requestRestart();
+		}
+		ImGui::Text("Num. samples: %d", displayed_stats.number_of_samples);
+		if(ImGui::SliderInt("Tile Size", &ui_state.settings.tile_size, 4, 64))
+		{
+			requestRestart();
+		}
+		ImGui::Text("Integrator:");
+		ImGui::SameLine();
+		if(ImGui::RadioButton("Recursive", &ui_state.settings.integrator,
+		                      pathtracer::INTEGRATOR_RECURSIVE))
+		{
+			requestRestart();
+		}
+		ImGui::SameLine();
+		if(ImGui::RadioButton("Wavefront", &ui_state.settings.integrator,
+		                      pathtracer::INTEGRATOR_WAVEFRONT))
+		{
+			requestRestart();
+		}
+		ImGui::Text("Sampler:");
+		ImGui::SameLine();
+		if(ImGui::RadioButton("Independent", &ui_state.settings.sampler, pathtracer::SAMPLER_INDEPENDENT))
+		{
+			requestRestart();
+		}
+		ImGui::SameLine();
+		if(ImGui::RadioButton("Stratified", &ui_state.settings.sampler, pathtracer::SAMPLER_STRATIFIED))
+		{
+			requestRestart();
+		}
+		ImGui::SameLine();
+		if(ImGui::RadioButton("Sobol", &ui_state.settings.sampler, pathtracer::SAMPLER_SOBOL))
+		{
+			requestRestart();
+		}
+		ImGui::SameLine();
+		if(ImGui::RadioButton("Blue Noise", &ui_state.settings.sampler, pathtracer::SAMPLER_BLUE_NOISE))
+		{
+			requestRestart();
+		}
+		if(ImGui::Checkbox("Sample Environment", &ui_state.settings.sample_environment))
+		{
+			requestRestart();
+		}
+		if(ImGui::Checkbox("Russian Roulette", &ui_state.settings.russian_roulette))
+		{
+			requestRestart();
+		}
+		ImGui::SameLine();
+		if(ImGui::SliderInt("Min Depth", &ui_state.settings.roulette_min_depth, 1, 16))
+		{
+			requestRestart();
+		}
+		const pathtracer::PathStats& path_stats = displayed_stats.paths;
+		if(path_stats.num_paths > 0)
+		{
+			std::vector<float> depth_fractions(path_stats.depth_histogram.size());
+			for(size_t d = 0; d < depth_fractions.size(); d++)
+			{
+				depth_fractions[d] = float(path_stats.depth_histogram[d]) / float(path_stats.num_paths);
+			}
+			ImGui::PlotHistogram("Path depth", depth_fractions.data(), int(depth_fractions.size()), 0, nullptr,
+			                     0.0f, 1.0f, ImVec2(0, 60));
+			const float percent = 100.0f / float(path_stats.num_paths);
+			ImGui::Text("Mean depth: %.2f", path_stats.mean_depth);
+			ImGui::Text("Ended: %.1f%% escaped, %.1f%% absorbed, %.1f%% roulette, %.1f%% max depth",
+			            percent * float(path_stats.ended[pathtracer::PATH_ESCAPED]),
+			            percent * float(path_stats.ended[pathtracer::PATH_ABSORBED]),
+			            percent * float(path_stats.ended[pathtracer::PATH_ROULETTE]),
+			            percent * float(path_stats.ended[pathtracer::PATH_MAX_DEPTH]));
+			ImGui::Text("%.2f Mrays/s (%.2f M primary, %.2f M extension, %.2f M shadow)",
+			            path_stats.mrays_per_second, double(path_stats.primary_rays) * 1e-6,
+			            double(path_stats.extension_rays) * 1e-6, double(path_stats.shadow_rays) * 1e-6);
+			const double thread_ms = std::max(path_stats.trace_ms + path_stats.shading_ms, 1e-9);
+			ImGui::Text("Thread time: %.0f%% BVH traversal, %.0f%% shading", 100.0 * path_stats.trace_ms / thread_ms,
+			            100.0 * path_stats.shading_ms / thread_ms);
+		}
+		ImGui::Checkbox("Adaptive Sampling", &ui_state.settings.adaptive_sampling);
+		ImGui::SliderFloat("Error Threshold", &ui_state.settings.adaptive_threshold, 0.001f, 0.2f, "%.4f", 3);
+		ImGui::SliderInt("Min Samples", &ui_state.settings.adaptive_min_samples, 2, 256);
+		ImGui::SliderInt("Max Samples Per Pass", &ui_state.settings.adaptive_max_samples_per_pass, 1, 16);
+		ImGui::Text("%.1f%% pixels converged", 100.0f * displayed_stats.converged_fraction);
+		ImGui::Checkbox("Denoise", &ui_state.settings.denoise);
+		ImGui::SameLine();
+		ImGui::SliderInt("Every N Passes", &ui_state.settings.denoise_interval, 1, 64);
+		ImGui::SliderInt("Denoise Iterations", &ui_state.settings.denoise_iterations, 1, 5);
+		if(displayed_stats.denoise_ms > 0.0)
+		{
+			ImGui::Text("Denoised in %.1f ms", displayed_stats.denoise_ms);
+		}
+		if(ImGui::Checkbox("Material Textures", &ui_state.settings.material_textures))
+		{
+			requestRestart();
+		}
+		ImGui::SliderInt("Texture Cache (MB)", &ui_state.settings.texture_cache_mb, 16, 4096);
+		const pathtracer::TextureCacheStats& texture_stats = displayed_stats.textures;
+		ImGui::Text("Textures: %d of %d loaded, %.1f MB resident, %llu decodes, %llu pages evicted",
+		            texture_stats.num_loaded, texture_stats.num_textures,
+		            double(texture_stats.resident_bytes) / (1024.0 * 1024.0),
+		            (unsigned long long)texture_stats.decodes, (unsigned long long)texture_stats.evicted_pages);
+		ImGui::Text("BVH:");
+		int bvh_profile = pathtracer::getBuildProfile();
+		const char* bvh_profiles[] = { "High Quality", "Fast", "Compact" };
+		for(int i = 0; i < 3; i++)
+		{
+			ImGui::SameLine();
+			if(ImGui::RadioButton(bvh_profiles[i], &bvh_profile, i))
+			{
+				pathtracer::pauseRenderThread();
+				pathtracer::setBuildProfile(pathtracer::BuildProfile(bvh_profile));
+				changeScene(currentScene);
+				requestRestart();
+				sendFrameState();
+				pathtracer::resumeRenderThread();
+			}
+		}
+		const pathtracer::BVHStats& bvh_stats = pathtracer::getBVHStats();
+		ImGui::Text("%s %.1f ms, %.1f MB, %d triangles, %d instances", bvh_stats.refit ? "Refit" : "Build",
+		            bvh_stats.build_ms, double(bvh_stats.bytes) / (1024.0 * 1024.0), int(bvh_stats.num_triangles),
+		            int(bvh_stats.num_instances));
+		ImGui::Checkbox("Packet Tracing", &ui_state.settings.packet_tracing);
+		ImGui::SameLine();
+		ImGui::Text("(max packet size: %d)", pathtracer::getMaxPacketSize());
+		const pathtracer::TileStats& tile_stats = displayed_stats.tiles;
+		ImGui::Text("Pass: %.1f ms, %d tiles on %d threads, %d steals", tile_stats.pass_ms,
+		            tile_stats.num_tiles, tile_stats.num_threads, tile_stats.num_steals);
+		ImGui::Text("Tile time min/mean/max: %.2f / %.2f / %.2f ms", tile_stats.min_tile_ms,
+		            tile_stats.mean_tile_ms, tile_stats.max_tile_ms);
+		ImGui::Text("Thread imbalance (max/mean busy): %.2f", tile_stats.thread_imbalance);
+		ImGui::Text("Display format:");
+		ImGui::SameLine();
+		if(ImGui::RadioButton("RGBA8", &upload_format, pathtracer::UPLOAD_RGBA8))
+		{
+			displayed_snapshot_id = 0;
+		}
+		ImGui::SameLine();
+		if(ImGui::RadioButton("RGBA16F", &upload_format, pathtracer::UPLOAD_RGBA16F))
+		{
+			displayed_snapshot_id = 0;
 		}
-		ImGui::Text("Num. samples: %d", pathtracer::getSampleCount());
+		ImGui::SameLine();
+		if(ImGui::RadioButton("RGB9E5", &upload_format, pathtracer::UPLOAD_RGB9E5))
+		{
+			displayed_snapshot_id = 0;
+		}
+		int snapshot_format = ui_state.snapshot_format;
+		ImGui::Text("Snapshot format:");
+		ImGui::SameLine();
+		ImGui::RadioButton("Float", &snapshot_format, labhelper::HDR_FLOAT32);
+		ImGui::SameLine();
+		ImGui::RadioButton("Half", &snapshot_format, labhelper::HDR_FLOAT16);
+		ImGui::SameLine();
+		ImGui::RadioButton("Shared exponent", &snapshot_format, labhelper::HDR_RGB9E5);
+		ui_state.snapshot_format = labhelper::HdrFormat(snapshot_format);
+		ImGui::Text("Snapshot: %.1f MB", double(displayed_snapshot_bytes) / (1024.0 * 1024.0));
+		ImGui::Text("Upload: pack %.2f ms, submit %.2f ms, GPU copy %.2f ms (%s PBOs)", pathtracer_result.pack_ms,
+		            pathtracer_result.submit_ms, pathtracer_result.copy_ms,
+		            pathtracer_result.isPersistent() ? "persistent" : "mapped");
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -498,6 +622,11 @@ void gui()
 			selected_mesh_index = 0;
 			selected_material_index = selected_model->m_meshes[selected_mesh_index].m_material_idx;
 		}
+		mat4& model_matrix = selected_scene->models[selected_model_index].modelMat;
+		if(ImGui::DragFloat3("Position", &model_matrix[3].x, 0.1f))
+		{
+			moveModel(selected_model_index, model_matrix);
+		}
 
 		///////////////////////////////////////////////////////////////////////////
 		// List all meshes in the model and show properties for the selected
@@ -522,13 +651,18 @@ void gui()
 		{
 			labhelper::Material& material = selected_model->m_materials[selected_material_index];
 			ImGui::LabelText("Material Name", "%s", material.m_name.c_str());
-			ImGui::ColorEdit3("Color", &material.m_color.x);
-			ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
-			ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
-			ImGui::SliderFloat("Shininess", &material.m_shininess, 0.0f, 5000.0f, "%.3f", 2);
-			ImGui::ColorEdit3("Emission", &material.m_emission.x);
-			ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
-			//ImGui::SliderFloat("IoR", &material.m_ior, 0.1f, 3.0f);
+			bool edited = false;
+			edited |= ImGui::ColorEdit3("Color", &material.m_color.x);
+			edited |= ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
+			edited |= ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
+			edited |= ImGui::SliderFloat("Shininess", &material.m_shininess, 0.0f, 5000.0f, "%.3f", 2);
+			edited |= ImGui::ColorEdit3("Emission", &material.m_emission.x);
+			edited |= ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
+			//edited |= ImGui::SliderFloat("IoR", &material.m_ior, 0.1f, 3.0f);
+			if(edited)
+			{
+				editMaterial(material);
+			}
 		}
 
 #if ALLOW_SAVE_MATERIALS
@@ -547,41 +681,347 @@ void gui()
 	if(ImGui::CollapsingHeader("Light sources", "lights_ch", true, true))
 	{
 		ImGui::Checkbox("Show Light Overlays", &showLightSources);
-		ImGui::SliderFloat("Environment multiplier", &pathtracer::environment.multiplier, 0.0f, 10.0f);
+		bool edited = false;
+		edited |= ImGui::SliderFloat("Environment multiplier", &ui_state.environment_multiplier, 0.0f, 10.0f);
+		const HDRImage& environment_map = pathtracer::environment.map;
+		ImGui::Text("Environment map: %dx%d %s, %.1f MB", environment_map.width, environment_map.height,
+		            labhelper::getHdrFormatName(environment_map.format),
+		            double(environment_map.getMemoryUsage()) / (1024.0 * 1024.0));
 		ImGui::Separator();
 		ImGui::Text("Point Light");
-		ImGui::ColorEdit3("Point light color", &pathtracer::point_light.color.x);
-		ImGui::SliderFloat("Point light intensity multiplier", &pathtracer::point_light.intensity_multiplier,
-		                   0.0f, 10000.0f);
-		ImGui::DragFloat3("Position", &pathtracer::point_light.position.x, 0.1);
+		edited |= ImGui::ColorEdit3("Point light color", &ui_state.point_light.color.x);
+		edited |= ImGui::SliderFloat("Point light intensity multiplier", &ui_state.point_light.intensity_multiplier,
+		                             0.0f, 10000.0f);
+		edited |= ImGui::DragFloat3("Position", &ui_state.point_light.position.x, 0.1);
 
-		for(int i = 0; i < pathtracer::disc_lights.size(); ++i)
+		for(int i = 0; i < ui_state.disc_lights.size(); ++i)
 		{
 			ImGui::PushID(i);
 			ImGui::Separator();
-			auto& l = pathtracer::disc_lights[i];
+			auto& l = ui_state.disc_lights[i];
 			ImGui::Text("Disc Light %d", i);
-			ImGui::ColorEdit3("Color", &l.color.x);
-			ImGui::SliderFloat("Intensity", &l.intensity_multiplier, 0.0f, 10000.0f, "%.3f", 3);
-			ImGui::DragFloat3("Position", &l.position.x, 0.1);
+			edited |= ImGui::ColorEdit3("Color", &l.color.x);
+			edited |= ImGui::SliderFloat("Intensity", &l.intensity_multiplier, 0.0f, 10000.0f, "%.3f", 3);
+			edited |= ImGui::DragFloat3("Position", &l.position.x, 0.1);
 
 			glm::vec2 dir(atan2(l.direction.z, l.direction.x) / (2 * M_PI) + 0.5, acos(l.direction.y) / M_PI);
-			ImGui::DragFloat2("Direction", &dir.x, 0.01, 0, 1);
-			dir.x -= 0.5;
-			dir.x *= 2 * M_PI;
-			dir.y *= M_PI;
-			l.direction = vec3(cos(dir.x) * sin(dir.y), cos(dir.y), sin(dir.x) * sin(dir.y));
+			if(ImGui::DragFloat2("Direction", &dir.x, 0.01, 0, 1))
+			{
+				dir.x -= 0.5;
+				dir.x *= 2 * M_PI;
+				dir.y *= M_PI;
+				l.direction = vec3(cos(dir.x) * sin(dir.y), cos(dir.y), sin(dir.x) * sin(dir.y));
+				edited = true;
+			}
 
-			ImGui::DragFloat("Radius", &l.radius, 1, 0, 100);
+			edited |= ImGui::DragFloat("Radius", &l.radius, 1, 0, 100);
 			ImGui::PopID();
 		}
+		// Lights are only sampled, so the image just starts over
+		if(edited)
+		{
+			requestRestart();
+		}
 	}
 
 	ImGui::End(); // Control Panel
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Headless batch rendering. Renders one scene to completion and writes the
+// result to disk, without creating a window or a GL context.
+///////////////////////////////////////////////////////////////////////////////
+struct batch_options_t
+{
+	bool headless = false;
+	std::string scene = "Ship";
+	int width = 1280, height = 720;
+	int samples = 256;
+	int bounces = 8;
+	int integrator = pathtracer::INTEGRATOR_RECURSIVE;
+	int sampler = pathtracer::SAMPLER_SOBOL;
+	int bvh = pathtracer::BUILD_HIGH_QUALITY;
+	// 0 turns Russian roulette off
+	int roulette_min_depth = 3;
+	// 0 turns adaptive sampling off
+	float adaptive_threshold = 0.0f;
+	uint32_t seed = 0;
+	// 0 for all cores
+	int threads = 0;
+	// Also write a denoised image
+	bool denoise = false;
+	// Read and write <name>.modelcache next to the OBJs
+	bool model_cache = true;
+	labhelper::HdrFormat environment_format = labhelper::HDR_FLOAT16;
+	bool custom_camera_position = false, custom_camera_direction = false;
+	vec3 camera_position, camera_direction;
+	std::string output = "pathtracer";
+};
+
+void printUsage(const char* program)
+{
+	cout << "Usage: " << program << " [--headless [options]]\n"
+	     << "  --scene NAME          Scene to render: Sphere, Ship or Refractions (default Ship)\n"
+	     << "  --width W --height H  Resolution in pixels (default 1280x720)\n"
+	     << "  --spp N               Samples per pixel (default 256)\n"
+	     << "  --bounces N           Max bounces per path (default 8)\n"
+	     << "  --integrator NAME     recursive or wavefront (default recursive)\n"
+	     << "  --sampler NAME        independent, stratified, sobol or bluenoise (default sobol)\n"
+	     << "  --bvh NAME            BVH build: quality, fast or compact (default quality)\n"
+	     << "  --roulette N          Russian roulette after N bounces, 0 for none (default 3)\n"
+	     << "  --adaptive T          Stop pixels at relative error T, 0 for uniform sampling (default 0).\n"
+	     << "                        --spp is then the most samples a pixel takes, not the count of each\n"
+	     << "  --seed N              Seed of the samplers (default 0)\n"
+	     << "  --threads N           Render threads, 0 for one per core. Does not change the image. (default 0)\n"
+	     << "  --denoise             Also write a denoised image to BASENAME_denoised.hdr/.png\n"
+	     << "  --envmap-format NAME  Environment map texels: float, half or rgb9e5 (default half)\n"
+	     << "  --no-model-cache      Load the OBJs without reading or writing their .modelcache files\n"
+	     << "  --camera-position X,Y,Z\n"
+	     << "  --camera-direction X,Y,Z\n"
+	     << "  --output BASENAME     Writes BASENAME.hdr and BASENAME.png (default pathtracer)\n";
+}
+
+bool parseVec3(const char* str, vec3& v)
+{
+	return sscanf(str, "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
+}
+
+bool parseHdrFormat(const std::string& name, labhelper::HdrFormat& format)
+{
+	if(name == "float")
+		format = labhelper::HDR_FLOAT32;
+	else if(name == "half")
+		format = labhelper::HDR_FLOAT16;
+	else if(name == "rgb9e5")
+		format = labhelper::HDR_RGB9E5;
+	else
+		return false;
+	return true;
+}
+
+// Returns false on malformed arguments
+bool parseArguments(int argc, char* argv[], batch_options_t& options)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if(arg == "--headless")
+		{
+			options.headless = true;
+		}
+		else if(arg == "--scene" && has_value)
+		{
+			options.scene = argv[++i];
+		}
+		else if(arg == "--width" && has_value)
+		{
+			options.width = atoi(argv[++i]);
+		}
+		else if(arg == "--height" && has_value)
+		{
+			options.height = atoi(argv[++i]);
+		}
+		else if(arg == "--spp" && has_value)
+		{
+			options.samples = atoi(argv[++i]);
+		}
+		else if(arg == "--bounces" && has_value)
+		{
+			options.bounces = atoi(argv[++i]);
+		}
+		else if(arg == "--integrator" && has_value)
+		{
+			std::string name = argv[++i];
+			if(name == "recursive")
+				options.integrator = pathtracer::INTEGRATOR_RECURSIVE;
+			else if(name == "wavefront")
+				options.integrator = pathtracer::INTEGRATOR_WAVEFRONT;
+			else
+				return false;
+		}
+		else if(arg == "--sampler" && has_value)
+		{
+			std::string name = argv[++i];
+			if(name == "independent")
+				options.sampler = pathtracer::SAMPLER_INDEPENDENT;
+			else if(name == "stratified")
+				options.sampler = pathtracer::SAMPLER_STRATIFIED;
+			else if(name == "sobol")
+				options.sampler = pathtracer::SAMPLER_SOBOL;
+			else if(name == "bluenoise")
+				options.sampler = pathtracer::SAMPLER_BLUE_NOISE;
+			else
+				return false;
+		}
+		else if(arg == "--bvh" && has_value)
+		{
+			std::string name = argv[++i];
+			if(name == "quality")
+				options.bvh = pathtracer::BUILD_HIGH_QUALITY;
+			else if(name == "fast")
+				options.bvh = pathtracer::BUILD_FAST;
+			else if(name == "compact")
+				options.bvh = pathtracer::BUILD_COMPACT;
+			else
+				return false;
+		}
+		else if(arg == "--roulette" && has_value)
+		{
+			options.roulette_min_depth = atoi(argv[++i]);
+		}
+		else if(arg == "--adaptive" && has_value)
+		{
+			options.adaptive_threshold = float(atof(argv[++i]));
+		}
+		else if(arg == "--seed" && has_value)
+		{
+			options.seed = uint32_t(strtoul(argv[++i], nullptr, 10));
+		}
+		else if(arg == "--threads" && has_value)
+		{
+			options.threads = atoi(argv[++i]);
+		}
+		else if(arg == "--denoise")
+		{
+			options.denoise = true;
+		}
+		else if(arg == "--envmap-format" && has_value)
+		{
+			if(!parseHdrFormat(argv[++i], options.environment_format))
+				return false;
+		}
+		else if(arg == "--no-model-cache")
+		{
+			options.model_cache = false;
+		}
+		else if(arg == "--camera-position" && has_value)
+		{
+			options.custom_camera_position = parseVec3(argv[++i], options.camera_position);
+			if(!options.custom_camera_position)
+				return false;
+		}
+		else if(arg == "--camera-direction" && has_value)
+		{
+			options.custom_camera_direction = parseVec3(argv[++i], options.camera_direction);
+			if(!options.custom_camera_direction)
+				return false;
+		}
+		else if(arg == "--output" && has_value)
+		{
+			options.output = argv[++i];
+		}
+		else
+		{
+			cout << "Unknown or incomplete argument: " << arg << "\n";
+			return false;
+		}
+	}
+	return options.width > 0 && options.height > 0 && options.samples > 0 && options.bounces >= 0
+	       && options.roulette_min_depth >= 0 && options.adaptive_threshold >= 0.0f && options.threads >= 0;
+}
+
+int renderHeadless(const batch_options_t& options)
+{
+	labhelper::setModelCacheEnabled(options.model_cache);
+	initializePathtracer(false, options.environment_format);
+	if(scenes.find(options.scene) == scenes.end())
+	{
+		cout << "Unknown scene: " << options.scene << "\n";
+		cleanupScenes();
+		return 1;
+	}
+	pathtracer::setBuildProfile(pathtracer::BuildProfile(options.bvh));
+	changeScene(options.scene);
+	if(options.custom_camera_position)
+		camera.position = options.camera_position;
+	if(options.custom_camera_direction)
+		camera.direction = normalize(options.camera_direction);
+
+	pathtracer::settings.subsampling = 1;
+	pathtracer::settings.max_bounces = options.bounces;
+	pathtracer::settings.integrator = options.integrator;
+	pathtracer::settings.sampler = options.sampler;
+	pathtracer::settings.russian_roulette = options.roulette_min_depth > 0;
+	pathtracer::settings.roulette_min_depth = options.roulette_min_depth;
+	pathtracer::settings.adaptive_sampling = options.adaptive_threshold > 0.0f;
+	pathtracer::settings.adaptive_threshold = options.adaptive_threshold;
+	pathtracer::settings.seed = options.seed;
+	if(options.threads > 0)
+		omp_set_num_threads(options.threads);
+	// Also tells the stratified sampler how many strata to use
+	pathtracer::settings.max_paths_per_pixel = options.samples;
+	pathtracer::resize(options.width, options.height);
+
+	pathtracer::updateShadingMaterials();
+	mat4 viewMatrix = getViewMatrix();
+	mat4 projMatrix = getProjectionMatrix(float(options.width) / float(options.height));
+
+	const HDRImage& environment_map = pathtracer::environment.map;
+	cout << "Environment map: " << environment_map.width << "x" << environment_map.height << " "
+	     << labhelper::getHdrFormatName(environment_map.format) << ", "
+	     << double(environment_map.getMemoryUsage()) / (1024.0 * 1024.0) << " MB\n";
+	cout << "Rendering " << options.scene << " at " << options.width << "x" << options.height << ", "
+	     << options.samples << " spp..." << endl;
+	auto start = std::chrono::steady_clock::now();
+	for(int i = 0; i < options.samples; i++)
+	{
+		pathtracer::tracePaths(viewMatrix, projMatrix);
+		// With adaptive sampling, all pixels may be done early
+		const bool done = pathtracer::rendered_image.num_active == 0;
+		if((i + 1) % 16 == 0 || i + 1 == options.samples || done)
+		{
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			cout << "  pass " << i + 1 << "/" << options.samples << ", "
+			     << 100.0f * pathtracer::getConvergedFraction() << "% pixels converged, " << elapsed.count()
+			     << " s\r" << flush;
+		}
+		if(done)
+			break;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	double total_samples = 0.0;
+	for(uint32_t n : pathtracer::rendered_image.sample_count)
+	{
+		total_samples += n;
+	}
+	double samples_per_second = total_samples / elapsed.count();
+	cout << "\nDone in " << elapsed.count() << " s (" << total_samples / (double(options.width) * options.height)
+	     << " spp on average, " << samples_per_second / 1e6 << " Msamples/s)\n";
+
+	const pathtracer::PathStats& path_stats = pathtracer::getPathStats();
+	cout << "Path depth in the last pass: mean " << path_stats.mean_depth << ", "
+	     << 100.0 * path_stats.ended[pathtracer::PATH_ROULETTE] / std::max<uint64_t>(path_stats.num_paths, 1)
+	     << "% ended by roulette, " << path_stats.mrays_per_second << " Mrays/s\n";
+	for(size_t d = 0; d < path_stats.depth_histogram.size(); d++)
+	{
+		cout << "  " << d << ": " << 100.0 * path_stats.depth_histogram[d] / std::max<uint64_t>(path_stats.num_paths, 1)
+		     << "%\n";
+	}
+
+	bool ok = pathtracer::saveImage(options.output);
+	if(options.denoise)
+	{
+		ok = pathtracer::saveImage(options.output + "_denoised", true) && ok;
+		cout << "Denoised in " << pathtracer::rendered_image.denoise_ms << " ms\n";
+	}
+	cleanupScenes();
+	return ok ? 0 : 1;
+}
+
 int main(int argc, char* argv[])
 {
+	batch_options_t options;
+	if(!parseArguments(argc, argv, options))
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+	if(options.headless)
+	{
+		return renderHeadless(options);
+	}
+
 	g_window = labhelper::init_window_SDL("Pathtracer", 1280, 720);
 
 	initialize();
@@ -611,6 +1051,9 @@ int main(int argc, char* argv[])
 			gui();
 		}
 
+		// Let the render thread pick up this frame's edits
+		sendFrameState();
+
 		// Render the GUI.
 		ImGui::Render();
 
@@ -618,6 +1061,9 @@ int main(int argc, char* argv[])
 		SDL_GL_SwapWindow(g_window);
 	}
 
+	pathtracer::stopRenderThread();
+	pathtracer_result.destroy();
+
 	// Delete Models
 	cleanupScenes();
 
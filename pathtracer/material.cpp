@@ -1,6 +1,10 @@
 #include "material.h"
 #include "sampling.h"
+#include "sampler.h"
 #include "labhelper.h"
+#include "embree.h"
+#include "texturecache.h"
+#include <algorithm>
 
 using namespace labhelper;
 
@@ -20,9 +24,10 @@ WiSample sampleHemisphereCosine(const vec3& wo, const vec3& n)
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// A Lambertian (diffuse) material
+// The lobes that all materials are built from. Both the BRDF/BSDF classes
+// and ShadingMaterial evaluate them through these functions.
 ///////////////////////////////////////////////////////////////////////////
-vec3 Diffuse::f(const vec3& wi, const vec3& wo, const vec3& n) const
+static inline vec3 diffuseF(const vec3& color, const vec3& wi, const vec3& wo, const vec3& n)
 {
 	if(dot(wi, n) <= 0.0f)
 		return vec3(0.0f);
@@ -31,14 +36,12 @@ vec3 Diffuse::f(const vec3& wi, const vec3& wo, const vec3& n) const
 	return (1.0f / M_PI) * color;
 }
 
-WiSample Diffuse::sample_wi(const vec3& wo, const vec3& n) const
+static inline float diffusePdf(const vec3& wi, const vec3& n)
 {
-	WiSample r = sampleHemisphereCosine(wo, n);
-	r.f = f(r.wi, wo, n);
-	return r;
+	return max(0.0f, dot(wi, n)) / M_PI;
 }
 
-vec3 MicrofacetBRDF::f(const vec3& wi, const vec3& wo, const vec3& n) const
+static inline vec3 microfacetF(float shininess, const vec3& wi, const vec3& wo, const vec3& n)
 {
 	if (dot(n, wi) < 0 || dot(n, wo) < 0)
 	{
@@ -57,16 +60,14 @@ vec3 MicrofacetBRDF::f(const vec3& wi, const vec3& wo, const vec3& n) const
 	return brdf * vec3(1.0, 1.0, 1.0);
 }
 
-WiSample MicrofacetBRDF::sample_wi(const vec3& wo, const vec3& n) const
+static inline WiSample microfacetSample(float shininess, const vec3& wo, const vec3& n)
 {
-	//WiSample r = sampleHemisphereCosine(wo, n);
-	//r.f = f(r.wi, wo, n);
-
 	WiSample r;
 	vec3 tangent = normalize(perpendicular(n));
 	vec3 bitangent = normalize(cross(tangent, n));
-	float phi = 2.0f * M_PI * randf();
-	float cos_theta = pow(randf(), 1.0f / (shininess + 1));
+	vec2 u = getSampler().get2D();
+	float phi = 2.0f * M_PI * u.x;
+	float cos_theta = pow(u.y, 1.0f / (shininess + 1));
 	float sin_theta = sqrt(max(0.0f, 1.0f - cos_theta * cos_theta));
 	vec3 wh = normalize(sin_theta * cos(phi) * tangent +
 		sin_theta * sin(phi) * bitangent +
@@ -80,13 +81,26 @@ WiSample MicrofacetBRDF::sample_wi(const vec3& wo, const vec3& n) const
 
 	r.pdf = pwi;
 	r.wi = normalize(2 * dot(wh, wo) * wh - wo);
-	r.f = f(r.wi, wo, n);
+	r.f = microfacetF(shininess, r.wi, wo, n);
 
 	return r;
 }
 
+static inline float microfacetPdf(float shininess, const vec3& wi, const vec3& wo, const vec3& n)
+{
+	vec3 h = wi + wo;
+	if(dot(h, h) < 1e-12f)
+	{
+		return 0.0f;
+	}
+	vec3 wh = normalize(h);
+	float ndotwh = abs(dot(n, wh));
+	float wodotwh = max(0.0001f, abs(dot(wo, wh)));
+	float pwh = (shininess + 1.0f) * pow(ndotwh, shininess) / (2 * M_PI);
+	return pwh / (4 * wodotwh);
+}
 
-float BSDF::fresnel(const vec3& wi, const vec3& wo) const
+static inline float fresnelTerm(float R0, const vec3& wi, const vec3& wo)
 {
 	vec3 wh = normalize(wi + wo);
 	float whdotwi = std::max(0.00001f, dot(wh, wi));
@@ -94,6 +108,47 @@ float BSDF::fresnel(const vec3& wi, const vec3& wo) const
 	return F;
 }
 
+///////////////////////////////////////////////////////////////////////////
+// A Lambertian (diffuse) material
+///////////////////////////////////////////////////////////////////////////
+vec3 Diffuse::f(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	return diffuseF(color, wi, wo, n);
+}
+
+WiSample Diffuse::sample_wi(const vec3& wo, const vec3& n) const
+{
+	WiSample r = sampleHemisphereCosine(wo, n);
+	r.f = f(r.wi, wo, n);
+	return r;
+}
+
+float Diffuse::pdf(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	return diffusePdf(wi, n);
+}
+
+vec3 MicrofacetBRDF::f(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	return microfacetF(shininess, wi, wo, n);
+}
+
+WiSample MicrofacetBRDF::sample_wi(const vec3& wo, const vec3& n) const
+{
+	return microfacetSample(shininess, wo, n);
+}
+
+float MicrofacetBRDF::pdf(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	return microfacetPdf(shininess, wi, wo, n);
+}
+
+
+float BSDF::fresnel(const vec3& wi, const vec3& wo) const
+{
+	return fresnelTerm(R0, wi, wo);
+}
+
 
 vec3 DielectricBSDF::f(const vec3& wi, const vec3& wo, const vec3& n) const
 {
@@ -110,7 +165,7 @@ WiSample DielectricBSDF::sample_wi(const vec3& wo, const vec3& n) const
 {
 	WiSample r;
 	
-	if (randf() < 0.5) {
+	if (getSampler().get1D() < 0.5) {
 		r = reflective_material->sample_wi(wo, n);
 		r.pdf *= 0.5;
 		float F = BSDF::fresnel(r.wi, wo);
@@ -129,6 +184,11 @@ WiSample DielectricBSDF::sample_wi(const vec3& wo, const vec3& n) const
 	return r;
 }
 
+float DielectricBSDF::pdf(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	return 0.5f * reflective_material->pdf(wi, wo, n) + 0.5f * transmissive_material->pdf(wi, wo, n);
+}
+
 vec3 MetalBSDF::f(const vec3& wi, const vec3& wo, const vec3& n) const
 {
 	float F = BSDF::fresnel(wi, wo);
@@ -147,6 +207,11 @@ WiSample MetalBSDF::sample_wi(const vec3& wo, const vec3& n) const
 	return r;
 }
 
+float MetalBSDF::pdf(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	return reflective_material->pdf(wi, wo, n);
+}
+
 
 vec3 BSDFLinearBlend::f(const vec3& wi, const vec3& wo, const vec3& n) const
 {
@@ -161,7 +226,7 @@ WiSample BSDFLinearBlend::sample_wi(const vec3& wo, const vec3& n) const
 
 	WiSample r;
 
-	if (randf() < w) {
+	if (getSampler().get1D() < w) {
 		r = bsdf0->sample_wi(wo, n);
 		
 		float F = BSDF::fresnel(r.wi, wo);
@@ -180,6 +245,222 @@ WiSample BSDFLinearBlend::sample_wi(const vec3& wo, const vec3& n) const
 	return r;
 }
 
+float BSDFLinearBlend::pdf(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	return w * bsdf0->pdf(wi, wo, n) + (1 - w) * bsdf1->pdf(wi, wo, n);
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// ShadingMaterial. Each function mirrors the corresponding MaterialTree
+// call, operation for operation, so the results are identical.
+///////////////////////////////////////////////////////////////////////////
+std::vector<ShadingMaterial> shading_materials;
+
+// Metals and dielectrics skip the blend
+static int shadingModel(float metalness)
+{
+	if(metalness == 0.0f)
+		return SHADING_DIELECTRIC;
+	if(metalness == 1.0f)
+		return SHADING_METAL;
+	return SHADING_BLEND;
+}
+
+ShadingMaterial ShadingMaterial::pack(const labhelper::Material& m)
+{
+	ShadingMaterial s;
+	s.color = m.m_color;
+	s.shininess = m.m_shininess;
+	s.emission = m.m_emission;
+	s.fresnel_R0 = m.m_fresnel;
+	s.metalness = m.m_metalness;
+	s.model = shadingModel(m.m_metalness);
+	s.color_texture = m.m_color_texture.valid ? findTexture(m.m_color_texture.path()) : -1;
+	s.shininess_texture = m.m_shininess_texture.valid ? findTexture(m.m_shininess_texture.path()) : -1;
+	s.metalness_texture = m.m_metalness_texture.valid ? findTexture(m.m_metalness_texture.path()) : -1;
+	s.fresnel_texture = m.m_fresnel_texture.valid ? findTexture(m.m_fresnel_texture.path()) : -1;
+	s.emission_texture = m.m_emission_texture.valid ? findTexture(m.m_emission_texture.path()) : -1;
+	s.has_textures = s.color_texture >= 0 || s.shininess_texture >= 0 || s.metalness_texture >= 0
+	                 || s.fresnel_texture >= 0 || s.emission_texture >= 0;
+	return s;
+}
+
+ShadingMaterial ShadingMaterial::textured(const vec2& uv, float uv_width) const
+{
+	ShadingMaterial s = *this;
+	if(color_texture >= 0)
+		s.color = vec3(sampleTexture(color_texture, uv, uv_width));
+	if(shininess_texture >= 0)
+		s.shininess = shininess * sampleTexture(shininess_texture, uv, uv_width).x;
+	if(fresnel_texture >= 0)
+		s.fresnel_R0 = sampleTexture(fresnel_texture, uv, uv_width).x;
+	if(emission_texture >= 0)
+		s.emission = vec3(sampleTexture(emission_texture, uv, uv_width));
+	if(metalness_texture >= 0)
+	{
+		s.metalness = sampleTexture(metalness_texture, uv, uv_width).x;
+		s.model = shadingModel(s.metalness);
+	}
+	return s;
+}
+
+void ShadingMaterial::textured(const vec2* uv, const float* uv_width, int count, ShadingMaterial* out) const
+{
+	static thread_local std::vector<vec4> texels;
+	texels.resize(count);
+	std::fill(out, out + count, *this);
+	if(color_texture >= 0)
+	{
+		sampleTexture(color_texture, uv, uv_width, count, texels.data());
+		for(int i = 0; i < count; i++)
+			out[i].color = vec3(texels[i]);
+	}
+	if(shininess_texture >= 0)
+	{
+		sampleTexture(shininess_texture, uv, uv_width, count, texels.data());
+		for(int i = 0; i < count; i++)
+			out[i].shininess = shininess * texels[i].x;
+	}
+	if(fresnel_texture >= 0)
+	{
+		sampleTexture(fresnel_texture, uv, uv_width, count, texels.data());
+		for(int i = 0; i < count; i++)
+			out[i].fresnel_R0 = texels[i].x;
+	}
+	if(emission_texture >= 0)
+	{
+		sampleTexture(emission_texture, uv, uv_width, count, texels.data());
+		for(int i = 0; i < count; i++)
+			out[i].emission = vec3(texels[i]);
+	}
+	if(metalness_texture >= 0)
+	{
+		sampleTexture(metalness_texture, uv, uv_width, count, texels.data());
+		for(int i = 0; i < count; i++)
+		{
+			out[i].metalness = texels[i].x;
+			out[i].model = shadingModel(out[i].metalness);
+		}
+	}
+}
+
+void packShadingMaterials(std::vector<ShadingMaterial>& materials)
+{
+	const std::vector<const labhelper::Material*>& scene_materials = getSceneMaterials();
+	materials.resize(scene_materials.size());
+	for(size_t i = 0; i < scene_materials.size(); i++)
+	{
+		materials[i] = ShadingMaterial::pack(*scene_materials[i]);
+	}
+}
+
+void updateShadingMaterials()
+{
+	packShadingMaterials(shading_materials);
+}
+
+bool packMaterialPatch(const labhelper::Material& m, MaterialPatch& patch)
+{
+	const std::vector<const labhelper::Material*>& scene_materials = getSceneMaterials();
+	const auto it = std::find(scene_materials.begin(), scene_materials.end(), &m);
+	if(it == scene_materials.end())
+	{
+		return false;
+	}
+	patch.material_id = uint32_t(it - scene_materials.begin());
+	patch.material = ShadingMaterial::pack(m);
+	return true;
+}
+
+void applyMaterialPatches(const std::vector<MaterialPatch>& patches)
+{
+	for(const MaterialPatch& patch : patches)
+	{
+		if(patch.material_id < shading_materials.size())
+		{
+			shading_materials[patch.material_id] = patch.material;
+		}
+	}
+}
+
+void registerMaterialTextures(const labhelper::Material& m)
+{
+	if(m.m_color_texture.valid)
+		registerTexture(m.m_color_texture.path(), 4);
+	if(m.m_shininess_texture.valid)
+		registerTexture(m.m_shininess_texture.path(), 1);
+	if(m.m_metalness_texture.valid)
+		registerTexture(m.m_metalness_texture.path(), 1);
+	if(m.m_fresnel_texture.valid)
+		registerTexture(m.m_fresnel_texture.path(), 1);
+	if(m.m_emission_texture.valid)
+		registerTexture(m.m_emission_texture.path(), 4);
+}
+
+vec3 ShadingMaterial::f(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	// The metal and the dielectric share the fresnel term and the BRDF
+	const float F = fresnelTerm(fresnel_R0, wi, wo);
+	const vec3 brdf = microfacetF(shininess, wi, wo, n);
+	switch(model)
+	{
+	case SHADING_DIELECTRIC:
+		return F * brdf + (1 - F) * diffuseF(color, wi, wo, n);
+	case SHADING_METAL:
+		return F * brdf * color;
+	default:
+		return metalness * (F * brdf * color) + (1 - metalness) * (F * brdf + (1 - F) * diffuseF(color, wi, wo, n));
+	}
+}
+
+WiSample ShadingMaterial::sample_wi(const vec3& wo, const vec3& n) const
+{
+	Sampler& sampler = getSampler();
+	// Drawn even when there is only one lobe, to keep the dimensions the
+	// same as for the blend
+	const float u_metal = sampler.get1D();
+	const bool metal = model == SHADING_METAL || (model == SHADING_BLEND && u_metal < metalness);
+
+	WiSample r;
+	if(metal)
+	{
+		r = microfacetSample(shininess, wo, n);
+		float F = fresnelTerm(fresnel_R0, r.wi, wo);
+		r.f = r.f * F * color;
+	}
+	else if(sampler.get1D() < 0.5)
+	{
+		r = microfacetSample(shininess, wo, n);
+		r.pdf *= 0.5;
+		float F = fresnelTerm(fresnel_R0, r.wi, wo);
+		r.f = r.f * F;
+	}
+	else
+	{
+		r = sampleHemisphereCosine(wo, n);
+		r.f = diffuseF(color, r.wi, wo, n);
+		r.pdf *= 0.5;
+		float F = fresnelTerm(fresnel_R0, r.wi, wo);
+		r.f = r.f * (1 - F);
+	}
+	return r;
+}
+
+float ShadingMaterial::pdf(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	const float metal_pdf = microfacetPdf(shininess, wi, wo, n);
+	if(model == SHADING_METAL)
+	{
+		return metal_pdf;
+	}
+	const float dielectric_pdf = 0.5f * metal_pdf + 0.5f * diffusePdf(wi, n);
+	if(model == SHADING_DIELECTRIC)
+	{
+		return dielectric_pdf;
+	}
+	return metalness * metal_pdf + (1 - metalness) * dielectric_pdf;
+}
 
 #if SOLUTION_PROJECT == PROJECT_REFRACTIONS
 ///////////////////////////////////////////////////////////////////////////
@@ -258,6 +539,12 @@ WiSample GlassBTDF::sample_wi(const vec3& wo, const vec3& n) const
 	return r;
 }
 
+float GlassBTDF::pdf(const vec3&, const vec3&, const vec3&) const
+{
+	// A specular refraction is never hit by directions chosen elsewhere
+	return 0.0f;
+}
+
 vec3 BTDFLinearBlend::f(const vec3& wi, const vec3& wo, const vec3& n) const
 {
 	return w * btdf0->f(wi, wo, n) + (1.0f - w) * btdf1->f(wi, wo, n);
@@ -265,7 +552,7 @@ vec3 BTDFLinearBlend::f(const vec3& wi, const vec3& wo, const vec3& n) const
 
 WiSample BTDFLinearBlend::sample_wi(const vec3& wo, const vec3& n) const
 {
-	if(randf() < w)
+	if(getSampler().get1D() < w)
 	{
 		WiSample r = btdf0->sample_wi(wo, n);
 		return r;
@@ -277,5 +564,10 @@ WiSample BTDFLinearBlend::sample_wi(const vec3& wo, const vec3& n) const
 	}
 }
 
+float BTDFLinearBlend::pdf(const vec3& wi, const vec3& wo, const vec3& n) const
+{
+	return w * btdf0->pdf(wi, wo, n) + (1.0f - w) * btdf1->pdf(wi, wo, n);
+}
+
 #endif
 } // namespace pathtracer
@@ -25,6 +25,8 @@ public:
 	// Sample a suitable direction and return the brdf in that direction as
 	// well as the pdf (~probability) that the direction was chosen.
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const = 0;
+	// The pdf with which sample_wi() would choose wi
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////
@@ -39,6 +41,8 @@ public:
 	// Sample a suitable direction and return the btdf in that direction as
 	// well as the pdf (~probability) that the direction was chosen.
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const = 0;
+	// The pdf with which sample_wi() would choose wi
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const = 0;
 };
 
 
@@ -62,6 +66,10 @@ public:
 	// well as the pdf (~probability) that the direction was chosen.
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const = 0;
 
+	// The pdf with which sample_wi() would choose wi, counting every lobe
+	// that could have produced it
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const = 0;
+
 	// Calculate the fresnel term
 	float fresnel(const vec3& wi, const vec3& wo) const;
 };
@@ -79,6 +87,7 @@ public:
 	}
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const override;
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const override;
 };
 
 
@@ -94,6 +103,7 @@ public:
 	}
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const override;
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const override;
 };
 
 
@@ -113,6 +123,7 @@ public:
 
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const override;
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const override;
 };
 
 ///////////////////////////////////////////////////////////////////////////
@@ -131,6 +142,7 @@ public:
 
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const override;
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const override;
 };
 
 
@@ -155,8 +167,129 @@ public:
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const override;
 
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const override;
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// The material tree used for a labhelper::Material: a blend between a
+/// metal and a dielectric that share a microfacet BRDF. The nodes point
+/// to each other, so the tree can not be copied.
+///////////////////////////////////////////////////////////////////////////
+struct MaterialTree
+{
+	Diffuse diffuse;
+	MicrofacetBRDF microfacet;
+	DielectricBSDF dielectric;
+	MetalBSDF metal;
+	BSDFLinearBlend metal_blend;
+
+	MaterialTree(const labhelper::Material& m)
+	    : diffuse(m.m_color)
+	    , microfacet(m.m_shininess)
+	    , dielectric(&microfacet, &diffuse, m.m_fresnel)
+	    , metal(&microfacet, m.m_color, m.m_fresnel)
+	    , metal_blend(m.m_metalness, &metal, &dielectric)
+	{
+	}
+	MaterialTree(const MaterialTree&) = delete;
+	MaterialTree& operator=(const MaterialTree&) = delete;
+
+	const BSDF& bsdf() const
+	{
+		return metal_blend;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// A labhelper::Material as plain data, for the integrators' hot loops.
+/// It computes exactly what MaterialTree does (and draws the same sample
+/// dimensions), but with a switch on `model` instead of virtual calls, so
+/// it needs no setup per hit and the lobes can be inlined.
+///////////////////////////////////////////////////////////////////////////
+enum ShadingModel
+{
+	// metalness == 0: the dielectric alone
+	SHADING_DIELECTRIC = 0,
+	// metalness == 1: the metal alone
+	SHADING_METAL = 1,
+	// Anything else: a blend of the two
+	SHADING_BLEND = 2,
+};
+
+struct ShadingMaterial
+{
+	vec3 color;
+	float shininess;
+	vec3 emission;
+	float fresnel_R0;
+	float metalness;
+	int model;
+	// Handles of the material's textures in the texture cache, or -1
+	int color_texture, shininess_texture, metalness_texture, fresnel_texture, emission_texture;
+	bool has_textures;
+
+	static ShadingMaterial pack(const labhelper::Material& m);
+	// The material with its textures looked up at `uv`, filtered over a
+	// footprint `uv_width` wide. Color and emission textures replace the
+	// color and emission, as in the GL shaders, as do metalness and
+	// fresnel textures. Shininess textures scale the shininess.
+	ShadingMaterial textured(const vec2& uv, float uv_width) const;
+	// The same for `count` hit points, with each texture looked up as one
+	// batch
+	void textured(const vec2* uv, const float* uv_width, int count, ShadingMaterial* out) const;
+
+	vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const;
+	WiSample sample_wi(const vec3& wo, const vec3& n) const;
+	float pdf(const vec3& wi, const vec3& wo, const vec3& n) const;
 };
 
+///////////////////////////////////////////////////////////////////////////
+/// The scene's materials, packed, indexed by Intersection::material_id
+///////////////////////////////////////////////////////////////////////////
+extern std::vector<ShadingMaterial> shading_materials;
+
+///////////////////////////////////////////////////////////////////////////
+/// Pack the materials of the models in the embree scene into `materials`,
+/// or into shading_materials
+///////////////////////////////////////////////////////////////////////////
+void packShadingMaterials(std::vector<ShadingMaterial>& materials);
+void updateShadingMaterials();
+
+///////////////////////////////////////////////////////////////////////////
+/// An edited material, repacked, for its entry in shading_materials. The
+/// viewer sends these to the render thread rather than the whole table.
+///////////////////////////////////////////////////////////////////////////
+struct MaterialPatch
+{
+	uint32_t material_id;
+	ShadingMaterial material;
+};
+// False if `m` is not one of the scene's materials
+bool packMaterialPatch(const labhelper::Material& m, MaterialPatch& patch);
+void applyMaterialPatches(const std::vector<MaterialPatch>& patches);
+
+///////////////////////////////////////////////////////////////////////////
+/// Register the textures of a material in the texture cache, when its
+/// model is added to the scene
+///////////////////////////////////////////////////////////////////////////
+void registerMaterialTextures(const labhelper::Material& m);
+
+///////////////////////////////////////////////////////////////////////////
+/// The material at a hit point: its entry in shading_materials, or, if it
+/// has textures, the textured material, in `storage`
+///////////////////////////////////////////////////////////////////////////
+inline const ShadingMaterial& shadingMaterialAt(uint32_t material_id, const vec2& uv, float uv_width,
+                                                ShadingMaterial& storage)
+{
+	const ShadingMaterial& mat = shading_materials[material_id];
+	if(!mat.has_textures || !settings.material_textures)
+	{
+		return mat;
+	}
+	storage = mat.textured(uv, uv_width);
+	return storage;
+}
+
 #if SOLUTION_PROJECT == PROJECT_REFRACTIONS
 ///////////////////////////////////////////////////////////////////////////
 // A perfect specular refraction.
@@ -172,6 +305,7 @@ public:
 
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const override;
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const override;
 };
 
 class BTDFLinearBlend : public BTDF
@@ -188,6 +322,7 @@ public:
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const override;
 
 	virtual WiSample sample_wi(const vec3& wo, const vec3& n) const override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) const override;
 };
 
 
@@ -0,0 +1,169 @@
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "Pathtracer.h"
+#include "material.h"
+#include "sampler.h"
+
+using namespace glm;
+using namespace std;
+using namespace pathtracer;
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks that ShadingMaterial computes what the MaterialTree it replaced
+// does: for a range of materials and random directions, both are
+// evaluated, and sampled from the same sampler dimensions, and f, pdf and
+// the sampled directions must agree. Returns nonzero on any mismatch.
+///////////////////////////////////////////////////////////////////////////////
+const float TOLERANCE = 1e-4f;
+const int DIRECTIONS_PER_MATERIAL = 2000;
+
+bool close(float a, float b)
+{
+	// Both sides hit the same degenerate cases, so inf and nan must agree
+	if(!std::isfinite(a) || !std::isfinite(b))
+	{
+		return (std::isnan(a) && std::isnan(b)) || a == b;
+	}
+	return std::abs(a - b) <= TOLERANCE * std::max(1.0f, std::max(std::abs(a), std::abs(b)));
+}
+
+bool close(const vec3& a, const vec3& b)
+{
+	return close(a.x, b.x) && close(a.y, b.y) && close(a.z, b.z);
+}
+
+vec3 uniformSphere(mt19937& rng)
+{
+	uniform_real_distribution<float> u(0.0f, 1.0f);
+	float z = 1.0f - 2.0f * u(rng);
+	float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+	float phi = 2.0f * float(M_PI) * u(rng);
+	return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+labhelper::Material randomMaterial(mt19937& rng, float metalness, float shininess, float fresnel)
+{
+	uniform_real_distribution<float> u(0.0f, 1.0f);
+	labhelper::Material m;
+	m.m_name = "test";
+	m.m_color = vec3(u(rng), u(rng), u(rng));
+	m.m_shininess = shininess;
+	m.m_metalness = metalness;
+	m.m_fresnel = fresnel;
+	m.m_emission = vec3(0.0f);
+	m.m_transparency = 0.0f;
+	m.m_ior = 1.0f;
+	return m;
+}
+
+int failures = 0;
+
+void report(const char* what, const labhelper::Material& m, const vec3& a, const vec3& b)
+{
+	// Only the first few, the rest are most likely the same problem
+	if(++failures <= 20)
+	{
+		printf("%s differs (metalness %g, shininess %g, fresnel %g): tree (%g, %g, %g), "
+		       "packed (%g, %g, %g)\n",
+		       what, m.m_metalness, m.m_shininess, m.m_fresnel, a.x, a.y, a.z, b.x, b.y, b.z);
+	}
+}
+
+void testMaterial(const labhelper::Material& m, mt19937& rng)
+{
+	const MaterialTree tree(m);
+	const BSDF& bsdf = tree.bsdf();
+	const ShadingMaterial packed = ShadingMaterial::pack(m);
+	Sampler& sampler = getSampler();
+
+	for(int i = 0; i < DIRECTIONS_PER_MATERIAL; i++)
+	{
+		const vec3 n = uniformSphere(rng);
+		vec3 wo = uniformSphere(rng);
+		if(dot(wo, n) < 0.0f)
+		{
+			wo = -wo;
+		}
+		// Any wi, including ones below the surface
+		const vec3 wi = uniformSphere(rng);
+
+		if(!close(bsdf.f(wi, wo, n), packed.f(wi, wo, n)))
+		{
+			report("f", m, bsdf.f(wi, wo, n), packed.f(wi, wo, n));
+		}
+		if(!close(bsdf.pdf(wi, wo, n), packed.pdf(wi, wo, n)))
+		{
+			report("pdf", m, vec3(bsdf.pdf(wi, wo, n)), vec3(packed.pdf(wi, wo, n)));
+		}
+
+		// Both must read the same dimensions of the same sample
+		const int x = i % 64, y = i / 64;
+		const uint32_t dimension = bounceDimension(i % 4);
+		sampler.startPixelSample(x, y, uint32_t(i), dimension);
+		const WiSample a = bsdf.sample_wi(wo, n);
+		const uint32_t tree_dimensions = sampler.getDimension() - dimension;
+		sampler.startPixelSample(x, y, uint32_t(i), dimension);
+		const WiSample b = packed.sample_wi(wo, n);
+		const uint32_t packed_dimensions = sampler.getDimension() - dimension;
+
+		if(tree_dimensions != packed_dimensions)
+		{
+			report("Dimensions used", m, vec3(float(tree_dimensions)), vec3(float(packed_dimensions)));
+		}
+		if(!close(a.wi, b.wi))
+		{
+			report("Sampled wi", m, a.wi, b.wi);
+		}
+		if(!close(a.f, b.f))
+		{
+			report("Sampled f", m, a.f, b.f);
+		}
+		if(!close(a.pdf, b.pdf))
+		{
+			report("Sampled pdf", m, vec3(a.pdf), vec3(b.pdf));
+		}
+		// And the pdf of the sampled direction, as used for MIS
+		if(!close(bsdf.pdf(a.wi, wo, n), packed.pdf(b.wi, wo, n)))
+		{
+			report("pdf(sampled wi)", m, vec3(bsdf.pdf(a.wi, wo, n)), vec3(packed.pdf(b.wi, wo, n)));
+		}
+	}
+}
+
+int main(int, char*[])
+{
+	mt19937 rng(1);
+	// The metal and the dielectric alone take their own paths through
+	// ShadingMaterial, so those are tested as well as blends
+	const float metalness[] = { 0.0f, 1.0f, 0.25f, 0.5f, 0.9f };
+	const float shininess[] = { 0.0f, 1.0f, 25.0f, 500.0f, 10000.0f };
+	const float fresnel[] = { 0.0f, 0.04f, 0.5f, 1.0f };
+	const int samplers[] = { SAMPLER_INDEPENDENT, SAMPLER_STRATIFIED, SAMPLER_SOBOL, SAMPLER_BLUE_NOISE };
+
+	int tested = 0;
+	for(int sampler : samplers)
+	{
+		settings.sampler = sampler;
+		for(float mm : metalness)
+		{
+			for(float s : shininess)
+			{
+				for(float f : fresnel)
+				{
+					testMaterial(randomMaterial(rng, mm, s, f), rng);
+					tested++;
+				}
+			}
+		}
+	}
+
+	if(failures > 0)
+	{
+		printf("FAILED: %d mismatches over %d materials\n", failures, tested);
+		return 1;
+	}
+	printf("OK: %d materials, %d directions each\n", tested, DIRECTIONS_PER_MATERIAL);
+	return 0;
+}
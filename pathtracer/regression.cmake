@@ -0,0 +1,77 @@
+###############################################################################
+# Renders SCENE headless with fixed settings and checks that
+#  - the render matches the stored reference, references/SCENE.hdr, within
+#    the thresholds below. A missing reference is an error.
+#  - rendering on one thread gives exactly the same image as on all cores,
+#    with both integrators, as every sample dimension comes from
+#    counterHash() and not from per-thread state.
+#
+# Run by ctest (see CMakeLists.txt) from bin/, as the scenes are loaded
+# relative to it:
+#   cmake -DSCENE=Ship -DPATHTRACER=... -DIMAGEDIFF=... -DREFERENCE_DIR=...
+#         -DOUTPUT_DIR=... [-DUPDATE_REFERENCES=ON] -P regression.cmake
+#
+# With UPDATE_REFERENCES=ON nothing is compared with the reference. The
+# render is written to OUTPUT_DIR/references/SCENE.hdr instead, to replace
+# the one in REFERENCE_DIR once it has been checked. Only OUTPUT_DIR is
+# ever written to.
+###############################################################################
+foreach ( VAR SCENE PATHTRACER IMAGEDIFF REFERENCE_DIR OUTPUT_DIR )
+    if ( NOT DEFINED ${VAR} )
+        message ( FATAL_ERROR "regression.cmake: ${VAR} is not set" )
+    endif ()
+endforeach ()
+
+# Small and cheap, but enough samples and bounces to reach every material
+# and light in the scenes. Adaptive sampling is off, so that every pixel
+# takes the same samples. The model cache is off, as it would be written
+# next to the OBJs, in the source tree.
+set ( RENDER_ARGS --headless --scene ${SCENE} --width 320 --height 180 --spp 32 --bounces 8
+      --seed 1 --sampler sobol --adaptive 0 --no-model-cache )
+# A change that only reorders floating point operations stays well below
+# these; a change in what is rendered does not.
+set ( MAX_RELMSE 0.001 )
+set ( MAX_FLIP 0.005 )
+
+file ( MAKE_DIRECTORY ${OUTPUT_DIR} )
+
+function ( render OUTPUT )
+    execute_process ( COMMAND ${PATHTRACER} ${RENDER_ARGS} ${ARGN} --output ${OUTPUT}
+                      RESULT_VARIABLE RESULT OUTPUT_QUIET )
+    if ( NOT RESULT EQUAL 0 )
+        string ( REPLACE ";" " " ARGS "${ARGN}" )
+        message ( FATAL_ERROR "Rendering ${SCENE} (${ARGS}) failed: ${RESULT}" )
+    endif ()
+endfunction ()
+
+function ( compare REFERENCE TEST )
+    execute_process ( COMMAND ${IMAGEDIFF} ${REFERENCE} ${TEST} ${ARGN} RESULT_VARIABLE RESULT )
+    if ( NOT RESULT EQUAL 0 )
+        message ( FATAL_ERROR "${TEST} does not match ${REFERENCE}" )
+    endif ()
+endfunction ()
+
+foreach ( INTEGRATOR recursive wavefront )
+    set ( BASENAME ${OUTPUT_DIR}/${SCENE}_${INTEGRATOR} )
+    render ( ${BASENAME} --integrator ${INTEGRATOR} --threads 0 )
+    render ( ${BASENAME}_1thread --integrator ${INTEGRATOR} --threads 1 )
+    compare ( ${BASENAME}.hdr ${BASENAME}_1thread.hdr --max-rmse 0 )
+endforeach ()
+
+# The integrators trace the same paths, so one reference covers both
+set ( REFERENCE ${REFERENCE_DIR}/${SCENE}.hdr )
+if ( UPDATE_REFERENCES )
+    set ( CANDIDATE ${OUTPUT_DIR}/references/${SCENE}.hdr )
+    file ( MAKE_DIRECTORY ${OUTPUT_DIR}/references )
+    configure_file ( ${OUTPUT_DIR}/${SCENE}_recursive.hdr ${CANDIDATE} COPYONLY )
+    message ( STATUS "Candidate reference for ${SCENE}: ${CANDIDATE}. Check it and copy it to ${REFERENCE}." )
+    return ()
+endif ()
+if ( NOT EXISTS ${REFERENCE} )
+    message ( FATAL_ERROR "No reference for ${SCENE} (${REFERENCE}). Configure with -DUPDATE_REFERENCES=ON "
+              "and run ctest to render a candidate." )
+endif ()
+foreach ( INTEGRATOR recursive wavefront )
+    compare ( ${REFERENCE} ${OUTPUT_DIR}/${SCENE}_${INTEGRATOR}.hdr --max-relmse ${MAX_RELMSE}
+              --max-flip ${MAX_FLIP} )
+endforeach ()
@@ -0,0 +1,322 @@
+#include "renderthread.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace pathtracer
+{
+namespace
+{
+std::thread render_thread;
+
+// Guards the state below, up to the snapshots
+std::mutex control_mutex;
+std::condition_variable control_changed;
+bool running = false;
+bool pause_requested = false;
+bool paused = false;
+FrameState pending_frame;
+
+// Bit 0 of snapshot_state is the index of the latest snapshot, and bit
+// 1 + i is set while the UI thread reads snapshot i. The render thread
+// only writes the snapshot that is neither the latest nor being read.
+ImageSnapshot snapshots[2];
+std::atomic<uint32_t> snapshot_state(0);
+std::atomic<bool> snapshot_available(false);
+// Only used by the UI thread
+int acquired_snapshot = -1;
+// Only used by the render thread
+uint64_t next_snapshot_id = 1;
+bool published_denoised = false;
+labhelper::HdrFormat snapshot_format = labhelper::HDR_FLOAT32, published_format = labhelper::HDR_FLOAT32;
+
+// Whether snapshots show the denoised image rather than the samples
+bool showDenoised()
+{
+	return settings.denoise && rendered_image.denoised_pass > 0
+	       && rendered_image.denoised.size() == rendered_image.sample_count.size();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Copy rendered_image into the snapshot that is not the latest, and make
+// it the latest. Returns false if the UI thread still reads that one.
+///////////////////////////////////////////////////////////////////////////
+bool publishSnapshot()
+{
+	uint32_t state = snapshot_state.load(std::memory_order_acquire);
+	const int target = 1 - int(state & 1u);
+	if(state & (2u << target))
+	{
+		return false;
+	}
+
+	ImageSnapshot& snapshot = snapshots[target];
+	const Image& image = rendered_image;
+	const int num_pixels = image.width * image.height;
+	snapshot.id = next_snapshot_id++;
+	snapshot.width = image.width;
+	snapshot.height = image.height;
+	snapshot.format = snapshot_format;
+	published_format = snapshot_format;
+	published_denoised = showDenoised();
+	// Free the storage of the other formats
+	if(snapshot.format != labhelper::HDR_FLOAT32)
+		std::vector<vec4>().swap(snapshot.pixels);
+	if(snapshot.format != labhelper::HDR_FLOAT16)
+		std::vector<uint16_t>().swap(snapshot.half_pixels);
+	if(snapshot.format != labhelper::HDR_RGB9E5)
+		std::vector<uint32_t>().swap(snapshot.rgb9e5_pixels);
+	if(snapshot.format == labhelper::HDR_FLOAT32)
+	{
+		snapshot.pixels.resize(num_pixels);
+		if(published_denoised)
+		{
+#pragma omp parallel for
+			for(int i = 0; i < num_pixels; i++)
+			{
+				snapshot.pixels[i] = vec4(image.denoised[i], 1.0f);
+			}
+		}
+		else
+		{
+#pragma omp parallel for
+			for(int i = 0; i < num_pixels; i++)
+			{
+				snapshot.pixels[i] = vec4(image.sum[i], float(image.sample_count[i]));
+			}
+		}
+	}
+	else
+	{
+		if(snapshot.format == labhelper::HDR_FLOAT16)
+			snapshot.half_pixels.resize(size_t(num_pixels) * 4);
+		else
+			snapshot.rgb9e5_pixels.resize(num_pixels);
+		// Resolved a chunk at a time, which stays in the cache to be packed
+		const int CHUNK = 1024;
+		const int num_chunks = (num_pixels + CHUNK - 1) / CHUNK;
+#pragma omp parallel for
+		for(int chunk = 0; chunk < num_chunks; chunk++)
+		{
+			vec4 colors[CHUNK];
+			const int begin = chunk * CHUNK;
+			const int count = std::min(CHUNK, num_pixels - begin);
+			for(int i = 0; i < count; i++)
+			{
+				const int p = begin + i;
+				if(published_denoised)
+				{
+					colors[i] = vec4(image.denoised[p], 1.0f);
+				}
+				else
+				{
+					const uint32_t n = image.sample_count[p];
+					colors[i] = vec4(image.sum[p] * (n > 0 ? 1.0f / float(n) : 0.0f), 1.0f);
+				}
+			}
+			if(snapshot.format == labhelper::HDR_FLOAT16)
+				labhelper::floatToHalf(&colors[0].x, size_t(count) * 4, &snapshot.half_pixels[size_t(begin) * 4]);
+			else
+				labhelper::packRGB9E5(&colors[0].x, 4, count, &snapshot.rgb9e5_pixels[begin]);
+		}
+	}
+	snapshot.stats.number_of_samples = getSampleCount();
+	snapshot.stats.converged_fraction = getConvergedFraction();
+	snapshot.stats.tiles = getTileStats();
+	snapshot.stats.paths = getPathStats();
+	snapshot.stats.textures = getTextureCacheStats();
+	snapshot.stats.denoise_ms = published_denoised ? image.denoise_ms : 0.0;
+
+	// Keep the UI's reading bits, which it may set meanwhile
+	while(!snapshot_state.compare_exchange_weak(state, (state & ~1u) | uint32_t(target), std::memory_order_acq_rel))
+	{
+	}
+	snapshot_available.store(true, std::memory_order_release);
+	return true;
+}
+
+void applyFrameState(const FrameState& frame)
+{
+	settings = frame.settings;
+	point_light = frame.point_light;
+	disc_lights = frame.disc_lights;
+	environment.multiplier = frame.environment_multiplier;
+	applyMaterialPatches(frame.material_patches);
+	snapshot_format = frame.snapshot_format;
+	if(rendered_image.width != frame.window_width / settings.subsampling
+	   || rendered_image.height != frame.window_height / settings.subsampling)
+	{
+		resize(frame.window_width, frame.window_height);
+	}
+	else if(frame.restart)
+	{
+		restart();
+	}
+}
+
+void renderLoop()
+{
+	FrameState frame;
+	// A finished pass that could not be published yet
+	bool unpublished = false;
+	for(;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(control_mutex);
+			if(pause_requested)
+			{
+				paused = true;
+				control_changed.notify_all();
+				control_changed.wait(lock, [] { return !pause_requested || !running; });
+				paused = false;
+			}
+			if(!running)
+			{
+				break;
+			}
+			frame = pending_frame;
+			pending_frame.restart = false;
+			pending_frame.material_patches.clear();
+			clearAbort();
+		}
+		applyFrameState(frame);
+
+		bool idle = true;
+		if(rendered_image.width > 0 && rendered_image.height > 0 && tracePaths(frame.view, frame.projection))
+		{
+			// An aborted pass left the image half updated, and it is about
+			// to be restarted anyway, so it is not shown
+			unpublished = !passAborted();
+			idle = rendered_image.num_active == 0;
+		}
+		else if(settings.denoise && rendered_image.changed_pass > rendered_image.denoised_pass)
+		{
+			// The image was done before denoising was turned on
+			denoise();
+			unpublished = true;
+		}
+		else if(showDenoised() != published_denoised || snapshot_format != published_format)
+		{
+			unpublished = true;
+		}
+		if(unpublished)
+		{
+			unpublished = !publishSnapshot();
+		}
+		if(idle)
+		{
+			std::unique_lock<std::mutex> lock(control_mutex);
+			control_changed.wait_for(lock, std::chrono::milliseconds(10),
+			                         [] { return pause_requested || !running || pending_frame.restart; });
+		}
+	}
+}
+} // namespace
+
+void startRenderThread(const FrameState& state)
+{
+	stopRenderThread();
+	pending_frame = state;
+	pending_frame.restart = true;
+	running = true;
+	render_thread = std::thread(renderLoop);
+}
+
+void stopRenderThread()
+{
+	{
+		std::lock_guard<std::mutex> lock(control_mutex);
+		running = false;
+		control_changed.notify_all();
+	}
+	abortPass();
+	if(render_thread.joinable())
+	{
+		render_thread.join();
+	}
+	pause_requested = false;
+}
+
+void setFrameState(const FrameState& state)
+{
+	std::lock_guard<std::mutex> lock(control_mutex);
+	const bool restart = pending_frame.restart || state.restart;
+	// A material edited again only needs its latest patch
+	std::vector<MaterialPatch> material_patches = std::move(pending_frame.material_patches);
+	for(const MaterialPatch& patch : state.material_patches)
+	{
+		auto it = std::find_if(material_patches.begin(), material_patches.end(),
+		                       [&](const MaterialPatch& p) { return p.material_id == patch.material_id; });
+		if(it != material_patches.end())
+			*it = patch;
+		else
+			material_patches.push_back(patch);
+	}
+	pending_frame = state;
+	pending_frame.restart = restart;
+	pending_frame.material_patches = std::move(material_patches);
+	if(state.restart)
+	{
+		abortPass();
+		control_changed.notify_all();
+	}
+}
+
+void pauseRenderThread()
+{
+	std::unique_lock<std::mutex> lock(control_mutex);
+	if(!running)
+	{
+		return;
+	}
+	pause_requested = true;
+	// The scene is about to change, so a pass that refines the image is
+	// not worth finishing
+	abortPass();
+	control_changed.notify_all();
+	control_changed.wait(lock, [] { return paused; });
+}
+
+void resumeRenderThread()
+{
+	std::lock_guard<std::mutex> lock(control_mutex);
+	pause_requested = false;
+	control_changed.notify_all();
+}
+
+void reloadMaterials()
+{
+	std::lock_guard<std::mutex> lock(control_mutex);
+	pending_frame.material_patches.clear();
+	updateShadingMaterials();
+}
+
+const ImageSnapshot* acquireSnapshot()
+{
+	if(acquired_snapshot >= 0 || !snapshot_available.load(std::memory_order_acquire))
+	{
+		return nullptr;
+	}
+	uint32_t state = snapshot_state.load(std::memory_order_acquire);
+	int latest;
+	do
+	{
+		latest = int(state & 1u);
+	} while(!snapshot_state.compare_exchange_weak(state, state | (2u << latest), std::memory_order_acq_rel));
+	acquired_snapshot = latest;
+	return &snapshots[latest];
+}
+
+void releaseSnapshot()
+{
+	if(acquired_snapshot < 0)
+	{
+		return;
+	}
+	snapshot_state.fetch_and(~(2u << acquired_snapshot), std::memory_order_release);
+	acquired_snapshot = -1;
+}
+} // namespace pathtracer
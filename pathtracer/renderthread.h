@@ -0,0 +1,131 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <PackedFloat.h>
+#include "Pathtracer.h"
+#include "material.h"
+#include "texturecache.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Interactive rendering. A render thread runs tracePaths() pass after
+// pass, while the UI thread shows the results and edits the scene.
+//
+// The UI edits its own FrameState and hands a copy over once per frame
+// with setFrameState(). The render thread picks up the latest one between
+// passes, so a pass never sees half an edit. After every pass it copies
+// the image into one of two ImageSnapshots, without ever waiting for the
+// UI, and the UI reads the latest one with acquireSnapshot().
+//
+// While the render thread runs, it owns settings, the lights,
+// environment.multiplier, shading_materials and rendered_image. The
+// embree scene may only change while it is paused.
+//
+// Edits cost the render thread only what they change. Light, camera and
+// setting edits start the image over. Material edits also replace the
+// edited entries of shading_materials (material_patches), without
+// touching the BVH. Moving a model refits the top level BVH to the
+// model's new transform while the thread is paused (setModelTransform()),
+// without rebuilding any model's own BVH.
+///////////////////////////////////////////////////////////////////////////
+struct FrameState
+{
+	Settings settings;
+	PointLight point_light;
+	std::vector<DiscLight> disc_lights;
+	float environment_multiplier = 1.0f;
+	// Materials edited since the last state. Like restart requests, they
+	// are kept until a pass picks them up, even if newer states replace
+	// this one.
+	std::vector<MaterialPatch> material_patches;
+	mat4 view, projection;
+	// The window size. The image is this divided by settings.subsampling.
+	int window_width = 0, window_height = 0;
+	// Start the image over. Aborts a pass that refines the old image.
+	bool restart = false;
+	// How snapshots store the image (see ImageSnapshot)
+	labhelper::HdrFormat snapshot_format = labhelper::HDR_FLOAT32;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// What the pass that produced a snapshot measured
+///////////////////////////////////////////////////////////////////////////
+struct RenderStats
+{
+	// As getSampleCount()
+	int number_of_samples = 0;
+	float converged_fraction = 0.0f;
+	TileStats tiles;
+	PathStats paths;
+	TextureCacheStats textures;
+	// How long denoising took, if the snapshot shows the denoised image
+	// (otherwise 0)
+	double denoise_ms = 0.0;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The image as of some pass
+///////////////////////////////////////////////////////////////////////////
+struct ImageSnapshot
+{
+	// Different for every published snapshot
+	uint64_t id = 0;
+	int width = 0, height = 0;
+	labhelper::HdrFormat format = labhelper::HDR_FLOAT32;
+	// With HDR_FLOAT32, per pixel: the sum of its samples in rgb, and their
+	// number in a (or the denoised color, and 1). Row 0 is the bottom row.
+	std::vector<glm::vec4> pixels;
+	// With the other formats, the colors (the sums divided by the counts)
+	// instead, packed by the render thread: RGBA half floats, or one RGB9E5
+	// word per pixel. That is 8 or 4 bytes per pixel rather than 16, and a
+	// texture of the same format is filled with a plain copy.
+	std::vector<uint16_t> half_pixels;
+	std::vector<uint32_t> rgb9e5_pixels;
+	RenderStats stats;
+
+	size_t getMemoryUsage() const
+	{
+		return pixels.size() * sizeof(glm::vec4) + half_pixels.size() * sizeof(uint16_t)
+		       + rgb9e5_pixels.size() * sizeof(uint32_t);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// Start rendering `state` on a new thread, and stop that thread
+///////////////////////////////////////////////////////////////////////////
+void startRenderThread(const FrameState& state);
+void stopRenderThread();
+
+///////////////////////////////////////////////////////////////////////////
+/// Replace the state that the next pass renders. Restart requests are
+/// kept until a pass picks them up, even if newer states replace this one.
+///////////////////////////////////////////////////////////////////////////
+void setFrameState(const FrameState& state);
+
+///////////////////////////////////////////////////////////////////////////
+/// Wait until the render thread has finished its pass (or aborted it, if
+/// it refines the image) and keep it from starting another, e.g. while
+/// the scene is rebuilt. Send a FrameState that matches the new scene,
+/// with a restart, before resuming.
+///////////////////////////////////////////////////////////////////////////
+void pauseRenderThread();
+void resumeRenderThread();
+
+///////////////////////////////////////////////////////////////////////////
+/// Repack all of shading_materials for a new scene, and drop the material
+/// patches for the old one that no pass has picked up. Call while paused
+/// (or before the thread starts).
+///////////////////////////////////////////////////////////////////////////
+void reloadMaterials();
+
+///////////////////////////////////////////////////////////////////////////
+/// The latest snapshot, or nullptr if no pass has finished yet. It stays
+/// unchanged until releaseSnapshot(). Acquire one at a time, and release
+/// it soon: the render thread skips publishing passes while the UI holds
+/// the snapshot that it would overwrite.
+///////////////////////////////////////////////////////////////////////////
+const ImageSnapshot* acquireSnapshot();
+void releaseSnapshot();
+} // namespace pathtracer
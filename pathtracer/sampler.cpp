@@ -0,0 +1,381 @@
+#include "sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+namespace
+{
+// The largest float below 1
+const float ONE_MINUS_EPSILON = 0.99999994f;
+
+uint32_t reverseBits(uint32_t x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+	x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+	x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+	x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+	return x;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Owen scrambling of the bits of x, most significant bit first
+///////////////////////////////////////////////////////////////////////////
+uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cU;
+	x ^= x * 0xb82f1e52U;
+	x ^= x * 0xc7afe638U;
+	x ^= x * 0x8d22f6e6U;
+	return x;
+}
+
+uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+	return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The second dimension of the Sobol sequence (the first one is the van
+// der Corput sequence, reverseBits(index))
+///////////////////////////////////////////////////////////////////////////
+uint32_t sobolSecondDimension(uint32_t index)
+{
+	uint32_t result = 0;
+	for(uint32_t v = 1U << 31; index != 0; index >>= 1, v ^= v >> 1)
+	{
+		if(index & 1)
+		{
+			result ^= v;
+		}
+	}
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A random permutation of [0, l), element i. From Kensler, "Correlated
+// Multi-Jittered Sampling".
+///////////////////////////////////////////////////////////////////////////
+uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+{
+	uint32_t w = l - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do
+	{
+		i ^= p;
+		i *= 0xe170893dU;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;
+		i *= 0x0929eb3fU;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | p >> 27;
+		i *= 0x6935fa69U;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303U;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3U;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3dfU;
+		i &= w;
+		i ^= i >> 5;
+	} while(i >= l);
+	return (i + p) % l;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A tileable 64x64 blue-noise mask with values in (0, 1), made with the
+// void-and-cluster method (Ulichney). Generated once, on first use.
+///////////////////////////////////////////////////////////////////////////
+const int MASK_SIZE = 64;
+
+std::vector<float> makeBlueNoiseMask()
+{
+	const int N = MASK_SIZE, S = N * N;
+	const float sigma = 1.5f;
+
+	// Gaussian energy of a point as a function of the (toroidal) offset
+	std::vector<float> kernel(S);
+	for(int dy = 0; dy < N; dy++)
+	{
+		for(int dx = 0; dx < N; dx++)
+		{
+			float x = float(std::min(dx, N - dx)), y = float(std::min(dy, N - dy));
+			kernel[dy * N + dx] = std::exp(-(x * x + y * y) / (2.0f * sigma * sigma));
+		}
+	}
+
+	std::vector<float> energy(S, 0.0f);
+	std::vector<char> is_set(S, 0);
+	auto update = [&](int p, float sign) {
+		const int px = p % N, py = p / N;
+		for(int q = 0; q < S; q++)
+		{
+			energy[q] += sign * kernel[((q / N - py) & (N - 1)) * N + ((q % N - px) & (N - 1))];
+		}
+		is_set[p] = sign > 0.0f;
+	};
+	auto tightestCluster = [&]() {
+		int best = -1;
+		for(int p = 0; p < S; p++)
+			if(is_set[p] && (best < 0 || energy[p] > energy[best]))
+				best = p;
+		return best;
+	};
+	auto largestVoid = [&]() {
+		int best = -1;
+		for(int p = 0; p < S; p++)
+			if(!is_set[p] && (best < 0 || energy[p] < energy[best]))
+				best = p;
+		return best;
+	};
+
+	///////////////////////////////////////////////////////////////////////
+	// Initial pattern: random points, relaxed by moving the point in the
+	// tightest cluster to the largest void until that changes nothing
+	///////////////////////////////////////////////////////////////////////
+	const int num_initial = S / 10;
+	uint32_t random = 1;
+	for(int placed = 0; placed < num_initial;)
+	{
+		random = hashUint(random);
+		int p = int(random % S);
+		if(!is_set[p])
+		{
+			update(p, 1.0f);
+			placed++;
+		}
+	}
+	for(;;)
+	{
+		int cluster = tightestCluster();
+		update(cluster, -1.0f);
+		int void_ = largestVoid();
+		update(void_, 1.0f);
+		if(void_ == cluster)
+		{
+			break;
+		}
+	}
+	const std::vector<float> initial_energy = energy;
+	const std::vector<char> initial_is_set = is_set;
+
+	///////////////////////////////////////////////////////////////////////
+	// Rank the initial points by removing the tightest clusters, then
+	// the rest by filling the largest voids
+	///////////////////////////////////////////////////////////////////////
+	std::vector<int> rank(S);
+	for(int r = num_initial - 1; r >= 0; r--)
+	{
+		int cluster = tightestCluster();
+		update(cluster, -1.0f);
+		rank[cluster] = r;
+	}
+	energy = initial_energy;
+	is_set = initial_is_set;
+	for(int r = num_initial; r < S; r++)
+	{
+		int void_ = largestVoid();
+		update(void_, 1.0f);
+		rank[void_] = r;
+	}
+
+	std::vector<float> mask(S);
+	for(int p = 0; p < S; p++)
+	{
+		mask[p] = (float(rank[p]) + 0.5f) / float(S);
+	}
+	return mask;
+}
+
+const std::vector<float>& blueNoiseMask()
+{
+	static const std::vector<float> mask = makeBlueNoiseMask();
+	return mask;
+}
+
+// Add two values in [0, 1) modulo 1
+float wrap(float a, float b)
+{
+	float v = a + b;
+	if(v >= 1.0f)
+	{
+		v -= 1.0f;
+	}
+	return std::min(v, ONE_MINUS_EPSILON);
+}
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////
+// Sampler
+///////////////////////////////////////////////////////////////////////////
+void Sampler::startPixelSample(int x, int y, uint32_t _sample_index, uint32_t _dimension)
+{
+	pixel_x = x;
+	pixel_y = y;
+	pixel_hash = hashUint(hashCombine(hashUint(uint32_t(x)), uint32_t(y)));
+	if(settings.seed != 0)
+		pixel_hash = hashUint(hashCombine(pixel_hash, settings.seed));
+	sample_index = _sample_index;
+	dimension = _dimension;
+}
+
+void Sampler::setDimension(uint32_t _dimension)
+{
+	dimension = _dimension;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// IndependentSampler
+///////////////////////////////////////////////////////////////////////////
+float IndependentSampler::get1D()
+{
+	return uintToFloat(counterHash(pixel_hash, sample_index, dimension++));
+}
+
+glm::vec2 IndependentSampler::get2D()
+{
+	float x = uintToFloat(counterHash(pixel_hash, sample_index, dimension++));
+	return glm::vec2(x, uintToFloat(counterHash(pixel_hash, sample_index, dimension++)));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// StratifiedSampler
+///////////////////////////////////////////////////////////////////////////
+void StratifiedSampler::setStrata(int strata_per_axis)
+{
+	strata = uint32_t(std::max(1, strata_per_axis));
+}
+
+uint32_t StratifiedSampler::stratum(uint32_t count) const
+{
+	// A new permutation for every run of `count` samples
+	uint32_t run = sample_index / count;
+	uint32_t seed = hashUint(hashCombine(hashCombine(pixel_hash, dimension), run));
+	return permute(sample_index % count, count, seed);
+}
+
+float StratifiedSampler::get1D()
+{
+	const uint32_t count = strata * strata;
+	float jitter = uintToFloat(hashUint(hashCombine(hashCombine(pixel_hash, sample_index), dimension) ^ 0x5bd1e995U));
+	float v = (float(stratum(count)) + jitter) / float(count);
+	dimension += 1;
+	return std::min(v, ONE_MINUS_EPSILON);
+}
+
+glm::vec2 StratifiedSampler::get2D()
+{
+	const uint32_t s = stratum(strata * strata);
+	uint32_t h = hashCombine(hashCombine(pixel_hash, sample_index), dimension);
+	float jitter_x = uintToFloat(hashUint(h ^ 0x5bd1e995U));
+	float jitter_y = uintToFloat(hashUint(h ^ 0x27d4eb2fU));
+	glm::vec2 v((float(s % strata) + jitter_x) / float(strata), (float(s / strata) + jitter_y) / float(strata));
+	dimension += 2;
+	return glm::min(v, glm::vec2(ONE_MINUS_EPSILON));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// SobolSampler
+///////////////////////////////////////////////////////////////////////////
+uint32_t SobolSampler::sobol1D(uint32_t seed) const
+{
+	uint32_t index = nestedUniformScramble(sample_index, seed);
+	return nestedUniformScramble(reverseBits(index), hashCombine(seed, 0));
+}
+
+void SobolSampler::sobol2D(uint32_t seed, uint32_t& x, uint32_t& y) const
+{
+	uint32_t index = nestedUniformScramble(sample_index, seed);
+	x = nestedUniformScramble(reverseBits(index), hashCombine(seed, 0));
+	y = nestedUniformScramble(sobolSecondDimension(index), hashCombine(seed, 1));
+}
+
+float SobolSampler::get1D()
+{
+	uint32_t seed = hashUint(hashCombine(pixel_hash, dimension));
+	dimension += 1;
+	return uintToFloat(sobol1D(seed));
+}
+
+glm::vec2 SobolSampler::get2D()
+{
+	uint32_t seed = hashUint(hashCombine(pixel_hash, dimension));
+	dimension += 2;
+	uint32_t x, y;
+	sobol2D(seed, x, y);
+	return glm::vec2(uintToFloat(x), uintToFloat(y));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// BlueNoiseSampler
+///////////////////////////////////////////////////////////////////////////
+float BlueNoiseSampler::mask(uint32_t dimension_seed) const
+{
+	// Every dimension reads the mask at its own toroidal offset, so that
+	// the dimensions are not correlated with each other
+	const int x = (pixel_x + int(dimension_seed & 63)) & (MASK_SIZE - 1);
+	const int y = (pixel_y + int((dimension_seed >> 6) & 63)) & (MASK_SIZE - 1);
+	return blueNoiseMask()[y * MASK_SIZE + x];
+}
+
+// The same points in all pixels: the seed does not depend on the pixel,
+// only on the dimension and settings.seed. hashUint(0) is 0, so seed 0
+// picks the same points as the unseeded sampler.
+static uint32_t blueNoiseSeed(uint32_t dimension)
+{
+	return hashUint(dimension ^ hashUint(settings.seed) ^ 0xb5297a4dU);
+}
+
+float BlueNoiseSampler::get1D()
+{
+	uint32_t seed = blueNoiseSeed(dimension);
+	dimension += 1;
+	return wrap(uintToFloat(sobol1D(seed)), mask(seed));
+}
+
+glm::vec2 BlueNoiseSampler::get2D()
+{
+	uint32_t seed = blueNoiseSeed(dimension);
+	dimension += 2;
+	uint32_t x, y;
+	sobol2D(seed, x, y);
+	return glm::vec2(wrap(uintToFloat(x), mask(seed)), wrap(uintToFloat(y), mask(hashUint(seed))));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// One sampler of each kind per thread
+///////////////////////////////////////////////////////////////////////////
+Sampler& getSampler()
+{
+	static thread_local IndependentSampler independent;
+	static thread_local StratifiedSampler stratified;
+	static thread_local SobolSampler sobol;
+	static thread_local BlueNoiseSampler blue_noise;
+	switch(settings.sampler)
+	{
+	case SAMPLER_INDEPENDENT:
+		return independent;
+	case SAMPLER_STRATIFIED:
+		// Stratify over the number of samples we are going to take
+		stratified.setStrata(settings.max_paths_per_pixel > 0 ?
+		                         int(std::ceil(std::sqrt(float(settings.max_paths_per_pixel)))) :
+		                         16);
+		return stratified;
+	case SAMPLER_BLUE_NOISE:
+		return blue_noise;
+	case SAMPLER_SOBOL:
+	default:
+		return sobol;
+	}
+}
+} // namespace pathtracer
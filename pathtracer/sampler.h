@@ -0,0 +1,182 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Every random decision along a path reads one dimension of the sample
+// vector of its pixel. Dimensions 0-3 jitter the camera ray, and every
+// bounce owns a fixed block after that, so a given dimension always
+// drives the same decision no matter what earlier bounces did.
+//
+// Within a bounce's block, BSDF sampling uses up to four dimensions from
+// the start, the environment map two from ENVIRONMENT_DIMENSION, Russian
+// roulette one at ROULETTE_DIMENSION and the disc lights two each from
+// LIGHT_DIMENSION.
+///////////////////////////////////////////////////////////////////////////
+const uint32_t CAMERA_DIMENSIONS = 4;
+const uint32_t DIMENSIONS_PER_BOUNCE = 16;
+const uint32_t ENVIRONMENT_DIMENSION = 4;
+const uint32_t ROULETTE_DIMENSION = 6;
+const uint32_t LIGHT_DIMENSION = 8;
+
+inline uint32_t bounceDimension(int bounce)
+{
+	return CAMERA_DIMENSIONS + uint32_t(bounce) * DIMENSIONS_PER_BOUNCE;
+}
+
+// Lights past the fourth reuse the dimensions of earlier lights, which
+// correlates their samples but does not bias them
+inline uint32_t lightDimension(int bounce, int light)
+{
+	return bounceDimension(bounce) + LIGHT_DIMENSION + 2 * uint32_t(light % 4);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Integer hashing, used to seed and scramble the samplers
+///////////////////////////////////////////////////////////////////////////
+inline uint32_t hashUint(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+inline uint32_t hashCombine(uint32_t seed, uint32_t v)
+{
+	return seed ^ (v + 0x9e3779b9U + (seed << 6) + (seed >> 2));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Counter-based random numbers: 32 random bits for the key (a, b, c),
+// with nothing carried over from earlier values. This is pcg3d, from
+// Jarzynski and Olano, "Hash Functions for GPU Rendering".
+///////////////////////////////////////////////////////////////////////////
+inline uint32_t counterHash(uint32_t a, uint32_t b, uint32_t c)
+{
+	a = a * 1664525U + 1013904223U;
+	b = b * 1664525U + 1013904223U;
+	c = c * 1664525U + 1013904223U;
+	a += b * c;
+	b += c * a;
+	c += a * b;
+	a ^= a >> 16;
+	b ^= b >> 16;
+	c ^= c >> 16;
+	a += b * c;
+	b += c * a;
+	c += a * b;
+	return c;
+}
+
+// Map 32 random bits to a float in [0, 1)
+inline float uintToFloat(uint32_t x)
+{
+	return float(x >> 8) * (1.0f / 16777216.0f);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A sampler generates the sample vector for one sample of one pixel. The
+// integrators call startPixelSample() before tracing a path (or a stage of
+// a path) and then draw values with get1D() and get2D(), each of which
+// consumes one or two dimensions.
+///////////////////////////////////////////////////////////////////////////
+class Sampler
+{
+public:
+	virtual ~Sampler() = default;
+
+	// Start sample `sample_index` of pixel (x, y), at `dimension`
+	virtual void startPixelSample(int x, int y, uint32_t sample_index, uint32_t dimension = 0);
+	// Jump to another dimension of the current sample
+	virtual void setDimension(uint32_t dimension);
+	uint32_t getDimension() const
+	{
+		return dimension;
+	}
+
+	// Values in [0, 1)
+	virtual float get1D() = 0;
+	virtual glm::vec2 get2D() = 0;
+
+protected:
+	int pixel_x = 0, pixel_y = 0;
+	uint32_t pixel_hash = 0;
+	uint32_t sample_index = 0;
+	uint32_t dimension = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Uncorrelated (white noise) samples. Every value is the counterHash() of
+// (pixel, sample index, dimension), so it does not depend on which thread
+// draws it, nor on what was drawn before.
+///////////////////////////////////////////////////////////////////////////
+class IndependentSampler : public Sampler
+{
+public:
+	float get1D() override;
+	glm::vec2 get2D() override;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Jittered stratification. Each run of `strata x strata` samples of a
+// pixel visits every stratum of every 2D dimension (and every one of the
+// strata^2 intervals of a 1D dimension) exactly once, in a random order
+// that differs per pixel and dimension.
+///////////////////////////////////////////////////////////////////////////
+class StratifiedSampler : public Sampler
+{
+public:
+	void setStrata(int strata_per_axis);
+	float get1D() override;
+	glm::vec2 get2D() override;
+
+private:
+	uint32_t strata = 16;
+	// The stratum that the current sample uses in `dimension`, out of `count`
+	uint32_t stratum(uint32_t count) const;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The first two dimensions of the Sobol sequence, padded to any number of
+// dimensions by shuffling the sample order per dimension pair, and Owen
+// scrambled per pixel (Burley, "Practical Hash-based Owen Scrambling").
+///////////////////////////////////////////////////////////////////////////
+class SobolSampler : public Sampler
+{
+public:
+	float get1D() override;
+	glm::vec2 get2D() override;
+
+protected:
+	// The scrambled point for the current sample and dimension, as 32-bit
+	// fixed point. `seed` decides the scrambling.
+	uint32_t sobol1D(uint32_t seed) const;
+	void sobol2D(uint32_t seed, uint32_t& x, uint32_t& y) const;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// All pixels use the same scrambled Sobol points, each toroidally shifted
+// by the value of a blue-noise mask at the pixel (Georgiev and Fajardo,
+// "Blue-noise Dithered Sampling"). The error is then distributed as blue
+// noise over the screen, which looks much less noisy at low sample counts.
+///////////////////////////////////////////////////////////////////////////
+class BlueNoiseSampler : public SobolSampler
+{
+public:
+	float get1D() override;
+	glm::vec2 get2D() override;
+
+private:
+	float mask(uint32_t dimension_seed) const;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The calling thread's sampler of the type selected in the settings
+///////////////////////////////////////////////////////////////////////////
+Sampler& getSampler();
+} // namespace pathtracer
@@ -1,7 +1,6 @@
 #include "sampling.h"
-#include <random>
+#include "sampler.h"
 #include "labhelper.h"
-#include <omp.h>
 #include <iostream>
 #include <glm/glm.hpp>
 
@@ -10,23 +9,23 @@ using namespace glm;
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////////
-// Get a random float. Note that we need one "generator" per thread, or we
-// would need to lock everytime someone called randf().
+// Get a random float: the next dimension of the pixel sample that the
+// calling thread's sampler is on, so no locking is needed and the value
+// does not depend on the thread.
 ///////////////////////////////////////////////////////////////////////////////
-std::mt19937 generators[24]; // Assuming no more than 24 cores
 float randf()
 {
-	return float(generators[omp_get_thread_num()]() / double(generators[omp_get_thread_num()].max()));
+	return getSampler().get1D();
 }
 
 ///////////////////////////////////////////////////////////////////////////
 // Generate uniform points on a disc
 ///////////////////////////////////////////////////////////////////////////
-glm::vec2 concentricSampleDisk()
+glm::vec2 concentricSampleDisk(const glm::vec2& u)
 {
 	float r, theta;
-	float u1 = randf();
-	float u2 = randf();
+	float u1 = u.x;
+	float u2 = u.y;
 	// Map uniform random numbers to $[-1,1]^2$
 	float sx = 2 * u1 - 1;
 	float sy = 2 * u2 - 1;
@@ -69,16 +68,26 @@ glm::vec2 concentricSampleDisk()
 	return r * glm::vec2(cosf(theta), sinf(theta));
 }
 
+glm::vec2 concentricSampleDisk()
+{
+	return concentricSampleDisk(getSampler().get2D());
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Generate points with a cosine distribution on the hemisphere
 ///////////////////////////////////////////////////////////////////////////
-glm::vec3 cosineSampleHemisphere()
+glm::vec3 cosineSampleHemisphere(const glm::vec2& u)
 {
-	glm::vec3 ret(concentricSampleDisk(), 0);
+	glm::vec3 ret(concentricSampleDisk(u), 0);
 	ret.z = sqrt(max(0.f, 1.f - ret.x * ret.x - ret.y * ret.y));
 	return ret;
 }
 
+glm::vec3 cosineSampleHemisphere()
+{
+	return cosineSampleHemisphere(getSampler().get2D());
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Check if wi and wo are on the same side of the plane defined by n
 ///////////////////////////////////////////////////////////////////////////
@@ -4,18 +4,22 @@
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////
-// Random number generation
+// Random number generation. Draws the next dimension from the calling
+// thread's sampler.
 ///////////////////////////////////////////////////////////////////////////
 float randf();
 
 ///////////////////////////////////////////////////////////////////////////
-// Generate uniform points on a disc
+// Generate uniform points on a disc, from a point u in [0,1)^2 or from
+// the next two dimensions of the sampler
 ///////////////////////////////////////////////////////////////////////////
+glm::vec2 concentricSampleDisk(const glm::vec2& u);
 glm::vec2 concentricSampleDisk();
 
 ///////////////////////////////////////////////////////////////////////////
 // Generate points with a cosine distribution on the hemisphere
 ///////////////////////////////////////////////////////////////////////////
+glm::vec3 cosineSampleHemisphere(const glm::vec2& u);
 glm::vec3 cosineSampleHemisphere();
 
 ///////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,137 @@
+#include "scenes.h"
+#include <glm/gtx/transform.hpp>
+#include "Pathtracer.h"
+#include "embree.h"
+
+using namespace glm;
+using namespace std;
+
+vec3 worldUp(0.0f, 1.0f, 0.0f);
+std::map<std::string, scene_t> scenes;
+
+static void loadScenes(bool upload_to_gpu)
+{
+	scenes["Sphere"] = { {
+		                     // Models
+		                     { labhelper::loadModelFromOBJ("../scenes/sphere.obj", upload_to_gpu, true), mat4(1.f) },
+		                 },
+		                 {
+		                     // Camera
+		                     vec3(-15, 0, 15),
+		                     normalize(-vec3(-15, 0, 15)),
+		                 } };
+	scenes["Ship"] = { {
+		                   // Models
+		                   { labhelper::loadModelFromOBJ("../scenes/space-ship.obj", upload_to_gpu, true),
+		                     translate(vec3(0.f, 8.f, 0.f)) },
+		                   { labhelper::loadModelFromOBJ("../scenes/landingpad.obj", upload_to_gpu, true), mat4(1.f) },
+		               },
+		               {
+		                   // Camera
+		                   vec3(-30, 15, 30),
+		                   normalize(-vec3(-30, 8, 30)),
+		               } };
+	// Modify the landingpad screen's color
+	scenes["Ship"].models[1].model->m_materials[8].m_color = glm::vec3(0.380392, 0.588235, 0.266667);
+
+	scenes["Refractions"] = { {
+		                          // Models
+		                          { labhelper::loadModelFromOBJ("../scenes/refractions.obj", upload_to_gpu, true), mat4(1.f) },
+		                      },
+		                      {
+		                          // Camera
+		                          vec3(7.3, 3.2, 7.2),
+		                          normalize(vec3(-0.43, -0.27, -0.85)),
+		                      } };
+}
+
+void cleanupScenes()
+{
+	for(auto& it : scenes)
+	{
+		for(auto m : it.second.models)
+		{
+			labhelper::freeModel(m.model);
+		}
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Set up the pathtracer: settings, light sources, environment map and
+// scenes. Makes no GL calls unless `upload_to_gpu` is set. The environment
+// map is stored in `environment_format`.
+///////////////////////////////////////////////////////////////////////////////
+void initializePathtracer(bool upload_to_gpu, labhelper::HdrFormat environment_format)
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Initial path-tracer settings
+	///////////////////////////////////////////////////////////////////////////
+	pathtracer::settings.max_bounces = 8;
+	pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
+#ifdef _DEBUG
+	pathtracer::settings.subsampling = 16;
+#else
+	pathtracer::settings.subsampling = 4;
+#endif
+
+	///////////////////////////////////////////////////////////////////////////
+	// Set up light sources
+	///////////////////////////////////////////////////////////////////////////
+	pathtracer::point_light.intensity_multiplier = 2500.0f;
+	pathtracer::point_light.color = vec3(1.f, 1.f, 1.f);
+	pathtracer::point_light.position = vec3(10.0f, 25.0f, 20.0f);
+
+	// float intensity_multiplier;
+	// vec3 color;
+	// vec3 position;
+	// vec3 direction;
+	// float radius;
+	
+	pathtracer::disc_lights.push_back( pathtracer::DiscLight{
+									   1000,
+									   {1, 0.8, 0},
+									   {-8, 10, 8},
+									   glm::normalize(glm::vec3(10, -2, 10)),
+									   8.0 } );
+	pathtracer::disc_lights.push_back( pathtracer::DiscLight{
+									   1000,
+									   {0.1, 0.3, 1},
+									   {-10, 20, -5},
+									   glm::normalize(-glm::vec3(-10, 20, -5)),
+									   10.0 } );
+	
+
+	///////////////////////////////////////////////////////////////////////////
+	// Load environment map
+	///////////////////////////////////////////////////////////////////////////
+	pathtracer::environment.map.load("../scenes/envmaps/001.hdr", environment_format);
+	pathtracer::environment.multiplier = 1.0f;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Load .obj models to scene
+	///////////////////////////////////////////////////////////////////////////
+	loadScenes(upload_to_gpu);
+}
+
+void buildScene(const scene_t& scene)
+{
+	pathtracer::reinitScene();
+
+	// Add models to pathtracer scene
+	for(auto& o : scene.models)
+	{
+		pathtracer::addModel(o.model, o.modelMat);
+	}
+	pathtracer::buildBVH();
+}
+
+mat4 getViewMatrix(const camera_t& camera)
+{
+	return lookAt(camera.position, camera.position + camera.direction, worldUp);
+}
+
+mat4 getProjectionMatrix(float aspect)
+{
+	return perspective(radians(45.0f), aspect, 0.1f, 100.0f);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <Model.h>
+#include <PackedFloat.h>
+#include <map>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// The scenes that the viewer and the benchmark render. They share the
+// light sources and the environment map.
+///////////////////////////////////////////////////////////////////////////////
+extern glm::vec3 worldUp;
+
+struct camera_t
+{
+	glm::vec3 position;
+	glm::vec3 direction;
+};
+
+struct scene_t
+{
+	struct scene_object_t
+	{
+		labhelper::Model* model;
+		glm::mat4 modelMat;
+	};
+	std::vector<scene_object_t> models;
+
+	camera_t camera;
+};
+
+extern std::map<std::string, scene_t> scenes;
+
+///////////////////////////////////////////////////////////////////////////////
+// Set up the pathtracer: settings, light sources, environment map and
+// scenes. Makes no GL calls unless `upload_to_gpu` is set. The environment
+// map is stored in `environment_format`.
+///////////////////////////////////////////////////////////////////////////////
+void initializePathtracer(bool upload_to_gpu, labhelper::HdrFormat environment_format = labhelper::HDR_FLOAT16);
+void cleanupScenes();
+
+///////////////////////////////////////////////////////////////////////////////
+// Replace the pathtracer's scene with the models of `scene`, and build the
+// BVH
+///////////////////////////////////////////////////////////////////////////////
+void buildScene(const scene_t& scene);
+
+///////////////////////////////////////////////////////////////////////////////
+// View and projection matrices for a camera
+///////////////////////////////////////////////////////////////////////////////
+glm::mat4 getViewMatrix(const camera_t& camera);
+glm::mat4 getProjectionMatrix(float aspect);
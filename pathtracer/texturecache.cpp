@@ -0,0 +1,219 @@
+#include "texturecache.h"
+#include <TiledTexture.h>
+#include <stb_image.h>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace
+{
+struct CachedTexture
+{
+	string path;
+	int components = 4;
+	labhelper::TiledTexture<uint8_t> texels;
+	// Held while decoding
+	mutex load_mutex;
+	// Set once `texels` has been built (or the image turned out unreadable)
+	atomic<bool> loaded = { false };
+	atomic<bool> failed = { false };
+	// Cleared when a page is evicted, set when they are all back
+	atomic<bool> complete = { false };
+};
+
+vector<unique_ptr<CachedTexture>> textures;
+unordered_map<string, int> texture_handles;
+atomic<uint64_t> decodes = { 0 };
+uint64_t evicted_pages = 0;
+uint32_t current_use = 0;
+
+bool decode(const CachedTexture& texture, labhelper::TiledTexture<uint8_t>& texels)
+{
+	int width, height, components;
+	uint8_t* data = stbi_load(texture.path.c_str(), &width, &height, &components, texture.components);
+	if(data == nullptr)
+	{
+		cout << "Failed to load texture: " << texture.path << "\n";
+		return false;
+	}
+	texels.build(data, width, height, texture.components, true);
+	stbi_image_free(data);
+	decodes++;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Decode the texture, the first time into `texels` itself and later into
+// a temporary texture that the evicted pages are taken from. Threads that
+// wait for the lock meanwhile find the texture complete. False if the
+// image can not be read.
+///////////////////////////////////////////////////////////////////////////
+bool load(CachedTexture& texture)
+{
+	lock_guard<mutex> lock(texture.load_mutex);
+	if(texture.failed.load())
+	{
+		return false;
+	}
+	if(!texture.loaded.load(memory_order_relaxed))
+	{
+		texture.texels.setUseStamp(current_use);
+		if(!decode(texture, texture.texels))
+		{
+			texture.failed = true;
+		}
+		texture.complete = true;
+		texture.loaded.store(true, memory_order_release);
+		return !texture.failed.load();
+	}
+	if(!texture.complete.load())
+	{
+		labhelper::TiledTexture<uint8_t> pages;
+		if(!decode(texture, pages))
+		{
+			texture.failed = true;
+			return false;
+		}
+		texture.texels.restorePages(pages);
+		texture.complete = true;
+	}
+	return true;
+}
+} // namespace
+
+int registerTexture(const string& path, int components)
+{
+	auto it = texture_handles.find(path);
+	if(it != texture_handles.end())
+	{
+		return it->second;
+	}
+	const int handle = int(textures.size());
+	textures.emplace_back(new CachedTexture);
+	textures.back()->path = path;
+	textures.back()->components = components;
+	texture_handles[path] = handle;
+	return handle;
+}
+
+int findTexture(const string& path)
+{
+	auto it = texture_handles.find(path);
+	return it != texture_handles.end() ? it->second : -1;
+}
+
+vec4 sampleTexture(int handle, const vec2& uv, float uv_width)
+{
+	CachedTexture& texture = *textures[handle];
+	vec4 result;
+	for(;;)
+	{
+		if(texture.loaded.load(memory_order_acquire)
+		   && texture.texels.sample(uv, texture.texels.lodForFootprint(uv_width), result))
+		{
+			return result;
+		}
+		if(!load(texture))
+		{
+			return vec4(1.0f);
+		}
+	}
+}
+
+void sampleTexture(int handle, const vec2* uv, const float* uv_width, int count, vec4* out)
+{
+	CachedTexture& texture = *textures[handle];
+	static thread_local vector<float> lod;
+	for(;;)
+	{
+		if(texture.loaded.load(memory_order_acquire))
+		{
+			lod.resize(count);
+			for(int i = 0; i < count; i++)
+			{
+				lod[i] = texture.texels.lodForFootprint(uv_width[i]);
+			}
+			if(texture.texels.sample(uv, lod.data(), count, out))
+			{
+				return;
+			}
+		}
+		if(!load(texture))
+		{
+			std::fill(out, out + count, vec4(1.0f));
+			return;
+		}
+	}
+}
+
+void trimTextureCache(size_t budget_bytes)
+{
+	size_t resident_bytes = 0;
+	for(const unique_ptr<CachedTexture>& texture : textures)
+	{
+		resident_bytes += texture->texels.getMemoryUsage();
+	}
+	if(resident_bytes > budget_bytes)
+	{
+		// Oldest first
+		struct Page
+		{
+			uint32_t age;
+			int texture, page;
+		};
+		vector<Page> pages;
+		for(int t = 0; t < int(textures.size()); t++)
+		{
+			const labhelper::TiledTexture<uint8_t>& texels = textures[t]->texels;
+			for(int p = 0; p < texels.getNumPages(); p++)
+			{
+				if(texels.isPageResident(p))
+				{
+					pages.push_back({ current_use - texels.getPageUse(p), t, p });
+				}
+			}
+		}
+		std::stable_sort(pages.begin(), pages.end(), [](const Page& a, const Page& b) { return a.age > b.age; });
+		for(size_t i = 0; i < pages.size() && resident_bytes > budget_bytes; i++)
+		{
+			CachedTexture& texture = *textures[pages[i].texture];
+			resident_bytes -= texture.texels.getPageBytes(pages[i].page);
+			texture.texels.evictPage(pages[i].page);
+			texture.complete = false;
+			evicted_pages++;
+		}
+	}
+
+	current_use++;
+	for(const unique_ptr<CachedTexture>& texture : textures)
+	{
+		texture->texels.setUseStamp(current_use);
+	}
+}
+
+TextureCacheStats getTextureCacheStats()
+{
+	TextureCacheStats stats;
+	stats.num_textures = int(textures.size());
+	for(const unique_ptr<CachedTexture>& texture : textures)
+	{
+		if(texture->loaded.load())
+		{
+			stats.num_loaded++;
+		}
+		stats.resident_bytes += texture->texels.getMemoryUsage();
+	}
+	stats.decodes = decodes.load();
+	stats.evicted_pages = evicted_pages;
+	return stats;
+}
+} // namespace pathtracer
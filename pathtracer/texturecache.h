@@ -0,0 +1,60 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The material textures that the path tracer samples, shared by all
+// models, so that a file that several models use is only loaded once.
+//
+// Textures are registered when their model is added to the scene, but
+// only decoded when a lookup first needs them. They are kept as
+// mipmapped TiledTextures, and when the cache grows past its budget it
+// evicts the pages that were used least recently. A lookup that needs an
+// evicted page decodes the image again and restores the pages that are
+// missing.
+///////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////
+/// Register the texture at `path` (decoded with `components` channels)
+/// and return its handle. Registering a path again returns the same
+/// handle. Not while lookups run.
+///////////////////////////////////////////////////////////////////////////
+int registerTexture(const std::string& path, int components);
+
+///////////////////////////////////////////////////////////////////////////
+/// The handle of the texture registered for `path`, or -1
+///////////////////////////////////////////////////////////////////////////
+int findTexture(const std::string& path);
+
+///////////////////////////////////////////////////////////////////////////
+/// Trilinear lookup over a footprint `uv_width` wide (in uv, 0 for the
+/// full resolution), from any number of threads. Textures that can not be
+/// read are white.
+///////////////////////////////////////////////////////////////////////////
+glm::vec4 sampleTexture(int handle, const glm::vec2& uv, float uv_width);
+// The same for `count` points, filtered as a batch (see TiledTexture)
+void sampleTexture(int handle, const glm::vec2* uv, const float* uv_width, int count, glm::vec4* out);
+
+///////////////////////////////////////////////////////////////////////////
+/// Evict the least recently used pages until the cache fits in
+/// `budget_bytes`, and start a new period of use. Call it between passes,
+/// while no lookups run.
+///////////////////////////////////////////////////////////////////////////
+void trimTextureCache(size_t budget_bytes);
+
+struct TextureCacheStats
+{
+	int num_textures = 0;
+	// Textures that have been decoded
+	int num_loaded = 0;
+	size_t resident_bytes = 0;
+	// Images decoded and pages evicted, in total
+	uint64_t decodes = 0;
+	uint64_t evicted_pages = 0;
+};
+TextureCacheStats getTextureCacheStats();
+} // namespace pathtracer
@@ -0,0 +1,335 @@
+#include "textureupload.h"
+#include <omp.h>
+#include <algorithm>
+#include <cstring>
+
+namespace pathtracer
+{
+namespace
+{
+// Pixels are resolved into floats a chunk at a time, which stays in the
+// cache to be packed
+const int CHUNK = 1024;
+
+// As GL converts floats to normalized bytes
+inline uint32_t toUnorm8(float x)
+{
+	return uint32_t(std::min(std::max(x * 255.0f, 0.0f), 255.0f) + 0.5f);
+}
+
+#if PACKED_FLOAT_SSE2
+// Four pixels, already scaled to [0, 255], to four RGBA8 texels. Clamping
+// with max() first also turns nan into 0.
+inline __m128i toRGBA8(__m128 p0, __m128 p1, __m128 p2, __m128 p3)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 max = _mm_set1_ps(255.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128i c0 = _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(p0, zero), max), half));
+	const __m128i c1 = _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(p1, zero), max), half));
+	const __m128i c2 = _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(p2, zero), max), half));
+	const __m128i c3 = _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(p3, zero), max), half));
+	return _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3));
+}
+
+// Divide the sums of four pixels by their sample counts (pixels without
+// samples become 0) and multiply by `scale`. Alpha is set to `scale`.
+inline void resolve4(const vec4* pixels, float scale, __m128 out[4])
+{
+	const float* p = &pixels[0].x;
+	const __m128 p0 = _mm_loadu_ps(p), p1 = _mm_loadu_ps(p + 4);
+	const __m128 p2 = _mm_loadu_ps(p + 8), p3 = _mm_loadu_ps(p + 12);
+	const __m128 w = _mm_shuffle_ps(_mm_unpackhi_ps(p0, p1), _mm_unpackhi_ps(p2, p3), _MM_SHUFFLE(3, 2, 3, 2));
+	const __m128 inv_w = _mm_and_ps(_mm_cmpgt_ps(w, _mm_setzero_ps()), _mm_div_ps(_mm_set1_ps(1.0f), w));
+	const __m128 s = _mm_set1_ps(scale);
+	const __m128 rgb_mask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+	const __m128 alpha = _mm_setr_ps(0.0f, 0.0f, 0.0f, scale);
+	out[0] = _mm_mul_ps(_mm_mul_ps(p0, _mm_shuffle_ps(inv_w, inv_w, _MM_SHUFFLE(0, 0, 0, 0))), s);
+	out[1] = _mm_mul_ps(_mm_mul_ps(p1, _mm_shuffle_ps(inv_w, inv_w, _MM_SHUFFLE(1, 1, 1, 1))), s);
+	out[2] = _mm_mul_ps(_mm_mul_ps(p2, _mm_shuffle_ps(inv_w, inv_w, _MM_SHUFFLE(2, 2, 2, 2))), s);
+	out[3] = _mm_mul_ps(_mm_mul_ps(p3, _mm_shuffle_ps(inv_w, inv_w, _MM_SHUFFLE(3, 3, 3, 3))), s);
+	for(int i = 0; i < 4; i++)
+	{
+		out[i] = _mm_or_ps(_mm_and_ps(out[i], rgb_mask), alpha);
+	}
+}
+#endif
+
+// The colors of `count` pixels from `begin`, as RGBA floats
+void resolvePixels(const ImageSnapshot& snapshot, int begin, int count, float* rgba)
+{
+	if(snapshot.format == labhelper::HDR_FLOAT16)
+	{
+		labhelper::halfToFloat(&snapshot.half_pixels[size_t(begin) * 4], size_t(count) * 4, rgba);
+	}
+	else if(snapshot.format == labhelper::HDR_RGB9E5)
+	{
+		labhelper::unpackRGB9E5(&snapshot.rgb9e5_pixels[begin], count, 4, rgba);
+	}
+	else
+	{
+		const vec4* pixels = &snapshot.pixels[begin];
+		int i = 0;
+#if PACKED_FLOAT_SSE2
+		for(; i + 4 <= count; i += 4)
+		{
+			__m128 resolved[4];
+			resolve4(pixels + i, 1.0f, resolved);
+			for(int j = 0; j < 4; j++)
+			{
+				_mm_storeu_ps(rgba + 4 * (i + j), resolved[j]);
+			}
+		}
+#endif
+		for(; i < count; i++)
+		{
+			const vec4& p = pixels[i];
+			const float scale = p.w > 0.0f ? 1.0f / p.w : 0.0f;
+			rgba[4 * i + 0] = p.x * scale;
+			rgba[4 * i + 1] = p.y * scale;
+			rgba[4 * i + 2] = p.z * scale;
+			rgba[4 * i + 3] = 1.0f;
+		}
+	}
+}
+
+void packRGBA8(const float* rgba, int count, uint32_t* out)
+{
+	int i = 0;
+#if PACKED_FLOAT_SSE2
+	const __m128 scale = _mm_set1_ps(255.0f);
+	for(; i + 4 <= count; i += 4)
+	{
+		const float* p = rgba + 4 * i;
+		const __m128i texels = toRGBA8(_mm_mul_ps(_mm_loadu_ps(p), scale), _mm_mul_ps(_mm_loadu_ps(p + 4), scale),
+		                               _mm_mul_ps(_mm_loadu_ps(p + 8), scale), _mm_mul_ps(_mm_loadu_ps(p + 12), scale));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), texels);
+	}
+#endif
+	for(; i < count; i++)
+	{
+		const float* p = rgba + 4 * i;
+		out[i] = toUnorm8(p[0]) | (toUnorm8(p[1]) << 8) | (toUnorm8(p[2]) << 16) | (255u << 24);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Resolve and pack float sums to RGBA8 in one pass, for the default
+// display path, without writing the floats out in between
+///////////////////////////////////////////////////////////////////////////
+void resolveRGBA8(const vec4* pixels, int count, uint32_t* out)
+{
+	int i = 0;
+#if PACKED_FLOAT_SSE2
+	for(; i + 4 <= count; i += 4)
+	{
+		__m128 resolved[4];
+		resolve4(pixels + i, 255.0f, resolved);
+		const __m128i texels = toRGBA8(resolved[0], resolved[1], resolved[2], resolved[3]);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), texels);
+	}
+#endif
+	for(; i < count; i++)
+	{
+		const vec4& p = pixels[i];
+		const float s = p.w > 0.0f ? 1.0f / p.w : 0.0f;
+		out[i] = toUnorm8(p.x * s) | (toUnorm8(p.y * s) << 8) | (toUnorm8(p.z * s) << 16) | (255u << 24);
+	}
+}
+} // namespace
+
+size_t bytesPerTexel(UploadFormat format)
+{
+	return format == UPLOAD_RGBA16F ? 4 * sizeof(uint16_t) : 4 * sizeof(uint8_t);
+}
+
+void packSnapshot(const ImageSnapshot& snapshot, UploadFormat format, void* dst)
+{
+	const int num_pixels = snapshot.width * snapshot.height;
+	const int num_chunks = (num_pixels + CHUNK - 1) / CHUNK;
+	const bool copy = (snapshot.format == labhelper::HDR_FLOAT16 && format == UPLOAD_RGBA16F)
+	                  || (snapshot.format == labhelper::HDR_RGB9E5 && format == UPLOAD_RGB9E5);
+	const uint8_t* packed = snapshot.format == labhelper::HDR_FLOAT16
+	                            ? reinterpret_cast<const uint8_t*>(snapshot.half_pixels.data())
+	                            : reinterpret_cast<const uint8_t*>(snapshot.rgb9e5_pixels.data());
+	const size_t texel_bytes = bytesPerTexel(format);
+#pragma omp parallel for schedule(static, 4)
+	for(int chunk = 0; chunk < num_chunks; chunk++)
+	{
+		const int begin = chunk * CHUNK;
+		const int count = std::min(CHUNK, num_pixels - begin);
+		uint8_t* out = static_cast<uint8_t*>(dst) + size_t(begin) * texel_bytes;
+		if(copy)
+		{
+			memcpy(out, packed + size_t(begin) * texel_bytes, size_t(count) * texel_bytes);
+			continue;
+		}
+		if(format == UPLOAD_RGBA8 && snapshot.format == labhelper::HDR_FLOAT32)
+		{
+			resolveRGBA8(&snapshot.pixels[begin], count, reinterpret_cast<uint32_t*>(out));
+			continue;
+		}
+		float rgba[4 * CHUNK];
+		resolvePixels(snapshot, begin, count, rgba);
+		if(format == UPLOAD_RGBA16F)
+			labhelper::floatToHalf(rgba, size_t(count) * 4, reinterpret_cast<uint16_t*>(out));
+		else if(format == UPLOAD_RGB9E5)
+			labhelper::packRGB9E5(rgba, 4, count, reinterpret_cast<uint32_t*>(out));
+		else
+			packRGBA8(rgba, count, reinterpret_cast<uint32_t*>(out));
+	}
+}
+
+void TextureUploader::init()
+{
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	persistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+	glGenQueries(RING_SIZE, queries);
+}
+
+void TextureUploader::destroy()
+{
+	allocate(0, 0, format);
+	glDeleteQueries(RING_SIZE, queries);
+	glDeleteTextures(1, &texture);
+	texture = 0;
+}
+
+void TextureUploader::waitForSlot(int slot)
+{
+	if(fences[slot] == nullptr)
+	{
+		return;
+	}
+	// With three slots the GPU is normally done long before the slot
+	// comes around again, so this rarely blocks
+	while(glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+	{
+	}
+	glDeleteSync(fences[slot]);
+	fences[slot] = nullptr;
+	// The copy is done, so its time is too
+	if(query_pending[slot])
+	{
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(queries[slot], GL_QUERY_RESULT, &ns);
+		copy_ms = double(ns) * 1e-6;
+		query_pending[slot] = false;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// (Re)create the texture storage and the ring for a new size or format.
+// 0 x 0 just frees the ring.
+///////////////////////////////////////////////////////////////////////////
+void TextureUploader::allocate(int w, int h, UploadFormat f)
+{
+	for(int slot = 0; slot < RING_SIZE; slot++)
+	{
+		waitForSlot(slot);
+	}
+	if(pbo != 0)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+		if(mapped != nullptr)
+		{
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &pbo);
+		pbo = 0;
+		mapped = nullptr;
+	}
+	width = w;
+	height = h;
+	format = f;
+	next_slot = 0;
+	if(w == 0 || h == 0)
+	{
+		return;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, texture);
+	if(format == UPLOAD_RGBA16F)
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_HALF_FLOAT, nullptr);
+	else if(format == UPLOAD_RGB9E5)
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB9_E5, w, h, 0, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV, nullptr);
+	else
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+	// Slots start at multiples of 256 bytes, which any mapping accepts
+	slot_size = (size_t(w) * h * bytesPerTexel(format) + 255) & ~size_t(255);
+	const GLsizeiptr ring_size = GLsizeiptr(slot_size * RING_SIZE);
+	glGenBuffers(1, &pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	if(persistent)
+	{
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, ring_size, nullptr, flags);
+		mapped = static_cast<uint8_t*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, ring_size, flags));
+	}
+	else
+	{
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, ring_size, nullptr, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void TextureUploader::upload(const ImageSnapshot& snapshot, UploadFormat f)
+{
+	if(snapshot.width != width || snapshot.height != height || f != format || pbo == 0)
+	{
+		allocate(snapshot.width, snapshot.height, f);
+	}
+	if(pbo == 0)
+	{
+		return;
+	}
+	const int slot = next_slot;
+	next_slot = (next_slot + 1) % RING_SIZE;
+	waitForSlot(slot);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	const double pack_start = omp_get_wtime();
+	if(persistent)
+	{
+		packSnapshot(snapshot, format, mapped + slot * slot_size);
+	}
+	else
+	{
+		// The fence already guarantees that the GPU is done with the slot
+		void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, GLintptr(slot * slot_size), GLsizeiptr(slot_size),
+		                             GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		if(dst != nullptr)
+		{
+			packSnapshot(snapshot, format, dst);
+		}
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+	const double submit_start = omp_get_wtime();
+
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBeginQuery(GL_TIME_ELAPSED, queries[slot]);
+	if(format == UPLOAD_RGB9E5)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV,
+		                reinterpret_cast<const void*>(slot * slot_size));
+	else
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA,
+		                format == UPLOAD_RGBA16F ? GL_HALF_FLOAT : GL_UNSIGNED_BYTE,
+		                reinterpret_cast<const void*>(slot * slot_size));
+	glEndQuery(GL_TIME_ELAPSED);
+	query_pending[slot] = true;
+	fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	const double end = omp_get_wtime();
+	pack_ms = (submit_start - pack_start) * 1000.0;
+	submit_ms = (end - submit_start) * 1000.0;
+}
+} // namespace pathtracer
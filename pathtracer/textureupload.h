@@ -0,0 +1,81 @@
+#pragma once
+#include <GL/glew.h>
+#include <cstddef>
+#include <cstdint>
+#include "renderthread.h"
+
+namespace pathtracer
+{
+enum UploadFormat
+{
+	// Clamped to [0, 1], 8 bits per channel
+	UPLOAD_RGBA8 = 0,
+	// Half floats, which keep the whole range of the image
+	UPLOAD_RGBA16F = 1,
+	// Shared-exponent RGB: the whole range in the 4 bytes of RGBA8
+	UPLOAD_RGB9E5 = 2,
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Streams snapshots into a texture. Each snapshot is resolved and packed
+// to the texture format on the CPU, in parallel, straight into one slot
+// of a ring of pixel buffer objects, and then copied to the texture with
+// glTexSubImage2D. That copy runs asynchronously on the GPU, and a fence
+// per slot keeps the CPU from overwriting a slot the GPU still reads.
+//
+// The ring is mapped once and stays mapped (GL_ARB_buffer_storage), or
+// if that is not available, each slot is mapped unsynchronized when it
+// is written.
+//
+// A GL_TIME_ELAPSED query per slot times the copy on the GPU. It is read
+// when the slot is reused, so copy_ms lags RING_SIZE uploads behind.
+///////////////////////////////////////////////////////////////////////////
+class TextureUploader
+{
+public:
+	static const int RING_SIZE = 3;
+
+	// Create the texture. Needs a current GL context.
+	void init();
+	void destroy();
+
+	void upload(const ImageSnapshot& snapshot, UploadFormat format);
+
+	GLuint getTexture() const
+	{
+		return texture;
+	}
+	bool isPersistent() const
+	{
+		return persistent;
+	}
+	// CPU time of the last upload: packing, and handing it to GL
+	double pack_ms = 0.0, submit_ms = 0.0;
+	// GPU time of the copy from the pixel buffer to the texture
+	double copy_ms = 0.0;
+
+private:
+	void allocate(int width, int height, UploadFormat format);
+	void waitForSlot(int slot);
+
+	GLuint texture = 0, pbo = 0;
+	int width = 0, height = 0;
+	UploadFormat format = UPLOAD_RGBA8;
+	bool persistent = false;
+	size_t slot_size = 0;
+	uint8_t* mapped = nullptr;
+	GLsync fences[RING_SIZE] = {};
+	GLuint queries[RING_SIZE] = {};
+	bool query_pending[RING_SIZE] = {};
+	int next_slot = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Resolve a snapshot (divide by the sample counts) into texels of
+// `format` at `dst`, on all threads. `dst` needs bytesPerTexel() times
+// the number of pixels. Snapshots that are already packed in the same
+// format are just copied.
+///////////////////////////////////////////////////////////////////////////
+void packSnapshot(const ImageSnapshot& snapshot, UploadFormat format, void* dst);
+size_t bytesPerTexel(UploadFormat format);
+} // namespace pathtracer
@@ -0,0 +1,206 @@
+#include "tiles.h"
+#include <algorithm>
+#include <omp.h>
+
+using namespace std;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Interleave the bits of x and y (x in the even bits)
+///////////////////////////////////////////////////////////////////////////
+static uint32_t spreadBits(uint32_t v)
+{
+	v &= 0x0000FFFF;
+	v = (v | (v << 8)) & 0x00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+uint32_t mortonEncode(uint32_t x, uint32_t y)
+{
+	return spreadBits(x) | (spreadBits(y) << 1);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// (Re)create the tiles for an image
+///////////////////////////////////////////////////////////////////////////
+void TileScheduler::setup(int _width, int _height, int _tile_size, bool _rows)
+{
+	_tile_size = std::max(1, _tile_size);
+	if(_width == width && _height == height && _tile_size == tile_size && _rows == rows)
+	{
+		return;
+	}
+	width = _width;
+	height = _height;
+	tile_size = _tile_size;
+	rows = _rows;
+
+	if(rows)
+	{
+		tiles.resize(height);
+		for(int y = 0; y < height; y++)
+		{
+			tiles[y].id = y;
+			tiles[y].x0 = 0;
+			tiles[y].y0 = y;
+			tiles[y].x1 = width;
+			tiles[y].y1 = y + 1;
+		}
+		stats.tile_ms.assign(tiles.size(), 0.0);
+		return;
+	}
+
+	int tiles_x = (width + tile_size - 1) / tile_size;
+	int tiles_y = (height + tile_size - 1) / tile_size;
+
+	///////////////////////////////////////////////////////////////////////
+	// Sort the tiles along a Z-curve so that consecutive tiles (and thus
+	// the tiles in one thread's queue) are close to each other on screen.
+	///////////////////////////////////////////////////////////////////////
+	vector<pair<uint32_t, Tile>> ordered;
+	ordered.reserve(tiles_x * tiles_y);
+	for(int ty = 0; ty < tiles_y; ty++)
+	{
+		for(int tx = 0; tx < tiles_x; tx++)
+		{
+			Tile t;
+			t.x0 = tx * tile_size;
+			t.y0 = ty * tile_size;
+			t.x1 = std::min(t.x0 + tile_size, width);
+			t.y1 = std::min(t.y0 + tile_size, height);
+			ordered.push_back(make_pair(mortonEncode(tx, ty), t));
+		}
+	}
+	std::sort(ordered.begin(), ordered.end(),
+	          [](const pair<uint32_t, Tile>& a, const pair<uint32_t, Tile>& b) { return a.first < b.first; });
+
+	tiles.resize(ordered.size());
+	for(size_t i = 0; i < ordered.size(); i++)
+	{
+		tiles[i] = ordered[i].second;
+		tiles[i].id = int(i);
+	}
+	stats.tile_ms.assign(tiles.size(), 0.0);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Give every thread a contiguous run of the Morton-ordered tiles
+///////////////////////////////////////////////////////////////////////////
+void TileScheduler::beginPass(int num_threads)
+{
+	num_threads = std::max(1, num_threads);
+	while(int(queues.size()) < num_threads)
+	{
+		queues.emplace_back(new WorkQueue);
+	}
+
+	int num_tiles = int(tiles.size());
+	for(int t = 0; t < num_threads; t++)
+	{
+		WorkQueue& q = *queues[t];
+		q.tile_ids.clear();
+		q.busy_seconds = 0.0;
+		q.steals = 0;
+		int begin = int((int64_t(num_tiles) * t) / num_threads);
+		int end = int((int64_t(num_tiles) * (t + 1)) / num_threads);
+		for(int i = begin; i < end; i++)
+		{
+			q.tile_ids.push_back(i);
+		}
+	}
+	for(size_t t = num_threads; t < queues.size(); t++)
+	{
+		queues[t]->tile_ids.clear();
+		queues[t]->busy_seconds = 0.0;
+		queues[t]->steals = 0;
+	}
+	stats.num_threads = num_threads;
+	pass_start = omp_get_wtime();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Pop from our own queue, or steal from someone else's
+///////////////////////////////////////////////////////////////////////////
+bool TileScheduler::next(int thread, Tile& tile)
+{
+	int tile_id = -1;
+	{
+		WorkQueue& q = *queues[thread];
+		lock_guard<mutex> guard(q.lock);
+		if(!q.tile_ids.empty())
+		{
+			tile_id = q.tile_ids.front();
+			q.tile_ids.pop_front();
+		}
+	}
+	if(tile_id < 0 && (rows || !steal(thread, tile_id)))
+	{
+		return false;
+	}
+	tile = tiles[tile_id];
+	return true;
+}
+
+bool TileScheduler::steal(int thread, int& tile_id)
+{
+	int num_queues = int(queues.size());
+	for(int i = 1; i < num_queues; i++)
+	{
+		WorkQueue& victim = *queues[(thread + i) % num_queues];
+		lock_guard<mutex> guard(victim.lock);
+		if(!victim.tile_ids.empty())
+		{
+			// Take from the back, the victim is working from the front
+			tile_id = victim.tile_ids.back();
+			victim.tile_ids.pop_back();
+			queues[thread]->steals += 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+void TileScheduler::finishTile(int thread, const Tile& tile, double seconds)
+{
+	// Every tile is rendered by exactly one thread per pass, so no lock.
+	stats.tile_ms[tile.id] = seconds * 1000.0;
+	queues[thread]->busy_seconds += seconds;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Summarize the timings of the pass
+///////////////////////////////////////////////////////////////////////////
+void TileScheduler::endPass()
+{
+	stats.pass_ms = (omp_get_wtime() - pass_start) * 1000.0;
+	stats.num_tiles = int(tiles.size());
+	stats.num_steals = 0;
+	double busy_sum = 0.0, busy_max = 0.0;
+	for(int t = 0; t < stats.num_threads; t++)
+	{
+		stats.num_steals += queues[t]->steals;
+		busy_sum += queues[t]->busy_seconds;
+		busy_max = std::max(busy_max, queues[t]->busy_seconds);
+	}
+	double busy_mean = busy_sum / stats.num_threads;
+	stats.thread_imbalance = busy_mean > 0.0 ? busy_max / busy_mean : 1.0;
+
+	if(stats.tile_ms.empty())
+	{
+		return;
+	}
+	auto minmax = std::minmax_element(stats.tile_ms.begin(), stats.tile_ms.end());
+	stats.min_tile_ms = *minmax.first;
+	stats.max_tile_ms = *minmax.second;
+	double sum = 0.0;
+	for(double ms : stats.tile_ms)
+	{
+		sum += ms;
+	}
+	stats.mean_tile_ms = sum / stats.tile_ms.size();
+}
+} // namespace pathtracer
@@ -0,0 +1,104 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A rectangular block of pixels, [x0, x1) x [y0, y1)
+///////////////////////////////////////////////////////////////////////////
+struct Tile
+{
+	int id;
+	int x0, y0;
+	int x1, y1;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Timings gathered during the last pass, so that load imbalance between
+// tiles and threads can be inspected.
+///////////////////////////////////////////////////////////////////////////
+struct TileStats
+{
+	int num_tiles = 0;
+	int num_threads = 0;
+	int num_steals = 0;
+	double min_tile_ms = 0.0;
+	double max_tile_ms = 0.0;
+	double mean_tile_ms = 0.0;
+	// Wall-clock time of the whole pass
+	double pass_ms = 0.0;
+	// max(thread busy time) / mean(thread busy time). 1.0 is perfect balance.
+	double thread_imbalance = 1.0;
+	// Per-tile time of the last pass, indexed by Tile::id
+	std::vector<double> tile_ms;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Splits the image into Morton-ordered tiles and hands them out to
+// threads. Every thread owns a queue that it pops from the front of, and
+// when it runs dry it steals from the back of another thread's queue.
+//
+// With `rows`, the tiles are instead the rows of the image, and each thread
+// renders its own contiguous run of them and does not steal, as a static
+// "#pragma omp parallel for" over the rows does. That is only there to
+// compare against.
+///////////////////////////////////////////////////////////////////////////
+class TileScheduler
+{
+public:
+	// (Re)create the tiles for an image. Cheap if nothing changed.
+	void setup(int width, int height, int tile_size, bool rows = false);
+
+	// Distribute all tiles over the queues of `num_threads` threads.
+	// Call once per pass, before entering the parallel region.
+	void beginPass(int num_threads);
+
+	// Get the next tile to render for `thread`. Returns false when there
+	// is no work left anywhere.
+	bool next(int thread, Tile& tile);
+
+	// Report how long it took to render a tile
+	void finishTile(int thread, const Tile& tile, double seconds);
+
+	// Gather the timings of the pass. Call after the parallel region.
+	void endPass();
+
+	const std::vector<Tile>& getTiles() const
+	{
+		return tiles;
+	}
+	const TileStats& getStats() const
+	{
+		return stats;
+	}
+
+private:
+	// Each queue is a separate allocation so that threads do not share
+	// cache lines when they update their own counters.
+	struct WorkQueue
+	{
+		std::mutex lock;
+		std::deque<int> tile_ids;
+		double busy_seconds = 0.0;
+		int steals = 0;
+	};
+
+	bool steal(int thread, int& tile_id);
+
+	int width = 0, height = 0, tile_size = 0;
+	bool rows = false;
+	std::vector<Tile> tiles;
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	double pass_start = 0.0;
+	TileStats stats;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Interleave the bits of x and y (x in the even bits)
+///////////////////////////////////////////////////////////////////////////
+uint32_t mortonEncode(uint32_t x, uint32_t y);
+} // namespace pathtracer
@@ -0,0 +1,334 @@
+#include "integrator.h"
+#include <algorithm>
+#include <vector>
+#include "material.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The wavefront integrator computes the same estimate as Li(), but instead
+// of following one path at a time it keeps all live paths of a tile in
+// queues and advances them together, one stage at a time:
+//
+//   extend:     intersect the next ray of every live path (as a stream)
+//   shade:      group the hits by material and, per material, look up
+//               its textures for the whole group, add emission, set up
+//               the shadow rays towards the point light, the environment
+//               and the disc lights and sample the next direction
+//               (unless Russian roulette ends the path)
+//   shadow:     trace all shadow rays (as a stream) and add the direct
+//               light of the unoccluded ones
+//   accumulate: when no path is left, add the tile to the image
+///////////////////////////////////////////////////////////////////////////
+namespace
+{
+///////////////////////////////////////////////////////////////////////////
+// Live paths, structure of arrays
+///////////////////////////////////////////////////////////////////////////
+struct PathQueue
+{
+	// Index of the path's pixel within the tile
+	vector<int> pixel;
+	vector<vec3> throughput;
+	// The ray that will extend the path in the next extend stage
+	vector<Ray> rays;
+	// The BSDF pdf of the ray's direction (0 for camera rays), for MIS
+	// when the ray hits a light
+	vector<float> bsdf_pdf;
+	// Width of the path's ray cone at the ray's origin
+	vector<float> cone_width;
+
+	size_t size() const
+	{
+		return pixel.size();
+	}
+	void clear()
+	{
+		pixel.clear();
+		throughput.clear();
+		rays.clear();
+		bsdf_pdf.clear();
+		cone_width.clear();
+	}
+	void push(int p, const vec3& t, const Ray& r, float pdf, float width)
+	{
+		pixel.push_back(p);
+		throughput.push_back(t);
+		rays.push_back(r);
+		bsdf_pdf.push_back(pdf);
+		cone_width.push_back(width);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Pending shadow rays, structure of arrays
+///////////////////////////////////////////////////////////////////////////
+struct ShadowQueue
+{
+	vector<int> pixel;
+	// Radiance that reaches the pixel if the ray is unoccluded
+	vector<vec3> contribution;
+	vector<Ray> rays;
+
+	size_t size() const
+	{
+		return pixel.size();
+	}
+	void clear()
+	{
+		pixel.clear();
+		contribution.clear();
+		rays.clear();
+	}
+	void push(int p, const vec3& c, const Ray& r)
+	{
+		pixel.push_back(p);
+		contribution.push_back(c);
+		rays.push_back(r);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Per-thread buffers, kept between tiles to avoid reallocating them
+///////////////////////////////////////////////////////////////////////////
+struct WavefrontState
+{
+	vector<vec3> L;
+	// What the camera rays hit
+	vector<Features> features;
+	PathQueue live, next;
+	ShadowQueue shadow;
+	vector<Intersection> hits;
+	// Indices into `live` of the paths that should be shaded
+	vector<int> to_shade;
+	// Of the paths of one material, when it has textures
+	vector<vec2> uv;
+	vector<float> uv_width;
+	vector<ShadingMaterial> textured;
+	// Indices into `live` of the paths that escaped, and their radiance
+	vector<int> escaped;
+	vector<vec3> escaped_wi, escaped_L;
+};
+} // namespace
+
+void traceTileWavefront(const Tile& tile, const PrimaryRayGenerator& camera, int round)
+{
+	static thread_local WavefrontState state;
+	const int tile_w = tile.x1 - tile.x0, tile_h = tile.y1 - tile.y0;
+	const int num_pixels = tile_w * tile_h;
+
+	///////////////////////////////////////////////////////////////////////
+	// Generate the primary rays
+	///////////////////////////////////////////////////////////////////////
+	state.L.assign(num_pixels, vec3(0.0f));
+	state.features.assign(num_pixels, Features());
+	state.live.clear();
+	for(int i = 0; i < num_pixels; i++)
+	{
+		const int x = tile.x0 + i % tile_w, y = tile.y0 + i / tile_w;
+		if(pixelActive(x, y, round))
+		{
+			state.live.push(i, vec3(1.0f), camera.generate(x, y), 0.0f, 0.0f);
+		}
+	}
+
+	for(int depth = 0; state.live.size() > 0; depth++)
+	{
+		PathQueue& live = state.live;
+
+		///////////////////////////////////////////////////////////////////
+		// Extend. Paths pick up the disc lights they pass through, paths
+		// that escape pick up the environment (looked up as one batch),
+		// and paths that hit something are shaded unless they are deep
+		// enough.
+		///////////////////////////////////////////////////////////////////
+		const double extend_start = omp_get_wtime();
+		intersect(live.rays.data(), live.size(), depth == 0);
+		recordRays(depth == 0 ? PRIMARY_RAYS : EXTENSION_RAYS, live.size(), extend_start);
+
+		state.to_shade.clear();
+		state.escaped.clear();
+		state.escaped_wi.clear();
+		state.hits.resize(live.size());
+		for(int p = 0; p < int(live.size()); p++)
+		{
+			if(depth > 0 && !disc_lights.empty())
+			{
+				state.L[live.pixel[p]] += live.throughput[p] * discLightsAlongRay(live.rays[p], live.bsdf_pdf[p]);
+			}
+			if(live.rays[p].geomID == RTC_INVALID_GEOMETRY_ID)
+			{
+				recordPathEnd(depth, PATH_ESCAPED);
+				state.escaped.push_back(p);
+				state.escaped_wi.push_back(live.rays[p].d);
+			}
+			else if(depth < settings.max_bounces)
+			{
+				state.hits[p] = getIntersection(live.rays[p]);
+				live.cone_width[p] += camera.spread_angle * live.rays[p].tfar;
+				state.to_shade.push_back(p);
+			}
+			else
+			{
+				recordPathEnd(depth, PATH_MAX_DEPTH);
+			}
+		}
+		state.escaped_L.resize(state.escaped.size());
+		Lenvironment(state.escaped_wi.data(), int(state.escaped.size()), camera.spread_angle, state.escaped_L.data());
+		for(size_t e = 0; e < state.escaped.size(); e++)
+		{
+			const int p = state.escaped[e];
+			state.L[live.pixel[p]] += live.throughput[p] * state.escaped_L[e]
+			                          * bsdfSampleWeight(live.bsdf_pdf[p], environmentPdf(state.escaped_wi[e]));
+		}
+
+		///////////////////////////////////////////////////////////////////
+		// Shade, one material at a time
+		///////////////////////////////////////////////////////////////////
+		const vector<Intersection>& hits = state.hits;
+		std::sort(state.to_shade.begin(), state.to_shade.end(),
+		          [&hits](int a, int b) { return hits[a].material_id < hits[b].material_id; });
+
+		state.next.clear();
+		state.shadow.clear();
+		size_t group_start = 0;
+		while(group_start < state.to_shade.size())
+		{
+			const uint32_t material_id = hits[state.to_shade[group_start]].material_id;
+			Sampler& sampler = getSampler();
+
+			size_t group_end = group_start;
+			while(group_end < state.to_shade.size() && hits[state.to_shade[group_end]].material_id == material_id)
+			{
+				group_end++;
+			}
+			// Look up the textures of the whole group at once
+			const ShadingMaterial& untextured = shading_materials[material_id];
+			const bool textured = untextured.has_textures && settings.material_textures;
+			if(textured)
+			{
+				const int count = int(group_end - group_start);
+				state.uv.resize(count);
+				state.uv_width.resize(count);
+				state.textured.resize(count);
+				for(int i = 0; i < count; i++)
+				{
+					const int p = state.to_shade[group_start + i];
+					state.uv[i] = hits[p].uv;
+					state.uv_width[i] = uvFootprint(hits[p], live.cone_width[p]);
+				}
+				untextured.textured(state.uv.data(), state.uv_width.data(), count, state.textured.data());
+			}
+
+			for(size_t s = group_start; s < group_end; s++)
+			{
+				const int p = state.to_shade[s];
+				const Intersection& hit = hits[p];
+				const ShadingMaterial& mat = textured ? state.textured[s - group_start] : untextured;
+				const vec3& path_throughput = live.throughput[p];
+				const int pixel = live.pixel[p];
+				const int x = tile.x0 + pixel % tile_w, y = tile.y0 + pixel / tile_w;
+				sampler.startPixelSample(x, y, pixelSampleIndex(x, y));
+				if(depth == 0)
+				{
+					state.features[pixel] = Features(mat.color, hit.shading_normal, live.rays[p].tfar);
+				}
+
+				// Direct illumination, if the shadow ray turns out unoccluded
+				const float distance_to_light = length(point_light.position - hit.position);
+				const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
+				vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
+				vec3 wi = normalize(point_light.position - hit.position);
+				vec3 direct = path_throughput * mat.f(wi, hit.wo, hit.shading_normal) * Li
+				              * std::max(0.0f, dot(wi, hit.shading_normal));
+				if(direct != vec3(0.0f))
+				{
+					state.shadow.push(pixel, direct, pointLightShadowRay(hit));
+				}
+				Ray env_ray;
+				vec3 env_contribution;
+				sampler.setDimension(bounceDimension(depth) + ENVIRONMENT_DIMENSION);
+				if(sampleEnvironment(hit, mat, sampler.get2D(), env_ray, env_contribution))
+				{
+					state.shadow.push(pixel, path_throughput * env_contribution, env_ray);
+				}
+				for(int i = 0; i < int(disc_lights.size()); i++)
+				{
+					sampler.setDimension(lightDimension(depth, i));
+					Ray shadow_ray;
+					vec3 contribution;
+					if(sampleDiscLight(disc_lights[i], hit, mat, sampler.get2D(), shadow_ray, contribution))
+					{
+						state.shadow.push(pixel, path_throughput * contribution, shadow_ray);
+					}
+				}
+
+				state.L[pixel] += path_throughput * mat.emission;
+
+				// Continue the path
+				sampler.setDimension(bounceDimension(depth));
+				WiSample r = mat.sample_wi(hit.wo, hit.shading_normal);
+				if(r.pdf < EPSILON)
+				{
+					recordPathEnd(depth + 1, PATH_ABSORBED);
+					continue;
+				}
+				float cosineterm = abs(dot(r.wi, hit.shading_normal));
+				vec3 next_throughput = path_throughput * (r.f * cosineterm) / r.pdf;
+				if(next_throughput == vec3(0.0f))
+				{
+					recordPathEnd(depth + 1, PATH_ABSORBED);
+					continue;
+				}
+				if(!russianRoulette(next_throughput, depth))
+				{
+					recordPathEnd(depth + 1, PATH_ROULETTE);
+					continue;
+				}
+				Ray next_ray;
+				next_ray.o = hit.position;
+				next_ray.d = r.wi;
+				if(dot(r.wi, hit.geometry_normal) < 0)
+					next_ray.o -= EPSILON * hit.geometry_normal;
+				else
+					next_ray.o += EPSILON * hit.geometry_normal;
+				float bsdf_pdf = mat.pdf(r.wi, hit.wo, hit.shading_normal);
+				state.next.push(pixel, next_throughput, next_ray, bsdf_pdf, live.cone_width[p]);
+			}
+			group_start = group_end;
+		}
+
+		///////////////////////////////////////////////////////////////////
+		// Shadow
+		///////////////////////////////////////////////////////////////////
+		ShadowQueue& shadow = state.shadow;
+		const double shadow_start = omp_get_wtime();
+		occluded(shadow.rays.data(), shadow.size());
+		recordRays(SHADOW_RAYS, shadow.size(), shadow_start);
+		for(size_t s = 0; s < shadow.size(); s++)
+		{
+			if(shadow.rays[s].geomID == RTC_INVALID_GEOMETRY_ID)
+			{
+				state.L[shadow.pixel[s]] += shadow.contribution[s];
+			}
+		}
+
+		std::swap(state.live, state.next);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Accumulate
+	///////////////////////////////////////////////////////////////////////
+	for(int i = 0; i < num_pixels; i++)
+	{
+		const int x = tile.x0 + i % tile_w, y = tile.y0 + i / tile_w;
+		if(pixelActive(x, y, round))
+		{
+			accumulate(x, y, state.L[i], state.features[i]);
+		}
+	}
+}
+} // namespace pathtracer
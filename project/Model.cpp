@@ -1,60 +1,38 @@
 #include "Model.h"
-#include <fstream>
-#include <sstream>
 #include <iostream>
+#include <ObjParser.h>
 
 bool OBJLoader::loadOBJ(const std::string& path,
     std::vector<glm::vec3>& out_vertices,
     std::vector<glm::vec2>& out_uvs,
     std::vector<glm::vec3>& out_normals) {
-    std::ifstream file(path);
-    if (!file.is_open()) {
-        std::cerr << "Failed to open OBJ file: " << path << std::endl;
+    // The '.mtl' file, if any, is next to the '.obj'
+    std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string err;
+    if (!labhelper::loadObjParallel(&attrib, &shapes, &materials, &err, path, directory)) {
+        std::cerr << "Failed to load OBJ file: " << path << std::endl << err << std::endl;
         return false;
     }
 
-    std::vector<unsigned int> vertexIndices, uvIndices, normalIndices;
-    std::vector<glm::vec3> temp_vertices;
-    std::vector<glm::vec2> temp_uvs;
-    std::vector<glm::vec3> temp_normals;
-
-    std::string line;
-    while (getline(file, line)) {
-        std::istringstream iss(line);
-        std::string prefix;
-        iss >> prefix;
-
-        if (prefix == "v") {
-            glm::vec3 vertex;
-            iss >> vertex.x >> vertex.y >> vertex.z;
-            temp_vertices.push_back(vertex);
-        }
-        else if (prefix == "vt") {
-            glm::vec2 uv;
-            iss >> uv.x >> uv.y;
-            temp_uvs.push_back(uv);
+    // One vertex per face corner, in the order of the file. Corners without
+    // a texture coordinate or normal get zero.
+    for (const tinyobj::shape_t& shape : shapes) {
+        for (const tinyobj::index_t& index : shape.mesh.indices) {
+            out_vertices.push_back(glm::vec3(attrib.vertices[3 * index.vertex_index + 0],
+                attrib.vertices[3 * index.vertex_index + 1],
+                attrib.vertices[3 * index.vertex_index + 2]));
+            out_uvs.push_back(index.texcoord_index < 0 ? glm::vec2(0.0f)
+                : glm::vec2(attrib.texcoords[2 * index.texcoord_index + 0],
+                    attrib.texcoords[2 * index.texcoord_index + 1]));
+            out_normals.push_back(index.normal_index < 0 ? glm::vec3(0.0f)
+                : glm::vec3(attrib.normals[3 * index.normal_index + 0],
+                    attrib.normals[3 * index.normal_index + 1],
+                    attrib.normals[3 * index.normal_index + 2]));
         }
-        else if (prefix == "vn") {
-            glm::vec3 normal;
-            iss >> normal.x >> normal.y >> normal.z;
-            temp_normals.push_back(normal);
-        }
-        else if (prefix == "f") {
-            unsigned int vertexIndex[3], uvIndex[3], normalIndex[3];
-            char slash;
-            for (int i = 0; i < 3; i++) {
-                iss >> vertexIndex[i] >> slash >> uvIndex[i] >> slash >> normalIndex[i];
-                vertexIndices.push_back(vertexIndex[i]);
-                uvIndices.push_back(uvIndex[i]);
-                normalIndices.push_back(normalIndex[i]);
-            }
-        }
-    }
-
-    for (unsigned int i = 0; i < vertexIndices.size(); i++) {
-        out_vertices.push_back(temp_vertices[vertexIndices[i] - 1]);
-        out_uvs.push_back(temp_uvs[uvIndices[i] - 1]);
-        out_normals.push_back(temp_normals[normalIndices[i] - 1]);
     }
 
     return true;